@@ -31,6 +31,7 @@ along with this program.  If not, see <http://www.gnu.org/licenses/>.
 #include "bambi_utils.h"
 
 int main_decode(int argc, char *argv[]);
+int main_decode_metrics_merge(int argc, char *argv[]);
 int main_i2b(int argc, char *argv[]);
 int main_select(int argc, char *argv[]);
 int main_chrsplit(int argc, char *argv[]);
@@ -53,6 +54,8 @@ static void usage(FILE *fp)
 "\n"
 "Commands:\n"
 "     decode         decode a multiplexed SAM/BAM/CRAM file by read groups\n"
+"     decode-metrics-merge\n"
+"                    combine the metrics from several decode runs\n"
 "     i2b            converts illumina files to SAM/BAM/CRAM files\n"
 "     select         select reads by alignment\n"
 "     chrsplit       split reads by chromosome\n"
@@ -79,6 +82,7 @@ int main(int argc, char *argv[])
 
     int ret = 0;
          if (strcmp(argv[1], "decode") == 0)    ret = main_decode(argc-1, argv+1);
+    else if (strcmp(argv[1], "decode-metrics-merge") == 0) ret = main_decode_metrics_merge(argc-1, argv+1);
     else if (strcmp(argv[1], "i2b") == 0)       ret = main_i2b(argc-1, argv+1);
     else if (strcmp(argv[1], "select") == 0)    ret = main_select(argc-1, argv+1);
     else if (strcmp(argv[1], "chrsplit") == 0)  ret = main_chrsplit(argc-1, argv+1);
@@ -17,9 +17,38 @@ along with this program.  If not, see <http://www.gnu.org/licenses/>.
 */
 
 #include <stdio.h>
+#include <string.h>
+#include <ctype.h>
+#include <limits.h>
+#include <sys/types.h>
 
+#include "htslib/bgzf.h"
+#include "htslib/hts_endian.h"
 #include "bamit.h"
 
+#define BGZF_HEADER_LENGTH 18
+// records which must check out before a guessed position is taken as a record
+#define VALID_CHAIN 8
+// data read to check them
+#define CHECK_SIZE (1 << 20)
+
+/*
+ * Read the next record into bit->nextRec, unless we are at the end of the range
+ */
+static int BAMit_read(BAMit_t *bit)
+{
+    if (bit->end) {
+        int64_t offset = bgzf_tell(bit->f->fp.bgzf);
+        if (offset > bit->end) {
+            // the range didn't start on a record boundary
+            fprintf(stderr, "Range of %s does not end on a record\n", bit->f->fn);
+            exit(1);
+        }
+        if (offset == bit->end) return -1;
+    }
+    return sam_read1(bit->f, bit->h, bit->nextRec);
+}
+
 BAMit_t *BAMit_init(samFile *f, bam_hdr_t *h)
 {
     int r;
@@ -29,7 +58,8 @@ BAMit_t *BAMit_init(samFile *f, bam_hdr_t *h)
     bit->rec = bam_init1();
     bit->nextRec = bam_init1();
     if (f->is_write == 0) {
-        r = sam_read1(bit->f, bit->h, bit->nextRec);
+        if (f->format.format == bam) bit->first = bgzf_tell(f->fp.bgzf);
+        r = BAMit_read(bit);
         if (r<0) { bam_destroy1(bit->nextRec); bit->nextRec = NULL; }
     }
     return bit;
@@ -41,9 +71,10 @@ BAMit_t *BAMit_init(samFile *f, bam_hdr_t *h)
  *                char mode                 'r' or 'w'
  *                char *fmt                 format [bam,sam,cram]
  *                char compression level    [0..9]
+ *                int required_fields       SAM_* fields to decode from CRAM, or 0 for all
  */
 BAMit_t *BAMit_open(char *fname, char mode, char *fmt, char compression_level,
-                    htsThreadPool *thread_pool)
+                    htsThreadPool *thread_pool, int required_fields)
 {
     samFile *f = NULL;
     bam_hdr_t *h = NULL;
@@ -71,6 +102,15 @@ BAMit_t *BAMit_open(char *fname, char mode, char *fmt, char compression_level,
         exit(1);
     }
 
+    // only decode the fields the caller needs (this must be set before reading)
+    if (mode == 'r' && required_fields) {
+        if (hts_set_opt(f, CRAM_OPT_REQUIRED_FIELDS, required_fields) < 0
+            || hts_set_opt(f, CRAM_OPT_DECODE_MD, 0) < 0) {
+            fprintf(stderr, "Couldn't set required fields on %s\n", fname);
+            exit(1);
+        }
+    }
+
     if (mode == 'r') h = sam_hdr_read(f);
     else             h = bam_hdr_init();
 
@@ -92,7 +132,7 @@ bam1_t *BAMit_next(BAMit_t *bit)
 {
     if (!bit->nextRec) return NULL;
     bam_copy1(bit->rec,bit->nextRec);
-    int r = sam_read1(bit->f, bit->h, bit->nextRec);
+    int r = BAMit_read(bit);
     if (r<0) { bam_destroy1(bit->nextRec); bit->nextRec = NULL; }
     return bit->rec;
 }
@@ -107,6 +147,291 @@ bool BAMit_hasnext(BAMit_t *bit)
     return (bit->nextRec != NULL);
 }
 
+/*
+ * Is there a BGZF block header at p? Returns the size of the block, or 0
+ */
+static int blockSize(const uint8_t *p)
+{
+    if (p[0] != 31 || p[1] != 139 || p[2] != 8 || !(p[3] & 4)) return 0;
+    if (le_to_u16(p + 10) != 6 || p[12] != 'B' || p[13] != 'C' || le_to_u16(p + 14) != 2) return 0;
+    return le_to_u16(p + 16) + 1;
+}
+
+/*
+ * Find the first BGZF block at or after file offset pos, by looking for a
+ * block header which is followed by another (or by the end of the file).
+ * Returns its offset, or -1 if there isn't one.
+ */
+static int64_t nextBlock(FILE *fp, int64_t pos, int64_t size, uint8_t *buf, size_t buf_size)
+{
+    if (fseeko(fp, pos, SEEK_SET) < 0) return -1;
+    size_t len = fread(buf, 1, buf_size, fp);
+    for (size_t i = 0; i + BGZF_HEADER_LENGTH <= len; i++) {
+        int bsize = blockSize(buf + i);
+        if (!bsize) continue;
+        if (pos + i + bsize == size) return pos + i;
+        if (i + bsize + BGZF_HEADER_LENGTH <= len && blockSize(buf + i + bsize)) return pos + i;
+    }
+    return -1;
+}
+
+/*
+ * Size of the aux field at s, or -1 if it isn't a valid one or runs past end
+ */
+static int auxSize(const uint8_t *s, const uint8_t *end)
+{
+    const uint8_t *z;
+    uint32_t count;
+    int size;
+
+    if (end - s < 3 || !isalpha(s[0]) || !isalnum(s[1])) return -1;
+    switch (s[2]) {
+    case 'A': case 'c': case 'C': size = 1; break;
+    case 's': case 'S':           size = 2; break;
+    case 'i': case 'I': case 'f': size = 4; break;
+    case 'd':                     size = 8; break;
+    case 'Z': case 'H':
+        z = memchr(s + 3, 0, end - s - 3);
+        if (!z) return -1;
+        size = z - s - 2;
+        break;
+    case 'B':
+        if (end - s < 8) return -1;
+        count = le_to_u32(s + 4);
+        switch (s[3]) {
+        case 'c': case 'C':           size = 1; break;
+        case 's': case 'S':           size = 2; break;
+        case 'i': case 'I': case 'f': size = 4; break;
+        default: return -1;
+        }
+        if (count > (end - s - 8) / size) return -1;
+        size = 5 + count * size;
+        break;
+    default:
+        return -1;
+    }
+    return (end - s - 3 < size) ? -1 : 3 + size;
+}
+
+/*
+ * Could a run of BAM records start at buf? Each record must be complete and
+ * consistent, down to its aux fields, and there must be VALID_CHAIN of them,
+ * unless the run ends exactly at the end of the file (at_eof).
+ */
+static bool validRecords(const uint8_t *buf, size_t len, bool at_eof, bam_hdr_t *h)
+{
+    int nrec = 0;
+
+    while (len >= 36) {
+        uint32_t block_size = le_to_u32(buf);
+        int32_t tid = le_to_u32(buf + 4), pos = le_to_u32(buf + 8);
+        int l_qname = buf[12];
+        uint16_t n_cigar = le_to_u16(buf + 16);
+        int32_t l_seq = le_to_u32(buf + 20);
+        int32_t mtid = le_to_u32(buf + 24), mpos = le_to_u32(buf + 28);
+        uint64_t core_size = 32 + l_qname + 4 * (uint64_t)n_cigar + ((uint64_t)l_seq + 1) / 2 + l_seq;
+
+        if (tid < -1 || tid >= h->n_targets || mtid < -1 || mtid >= h->n_targets) return false;
+        if (pos < -1 || mpos < -1 || l_qname < 2 || l_seq < 0) return false;
+        if (block_size < core_size) return false;
+        if (len < 4 + (size_t)block_size) break;    // only complete records count
+        for (int i = 0; i < l_qname - 1; i++) {
+            if (buf[36 + i] < '!' || buf[36 + i] > '~' || buf[36 + i] == '@') return false;
+        }
+        if (buf[36 + l_qname - 1]) return false;
+        const uint8_t *aux = buf + 4 + core_size, *end = buf + 4 + block_size;
+        while (aux < end) {
+            int size = auxSize(aux, end);
+            if (size < 0) return false;
+            aux += size;
+        }
+        if (++nrec == VALID_CHAIN) return true;
+        buf += 4 + block_size;
+        len -= 4 + block_size;
+    }
+    return nrec > 0 && at_eof && len == 0;
+}
+
+/*
+ * Find the first record which starts in the block at file offset coffset,
+ * or in a later block. Up to CHECK_SIZE bytes are read to check the records
+ * which follow it. Sets *voffset to its virtual offset, or to -1 if there
+ * are no more records.
+ */
+static int findRecord(samFile *f, bam_hdr_t *h, uint8_t *buf, int64_t coffset, int64_t *voffset)
+{
+    BGZF *fp = f->fp.bgzf;
+
+    *voffset = -1;
+    while (1) {
+        size_t len = 0, first_len = 0;
+        int64_t next = -1;
+        bool at_eof = false;
+
+        if (bgzf_seek(fp, coffset << 16, SEEK_SET) < 0) return -1;
+        while (len < CHECK_SIZE) {
+            if (bgzf_read_block(fp) < 0) return -1;
+            if (len && next < 0) next = fp->block_address;
+            if (fp->block_length == 0) { at_eof = true; break; }
+            memcpy(buf + len, fp->uncompressed_block, fp->block_length);
+            len += fp->block_length;
+            if (!first_len) first_len = len;
+        }
+        if (first_len == 0) return 0;
+        for (size_t u = 0; u < first_len; u++) {
+            if (validRecords(buf + u, len - u, at_eof, h)) {
+                *voffset = coffset << 16 | u;
+                return 0;
+            }
+        }
+        // a record covers the whole block, so try the next one
+        if (next < 0) return 0;
+        coffset = next;
+    }
+}
+
+static int compareOffsets(const void *o1, const void *o2)
+{
+    uint64_t a = *(const uint64_t *)o1, b = *(const uint64_t *)o2;
+    return a < b ? -1 : a > b;
+}
+
+/*
+ * Get the virtual offsets of records from the file's index, if it has one:
+ * the start of each chunk of each reference, and of the unplaced records.
+ * Returns how many there are, sorted, in *starts (which the caller must free)
+ */
+static int indexedRecords(samFile *f, char *fname, bam_hdr_t *h, uint64_t **starts)
+{
+    hts_idx_t *idx = sam_index_load(f, fname);
+    int n = 0, max = 0;
+
+    *starts = NULL;
+    if (!idx) return 0;
+    for (int tid = -1; tid < h->n_targets; tid++) {
+        hts_itr_t *itr = tid < 0 ? sam_itr_queryi(idx, HTS_IDX_NOCOOR, 0, 0) : sam_itr_queryi(idx, tid, 0, INT_MAX);
+        if (!itr) continue;
+        if (n + itr->n_off + 1 > max) {
+            max = (n + itr->n_off + 1) * 2;
+            *starts = realloc(*starts, max * sizeof(uint64_t));
+            if (!*starts) { fprintf(stderr, "Out of memory\n"); exit(1); }
+        }
+        for (int i = 0; i < itr->n_off; i++) (*starts)[n++] = itr->off[i].u;
+        if (tid < 0 && itr->read_rest && !itr->finished) (*starts)[n++] = itr->curr_off;
+        hts_itr_destroy(itr);
+    }
+    hts_idx_destroy(idx);
+    if (n) qsort(*starts, n, sizeof(uint64_t), compareOffsets);
+    return n;
+}
+
+int BAMit_split(char *fname, int64_t range_size, int64_t **offsets)
+{
+    samFile *f = hts_open(fname, "r");
+    bam_hdr_t *h = NULL;
+    FILE *fp = NULL;
+    uint8_t *buf = NULL;
+    uint64_t *starts = NULL;
+    size_t buf_size = CHECK_SIZE + BGZF_MAX_BLOCK_SIZE;
+    int n = -1, nstarts = 0, s = 0;
 
+    *offsets = NULL;
+    if (!f || f->format.format != bam || f->format.compression != bgzf) goto cleanup;
+    h = sam_hdr_read(f);
+    fp = fopen(fname, "rb");
+    buf = malloc(buf_size);
+    if (!h || !fp || !buf || fseeko(fp, 0, SEEK_END) < 0) goto cleanup;
 
+    int64_t first = bgzf_tell(f->fp.bgzf);
+    int64_t size = ftello(fp);
+    if (range_size < BGZF_MAX_BLOCK_SIZE) range_size = BGZF_MAX_BLOCK_SIZE;
+    *offsets = malloc((size / range_size + 1) * sizeof(int64_t));
+    if (!*offsets) goto cleanup;
+    nstarts = indexedRecords(f, fname, h, &starts);
 
+    // the first range starts with the first record
+    (*offsets)[0] = 0;
+    n = 1;
+    for (int64_t pos = range_size; pos < size; pos += range_size) {
+        int64_t last = n > 1 ? (*offsets)[n-1] : first;
+        int64_t voffset = -1;
+
+        // a record the index knows of, near enough to pos, or else one found in the blocks
+        while (s < nstarts && (int64_t)(starts[s] >> 16) < pos) s++;
+        if (s < nstarts && (int64_t)(starts[s] >> 16) < pos + range_size) {
+            voffset = starts[s];
+        } else {
+            int64_t block = nextBlock(fp, pos, size, buf, 2 * BGZF_MAX_BLOCK_SIZE + BGZF_HEADER_LENGTH);
+            if (block < 0) break;
+            if (findRecord(f, h, buf, block, &voffset) < 0) {
+                free(*offsets);
+                *offsets = NULL;
+                n = -1;
+                goto cleanup;
+            }
+        }
+        if (voffset > last) (*offsets)[n++] = voffset;
+    }
+
+ cleanup:
+    free(starts);
+    free(buf);
+    if (fp) fclose(fp);
+    if (h) bam_hdr_destroy(h);
+    if (f) hts_close(f);
+    return n;
+}
+
+/*
+ * Find the first record at or after the record at virtual offset start which
+ * starts a template, ie whose QNAME differs from the one before it. The record
+ * at start may be part way through a template, so it can't start one itself.
+ * Sets *voffset to its virtual offset, or to -1 if there isn't one.
+ */
+static int alignRange(BAMit_t *bit, int64_t start, int64_t *voffset)
+{
+    BGZF *fp = bit->f->fp.bgzf;
+    char qname[256];
+    int r;
+
+    if (start == 0) { *voffset = bit->first; return 0; }
+    if (bgzf_seek(fp, start, SEEK_SET) < 0) return -1;
+
+    bam1_t *rec = bam_init1();
+    if (!rec) return -1;
+    *voffset = -1;
+    r = sam_read1(bit->f, bit->h, rec);
+    if (r >= 0) {
+        strcpy(qname, bam_get_qname(rec));
+        while (1) {
+            int64_t offset = bgzf_tell(fp);
+            r = sam_read1(bit->f, bit->h, rec);
+            if (r < 0) break;
+            if (strcmp(qname, bam_get_qname(rec))) { *voffset = offset; break; }
+        }
+    }
+    bam_destroy1(rec);
+    return r < -1 ? -1 : 0;
+}
+
+int BAMit_seek_range(BAMit_t *bit, int64_t start, int64_t end)
+{
+    int64_t vstart, vend = -1;
+
+    if (bit->f->format.format != bam) return -1;
+    if (alignRange(bit, start, &vstart) < 0) return -1;
+    if (end && alignRange(bit, end, &vend) < 0) return -1;
+
+    // if no template starts after end, read to the end of the file
+    bit->end = vend < 0 ? 0 : vend;
+    if (!bit->nextRec) bit->nextRec = bam_init1();
+    if (vstart < 0 || (vend >= 0 && vstart >= vend)) {
+        // no template starts in this range
+        bam_destroy1(bit->nextRec);
+        bit->nextRec = NULL;
+        return 0;
+    }
+    if (bgzf_seek(bit->f->fp.bgzf, vstart, SEEK_SET) < 0) return -1;
+    if (BAMit_read(bit) < 0) { bam_destroy1(bit->nextRec); bit->nextRec = NULL; }
+    return 0;
+}
@@ -33,6 +33,8 @@ typedef struct {
     bam_hdr_t *h;
     bam1_t *rec;
     bam1_t *nextRec;
+    int64_t first;      // virtual offset of the first record (BAM only)
+    int64_t end;        // virtual offset where a range ends, or 0, see BAMit_seek_range()
 } BAMit_t;
 
 /*
@@ -42,9 +44,11 @@ typedef struct {
  *                char *fmt                  format [bam,sam,cram] or NULL
  *                char compression level     [0..9] or NULL
  *                htsThreadPool *thread_pool thread pool to use, or NULL
+ *                int required_fields        SAM_* fields the caller needs when reading
+ *                                           CRAM, or 0 for all of them
  */
 BAMit_t *BAMit_open(char *fname, char mode, char *fmt, char compression_level,
-                    htsThreadPool *thread_pool);
+                    htsThreadPool *thread_pool, int required_fields);
 
 /*
  * initialise with open file pointer and header
@@ -73,5 +77,27 @@ bool BAMit_hasnext(BAMit_t *bit);
  */
 void BAMit_free(void *bit);
 
+/*
+ * Divide a BAM file into ranges of about range_size bytes, so that they can be
+ * read in parallel. Each range starts at a record, given by its virtual offset;
+ * the first is 0, for the start of the records. The records are taken from the
+ * file's .bai or .csi index if it has one, and otherwise found by looking for a
+ * run of valid records in the BGZF blocks.
+ * Returns the number of ranges, with their offsets in *offsets (which the
+ * caller must free), or -1 if the file can't be divided (eg it isn't BAM)
+ */
+int BAMit_split(char *fname, int64_t range_size, int64_t **offsets);
+
+/*
+ * Read one range of a BAM file opened with BAMit_open(). The range is
+ * aligned to templates: it starts with the first record after the one at
+ * virtual offset start whose QNAME differs from its predecessor (or with the
+ * first record, if start is 0), and ends at the same point after end (0 for
+ * the end of the file). So ranges from
+ * BAMit_split() never split a template, and may be empty.
+ * Returns 0 on success, -1 on error
+ */
+int BAMit_seek_range(BAMit_t *bit, int64_t start, int64_t end);
+
 #endif
 
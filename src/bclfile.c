@@ -80,6 +80,123 @@ static int uncompressBlock(char* abSrc, int nLenSrc, char* abDst, int nLenDst )
 }
 
 
+bcl_fd_cache_t *bcl_fd_cache_init(int max_open)
+{
+    bcl_fd_cache_t *cache = calloc(1, sizeof(bcl_fd_cache_t));
+    if (!cache) die("Out of memory");
+    pthread_mutex_init(&cache->lock, NULL);
+    cache->max_open = max_open;
+    return cache;
+}
+
+void bcl_fd_cache_free(bcl_fd_cache_t *cache)
+{
+    if (!cache) return;
+    pthread_mutex_destroy(&cache->lock);
+    free(cache);
+}
+
+static void _lru_unlink(bcl_fd_cache_t *cache, bclfile_t *bcl)
+{
+    if (bcl->lru_prev) bcl->lru_prev->lru_next = bcl->lru_next;
+    else if (cache->head == bcl) cache->head = bcl->lru_next;
+    else return;    // not in the list
+    if (bcl->lru_next) bcl->lru_next->lru_prev = bcl->lru_prev;
+    else cache->tail = bcl->lru_prev;
+    bcl->lru_prev = bcl->lru_next = NULL;
+}
+
+static void _lru_push(bcl_fd_cache_t *cache, bclfile_t *bcl)
+{
+    bcl->lru_prev = NULL;
+    bcl->lru_next = cache->head;
+    if (cache->head) cache->head->lru_prev = bcl;
+    cache->head = bcl;
+    if (!cache->tail) cache->tail = bcl;
+}
+
+static int _bclfile_is_open(bclfile_t *bcl)
+{
+    return bcl->fhandle != NULL || bcl->gzhandle != NULL;
+}
+
+static void _bclfile_close_handle(bclfile_t *bcl)
+{
+    if (bcl->gzhandle) if (gzclose(bcl->gzhandle) != Z_OK) die("Couldn't gzclose BCL file [%s]\n", bcl->filename);
+    if (bcl->fhandle != NULL) if (fclose(bcl->fhandle)) die("Couldn't close BCL file [%s]\n", bcl->filename);
+    bcl->gzhandle = NULL;
+    bcl->fhandle = NULL;
+}
+
+static void _bclfile_open_handle(bclfile_t *bcl)
+{
+    switch (bcl->machine_type) {
+        case MT_HISEQX:
+        case MT_NEXTSEQ:
+            bcl->gzhandle = gzopen(bcl->filename, "r");
+            if (!bcl->gzhandle) die("Can't open BCL file %s\n", bcl->filename);
+            break;
+        default:
+            bcl->fhandle = fopen(bcl->filename, "rb");
+            if (bcl->fhandle == NULL) die("Can't open BCL file %s\n", bcl->filename);
+#if (USE_POSIX_FADVISE > 0)
+            // posix_fadvise() and buffered I/O don't go well together, so switch
+            // to unbuffered mode.  Makes reading the header slightly less efficient
+            // but shouldn't matter for the rest of the file.
+            if (bcl->machine_type == MT_NOVASEQ) setvbuf(bcl->fhandle, NULL, _IONBF, 0);
+#endif
+            break;
+    }
+}
+
+/*
+ * Make sure the file handle is open before reading, and stop it being
+ * closed by the handle cache until _bclfile_release() is called.
+ * If the cache is full, the least recently used idle handles are closed.
+ * The handle is checked and opened with the cache locked, so another
+ * thread making room can never close it or see it half open.
+ */
+static void _bclfile_acquire(bclfile_t *bcl)
+{
+    bcl_fd_cache_t *cache = bcl->fd_cache;
+
+    if (!cache) {
+        if (!_bclfile_is_open(bcl)) _bclfile_open_handle(bcl);
+        return;
+    }
+
+    if (pthread_mutex_lock(&cache->lock) < 0) die("pthread_mutex_lock failed\n");
+    if (!_bclfile_is_open(bcl)) {
+        cache->misses++;
+        while (cache->max_open && cache->nopen >= cache->max_open && cache->tail) {
+            bclfile_t *victim = cache->tail;
+            _lru_unlink(cache, victim);
+            _bclfile_close_handle(victim);
+            cache->nopen--;
+            cache->evictions++;
+        }
+        _bclfile_open_handle(bcl);
+        cache->nopen++;
+    } else {
+        cache->hits++;
+        _lru_unlink(cache, bcl);
+    }
+    bcl->fd_busy++;
+    if (pthread_mutex_unlock(&cache->lock) < 0) die("pthread_mutex_unlock failed\n");
+}
+
+/*
+ * Finished reading for now, so the handle may be closed if the cache needs room
+ */
+static void _bclfile_release(bclfile_t *bcl)
+{
+    bcl_fd_cache_t *cache = bcl->fd_cache;
+    if (!cache) return;
+    if (pthread_mutex_lock(&cache->lock) < 0) die("pthread_mutex_lock failed\n");
+    if (--bcl->fd_busy == 0 && _bclfile_is_open(bcl)) _lru_push(cache, bcl);
+    if (pthread_mutex_unlock(&cache->lock) < 0) die("pthread_mutex_unlock failed\n");
+}
+
 bclfile_t *bclfile_init(void)
 {
     bclfile_t *bclfile = calloc(1, sizeof(bclfile_t));
@@ -100,6 +217,26 @@ bclfile_t *bclfile_init(void)
     return bclfile;
 }
 
+/*
+ * Split the one-byte-per-cluster BCL data into bases and qualities.
+ * Qualities are binned through qual_map, if there is one.
+ */
+static void _bclfile_decode_buffer(bclfile_t *bcl, const char *buffer)
+{
+    for (int n=0; n < bcl->total_clusters; n++) {
+        unsigned char c = buffer[n];
+        int baseIndex = c & 0x03;   // last two bits
+        int qual = c >> 2;          // rest of bits
+        if (qual) {
+            bcl->bases[n] = BCL_BASE_ARRAY[baseIndex];
+            bcl->quals[n] = bcl->qual_map ? bcl->qual_map[qual] : qual;
+        } else {
+            bcl->bases[n] = BCL_UNKNOWN_BASE;
+            bcl->quals[n] = 0;
+        }
+    }
+}
+
  /*
  * Try to open the given bcl file.
  */
@@ -107,8 +244,7 @@ static void _bclfile_open_miseq(bclfile_t *bcl)
 {
     int r;
     
-    bcl->fhandle = fopen(bcl->filename, "rb");
-    if (bcl->fhandle == NULL) die("Can't open BCL file %s\n", bcl->filename);
+    _bclfile_acquire(bcl);
 
     r = fread(&bcl->total_clusters, 1, 4, bcl->fhandle);
     if (r != 4) die("failed to read header from bcl file '%s'\n", bcl->filename);
@@ -117,17 +253,12 @@ static void _bclfile_open_miseq(bclfile_t *bcl)
     if (!buffer) die("Can't malloc buffer %d for file %s\n", bcl->total_clusters, bcl->filename);
     r = fread(buffer, 1, bcl->total_clusters, bcl->fhandle);
     if (r != bcl->total_clusters) die("failed to read buffer from bcl file '%s'\n", bcl->filename);
+    _bclfile_release(bcl);
     
     free(bcl->bases); bcl->bases = malloc(bcl->total_clusters);
     free(bcl->quals); bcl->quals = malloc(bcl->total_clusters);
 
-    for (int n=0; n < bcl->total_clusters; n++) {
-        char c = buffer[n];
-        int baseIndex = c & 0x03;   // last two bits
-        bcl->quals[n] = (c & 0xfc) >> 2;     // rest of bits
-        if (bcl->quals[n]) bcl->bases[n] = BCL_BASE_ARRAY[baseIndex];
-        else               bcl->bases[n] = BCL_UNKNOWN_BASE;
-    }
+    _bclfile_decode_buffer(bcl, buffer);
     free(buffer);
     bcl->base_ptr = 0;
     bcl->bases_size = bcl->total_clusters;
@@ -137,8 +268,7 @@ static void _bclfile_open_hiseqx(bclfile_t *bcl)
 {
     int r;
     
-    bcl->gzhandle = gzopen(bcl->filename, "r");
-    if (!bcl->gzhandle) die("Can't open BCL file %s\n", bcl->filename);
+    _bclfile_acquire(bcl);
 
     r = gzread(bcl->gzhandle, (void *)&bcl->total_clusters, 4);
     if (r != 4) die("failed to read header from bcl file '%s'\n", bcl->filename);
@@ -147,17 +277,12 @@ static void _bclfile_open_hiseqx(bclfile_t *bcl)
     if (!buffer) die("Can't malloc buffer %d for file %s\n", bcl->total_clusters, bcl->filename);
     r = gzread(bcl->gzhandle, buffer, bcl->total_clusters);
     if (r != bcl->total_clusters) die("failed to read buffer from bcl file '%s'\n", bcl->filename);
+    _bclfile_release(bcl);
     
     free(bcl->bases); bcl->bases = malloc(bcl->total_clusters);
     free(bcl->quals); bcl->quals = malloc(bcl->total_clusters);
 
-    for (int n=0; n < bcl->total_clusters; n++) {
-        char c = buffer[n];
-        int baseIndex = c & 0x03;   // last two bits
-        bcl->quals[n] = (c & 0xfc) >> 2;     // rest of bits
-        if (bcl->quals[n]) bcl->bases[n] = BCL_BASE_ARRAY[baseIndex];
-        else               bcl->bases[n] = BCL_UNKNOWN_BASE;
-    }
+    _bclfile_decode_buffer(bcl, buffer);
     free(buffer);
     bcl->base_ptr = 0;
     bcl->bases_size = bcl->total_clusters;
@@ -186,6 +311,44 @@ static off_t find_tile_offset(bclfile_t *bcl, int tile, tilerec_t **ti_out)
     return found ? offset : -1;
 }
 
+/*
+ * Build the CBCL decoding tables from the header.
+ *
+ * Each cluster is bits_per_base bits of base followed by bits_per_qual bits
+ * of qbin, packed from the least significant bit. If clusters pack into
+ * whole bytes, the tables map each byte value to its clusters_per_byte
+ * (base, quality) pairs; otherwise they map each cluster value.
+ */
+static void _bclfile_build_lut(bclfile_t *bcl)
+{
+    int width = bcl->bits_per_base + bcl->bits_per_qual;
+    int base_mask = (1 << bcl->bits_per_base) - 1;
+    int nvalues, per_value;
+
+    bcl->clusters_per_byte = (8 % width == 0) ? 8 / width : 0;
+    if (bcl->clusters_per_byte) {
+        nvalues = 256;
+        per_value = bcl->clusters_per_byte;
+    } else {
+        nvalues = 1 << width;
+        per_value = 1;
+    }
+
+    bcl->lut_bases = malloc(nvalues * per_value);
+    bcl->lut_quals = malloc(nvalues * per_value);
+    if (!bcl->lut_bases || !bcl->lut_quals) die("Out of memory");
+
+    for (int v = 0; v < nvalues; v++) {
+        for (int i = 0; i < per_value; i++) {
+            int c = (v >> (i * width)) & ((1 << width) - 1);
+            int baseIndex = c & base_mask;
+            int qscore = bcl->qbin[c >> bcl->bits_per_base];
+            bcl->lut_quals[v * per_value + i] = qscore;
+            bcl->lut_bases[v * per_value + i] = (qscore && baseIndex < 4) ? BCL_BASE_ARRAY[baseIndex] : BCL_UNKNOWN_BASE;
+        }
+    }
+}
+
 static void _bclfile_open_novaseq(bclfile_t *bclfile, int tile)
 {
     int r;
@@ -194,16 +357,7 @@ static void _bclfile_open_novaseq(bclfile_t *bclfile, int tile)
     const uint32_t qbins_in_buffer = sizeof(buffer) / (2 * 4);
     const uint32_t tiles_in_buffer = sizeof(buffer) / (4 * 4);
 
-    bclfile->fhandle = fopen(bclfile->filename, "rb");
-    if (bclfile->fhandle == NULL) {
-        die("Can't open BCL file %s\n", bclfile->filename);
-    }
-#if (USE_POSIX_FADVISE > 0)
-    // posix_fadvise() and buffered I/O don't go well together, so switch
-    // to unbuffered mode.  Makes reading the header slightly less efficient
-    // but shouldn't matter for the rest of the file.
-    setvbuf(bclfile->fhandle, NULL, _IONBF, 0);
-#endif
+    _bclfile_acquire(bclfile);
     // File is open. Read and parse header.
 
     r = fread(buffer, 2+4+1+1+4, 1, bclfile->fhandle);
@@ -213,6 +367,16 @@ static void _bclfile_open_novaseq(bclfile_t *bclfile, int tile)
     bclfile->bits_per_base = buffer[6];
     bclfile->bits_per_qual = buffer[7];
     bclfile->nbins = le_to_u32(buffer + 8);
+
+    if (bclfile->bits_per_base < 2 || bclfile->bits_per_base > 8) {
+        die("CBCL file '%s' has bits_per_base %d : expecting 2 to 8\n", bclfile->filename, bclfile->bits_per_base);
+    }
+    if (bclfile->bits_per_qual < 1 || bclfile->bits_per_qual > 8) {
+        die("CBCL file '%s' has bits_per_qual %d : expecting 1 to 8\n", bclfile->filename, bclfile->bits_per_qual);
+    }
+    bclfile->qbin = calloc(1 << bclfile->bits_per_qual, sizeof(int));
+    if (!bclfile->qbin) die("Out of memory\n");
+
     for (n = 0; n < bclfile->nbins;) {
         uint32_t last_n = bclfile->nbins < n + qbins_in_buffer ? bclfile->nbins : n + qbins_in_buffer;
         r = fread(buffer, 8, last_n - n, bclfile->fhandle);
@@ -220,6 +384,11 @@ static void _bclfile_open_novaseq(bclfile_t *bclfile, int tile)
         for (m = 0; n < last_n; n++, m += 8) {
             uint32_t qbin = le_to_u32(buffer + m);
             uint32_t qscore = le_to_u32(buffer + m + 4);
+            if (qbin >= (1u << bclfile->bits_per_qual)) {
+                die("CBCL file '%s' has qbin %u : more than %d bits\n", bclfile->filename, qbin, bclfile->bits_per_qual);
+            }
+            // qscore 0 is a no-call, which is never binned
+            if (bclfile->qual_map && qscore && qscore < QUAL_MAP_SIZE) qscore = bclfile->qual_map[qscore];
             bclfile->qbin[qbin] = qscore;
         }
     }
@@ -243,12 +412,7 @@ static void _bclfile_open_novaseq(bclfile_t *bclfile, int tile)
     r = fread(&bclfile->pfFlag, sizeof(bclfile->pfFlag), 1, bclfile->fhandle);
     if (r!=1) goto fail;
 
-    if (bclfile->bits_per_base != 2) {
-        die("CBCL file '%s' has bits_per_base %d : expecting 2\n", (bclfile->filename), bclfile->bits_per_base);
-    }
-    if (bclfile->bits_per_qual != 2) {
-        die("CBCL file '%s' has bits_per_qual %d : expecting 2\n", (bclfile->filename), bclfile->bits_per_qual);
-    }
+    _bclfile_build_lut(bclfile);
 #if (USE_POSIX_FADVISE & 1) > 0
     if (tile >= 0) {
         tilerec_t *ti = NULL;
@@ -258,16 +422,19 @@ static void _bclfile_open_novaseq(bclfile_t *bclfile, int tile)
         }
     }
 #endif
+    _bclfile_release(bclfile);
     return;
  fail:
     die("failed to read header from bcl file '%s'\n", bclfile->filename);
 }
 
-bclfile_t *bclfile_open(char *fname, MACHINE_TYPE mt, int tile)
+bclfile_t *bclfile_open(char *fname, MACHINE_TYPE mt, int tile, const uint8_t *qual_map, bcl_fd_cache_t *fd_cache)
 {
     bclfile_t *bclfile = bclfile_init();
     bclfile->filename = strdup(fname);
     bclfile->machine_type = mt;
+    bclfile->qual_map = qual_map;
+    bclfile->fd_cache = fd_cache;
 
     switch(mt) {
         case MT_MISEQ: _bclfile_open_miseq(bclfile); break;
@@ -283,6 +450,7 @@ bclfile_t *bclfile_open(char *fname, MACHINE_TYPE mt, int tile)
 
 int bclfile_seek_cluster(bclfile_t *bcl, int cluster)
 {
+    _bclfile_acquire(bcl);
     if (bcl->gzhandle) {
         if (gzseek(bcl->gzhandle, (z_off_t)(4 + cluster), SEEK_SET) < 0) {
             int e;
@@ -293,6 +461,7 @@ int bclfile_seek_cluster(bclfile_t *bcl, int cluster)
             die("fseeko failed: %s", strerror(errno));
         }
     }
+    _bclfile_release(bcl);
     return 0;
 }
 
@@ -323,10 +492,6 @@ int bclfile_seek_tile(bclfile_t *bcl, int tile, filter_t *filter, int next_tile)
 
     bcl->current_tile = ti;
 
-    // Read and uncompress the record for this tile
-    if (fseeko(bcl->fhandle, offset, SEEK_SET) < 0) {
-        die("Couldn't seek: %s\n", strerror(errno));
-    }
     uncompressed_block = malloc(ti->uncompressed_blocksize);
     if (!uncompressed_block) {
         fprintf(stderr,"bclfile_seek_tile(%d): failed to malloc uncompressed_block\n", tile);
@@ -337,9 +502,16 @@ int bclfile_seek_tile(bclfile_t *bcl, int tile, filter_t *filter, int next_tile)
         fprintf(stderr,"bclfile_seek_tile(%d): failed to malloc compressed_block\n", tile);
         return -1;
     }
+
+    // Read and uncompress the record for this tile
+    _bclfile_acquire(bcl);
+    if (fseeko(bcl->fhandle, offset, SEEK_SET) < 0) {
+        die("Couldn't seek: %s\n", strerror(errno));
+    }
     r = fread(compressed_block, 1, ti->compressed_blocksize, bcl->fhandle);
     if (r != ti->compressed_blocksize) {
         fprintf(stderr,"bclfile_seek_tile(%d): failed to read block: returned %d\n", tile, r);
+        _bclfile_release(bcl);
         return -1;
     }
 
@@ -355,6 +527,7 @@ int bclfile_seek_tile(bclfile_t *bcl, int tile, filter_t *filter, int next_tile)
         }
     }
 #endif
+    _bclfile_release(bcl);
 
     r=uncompressBlock(compressed_block, ti->compressed_blocksize, uncompressed_block, ti->uncompressed_blocksize);
     free(compressed_block);
@@ -365,35 +538,70 @@ int bclfile_seek_tile(bclfile_t *bcl, int tile, filter_t *filter, int next_tile)
         return r;
     }
 
-    bcl->bases_size = ti->uncompressed_blocksize * 2;   // NovaSeq stores 2 bases and 2 quals per byte
+    if (bcl->clusters_per_byte) {
+        bcl->bases_size = ti->uncompressed_blocksize * bcl->clusters_per_byte;
+    } else {
+        bcl->bases_size = ti->nclusters;
+        if ((uint64_t)ti->nclusters * (bcl->bits_per_base + bcl->bits_per_qual) > (uint64_t)ti->uncompressed_blocksize * 8) {
+            fprintf(stderr,"bclfile_seek_tile(%d): block too small for %d clusters\n", tile, ti->nclusters);
+            free(uncompressed_block);
+            return -1;
+        }
+    }
     free(bcl->bases); bcl->bases = malloc(bcl->bases_size);
     free(bcl->quals); bcl->quals = malloc(bcl->bases_size);
     if (!bcl->bases || !bcl->quals) { fprintf(stderr,"Can't malloc memory for bases or quals in bclfile_seek_tile()"); return -1; }
     int b=0;
-    for (int n=0, u=0; n < ti->uncompressed_blocksize; n++, u+=2) {
-        char c = uncompressed_block[n];
-        int baseIndex = 0, qbin = 0;
-        unsigned char base, qscore=0;
-        baseIndex = c & 0x03;           
-        qbin = (c >> 2) & 0x03;
-        qscore = bcl->qbin[qbin];
-        if (qscore) base = BCL_BASE_ARRAY[baseIndex];
-        else        base = BCL_UNKNOWN_BASE;
-        if (!filter || bcl->pfFlag || (filter->buffer[u] & 0x01)) {
-            bcl->bases[b] = base;
-            bcl->quals[b] = qscore;
-            b++;
+    const unsigned char *ub = (const unsigned char *)uncompressed_block;
+    const char *lut_bases = bcl->lut_bases;
+    const uint8_t *lut_quals = bcl->lut_quals;
+    bool keep_all = !filter || bcl->pfFlag;
+    if (bcl->clusters_per_byte == 2) {
+        // Fast path for the usual 2 bit base, 2 bit qbin layout
+        for (int n=0, u=0; n < ti->uncompressed_blocksize; n++, u+=2) {
+            int v = ub[n] * 2;
+            if (keep_all || (filter->buffer[u] & 0x01)) {
+                bcl->bases[b] = lut_bases[v];
+                bcl->quals[b] = lut_quals[v];
+                b++;
+            }
+            if (keep_all || (filter->buffer[u+1] & 0x01)) {
+                bcl->bases[b] = lut_bases[v+1];
+                bcl->quals[b] = lut_quals[v+1];
+                b++;
+            }
         }
-
-        baseIndex = (c >> 4) & 0x03;    
-        qbin = (c >> 6) & 0x03;
-        qscore = bcl->qbin[qbin];
-        if (qscore) base = BCL_BASE_ARRAY[baseIndex];
-        else        base = BCL_UNKNOWN_BASE;
-        if (!filter || bcl->pfFlag || (filter->buffer[u+1] & 0x01)) {
-            bcl->bases[b] = base;
-            bcl->quals[b] = qscore;
-            b++;
+    } else if (bcl->clusters_per_byte) {
+        int k = bcl->clusters_per_byte;
+        for (int n=0, u=0; n < ti->uncompressed_blocksize; n++) {
+            int v = ub[n] * k;
+            for (int i = 0; i < k; i++, u++) {
+                if (keep_all || (filter->buffer[u] & 0x01)) {
+                    bcl->bases[b] = lut_bases[v+i];
+                    bcl->quals[b] = lut_quals[v+i];
+                    b++;
+                }
+            }
+        }
+    } else {
+        // Clusters straddle byte boundaries, so read them as a bit stream
+        int width = bcl->bits_per_base + bcl->bits_per_qual;
+        uint32_t mask = (1u << width) - 1;
+        uint32_t bits = 0;
+        int nbits = 0, n = 0;
+        for (int u = 0; u < ti->nclusters; u++) {
+            while (nbits < width) {
+                bits |= (uint32_t)ub[n++] << nbits;
+                nbits += 8;
+            }
+            uint32_t v = bits & mask;
+            bits >>= width;
+            nbits -= width;
+            if (keep_all || (filter->buffer[u] & 0x01)) {
+                bcl->bases[b] = lut_bases[v];
+                bcl->quals[b] = lut_quals[v];
+                b++;
+            }
         }
     }
     bcl->base_ptr = 0;
@@ -404,14 +612,23 @@ int bclfile_seek_tile(bclfile_t *bcl, int tile, filter_t *filter, int next_tile)
 void bclfile_close(bclfile_t *bclfile)
 {
     if (bclfile->is_cached) return;
-    if (bclfile->gzhandle) if (gzclose(bclfile->gzhandle) != Z_OK) die("Couldn't gzclose BCL file [%s]\n", bclfile->filename);
-    if (bclfile->fhandle != NULL) if (fclose(bclfile->fhandle)) die("Couldn't close BCL file [%s] Handle %d\n", bclfile->filename, bclfile->fhandle);
+    if (bclfile->fd_cache) {
+        bcl_fd_cache_t *cache = bclfile->fd_cache;
+        if (pthread_mutex_lock(&cache->lock) < 0) die("pthread_mutex_lock failed\n");
+        _lru_unlink(cache, bclfile);
+        if (_bclfile_is_open(bclfile)) cache->nopen--;
+        if (pthread_mutex_unlock(&cache->lock) < 0) die("pthread_mutex_unlock failed\n");
+    }
+    _bclfile_close_handle(bclfile);
     free(bclfile->filename);
     free(bclfile->errmsg);
     va_free(bclfile->tiles);
     free(bclfile->current_block);
     free(bclfile->bases);
     free(bclfile->quals);
+    free(bclfile->qbin);
+    free(bclfile->lut_bases);
+    free(bclfile->lut_quals);
     free(bclfile);
 }
 
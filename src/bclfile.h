@@ -22,10 +22,12 @@ along with this program.  If not, see <http://www.gnu.org/licenses/>.
 #define __BCLFILE_H__
 
 #include <stdint.h>
+#include <pthread.h>
 #include <zlib.h>
 #include "array.h"
 #include "filterfile.h"
 #include "bambi.h"
+#include "qualbin.h"
 
 typedef struct {
     uint32_t  tilenum;
@@ -33,8 +35,24 @@ typedef struct {
     uint32_t  uncompressed_blocksize;
     uint32_t  compressed_blocksize;
 } tilerec_t;
-    
-typedef struct {
+
+/*
+ * LRU cache of open BCL file handles, shared by all the BCL files that are
+ * opened with it, to limit the number of open files. A handle which is not
+ * being read can be closed, and is reopened when it is next needed.
+ */
+typedef struct bcl_fd_cache_t {
+    pthread_mutex_t lock;
+    int max_open;               // 0 means no limit
+    int nopen;
+    struct bclfile_t *head;     // most recently used idle handle
+    struct bclfile_t *tail;     // least recently used idle handle
+    uint64_t hits;
+    uint64_t misses;
+    uint64_t evictions;
+} bcl_fd_cache_t;
+
+typedef struct bclfile_t {
     MACHINE_TYPE machine_type;
     FILE *fhandle;
     gzFile gzhandle;
@@ -50,6 +68,7 @@ typedef struct {
     char base;
     int quality;
     char *filename;
+    const uint8_t *qual_map;    // quality binning, or NULL
 
     char current_byte;
     int block_index;
@@ -59,7 +78,10 @@ typedef struct {
     unsigned char bits_per_base;
     unsigned char bits_per_qual;
     uint32_t nbins;
-    int qbin[4];
+    int *qbin;                  // quality for each qbin value (1 << bits_per_qual entries)
+    int clusters_per_byte;      // 0 if clusters are not packed into whole bytes
+    char *lut_bases;            // decoding tables built from the header, see _bclfile_build_lut()
+    uint8_t *lut_quals;
     uint32_t ntiles;
     tilerec_t *current_tile;
     va_t *tiles;
@@ -69,10 +91,18 @@ typedef struct {
     char pfFlag;
     int surface;
     int fails;
+    // handle cache
+    bcl_fd_cache_t *fd_cache;
+    int fd_busy;
+    struct bclfile_t *lru_prev;
+    struct bclfile_t *lru_next;
 } bclfile_t;
 
+bcl_fd_cache_t *bcl_fd_cache_init(int max_open);
+void bcl_fd_cache_free(bcl_fd_cache_t *cache);
+
 int bcl_tile2surface(int tile);
-bclfile_t *bclfile_open(char *fname, MACHINE_TYPE mt, int tile);
+bclfile_t *bclfile_open(char *fname, MACHINE_TYPE mt, int tile, const uint8_t *qual_map, bcl_fd_cache_t *fd_cache);
 void bclfile_close(bclfile_t *bclfile);
 int bclfile_load_tile(bclfile_t *bclfile, int tile, filter_t *filter, int next_tile);
 char bclfile_base(bclfile_t *bcl, int cluster);
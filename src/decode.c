@@ -28,6 +28,7 @@ along with this program.  If not, see <http://www.gnu.org/licenses/>.
 #include <stdlib.h>
 #include <stdbool.h>
 #include <limits.h>
+#include <math.h>
 #include <unistd.h>
 #include <regex.h>
 #include <errno.h>
@@ -35,10 +36,17 @@ along with this program.  If not, see <http://www.gnu.org/licenses/>.
 #include <htslib/thread_pool.h>
 #include <cram/sam_header.h>
 #include <inttypes.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/resource.h>
+#include <pthread.h>
 
 #include "decode.h"
 #include "bamit.h"
 #include "hash_table.h"
+#include "qualbin.h"
+#include "numa_util.h"
 
 #define xstr(s) str(s)
 #define str(s) #s
@@ -49,7 +57,38 @@ along with this program.  If not, see <http://www.gnu.org/licenses/>.
 #define DEFAULT_MIN_MISMATCH_DELTA 1
 #define DEFAULT_BARCODE_TAG "BC"
 #define DEFAULT_QUALITY_TAG "QT"
+#define DEFAULT_UNMATCHED_TOP 0
+#define MAX_UNMATCHED_TOP 10000
+// Sequences monitored by the unmatched barcode sketch, per reported sequence
+#define UNMATCHED_SKETCH_FACTOR 8
+// version of the counts files written by writeCounts()
+#define COUNTS_FILE_VERSION 1
 #define TEMPLATES_PER_JOB 5000
+// size of the ranges of the input file read by each job with --split-input
+// (the tests use smaller ones, to split their small input files)
+#ifndef RANGE_SIZE
+#define RANGE_SIZE (4 << 20)
+#endif
+// number of ranges of a BAM file which --sample and --sample-fraction read from
+#define SAMPLE_RANGES 1000
+
+// Longest barcode which can be packed (32 bases per word)
+#define PACKED_BC_WORDS 2
+#define PACKED_BC_MAX (32 * PACKED_BC_WORDS)
+// Barcodes scored at once by packedMismatchesMany()
+#define PACKED_BLOCK 256
+
+// Limit on the number of sequences in the barcode neighbourhood hash
+#define NBHD_MAX_KEYS (1<<20)
+// Maximum number of different characters at one position of the barcodes
+#define NBHD_ALPHA_MAX 8
+// Use a seed index when there are at least this many barcodes...
+#define SEED_MIN_BARCODES 512
+// ...and each segment is at least this long
+#define SEED_MIN_SEGMENT 3
+// saved neighbourhood files, see save_barcode_nbhd()
+#define NBHD_FILE_MAGIC "BNBH"
+#define NBHD_FILE_VERSION 1
 
 // Size of stack allocations to use for storing barcodes.  If too small, malloc will be used instead.
 // Ideally this should be bigger than the longest barcode expected.
@@ -57,6 +96,122 @@ along with this program.  If not, see <http://www.gnu.org/licenses/>.
 #define STACK_BC_LEN 32
 #endif
 
+/*
+ * Every sequence within a few mismatches of a barcode, with the result of
+ * matching it. See make_barcode_neighbourhood().
+ */
+typedef struct barcode_nbhd_t {
+    HashTable *hash;
+    char *keys;         // storage for the hash keys
+    size_t nkeys;
+    int len;            // length of the barcode sequences
+    int max_n;          // sequences with more Ns than this are not in the hash
+    char *alpha;        // characters which can appear at each position
+    int radius;         // mismatches from each barcode which were enumerated
+    void *map;          // if loaded from a file, it is searched in place
+    size_t map_len;
+    uint32_t *data;     // in the file: HashData.i32 for each key
+    uint32_t *slots;    // in the file: open addressing table of key number + 1
+    uint64_t slot_mask;
+} barcode_nbhd_t;
+
+/*
+ * Header of a saved neighbourhood file. It is followed by the hash data
+ * (two uint32_t for each key), the hash slots, the alphabet, and the keys.
+ */
+typedef struct {
+    char magic[4];
+    uint32_t version;
+    uint64_t checksum;          // of the barcode sequences, see barcode_set_checksum()
+    int32_t max_mismatches;
+    int32_t min_mismatch_delta;
+    int32_t max_no_calls;
+    int32_t len;
+    int32_t radius;
+    int32_t max_n;
+    uint64_t nkeys;
+    uint64_t nslots;            // a power of two
+} nbhd_file_header_t;
+
+// packing of the HashData for each sequence: i32[0] is the index of the best match
+#define NBHD_D1(x) ((x) & 0xff)             // mismatches against the best match
+#define NBHD_D2(x) (((x) >> 8) & 0xff)      // mismatches against the second best match
+#define NBHD_AMBIGUOUS (1<<16)              // fails min_mismatch_delta
+
+static void free_barcode_nbhd(barcode_nbhd_t *nbhd);
+
+/*
+ * Pigeonhole index for large barcode sets: each barcode is split into
+ * radius+1 segments (one more if reads may have Ns), so any read within
+ * radius mismatches matches at least one segment exactly.
+ * See make_barcode_seeds().
+ */
+typedef struct barcode_seeds_t {
+    int len;            // length of the barcode sequences
+    int radius;         // mismatches which are guaranteed to be found
+    int nsegs;
+    int *seg_start;     // nsegs+1 entries
+    HashTable **hash;   // for each segment, its sequence -> ia_t of barcode indexes
+} barcode_seeds_t;
+
+static void free_barcode_seeds(barcode_seeds_t *seeds);
+
+/*
+ * A barcode packed two bits per base (A=0, C=1, G=2, T=3), with masks
+ * marking the Ns and index separators by the low bit of their slot.
+ * Sequences with any other character can't be packed (len is -1), and
+ * are compared by countMismatches() instead.
+ */
+typedef struct {
+    uint64_t bases[PACKED_BC_WORDS];
+    uint64_t n[PACKED_BC_WORDS];
+    uint64_t sep[PACKED_BC_WORDS];
+    int len;
+} packed_bc_t;
+
+/*
+ * The barcodes packed word by word into arrays, so that one read can be
+ * scored against a block of barcodes in a loop the compiler can vectorise
+ */
+typedef struct packed_set_t {
+    int len;            // all of the barcodes are this long
+    int nbarcodes;      // including the null barcode at index 0
+    uint64_t *bases;    // [word * nbarcodes + barcode]
+    uint64_t *n;
+    uint64_t *sep;
+} packed_set_t;
+
+static void free_packed_set(packed_set_t *set);
+static void packBarcodes(va_t *barcodeArray, decode_opts_t *opts);
+static void make_index_hashes(va_t *barcodeArray, decode_opts_t *opts);
+
+/*
+ * Barcodes of one length, for barcode files which mix index lengths.
+ * Each class is matched against the read barcode cut down to its length,
+ * see findBestClassMatch().
+ */
+typedef struct barcode_class_t {
+    int idx1_len, idx2_len;
+    va_t *barcodeArray;         // a null barcode of this length, then the barcodes from the full array
+    HashTable *barcodeHash;
+    decode_opts_t *opts;        // copy of the options, with this class's lengths and matchers
+} barcode_class_t;
+
+static void free_barcode_class(void *entry);
+
+/*
+ * The new RG value for every input RG and barcode, see make_rg_table()
+ */
+typedef struct {
+    HashTable *rgs;     // input RG -> row; row 0 is for records without an RG
+    int nbarcodes;
+    char **values;      // [row * nbarcodes + barcode index] = "<RG>#<barcode name>"
+    size_t *lens;       // of each value, including the NUL
+    char *buf;          // storage for the values
+} rg_table_t;
+
+static void free_rg_table(rg_table_t *t);
+
 enum match {
     MATCHED_NONE,
     MATCHED_FIRST,
@@ -72,8 +227,12 @@ enum match {
 struct decode_opts_t {
     char *input_name;
     char *output_name;
+    char *output_per_barcode;           // output file name template, %s is replaced by the barcode name
     char *barcode_name;
     char *metrics_name;
+    char *counts_name;                  // raw counts for decode-metrics-merge, or NULL
+    char *save_index_name;
+    char *load_index_name;
     char *barcode_tag_name;
     char *quality_tag_name;
     bool verbose;
@@ -82,15 +241,34 @@ struct decode_opts_t {
     int max_no_calls;
     int max_mismatches;
     int min_mismatch_delta;
+    int unmatched_top;                  // unmatched sequences to report, 0 for none
     bool change_read_name;
+    bool metrics_only;                  // only count the barcodes, don't rewrite or write the records
+    double sample_fraction;             // fraction of the templates to sample, 0 for all of them
+    uint64_t sample_max;                // stop after sampling this many templates, 0 for no limit
+    uint64_t nsampled;                  // templates sampled so far
+    int64_t *sample_ranges;             // start and end offsets of the input ranges to sample, or NULL
+    int nsample_ranges;                 // number of ranges in sample_ranges
+    int sample_range;                   // the range being read, or -1 before the first
     char *argv_list;
     char *input_fmt;
     char *output_fmt;
     char compression_level;
     int nthreads;
+    bool numa;
+    bool split_input;                   // jobs read ranges of the input file in parallel
     int idx1_len, idx2_len;
     bool ignore_pf;
     unsigned short dual_tag;
+    bool qual_bin;
+    uint8_t qual_map[QUAL_MAP_SIZE];
+    barcode_nbhd_t *nbhd;
+    barcode_seeds_t *seeds;
+    packed_set_t *packed;
+    HashTable *idx1Hash, *idx2Hash;     // first barcodeArray entry for each i7 / i5 sequence
+    va_t *classes;                      // barcode_class_t, longest first, if the barcode lengths differ
+    rg_table_t *rg_table;
+    bc_counter_set_t *counters;         // per-thread metrics for the decode jobs, or NULL
 };
 
 decode_opts_t *decode_init_opts(int argc, char **argv)
@@ -105,6 +283,7 @@ decode_opts_t *decode_init_opts(int argc, char **argv)
     opts->max_no_calls = DEFAULT_MAX_NO_CALLS;
     opts->max_mismatches = DEFAULT_MAX_MISMATCHES;
     opts->min_mismatch_delta = DEFAULT_MIN_MISMATCH_DELTA;
+    opts->unmatched_top = DEFAULT_UNMATCHED_TOP;
     opts->verbose = false;
     opts->convert_low_quality = false;
     opts->change_read_name = false;
@@ -112,6 +291,7 @@ decode_opts_t *decode_init_opts(int argc, char **argv)
     opts->quality_tag_name = NULL;
     opts->ignore_pf = 0;
     opts->dual_tag = 0;
+    opts->sample_range = -1;
     return opts;
 }
 
@@ -120,6 +300,7 @@ void decode_free_opts(decode_opts_t *opts)
     if (!opts) return;
     free(opts->input_name);
     free(opts->output_name);
+    free(opts->output_per_barcode);
     free(opts->barcode_name);
     free(opts->barcode_tag_name);
     free(opts->quality_tag_name);
@@ -127,9 +308,34 @@ void decode_free_opts(decode_opts_t *opts)
     free(opts->input_fmt);
     free(opts->output_fmt);
     free(opts->metrics_name);
+    free(opts->counts_name);
+    free(opts->sample_ranges);
+    free(opts->save_index_name);
+    free(opts->load_index_name);
+    free_barcode_nbhd(opts->nbhd);
+    free_barcode_seeds(opts->seeds);
+    free_packed_set(opts->packed);
+    HashTableDestroy(opts->idx1Hash, 0);
+    HashTableDestroy(opts->idx2Hash, 0);
+    va_free(opts->classes);
+    free_rg_table(opts->rg_table);
     free(opts);
 }
 
+/*
+ * Space-saving sketch of the most common unmatched barcode sequences.
+ * A fixed number of sequences are monitored; an unmonitored sequence
+ * replaces the one with the lowest count, and takes over that count as
+ * its possible overcount (error).
+ */
+typedef struct {
+    int size, nused;
+    HashTable *hash;                    // sequence -> slot
+    HashItem **items;                   // hash item of each slot
+    uint64_t *counts, *errors;
+    uint64_t total;                     // reads added to the sketch
+} unmatched_sketch_t;
+
 /*
  * details read from barcode file
  * Plus metrics information for each barcode
@@ -140,19 +346,48 @@ typedef struct {
     char *lib;
     char *sample;
     char *desc;
+    packed_bc_t pseq, pidx1, pidx2;
+    int index;                  // position in the barcode array, see make_barcode_classes()
     uint64_t reads, pf_reads, perfect, pf_perfect, one_mismatch, pf_one_mismatch;
+    unmatched_sketch_t *unmatched;  // the unmatched sequences (entry 0 only)
 } bc_details_t;
 
+/*
+ * Metrics counters for one thread, indexed by bc_details_t.index
+ */
+typedef struct bc_counts_t {
+    int n;
+    uint64_t *reads, *pf_reads, *perfect, *pf_perfect, *one_mismatch, *pf_one_mismatch;
+    unmatched_sketch_t *unmatched;      // the unmatched sequences
+    struct bc_counts_t *next;
+} bc_counts_t;
+
+/*
+ * Per-thread counters for the decode jobs, so that they can share one
+ * barcode array. Each thread gets its own counts the first time it
+ * updates the metrics, and they are added into the barcode array once,
+ * at the end.
+ */
+struct bc_counter_set_t {
+    pthread_key_t key;
+    pthread_mutex_t lock;
+    int n, unmatched_size;
+    bc_counts_t *list;                  // every thread's counts
+};
+
 // Data for thread pool jobs
 typedef struct decode_thread_data_t {
     va_t *record_set;                   // records to process
     ia_t *template_counts;              // records in each template
-    va_t *barcode_array;                // job-local copy of barcodes array
-    bc_details_t *barcodes;             // memory for job-local barcodes
+    ia_t *template_barcodes;            // barcode index of each template
+    va_t *barcode_array;                // pointer to shared barcodes array
     HashTable *tagHopHash;              // job-local tag hops hash
     HashTable *barcodeHash;             // pointer to shared barcodeHash
     decode_opts_t *opts;                       // pointer to shared opts
     int nrec;                           // number of live records in record_set
+    int node;                           // NUMA node to run on, or -1
+    int64_t range_start, range_end;     // range of the input for the job to read, or -1, see BAMit_split()
+    BAMit_t *bam_in;                    // the job's input file, for reading ranges
     int result;                         // job result, 0 = success
     struct decode_thread_data_t *next;  // for free list
 } decode_thread_data_t;
@@ -160,6 +395,7 @@ typedef struct decode_thread_data_t {
 static bc_details_t *bcd_init(void)
 {
     bc_details_t *bcd = calloc(1, sizeof(bc_details_t));
+    bcd->pseq.len = bcd->pidx1.len = bcd->pidx2.len = -1;
     bcd->seq = NULL;
     bcd->idx1 = NULL;
     bcd->idx2 = NULL;
@@ -173,6 +409,26 @@ static bc_details_t *bcd_init(void)
 /*
  * Print metrics file header
  */
+static inline bool isSampling(decode_opts_t *opts)
+{
+    return opts->sample_max || opts->sample_fraction;
+}
+
+/*
+ * 95% Wilson score interval for the fraction k/n
+ */
+static void wilsonInterval(uint64_t k, uint64_t n, double *lo, double *hi)
+{
+    const double z = 1.96;
+    if (!n) { *lo = *hi = 0; return; }
+    double p = k / (double)n;
+    double d = 1 + z * z / n;
+    double c = (p + z * z / (2 * n)) / d;
+    double w = z * sqrt(p * (1 - p) / n + z * z / (4.0 * n * n)) / d;
+    *lo = c - w < 0 ? 0 : c - w;
+    *hi = c + w > 1 ? 1 : c + w;
+}
+
 static void print_header(FILE* f, decode_opts_t* opts, bool metrics) {
     // print header
     fprintf(f, "##\n");
@@ -180,6 +436,10 @@ static void print_header(FILE* f, decode_opts_t* opts, bool metrics) {
     fprintf(f, "MAX_MISMATCHES=%d ", opts->max_mismatches);
     fprintf(f, "MIN_MISMATCH_DELTA=%d ", opts->min_mismatch_delta);
     fprintf(f, "MAX_NO_CALLS=%d ", opts->max_no_calls);
+    if (isSampling(opts)) {
+        fprintf(f, "SAMPLE_FRACTION=%g ", opts->sample_fraction ? opts->sample_fraction : 1.0);
+        fprintf(f, "SAMPLED_TEMPLATES=%"PRIu64" ", opts->nsampled);
+    }
     fprintf(f, "\n");
     fprintf(f, "##\n");
     fprintf(f, "# ID:bambi VN:%s (htslib %s) CL:%s\n", bambi_version(), hts_version(), opts->argv_list);
@@ -217,12 +477,149 @@ static void print_header(FILE* f, decode_opts_t* opts, bool metrics) {
     if (!opts->ignore_pf) {
         fprintf(f, "\tPF_NORMALIZED_MATCHES");
     }
+    if (metrics && isSampling(opts)) {
+        fprintf(f, "\tPCT_MATCHES_CI_LOW");
+        fprintf(f, "\tPCT_MATCHES_CI_HIGH");
+    }
     fprintf(f, "\n");
 }
 
+static unmatched_sketch_t *unmatched_init(int size)
+{
+    unmatched_sketch_t *s = calloc(1, sizeof(unmatched_sketch_t));
+    if (!s) die("Out of memory");
+    s->size = size;
+    s->hash = HashTableCreate(size, HASH_FUNC_JENKINS);
+    s->items = calloc(size, sizeof(HashItem *));
+    s->counts = calloc(size, sizeof(uint64_t));
+    s->errors = calloc(size, sizeof(uint64_t));
+    if (!s->hash || !s->items || !s->counts || !s->errors) die("Out of memory");
+    return s;
+}
+
+static void unmatched_free(unmatched_sketch_t *s)
+{
+    if (!s) return;
+    HashTableDestroy(s->hash, 0);
+    free(s->items);
+    free(s->counts);
+    free(s->errors);
+    free(s);
+}
+
+/*
+ * Add count reads of a sequence, which may already be overcounted by error
+ */
+static void unmatchedInsert(unmatched_sketch_t *s, char *seq, uint64_t count, uint64_t error)
+{
+    HashItem *hi = HashTableSearch(s->hash, seq, 0);
+    int slot;
+
+    if (hi) {
+        slot = hi->data.i;
+    } else {
+        if (s->nused < s->size) {
+            slot = s->nused++;
+        } else {
+            // replace the sequence with the lowest count
+            slot = 0;
+            for (int n = 1; n < s->size; n++) {
+                if (s->counts[n] < s->counts[slot]) slot = n;
+            }
+            error += s->counts[slot];
+            count += s->counts[slot];
+            HashTableDel(s->hash, s->items[slot], 0);
+            s->counts[slot] = s->errors[slot] = 0;
+        }
+        HashData hd;
+        hd.i = slot;
+        s->items[slot] = HashTableAdd(s->hash, seq, 0, hd, NULL);
+        if (!s->items[slot]) die("Out of memory");
+    }
+    s->counts[slot] += count;
+    s->errors[slot] += error;
+}
+
+static inline void unmatchedAdd(unmatched_sketch_t *s, char *seq)
+{
+    s->total++;
+    unmatchedInsert(s, seq, 1, 0);
+}
+
+typedef struct {
+    char *seq;
+    uint64_t count, error;
+} unmatched_entry_t;
+
+static int compareUnmatched(const void *u1, const void *u2)
+{
+    const unmatched_entry_t *e1 = u1, *e2 = u2;
+    if (e1->count != e2->count) return e1->count < e2->count ? 1 : -1;
+    return strcmp(e1->seq, e2->seq);
+}
+
+/*
+ * The count which a sequence the sketch doesn't monitor may have: the lowest
+ * count, once every slot is used
+ */
+static uint64_t unmatchedFloor(unmatched_sketch_t *s)
+{
+    uint64_t min = 0;
+    if (s->nused < s->size) return 0;
+    for (int n = 0; n < s->nused; n++) {
+        if (n == 0 || s->counts[n] < min) min = s->counts[n];
+    }
+    return min;
+}
+
+/*
+ * Merge one sketch into another. A sequence missing from one of them may
+ * have had up to its lowest count there, so that is added to both its count
+ * and its error. The merged sketch keeps the dst->size highest counts.
+ */
+static void unmatchedMerge(unmatched_sketch_t *dst, unmatched_sketch_t *src)
+{
+    uint64_t dst_floor = unmatchedFloor(dst), src_floor = unmatchedFloor(src);
+    unmatched_entry_t *entries = malloc((dst->nused + src->nused + 1) * sizeof(unmatched_entry_t));
+    int nentries = 0;
+    if (!entries) die("Out of memory");
+
+    for (int n = 0; n < dst->nused; n++) {
+        HashItem *hi = HashTableSearch(src->hash, dst->items[n]->key, 0);
+        uint64_t count = hi ? src->counts[hi->data.i] : src_floor;
+        uint64_t error = hi ? src->errors[hi->data.i] : src_floor;
+        entries[nentries].seq = dst->items[n]->key;
+        entries[nentries].count = dst->counts[n] + count;
+        entries[nentries].error = dst->errors[n] + error;
+        nentries++;
+    }
+    for (int n = 0; n < src->nused; n++) {
+        if (HashTableSearch(dst->hash, src->items[n]->key, 0)) continue;
+        entries[nentries].seq = src->items[n]->key;
+        entries[nentries].count = src->counts[n] + dst_floor;
+        entries[nentries].error = src->errors[n] + dst_floor;
+        nentries++;
+    }
+    qsort(entries, nentries, sizeof(unmatched_entry_t), compareUnmatched);
+
+    unmatched_sketch_t *merged = unmatched_init(dst->size);
+    for (int n = 0; n < nentries && n < merged->size; n++) {
+        unmatchedInsert(merged, entries[n].seq, entries[n].count, entries[n].error);
+    }
+    merged->total = dst->total + src->total;
+    free(entries);
+
+    // swap the merged sketch into dst
+    unmatched_sketch_t tmp = *dst;
+    *dst = *merged;
+    *merged = tmp;
+    unmatched_free(merged);
+}
+
 void free_bcd(void *entry)
 {
     bc_details_t *bcd = (bc_details_t *)entry;
+    unmatched_free(bcd->unmatched);
     free(bcd->seq);
     free(bcd->idx1);
     free(bcd->idx2);
@@ -267,6 +664,8 @@ static void usage(FILE *write_to)
 "\n"
 "Options:\n"
 "  -o   --output                        output file [default: stdout]\n"
+"       --output-per-barcode            write each barcode to its own file instead, named by replacing\n"
+"                                       %%s in this template with the barcode name (0 for unmatched reads)\n"
 "  -v   --verbose                       verbose output\n"
 "  -b   --barcode-file                  file containing barcodes\n"
 "       --convert-low-quality           Convert low quality bases in barcode read to 'N'\n"
@@ -281,14 +680,39 @@ static void usage(FILE *write_to)
 "                                       match [default: " xstr(DEFAULT_MIN_MISMATCH_DELTA) "]\n"
 "       --change-read-name              Change the read name by adding #<barcode> suffix\n"
 "       --metrics-file                  Per-barcode and per-lane metrics written to this file\n"
+"       --counts-file                   Write the raw counts behind the metrics to this file, so that the metrics\n"
+"                                       of parts of a run can be combined by bambi decode-metrics-merge\n"
+"       --unmatched-top                 Write this many of the most common unmatched barcode sequences, with\n"
+"                                       approximate counts, to <metrics-file>.unmatched (at most " xstr(MAX_UNMATCHED_TOP) ")\n"
+"                                       [default: none]\n"
+"       --metrics-only                  Only write the metrics file; the records are not changed or written\n"
+"       --sample                        With --metrics-only, estimate the barcode fractions, with 95%% confidence\n"
+"                                       intervals, from this many templates. They are taken in equal shares from\n"
+"                                       ranges spread through a BAM file, but from the start of a SAM or CRAM file\n"
+"       --sample-fraction               With --metrics-only, estimate the barcode fractions from this fraction\n"
+"                                       of the templates. Only that fraction of a BAM file is read, in ranges\n"
+"                                       spread through it; SAM and CRAM files are read in full, and the templates\n"
+"                                       are chosen by a hash of the read name\n"
 "       --barcode-tag-name              Barcode tag name [default: " DEFAULT_BARCODE_TAG "]\n"
 "       --quality-tag-name              Quality tag name [default: " DEFAULT_QUALITY_TAG "]\n"
 "       --input-fmt                     format of input file [sam/bam/cram]\n"
 "       --output-fmt                    format of output file [sam/bam/cram]\n"
 "       --compression-level             Compression level of output file [0..9]\n"
 "  -t   --threads                       number of threads to use [default: 1]\n"
+"       --numa                          Split the threads between the NUMA nodes, and share the work between them.\n"
+"                                       The input is decompressed on the first node, and the output files are\n"
+"                                       compressed on the nodes in turn, starting with the second\n"
+"       --split-input                   With --threads and a BAM input file, read the input in parallel, in ranges\n"
+"                                       which start at records (found from the .bai or .csi index if there is one)\n"
+"                                       and are aligned to templates\n"
 "       --ignore-pf                     Doesn't output PF statistics\n"
 "       --dual-tag                      Dual tag position in the barcode string (between 2 and barcode length - 1)\n"
+"       --qual-bin                      Bin read quality values. Either 'illumina8' (8-level binning), 'illumina4'\n"
+"                                       (4-level binning), or a file with lines of 'low high binned-value'\n"
+"       --save-index                    Save the compiled barcode index to this file\n"
+"       --load-index                    Load the barcode index from this file, if it was saved with the same\n"
+"                                       barcodes and matching options. Otherwise it is rebuilt (and saved\n"
+"                                       again if --save-index names the same file)\n"
 );
 }
 
@@ -350,6 +774,21 @@ void set_decode_opt_ignore_pf(decode_opts_t *opts, bool flag)
     opts->ignore_pf = flag;
 }
 
+/*
+ * parse a whole number from 1 to max
+ *
+ * returns the number, or 0 if s isn't one
+ */
+static uint64_t parse_count(const char *s, uint64_t max)
+{
+    char *end;
+    if (!isdigit((unsigned char)*s)) return 0;
+    errno = 0;
+    uint64_t n = strtoull(s, &end, 10);
+    if (errno || *end || n > max) return 0;
+    return n;
+}
+
 /*
  * Takes the command line options and turns them into something we can understand
  */
@@ -362,6 +801,7 @@ static decode_opts_t* parse_args(int argc, char *argv[])
     static const struct option lopts[] = {
         { "input",                      1, 0, 'i' },
         { "output",                     1, 0, 'o' },
+        { "output-per-barcode",         1, 0, 0 },
         { "verbose",                    0, 0, 'v' },
         { "max-low-quality-to-convert", 1, 0, 0 },
         { "convert-low-quality",        0, 0, 0 },
@@ -371,6 +811,11 @@ static decode_opts_t* parse_args(int argc, char *argv[])
         { "min-mismatch-delta",         1, 0, 0 },
         { "change-read-name",           0, 0, 0 },
         { "metrics-file",               1, 0, 0 },
+        { "metrics-only",               0, 0, 0 },
+        { "counts-file",                1, 0, 0 },
+        { "unmatched-top",              1, 0, 0 },
+        { "sample",                     1, 0, 0 },
+        { "sample-fraction",            1, 0, 0 },
         { "barcode-tag-name",           1, 0, 0 },
         { "quality-tag-name",           1, 0, 0 },
         { "input-fmt",                  1, 0, 0 },
@@ -378,6 +823,11 @@ static decode_opts_t* parse_args(int argc, char *argv[])
         { "compression-level",          1, 0, 0 },
         { "ignore-pf",                  0, 0, 0 },
         { "dual-tag",                   1, 0, 0 },
+        { "qual-bin",                   1, 0, 0 },
+        { "numa",                       0, 0, 0 },
+        { "split-input",                0, 0, 0 },
+        { "save-index",                 1, 0, 0 },
+        { "load-index",                 1, 0, 0 },
         { "threads",                    1, 0, 't' },
         { NULL, 0, NULL, 0 }
     };
@@ -400,6 +850,25 @@ static decode_opts_t* parse_args(int argc, char *argv[])
                     break;
         case 0:     arg = lopts[option_index].name;
                          if (strcmp(arg, "metrics-file") == 0)               opts->metrics_name = strdup(optarg);
+                    else if (strcmp(arg, "metrics-only") == 0)               opts->metrics_only = true;
+                    else if (strcmp(arg, "counts-file") == 0)                opts->counts_name = strdup(optarg);
+                    else if (strcmp(arg, "unmatched-top") == 0) {
+                        opts->unmatched_top = parse_count(optarg, MAX_UNMATCHED_TOP);
+                        if (!opts->unmatched_top) {
+                            fprintf(stderr,"--unmatched-top must be a number from 1 to %d\n", MAX_UNMATCHED_TOP);
+                            usage(stderr); decode_free_opts(opts);
+                            return NULL;
+                        }
+                    }
+                    else if (strcmp(arg, "sample") == 0) {
+                        opts->sample_max = parse_count(optarg, UINT64_MAX);
+                        if (!opts->sample_max) {
+                            fprintf(stderr,"--sample must be a number of templates greater than 0\n");
+                            usage(stderr); decode_free_opts(opts);
+                            return NULL;
+                        }
+                    }
+                    else if (strcmp(arg, "sample-fraction") == 0)            opts->sample_fraction = atof(optarg);
                     else if (strcmp(arg, "max-low-quality-to-convert") == 0) opts->max_low_quality_to_convert = atoi(optarg);
                     else if (strcmp(arg, "convert-low-quality") == 0)        opts->convert_low_quality = true;
                     else if (strcmp(arg, "max-no-calls") == 0)               opts->max_no_calls = atoi(optarg);
@@ -410,10 +879,23 @@ static decode_opts_t* parse_args(int argc, char *argv[])
                     else if (strcmp(arg, "quality-tag-name") == 0)           opts->quality_tag_name = strdup(optarg);
                     else if (strcmp(arg, "input-fmt") == 0)                  opts->input_fmt = strdup(optarg);
                     else if (strcmp(arg, "output-fmt") == 0)                 opts->output_fmt = strdup(optarg);
+                    else if (strcmp(arg, "output-per-barcode") == 0)         opts->output_per_barcode = strdup(optarg);
                     else if (strcmp(arg, "compression-level") == 0)          opts->compression_level = *optarg;
                     else if (strcmp(arg, "ignore-pf") == 0)                  opts->ignore_pf = true;
+                    else if (strcmp(arg, "numa") == 0)                       opts->numa = true;
+                    else if (strcmp(arg, "split-input") == 0)                opts->split_input = true;
+                    else if (strcmp(arg, "save-index") == 0)                 opts->save_index_name = strdup(optarg);
+                    else if (strcmp(arg, "load-index") == 0)                 opts->load_index_name = strdup(optarg);
                     else if (strcmp(arg, "dual-tag") == 0)                  {opts->dual_tag = (short)atoi(optarg);
                                                                              opts->max_no_calls = 0;}  
+                    else if (strcmp(arg, "qual-bin") == 0) {
+                        if (qualbin_make_map(optarg, opts->qual_map) < 0) {
+                            fprintf(stderr,"Invalid quality binning scheme: %s\n", optarg);
+                            decode_free_opts(opts);
+                            return NULL;
+                        }
+                        opts->qual_bin = true;
+                    }
                     else {
                         printf("\nUnknown option: %s\n\n", arg); 
                         usage(stdout); decode_free_opts(opts);
@@ -444,11 +926,60 @@ static decode_opts_t* parse_args(int argc, char *argv[])
         return NULL;
     }
 
+    if (opts->counts_name && !opts->metrics_name) {
+        fprintf(stderr,"--counts-file needs a metrics file (--metrics-file)\n");
+        usage(stderr); decode_free_opts(opts);
+        return NULL;
+    }
+
+    if (opts->metrics_only) {
+        if (!opts->metrics_name) {
+            fprintf(stderr,"--metrics-only needs a metrics file (--metrics-file)\n");
+            usage(stderr); decode_free_opts(opts);
+            return NULL;
+        }
+        if (opts->output_name || opts->output_per_barcode) {
+            fprintf(stderr,"--metrics-only doesn't write any records, so can't be used with an output file\n");
+            usage(stderr); decode_free_opts(opts);
+            return NULL;
+        }
+    }
+
+    if ((opts->sample_max || opts->sample_fraction) && !opts->metrics_only) {
+        fprintf(stderr,"--sample and --sample-fraction can only be used with --metrics-only\n");
+        usage(stderr); decode_free_opts(opts);
+        return NULL;
+    }
+    if (opts->split_input && (opts->nthreads < 2 || opts->sample_max || opts->sample_fraction)) {
+        fprintf(stderr,"--split-input needs --threads, and can't be used with --sample or --sample-fraction\n");
+        usage(stderr); decode_free_opts(opts);
+        return NULL;
+    }
+    if (opts->sample_fraction < 0 || opts->sample_fraction > 1) {
+        fprintf(stderr,"--sample-fraction must be between 0 and 1\n");
+        usage(stderr); decode_free_opts(opts);
+        return NULL;
+    }
+
+    if (opts->output_per_barcode) {
+        char *p = strstr(opts->output_per_barcode, "%s");
+        if (opts->output_name) {
+            fprintf(stderr,"You can't specify both --output and --output-per-barcode\n");
+            usage(stderr); decode_free_opts(opts);
+            return NULL;
+        }
+        if (!p || strchr(opts->output_per_barcode, '%') != p || strchr(p + 1, '%')) {
+            fprintf(stderr,"--output-per-barcode must contain %%s once, and no other %%\n");
+            usage(stderr); decode_free_opts(opts);
+            return NULL;
+        }
+    }
+
     if (!opts->barcode_tag_name) opts->barcode_tag_name = strdup(DEFAULT_BARCODE_TAG);
     if (!opts->quality_tag_name) opts->quality_tag_name = strdup(DEFAULT_QUALITY_TAG);
 
     // output defaults to stdout
-    if (!opts->output_name) opts->output_name = strdup("-");
+    if (!opts->output_name && !opts->output_per_barcode && !opts->metrics_only) opts->output_name = strdup("-");
 
     return opts;
 }
@@ -513,10 +1044,114 @@ void writeMetricsLine(FILE *f, bc_details_t *bcd, decode_opts_t *opts, uint64_t
     if (!opts->ignore_pf) {
         fprintf(f, "\t%.3f", total_pf_reads_assigned ? bcd->pf_reads * nReads / (double)total_pf_reads_assigned  : 0);
     }
+    if (metrics && isSampling(opts)) {
+        double lo, hi;
+        wilsonInterval(bcd->reads, total_reads, &lo, &hi);
+        fprintf(f, "\t%.3g\t%.3g", lo, hi);
+    }
     fprintf(f, "\n");
 }
 
 
+/*
+ * Write the top opts->unmatched_top unmatched sequences to <metrics>.unmatched
+ */
+static void writeUnmatched(unmatched_sketch_t *s, decode_opts_t *opts)
+{
+    char *fname = malloc(strlen(opts->metrics_name) + 11);
+    unmatched_entry_t *entries = malloc(s->size * sizeof(unmatched_entry_t));
+    if (!fname || !entries) die("Out of memory");
+    sprintf(fname, "%s.unmatched", opts->metrics_name);
+
+    FILE *f = fopen(fname, "w");
+    if (!f) {
+        fprintf(stderr,"Can't open unmatched barcodes file %s\n", fname);
+    } else {
+        for (int n = 0; n < s->nused; n++) {
+            entries[n].seq = s->items[n]->key;
+            entries[n].count = s->counts[n];
+            entries[n].error = s->errors[n];
+        }
+        qsort(entries, s->nused, sizeof(unmatched_entry_t), compareUnmatched);
+
+        fprintf(f, "##\n");
+        fprintf(f, "# TOTAL_UNMATCHED_READS=%"PRIu64", ", s->total);
+        fprintf(f, "SEQUENCES_MONITORED=%d\n", s->size);
+        fprintf(f, "##\n");
+        fprintf(f, "BARCODE\tREADS\tMAX_OVERCOUNT\tPCT_UNMATCHED_READS\n");
+        for (int n = 0; n < s->nused && n < opts->unmatched_top; n++) {
+            fprintf(f, "%s\t%"PRIu64"\t%"PRIu64"\t%.3f\n", entries[n].seq, entries[n].count, entries[n].error,
+                    s->total ? entries[n].count / (double)s->total : 0);
+        }
+        fclose(f);
+    }
+    free(entries);
+    free(fname);
+}
+
+static void writeCountsLine(FILE *f, const char *type, bc_details_t *bcd, bool metadata)
+{
+    fprintf(f, "%s\t%s\t%s\t", type, bcd->idx1, bcd->idx2);
+    if (metadata) fprintf(f, "%s\t%s\t%s\t%s\t", bcd->name, bcd->lib, bcd->sample, bcd->desc);
+    else fprintf(f, "\t\t\t\t");
+    fprintf(f, "%"PRIu64"\t%"PRIu64"\t%"PRIu64"\t%"PRIu64"\t%"PRIu64"\t%"PRIu64"\t0\n",
+            bcd->reads, bcd->pf_reads, bcd->perfect, bcd->pf_perfect, bcd->one_mismatch, bcd->pf_one_mismatch);
+}
+
+/*
+ * Write the raw counts behind the metrics to opts->counts_name, so that the
+ * metrics for parts of a run decoded separately can be combined by
+ * decode-metrics-merge.
+ */
+static int writeCounts(va_t *barcodeArray, va_t *tagHopArray, decode_opts_t *opts)
+{
+    unmatched_sketch_t *s = ((bc_details_t *)barcodeArray->entries[0])->unmatched;
+
+    FILE *f = fopen(opts->counts_name, "w");
+    if (!f) {
+        fprintf(stderr,"Can't open metrics counts file %s\n", opts->counts_name);
+        return 1;
+    }
+
+    fprintf(f, "##\n");
+    fprintf(f, "# BAMBI_DECODE_COUNTS=%d ", COUNTS_FILE_VERSION);
+    fprintf(f, "BARCODE_TAG_NAME=%s ", opts->barcode_tag_name);
+    fprintf(f, "MAX_MISMATCHES=%d ", opts->max_mismatches);
+    fprintf(f, "MIN_MISMATCH_DELTA=%d ", opts->min_mismatch_delta);
+    fprintf(f, "MAX_NO_CALLS=%d ", opts->max_no_calls);
+    fprintf(f, "IGNORE_PF=%d ", opts->ignore_pf);
+    fprintf(f, "IDX1_LEN=%d ", opts->idx1_len);
+    fprintf(f, "IDX2_LEN=%d ", opts->idx2_len);
+    fprintf(f, "SAMPLE_FRACTION=%.17g ", opts->sample_fraction);
+    fprintf(f, "SAMPLE_MAX=%"PRIu64" ", opts->sample_max);
+    fprintf(f, "SAMPLED_TEMPLATES=%"PRIu64" ", opts->nsampled);
+    fprintf(f, "UNMATCHED_TOP=%d ", opts->unmatched_top);
+    fprintf(f, "SEQUENCES_MONITORED=%d ", s ? s->size : 0);
+    fprintf(f, "TOTAL_UNMATCHED_READS=%"PRIu64"\n", s ? s->total : 0);
+    fprintf(f, "# ID:bambi VN:%s (htslib %s) CL:%s\n", bambi_version(), hts_version(), opts->argv_list);
+    fprintf(f, "##\n");
+    fprintf(f, "TYPE\tINDEX1\tINDEX2\tBARCODE_NAME\tLIBRARY_NAME\tSAMPLE_NAME\tDESCRIPTION\t");
+    fprintf(f, "READS\tPF_READS\tPERFECT_MATCHES\tPF_PERFECT_MATCHES\tONE_MISMATCH_MATCHES\tPF_ONE_MISMATCH_MATCHES\t");
+    fprintf(f, "MAX_OVERCOUNT\n");
+
+    // the barcodes, starting with the null barcode
+    for (int n = 0; n < barcodeArray->end; n++) {
+        writeCountsLine(f, "BARCODE", barcodeArray->entries[n], true);
+    }
+    for (int n = 0; tagHopArray && n < tagHopArray->end; n++) {
+        writeCountsLine(f, "HOP", tagHopArray->entries[n], false);
+    }
+    for (int n = 0; s && n < s->nused; n++) {
+        fprintf(f, "UNMATCHED\t%s\t\t\t\t\t\t%"PRIu64"\t0\t0\t0\t0\t0\t%"PRIu64"\n", s->items[n]->key, s->counts[n], s->errors[n]);
+    }
+
+    if (fclose(f) != 0) {
+        fprintf(stderr,"Can't write metrics counts file %s\n", opts->counts_name);
+        return 1;
+    }
+    return 0;
+}
+
 /*
  *
  */
@@ -572,6 +1207,27 @@ int writeMetrics(va_t *barcodeArray, HashTable *tagHopHash, decode_opts_t *opts)
         }
     }
 
+    // summarise each class of a mixed length barcode set
+    if (opts->classes) {
+        fprintf(f, "##\n");
+        for (int c = 0; c < opts->classes->end; c++) {
+            barcode_class_t *cls = opts->classes->entries[c];
+            uint64_t reads = 0, pf_reads = 0, perfect = 0, pf_perfect = 0;
+            for (n = 1; n < cls->barcodeArray->end; n++) {
+                bc_details_t *bcd = barcodeArray->entries[((bc_details_t *)cls->barcodeArray->entries[n])->index];
+                reads += bcd->reads;
+                pf_reads += bcd->pf_reads;
+                perfect += bcd->perfect;
+                pf_perfect += bcd->pf_perfect;
+            }
+            fprintf(f, "# BARCODE_CLASS=%d", cls->idx1_len);
+            if (cls->idx2_len) fprintf(f, "-%d", cls->idx2_len);
+            fprintf(f, " BARCODES=%d READS=%"PRIu64" PERFECT_MATCHES=%"PRIu64, cls->barcodeArray->end - 1, reads, perfect);
+            if (!opts->ignore_pf) fprintf(f, " PF_READS=%"PRIu64" PF_PERFECT_MATCHES=%"PRIu64, pf_reads, pf_perfect);
+            fprintf(f, "\n");
+        }
+    }
+
     // print header
     print_header(f, opts, true);
 
@@ -580,12 +1236,12 @@ int writeMetrics(va_t *barcodeArray, HashTable *tagHopHash, decode_opts_t *opts)
         bc_details_t *bcd = barcodeArray->entries[n];
         writeMetricsLine(f, bcd, opts, total_reads, max_reads, total_pf_reads, max_pf_reads, total_pf_reads_assigned, nReads, true);
     }
-    // treat Tag 0 as a special case
-    bcd = barcodeArray->entries[0];
-    bcd->perfect = 0;
-    bcd->pf_perfect = 0;
-    bcd->name[0] = 0;
-    writeMetricsLine(f, bcd, opts, total_reads, max_reads, total_pf_reads, max_pf_reads, 0, nReads, true);
+    // treat Tag 0 as a special case, leaving its counts for writeCounts()
+    bc_details_t null_bcd = *(bc_details_t *)barcodeArray->entries[0];
+    null_bcd.perfect = 0;
+    null_bcd.pf_perfect = 0;
+    null_bcd.name = "";
+    writeMetricsLine(f, &null_bcd, opts, total_reads, max_reads, total_pf_reads, max_pf_reads, 0, nReads, true);
 
     fclose(f);
 
@@ -622,8 +1278,20 @@ int writeMetrics(va_t *barcodeArray, HashTable *tagHopHash, decode_opts_t *opts)
         free(metrics_hops_name);
     }
 
+    /*
+     * and the most common unmatched sequences
+     */
+    bcd = barcodeArray->entries[0];
+    if (bcd->unmatched) writeUnmatched(bcd->unmatched, opts);
+
+    /*
+     * and, last, the raw counts for decode-metrics-merge
+     */
+    int ret = 0;
+    if (opts->counts_name) ret = writeCounts(barcodeArray, tagHopArray, opts);
+
     va_free(tagHopArray);
-    return 0;
+    return ret;
 }
 
 /*
@@ -669,6 +1337,7 @@ va_t *loadBarcodeFile(decode_opts_t *opts)
     bcd->lib    = strdup("");
     bcd->sample = strdup("");
     bcd->desc   = strdup("");
+    if (opts->metrics_name && opts->unmatched_top > 0) bcd->unmatched = unmatched_init(opts->unmatched_top * UNMATCHED_SKETCH_FACTOR);
     va_push(barcodeArray,bcd);
 
     FILE *fh = fopen(opts->barcode_name,"r");
@@ -704,15 +1373,9 @@ va_t *loadBarcodeFile(decode_opts_t *opts)
         va_push(barcodeArray,bcd);
         free(buf); buf=NULL;
 
-        if (idx1_len == 0) {
-            idx1_len = strlen(bcd->idx1);
-            idx2_len = strlen(bcd->idx2);
-        } else {
-            if ( (idx1_len != strlen(bcd->idx1)) && (idx2_len != strlen(bcd->idx2)) ) {
-                fprintf(stderr,"ERROR: Tag '%s' is a different length to the previous tag\n", bcd->seq);
-                return NULL;
-            }
-        }
+        // barcodes may have different lengths, see make_barcode_classes()
+        if (strlen(bcd->idx1) > idx1_len) idx1_len = strlen(bcd->idx1);
+        if (strlen(bcd->idx2) > idx2_len) idx2_len = strlen(bcd->idx2);
     }
 
     opts->idx1_len = idx1_len;
@@ -725,6 +1388,9 @@ va_t *loadBarcodeFile(decode_opts_t *opts)
     if (idx2_len) strcat(bcd->seq,INDEX_SEPARATOR);
     strcat(bcd->seq,bcd->idx2);
 
+    packBarcodes(barcodeArray, opts);
+    make_index_hashes(barcodeArray, opts);
+
     free(buf);
     fclose(fh);
     return barcodeArray;
@@ -768,93 +1434,413 @@ static int countMismatches(char *tag, char *barcode, int maxval)
 }
 
 /*
- * For a failed match, check is there is tag hopping to report
+ * Pack a sequence, see packed_bc_t
  */
-static bc_details_t *check_tag_hopping(char *barcode, va_t *barcodeArray, HashTable *tagHopHash, decode_opts_t *opts)
+static void packBarcode(const char *s, packed_bc_t *p)
 {
-    bc_details_t *bcd = NULL, *best_match1 = NULL, *best_match2 = NULL;
-    char stack_idx1[STACK_BC_LEN], stack_idx2[STACK_BC_LEN];
-    char *idx1 = stack_idx1, *idx2 = stack_idx2;
-    int nmBest1 = opts->idx1_len + opts->idx2_len + 1;
-    int nmBest2 = nmBest1;
+    // base code + 1, or 5 for N. Zero for anything else.
+    static const uint8_t pack_code[256] = { ['A'] = 1, ['C'] = 2, ['G'] = 3, ['T'] = 4, ['N'] = 5 };
+    int i = 0;
+
+    p->len = -1;
+    for (int w = 0; w < PACKED_BC_WORDS; w++) {
+        uint64_t bases = 0, n = 0, sep = 0;
+        for (int shift = 0; shift < 64 && s[i]; shift += 2, i++) {
+            uint64_t code = pack_code[(uint8_t)s[i]];
+            if (code == 0) {
+                if (s[i] != INDEX_SEPARATOR[0]) return;
+                sep |= 1ULL << shift;
+            } else {
+                bases |= ((code - 1) & 3) << shift;
+                n |= (uint64_t)(code == 5) << shift;
+            }
+        }
+        p->bases[w] = bases;
+        p->n[w] = n;
+        p->sep[w] = sep;
+        if (!s[i]) break;
+    }
+    if (!s[i]) p->len = i;
+}
 
-    split_index(barcode, strlen(barcode), opts->dual_tag, &idx1, &idx2, sizeof(stack_idx1), sizeof(stack_idx2));
+/*
+ * Mismatches in one word of packed sequences, where mask selects the
+ * bases to compare. As countMismatches(), an N in the read never
+ * mismatches, but an N in the tag mismatches anything else.
+ */
+static inline int packedWordMismatches(uint64_t tag_bases, uint64_t tag_n, uint64_t tag_sep,
+                                       uint64_t bases, uint64_t n, uint64_t sep, uint64_t mask)
+{
+    uint64_t x = tag_bases ^ bases;
+    uint64_t diff = ((x | (x >> 1)) & 0x5555555555555555ULL) | tag_n | (tag_sep ^ sep);
+    return __builtin_popcountll(diff & ~n & mask);
+}
 
-    // for each tag in barcodeArray
-    for (int n=1; n < barcodeArray->end; n++) {
-        bc_details_t *bcd = barcodeArray->entries[n];
+static inline uint64_t packedMask(int len, int word)
+{
+    int bases = len - 32 * word;
+    return bases >= 32 ? ~0ULL : (1ULL << (2 * bases)) - 1;
+}
 
-        int nMismatches1 = countMismatches(bcd->idx1, idx1, nmBest1);
-        int nMismatches2 = countMismatches(bcd->idx2, idx2, nmBest2);
+/*
+ * count number of mismatches between two packed sequences
+ * (the same as countMismatches() with no early exit)
+ */
+static int packedMismatches(const packed_bc_t *tag, const packed_bc_t *barcode)
+{
+    int len = tag->len < barcode->len ? tag->len : barcode->len;
+    int n = 0;
+    for (int w = 0; w * 32 < len; w++) {
+        n += packedWordMismatches(tag->bases[w], tag->n[w], tag->sep[w],
+                                  barcode->bases[w], barcode->n[w], barcode->sep[w],
+                                  packedMask(len, w));
+    }
+    return n;
+}
 
-        // match the first tag
-        if (nMismatches1 < nmBest1) {
-            nmBest1 = nMismatches1;
-            best_match1 = bcd;
-        }
+/*
+ * Number of noCalls in a packed sequence
+ */
+static inline int packedNoCalls(const packed_bc_t *p)
+{
+    int n = 0;
+    for (int w = 0; w * 32 < p->len; w++) n += __builtin_popcountll(p->n[w]);
+    return n;
+}
+
+/*
+ * Mismatches for a barcode with and without packing
+ */
+static inline int mismatches(char *tag, const packed_bc_t *ptag, char *barcode, const packed_bc_t *pbarcode, int maxval)
+{
+    if (ptag->len >= 0 && pbarcode->len >= 0) return packedMismatches(ptag, pbarcode);
+    return countMismatches(tag, barcode, maxval);
+}
 
-        // match the second tag
-        if (nMismatches2 < nmBest2) {
-            nmBest2 = nMismatches2;
-            best_match2 = bcd;
+/*
+ * Score a read against barcodes [first, first+count) of the set
+ */
+static void packedMismatchesMany(const packed_set_t *set, const packed_bc_t *read, int first, int count, uint8_t *counts)
+{
+    memset(counts, 0, count);
+    for (int w = 0; w * 32 < set->len; w++) {
+        const uint64_t *bases = set->bases + (size_t)w * set->nbarcodes + first;
+        const uint64_t *n = set->n + (size_t)w * set->nbarcodes + first;
+        const uint64_t *sep = set->sep + (size_t)w * set->nbarcodes + first;
+        uint64_t rb = read->bases[w], rn = read->n[w], rs = read->sep[w];
+        uint64_t mask = packedMask(set->len, w);
+        for (int b = 0; b < count; b++) {
+            counts[b] += packedWordMismatches(bases[b], n[b], sep[b], rb, rn, rs, mask);
         }
     }
+}
 
-    if (idx1 != stack_idx1) free(idx1);
-    if (idx2 != stack_idx2) free(idx2);
+static void free_packed_set(packed_set_t *set)
+{
+    if (!set) return;
+    free(set->bases);
+    free(set->n);
+    free(set->sep);
+    free(set);
+}
 
-    bool matched_first = (nmBest1 == 0 );
-    bool matched_second = (nmBest2 == 0 );
+/*
+ * Pack the barcodes, and make the packed set if they are all the same length
+ */
+static void packBarcodes(va_t *barcodeArray, decode_opts_t *opts)
+{
+    int len = -1;
 
-    if (matched_first && matched_second) {
-        HashData hd;
-        HashItem *hi;
-        char stack_key[STACK_BC_LEN];
-        char *key = stack_key;
-
-        assert(best_match1 != NULL && best_match2 != NULL);
-        if (opts->idx1_len + opts->idx2_len + 2 >= sizeof(stack_key)) {
-            key = malloc(opts->idx1_len + opts->idx2_len + 2);
-            if (!key) die("Out of memory");
-        }
-        memcpy(key, best_match1->idx1, opts->idx1_len);
-        memcpy(key + opts->idx1_len, INDEX_SEPARATOR, 1);
-        memcpy(key + opts->idx1_len + 1, best_match2->idx2, opts->idx2_len);
-        key[opts->idx1_len + opts->idx2_len + 1] = '\0';
-        hi = HashTableSearch(tagHopHash, key, 0);
-        if (hi) {
-            bcd = hi->data.p;
-        } else {
-            bcd = calloc(1, sizeof(bc_details_t)); //create a new entry with the two tags
-            bcd->idx1 = best_match1->idx1;
-            bcd->idx2 = best_match2->idx2;
-            bcd->seq = strdup(key);
-            bcd->name = "0";
-            bcd->lib = "DUMMY_LIB";
-            bcd->sample = "DUMMY_SAMPLE";
-            bcd->desc = NULL;
-            hd.p = bcd;
-            HashTableAdd(tagHopHash, key, 0, hd, NULL);
-        }
-        if (key != stack_key) free(key);
+    for (int i = 0; i < barcodeArray->end; i++) {
+        bc_details_t *bcd = barcodeArray->entries[i];
+        packBarcode(bcd->seq, &bcd->pseq);
+        packBarcode(bcd->idx1, &bcd->pidx1);
+        packBarcode(bcd->idx2, &bcd->pidx2);
+        if (i == 1) len = bcd->pseq.len;
+        if (i > 1 && bcd->pseq.len != len) len = -1;
     }
 
-    return bcd;
+    free_packed_set(opts->packed);
+    opts->packed = NULL;
+    if (len <= 0 || len > 255) return;
+
+    packed_set_t *set = calloc(1, sizeof(packed_set_t));
+    size_t nwords = (len + 31) / 32;
+    if (!set) die("Out of memory");
+    set->len = len;
+    set->nbarcodes = barcodeArray->end;
+    set->bases = malloc(nwords * set->nbarcodes * sizeof(uint64_t));
+    set->n = malloc(nwords * set->nbarcodes * sizeof(uint64_t));
+    set->sep = malloc(nwords * set->nbarcodes * sizeof(uint64_t));
+    if (!set->bases || !set->n || !set->sep) die("Out of memory");
+    for (int w = 0; w < nwords; w++) {
+        for (int i = 0; i < set->nbarcodes; i++) {
+            bc_details_t *bcd = barcodeArray->entries[i];
+            set->bases[w * set->nbarcodes + i] = bcd->pseq.bases[w];
+            set->n[w * set->nbarcodes + i] = bcd->pseq.n[w];
+            set->sep[w * set->nbarcodes + i] = bcd->pseq.sep[w];
+        }
+    }
+    opts->packed = set;
 }
 
-
 /*
- * find the best match in the barcode (tag) file for a given barcode
- * return the tag, if a match found, else return NULL
+ * Build exact-match hashes of the first and second index sequences, so that
+ * tag hops can be found without scanning the barcode array.
+ * Each sequence maps to the first barcodeArray entry which has it.
+ * The hashes are only built for dual index barcodes which are all the same length.
  */
-bc_details_t *findBestMatch(char *barcode, va_t *barcodeArray, HashTable *barcodeHash, decode_opts_t *opts)
+static void make_index_hashes(va_t *barcodeArray, decode_opts_t *opts)
 {
-    int bcLen = opts->idx1_len + opts->idx2_len + 1;   // size of barcode sequence in barcode file
-    bc_details_t *best_match = NULL;
-    int nmBest = bcLen;             // number of mismatches (best)
-    int nm2Best = bcLen;            // number of mismatches (second best)
-
-    bool matched = false;
+    HashTableDestroy(opts->idx1Hash, 0);
+    HashTableDestroy(opts->idx2Hash, 0);
+    opts->idx1Hash = opts->idx2Hash = NULL;
+    if (!opts->idx2_len) return;
+
+    for (int n = 1; n < barcodeArray->end; n++) {
+        bc_details_t *bcd = barcodeArray->entries[n];
+        if (strlen(bcd->idx1) != opts->idx1_len || strlen(bcd->idx2) != opts->idx2_len) return;
+    }
+
+    opts->idx1Hash = HashTableCreate(0, HASH_DYNAMIC_SIZE | HASH_FUNC_JENKINS);
+    opts->idx2Hash = HashTableCreate(0, HASH_DYNAMIC_SIZE | HASH_FUNC_JENKINS);
+    if (!opts->idx1Hash || !opts->idx2Hash) die("Out of memory");
+
+    for (int n = 1; n < barcodeArray->end; n++) {
+        bc_details_t *bcd = barcodeArray->entries[n];
+        HashData hd;
+        hd.i = n;
+        // HashTableAdd() keeps the existing entry, so the first barcode wins
+        if (!HashTableAdd(opts->idx1Hash, bcd->idx1, 0, hd, NULL)) die("Out of memory");
+        if (!HashTableAdd(opts->idx2Hash, bcd->idx2, 0, hd, NULL)) die("Out of memory");
+    }
+}
+
+/*
+ * Find the first barcode whose index exactly matches idx.
+ * Returns the barcodeArray index (0 for no match), or -1 if the hash can't
+ * answer because idx is the wrong length or contains a noCall, which matches anything.
+ */
+static int indexHashSearch(HashTable *h, char *idx, int len)
+{
+    if (!h) return -1;
+    for (int i = 0; i < len; i++) {
+        if (idx[i] == '\0' || idx[i] == 'N') return -1;
+    }
+    if (idx[len]) return -1;
+    HashItem *hi = HashTableSearch(h, idx, len);
+    return hi ? hi->data.i : 0;
+}
+
+/*
+ * For a failed match, check is there is tag hopping to report
+ */
+static bc_details_t *check_tag_hopping(char *barcode, va_t *barcodeArray, HashTable *tagHopHash, decode_opts_t *opts)
+{
+    bc_details_t *bcd = NULL;
+    char stack_idx1[STACK_BC_LEN], stack_idx2[STACK_BC_LEN];
+    char *idx1 = stack_idx1, *idx2 = stack_idx2;
+    int best1, best2;
+
+    split_index(barcode, strlen(barcode), opts->dual_tag, &idx1, &idx2, sizeof(stack_idx1), sizeof(stack_idx2));
+    best1 = indexHashSearch(opts->idx1Hash, idx1, opts->idx1_len);
+    best2 = indexHashSearch(opts->idx2Hash, idx2, opts->idx2_len);
+
+    // fall back to scanning barcodeArray if either index can't be looked up,
+    // unless the other has already failed to match
+    if ((best1 < 0 || best2 < 0) && best1 && best2) {
+        packed_bc_t pidx1, pidx2;
+        int nmBest1 = opts->idx1_len + opts->idx2_len + 1;
+        int nmBest2 = nmBest1;
+
+        packBarcode(idx1, &pidx1);
+        packBarcode(idx2, &pidx2);
+        best1 = best2 = 0;
+
+        // for each tag in barcodeArray
+        for (int n=1; n < barcodeArray->end; n++) {
+            bc_details_t *bcd = barcodeArray->entries[n];
+
+            int nMismatches1 = mismatches(bcd->idx1, &bcd->pidx1, idx1, &pidx1, nmBest1);
+            int nMismatches2 = mismatches(bcd->idx2, &bcd->pidx2, idx2, &pidx2, nmBest2);
+
+            // match the first tag
+            if (nMismatches1 < nmBest1) {
+                nmBest1 = nMismatches1;
+                if (nmBest1 == 0) best1 = n;
+            }
+
+            // match the second tag, which single index barcodes don't have
+            if (nMismatches2 < nmBest2 && *bcd->idx2) {
+                nmBest2 = nMismatches2;
+                if (nmBest2 == 0) best2 = n;
+            }
+        }
+    }
+
+    if (idx1 != stack_idx1) free(idx1);
+    if (idx2 != stack_idx2) free(idx2);
+
+    if (best1 > 0 && best2 > 0) {
+        // tag hops are keyed on the barcodeArray indexes of the two matches
+        int32_t key[2] = { best1, best2 };
+        HashItem *hi = HashTableSearch(tagHopHash, (char *)key, sizeof(key));
+        if (hi) {
+            bcd = hi->data.p;
+        } else {
+            bc_details_t *best_match1 = barcodeArray->entries[best1];
+            bc_details_t *best_match2 = barcodeArray->entries[best2];
+            HashData hd;
+
+            bcd = calloc(1, sizeof(bc_details_t)); //create a new entry with the two tags
+            if (!bcd) die("Out of memory");
+            bcd->idx1 = best_match1->idx1;
+            bcd->idx2 = best_match2->idx2;
+            // the two barcodes may have different lengths in a mixed barcode file
+            size_t len1 = strlen(best_match1->idx1), len2 = strlen(best_match2->idx2);
+            bcd->seq = malloc(len1 + len2 + 2);
+            if (!bcd->seq) die("Out of memory");
+            memcpy(bcd->seq, best_match1->idx1, len1);
+            memcpy(bcd->seq + len1, INDEX_SEPARATOR, 1);
+            memcpy(bcd->seq + len1 + 1, best_match2->idx2, len2);
+            bcd->seq[len1 + len2 + 1] = '\0';
+            bcd->name = "0";
+            bcd->lib = "DUMMY_LIB";
+            bcd->sample = "DUMMY_SAMPLE";
+            bcd->desc = NULL;
+            packBarcode(bcd->seq, &bcd->pseq);
+            bcd->pidx1 = best_match1->pidx1;
+            bcd->pidx2 = best_match2->pidx2;
+            hd.p = bcd;
+            if (!HashTableAdd(tagHopHash, (char *)key, sizeof(key), hd, NULL)) die("Out of memory");
+        }
+    }
+
+    return bcd;
+}
+
+
+/*
+ * Find the HashData.i32 pair for a sequence in the neighbourhood, either
+ * in its hash table or, if it was loaded from a file, in the file's slots
+ */
+static uint32_t *nbhdLookup(barcode_nbhd_t *nbhd, char *seq)
+{
+    if (nbhd->hash) {
+        HashItem *hi = HashTableSearch(nbhd->hash, seq, nbhd->len);
+        return hi ? hi->data.i32 : NULL;
+    }
+    // a file which passed load_barcode_nbhd() may still be corrupt, so the key
+    // numbers are checked, and the probe stops after trying every slot
+    uint64_t h = hash64(HASH_FUNC_JENKINS, (uint8_t *)seq, nbhd->len) & nbhd->slot_mask;
+    for (uint64_t n = 0; n <= nbhd->slot_mask; n++, h = (h + 1) & nbhd->slot_mask) {
+        uint32_t k = nbhd->slots[h];
+        if (!k || k > nbhd->nkeys) return NULL;
+        if (memcmp(nbhd->keys + (k-1) * (size_t)(nbhd->len + 1), seq, nbhd->len) == 0) return nbhd->data + 2 * (k-1);
+    }
+    return NULL;
+}
+
+/*
+ * Look up a barcode in the neighbourhood hash.
+ * Returns the index of the matching entry in barcodeArray (0 if there is
+ * no match), or -1 if the sequence is not covered by the hash.
+ */
+static int nbhdSearch(barcode_nbhd_t *nbhd, char *barcode, decode_opts_t *opts)
+{
+    int nN = 0;
+    for (int i = 0; i < nbhd->len; i++) {
+        char c = barcode[i];
+        if (c == '\0') return -1;
+        if (c == 'N') {
+            if (++nN > nbhd->max_n) return -1;
+        } else if (!strchr(nbhd->alpha + i * (NBHD_ALPHA_MAX+1), c)) {
+            return -1;
+        }
+    }
+    if (barcode[nbhd->len]) return -1;
+
+    uint32_t *data = nbhdLookup(nbhd, barcode);
+    if (!data) return 0;    // nothing within the radius, so nothing can match
+    uint32_t x = data[1];
+    if (NBHD_D1(x) > opts->max_mismatches || (x & NBHD_AMBIGUOUS)) return 0;
+    return data[0];
+}
+
+/*
+ * find the best match in the barcode (tag) file for a given barcode
+ * return the tag, if a match found, else return NULL
+ */
+/*
+ * Keep track of the best and second best matches
+ */
+static inline void rankMatch(bc_details_t *bcd, int nMismatches, bc_details_t **best_match, int *nmBest, int *nm2Best)
+{
+    if (nMismatches < *nmBest) {
+        *nm2Best = *nmBest;
+        *nmBest = nMismatches;
+        *best_match = bcd;
+    } else {
+        if (nMismatches < *nm2Best) *nm2Best = nMismatches;
+    }
+}
+
+/*
+ * Look up a barcode in the seed index, checking each barcode which shares
+ * a segment with it.
+ * Returns the matching entry in barcodeArray (entry 0 if there is no
+ * match), or NULL if the index can't be used for this sequence.
+ */
+static bc_details_t *seedSearch(barcode_seeds_t *seeds, char *barcode, packed_bc_t *pbc, va_t *barcodeArray, decode_opts_t *opts)
+{
+    int bcLen = opts->idx1_len + opts->idx2_len + 1;
+    int nmBest = bcLen, nm2Best = bcLen;
+    bc_details_t *best_match = NULL;
+    int usable = 0;
+
+    if (strlen(barcode) != seeds->len) return NULL;
+
+    // an N doesn't count as a mismatch, but stops its segment from matching
+    for (int s = 0; s < seeds->nsegs; s++) {
+        if (!memchr(barcode + seeds->seg_start[s], 'N', seeds->seg_start[s+1] - seeds->seg_start[s])) usable++;
+    }
+    if (usable <= seeds->radius) return NULL;
+
+    ia_t *candidates = ia_init(64);
+    for (int s = 0; s < seeds->nsegs; s++) {
+        int start = seeds->seg_start[s], seg_len = seeds->seg_start[s+1] - start;
+        if (memchr(barcode + start, 'N', seg_len)) continue;
+        HashItem *hi = HashTableSearch(seeds->hash[s], barcode + start, seg_len);
+        if (!hi) continue;
+        ia_t *hits = hi->data.p;
+        for (int i = 0; i < hits->end; i++) ia_push(candidates, hits->entries[i]);
+    }
+
+    // check the candidates in barcode file order, as the linear search would
+    ia_sort(candidates);
+    for (int i = 0; i < candidates->end; i++) {
+        if (i && candidates->entries[i] == candidates->entries[i-1]) continue;
+        bc_details_t *bcd = barcodeArray->entries[candidates->entries[i]];
+        rankMatch(bcd, mismatches(bcd->seq, &bcd->pseq, barcode, pbc, nm2Best), &best_match, &nmBest, &nm2Best);
+    }
+    ia_free(candidates);
+
+    // a barcode which wasn't a candidate is more than radius mismatches away,
+    // so can't change the result
+    if (best_match && nmBest <= opts->max_mismatches && nm2Best - nmBest >= opts->min_mismatch_delta) {
+        return best_match;
+    }
+    return barcodeArray->entries[0];
+}
+
+bc_details_t *findBestMatch(char *barcode, packed_bc_t *pbc, va_t *barcodeArray, HashTable *barcodeHash, decode_opts_t *opts)
+{
+    int bcLen = opts->idx1_len + opts->idx2_len + 1;   // size of barcode sequence in barcode file
+    bc_details_t *best_match = NULL;
+    int nmBest = bcLen;             // number of mismatches (best)
+    int nm2Best = bcLen;            // number of mismatches (second best)
+
+    bool matched = false;
 
     // First look in the barcodeHash for an exact match
     // This optimisation only applies when mismatch_delta is 1 (the default)
@@ -866,17 +1852,33 @@ bc_details_t *findBestMatch(char *barcode, va_t *barcodeArray, HashTable *barcod
         }
     }
 
-    // No exact match, so do it the hard way...
-    for (int n=1; n < barcodeArray->end; n++) {
-        bc_details_t *bcd = barcodeArray->entries[n];
+    // Then in the neighbourhood of the barcodes, which has the answer for
+    // any sequence it covers
+    if (opts->nbhd) {
+        int idx = nbhdSearch(opts->nbhd, barcode, opts);
+        if (idx >= 0 && idx < barcodeArray->end) return barcodeArray->entries[idx];
+    }
 
-        int nMismatches = countMismatches(bcd->seq, barcode, nm2Best);
-        if (nMismatches < nmBest) {
-            nm2Best = nmBest;
-            nmBest = nMismatches;
-            best_match = bcd;
-        } else {
-            if (nMismatches < nm2Best) nm2Best = nMismatches;
+    // Then in the seed index, if the barcode set is too big for a neighbourhood
+    if (opts->seeds) {
+        bc_details_t *bcd = seedSearch(opts->seeds, barcode, pbc, barcodeArray, opts);
+        if (bcd) return bcd;
+    }
+
+    // No exact match, so do it the hard way...
+    if (opts->packed && pbc->len == opts->packed->len) {
+        uint8_t counts[PACKED_BLOCK];
+        for (int first = 1; first < barcodeArray->end; first += PACKED_BLOCK) {
+            int count = barcodeArray->end - first < PACKED_BLOCK ? barcodeArray->end - first : PACKED_BLOCK;
+            packedMismatchesMany(opts->packed, pbc, first, count, counts);
+            for (int b = 0; b < count; b++) {
+                rankMatch(barcodeArray->entries[first + b], counts[b], &best_match, &nmBest, &nm2Best);
+            }
+        }
+    } else {
+        for (int n=1; n < barcodeArray->end; n++) {
+            bc_details_t *bcd = barcodeArray->entries[n];
+            rankMatch(bcd, mismatches(bcd->seq, &bcd->pseq, barcode, pbc, nm2Best), &best_match, &nmBest, &nm2Best);
         }
     }
 
@@ -892,10 +1894,97 @@ bc_details_t *findBestMatch(char *barcode, va_t *barcodeArray, HashTable *barcod
 /*
  * Update the metrics information
  */
-static void updateMetrics(bc_details_t *bcd, char *seq, bool isPf)
+bc_counter_set_t *counter_set_init(va_t *barcodeArray)
+{
+    bc_counter_set_t *set = calloc(1, sizeof(bc_counter_set_t));
+    bc_details_t *bcd = barcodeArray->entries[0];
+    if (!set) die("Out of memory");
+    set->n = barcodeArray->end;
+    set->unmatched_size = bcd->unmatched ? bcd->unmatched->size : 0;
+    if (pthread_key_create(&set->key, NULL) != 0 || pthread_mutex_init(&set->lock, NULL) != 0) die("Couldn't create thread counters");
+    return set;
+}
+
+/*
+ * Get the calling thread's counters, making them if necessary
+ */
+static bc_counts_t *threadCounts(bc_counter_set_t *set)
+{
+    bc_counts_t *c = pthread_getspecific(set->key);
+    if (c) return c;
+
+    c = calloc(1, sizeof(bc_counts_t));
+    uint64_t *block = calloc(6 * (size_t)set->n, sizeof(uint64_t));
+    if (!c || !block) die("Out of memory");
+    c->n = set->n;
+    c->reads           = block;
+    c->pf_reads        = block + set->n;
+    c->perfect         = block + 2 * set->n;
+    c->pf_perfect      = block + 3 * set->n;
+    c->one_mismatch    = block + 4 * set->n;
+    c->pf_one_mismatch = block + 5 * set->n;
+    if (set->unmatched_size) c->unmatched = unmatched_init(set->unmatched_size);
+
+    pthread_mutex_lock(&set->lock);
+    c->next = set->list;
+    set->list = c;
+    pthread_mutex_unlock(&set->lock);
+    if (pthread_setspecific(set->key, c) != 0) die("Couldn't set thread counters");
+    return c;
+}
+
+/*
+ * Add every thread's counts into the barcode array, and free the counters
+ */
+void counter_set_merge(bc_counter_set_t *set, va_t *barcodeArray)
+{
+    bc_details_t *bcd0 = barcodeArray->entries[0];
+    while (set->list) {
+        bc_counts_t *c = set->list;
+        for (int i = 0; i < c->n; i++) {
+            bc_details_t *bcd = barcodeArray->entries[i];
+            bcd->reads           += c->reads[i];
+            bcd->pf_reads        += c->pf_reads[i];
+            bcd->perfect         += c->perfect[i];
+            bcd->pf_perfect      += c->pf_perfect[i];
+            bcd->one_mismatch    += c->one_mismatch[i];
+            bcd->pf_one_mismatch += c->pf_one_mismatch[i];
+        }
+        if (c->unmatched) {
+            if (bcd0->unmatched) unmatchedMerge(bcd0->unmatched, c->unmatched);
+            unmatched_free(c->unmatched);
+        }
+        set->list = c->next;
+        free(c->reads);
+        free(c);
+    }
+    pthread_key_delete(set->key);
+    pthread_mutex_destroy(&set->lock);
+    free(set);
+}
+
+/*
+ * Count a read for a barcode, in the thread's counters if there are any
+ */
+static void updateMetrics(bc_details_t *bcd, char *seq, packed_bc_t *pseq, bool isPf, bc_counts_t *counts)
 {
     int n = 99;
-    if (seq) n = countMismatches(bcd->seq, seq, 999);
+    if (seq) n = mismatches(bcd->seq, &bcd->pseq, seq, pseq, 999);
+
+    if (counts) {
+        int i = bcd->index;
+        counts->reads[i]++;
+        if (isPf) counts->pf_reads[i]++;
+        if (n==0) {
+            counts->perfect[i]++;
+            if (isPf) counts->pf_perfect[i]++;
+        }
+        if (n==1) {
+            counts->one_mismatch[i]++;
+            if (isPf) counts->pf_one_mismatch[i]++;
+        }
+        return;
+    }
 
     bcd->reads++;
     if (isPf) bcd->pf_reads++;
@@ -915,32 +2004,193 @@ static void updateMetrics(bc_details_t *bcd, char *seq, bool isPf)
  * find the best match in the barcode (tag) file, and return the corresponding barcode name
  * If no match found, check for tag hopping, and return dummy entry 0
  */
-char *findBarcodeName(char *barcode, va_t *barcodeArray, HashTable *barcodeHash, HashTable *tagHopHash, decode_opts_t *opts, bool isPf, bool isUpdateMetrics)
+/*
+ * Match a barcode against each class of a mixed length barcode set, using
+ * as much of each index as the class needs.
+ * The match with the fewest mismatches wins, and ties go to the longer
+ * class (the classes are sorted longest first), then to the barcode which
+ * comes first in the barcode file.
+ * The sequence which was matched is copied to seq (which must be at least
+ * as long as barcode plus 2), and packed into pseq, for the metrics.
+ */
+static bc_details_t *findBestClassMatch(char *barcode, va_t *barcodeArray, decode_opts_t *opts, char *seq, packed_bc_t *pseq)
+{
+    char stack_idx1[STACK_BC_LEN], stack_idx2[STACK_BC_LEN];
+    char *idx1 = stack_idx1, *idx2 = stack_idx2;
+    char stack_t[STACK_BC_LEN], *t = stack_t;
+    size_t len = strlen(barcode), len1, len2;
+    bc_details_t *best_match = NULL;
+    int nmBest = INT_MAX;
+
+    split_index(barcode, len, opts->dual_tag, &idx1, &idx2, sizeof(stack_idx1), sizeof(stack_idx2));
+    len1 = strlen(idx1);
+    len2 = strlen(idx2);
+    if (len + 2 > sizeof(stack_t)) {
+        t = malloc(len + 2);
+        if (!t) die("Out of memory");
+    }
+    strcpy(seq, barcode);
+    packBarcode(seq, pseq);
+
+    for (int c = 0; c < opts->classes->end; c++) {
+        barcode_class_t *cls = opts->classes->entries[c];
+        packed_bc_t pt;
+        char *p = t;
+
+        if (len1 < cls->idx1_len || len2 < cls->idx2_len) continue;
+        memcpy(p, idx1, cls->idx1_len); p += cls->idx1_len;
+        if (cls->idx2_len && !opts->dual_tag) *p++ = INDEX_SEPARATOR[0];
+        memcpy(p, idx2, cls->idx2_len); p += cls->idx2_len;
+        *p = '\0';
+        if (noCalls(t) > opts->max_no_calls) continue;
+
+        packBarcode(t, &pt);
+        bc_details_t *bcd = findBestMatch(t, &pt, cls->barcodeArray, cls->barcodeHash, cls->opts);
+        if (bcd == cls->barcodeArray->entries[0]) continue;
+        int nm = mismatches(bcd->seq, &bcd->pseq, t, &pt, nmBest);
+        if (nm < nmBest) {
+            nmBest = nm;
+            best_match = bcd;
+            strcpy(seq, t);
+            *pseq = pt;
+        }
+    }
+
+    if (idx1 != stack_idx1) free(idx1);
+    if (idx2 != stack_idx2) free(idx2);
+    if (t != stack_t) free(t);
+
+    // the class arrays point to the full barcode array, which may not be the one passed in
+    return barcodeArray->entries[best_match ? best_match->index : 0];
+}
+
+/*
+ * Find the barcode for a read, and update the metrics
+ */
+static bc_details_t *findBarcode(char *barcode, va_t *barcodeArray, HashTable *barcodeHash, HashTable *tagHopHash, bc_counter_set_t *counters, decode_opts_t *opts, bool isPf, bool isUpdateMetrics)
 {
     bc_details_t *bcd;
-    if (noCalls(barcode) > opts->max_no_calls) {
+    packed_bc_t pbc;
+    bc_counts_t *counts = (isUpdateMetrics && counters) ? threadCounts(counters) : NULL;
+    unmatched_sketch_t *unmatched = counts ? counts->unmatched : ((bc_details_t *)barcodeArray->entries[0])->unmatched;
+
+    if (opts->classes) {
+        char stack_seq[STACK_BC_LEN], *seq = stack_seq;
+        size_t len = strlen(barcode);
+        if (len + 2 > sizeof(stack_seq)) {
+            seq = malloc(len + 2);
+            if (!seq) die("Out of memory");
+        }
+        bcd = findBestClassMatch(barcode, barcodeArray, opts, seq, &pbc);
+        if (isUpdateMetrics) updateMetrics(bcd, seq, &pbc, isPf, counts);
+        if ((bcd == barcodeArray->entries[0]) && opts->idx2_len) {
+            bc_details_t *tag_hop = check_tag_hopping(barcode, barcodeArray, tagHopHash, opts);
+            if (isUpdateMetrics && tag_hop) updateMetrics(tag_hop, barcode, &pbc, isPf, NULL);
+        }
+        if (isUpdateMetrics && unmatched && bcd == barcodeArray->entries[0]) unmatchedAdd(unmatched, barcode);
+        if (seq != stack_seq) free(seq);
+        return bcd;
+    }
+
+    packBarcode(barcode, &pbc);
+    if ((pbc.len >= 0 ? packedNoCalls(&pbc) : noCalls(barcode)) > opts->max_no_calls) {
         bcd = barcodeArray->entries[0];
-        if (isUpdateMetrics) updateMetrics(bcd, barcode, isPf);
+        if (isUpdateMetrics) updateMetrics(bcd, barcode, &pbc, isPf, counts);
     } else {
-        bcd = findBestMatch(barcode, barcodeArray, barcodeHash, opts);
-        if (isUpdateMetrics) updateMetrics(bcd, barcode, isPf);
+        bcd = findBestMatch(barcode, &pbc, barcodeArray, barcodeHash, opts);
+        if (isUpdateMetrics) updateMetrics(bcd, barcode, &pbc, isPf, counts);
         if ((bcd == barcodeArray->entries[0]) && opts->idx2_len) {
             bc_details_t *tag_hop = check_tag_hopping(barcode, barcodeArray, tagHopHash, opts);
-            if (isUpdateMetrics && tag_hop) updateMetrics(tag_hop, barcode, isPf);
+            if (isUpdateMetrics && tag_hop) updateMetrics(tag_hop, barcode, &pbc, isPf, NULL);
+        }
+    }
+    if (isUpdateMetrics && unmatched && bcd == barcodeArray->entries[0]) unmatchedAdd(unmatched, barcode);
+    return bcd;
+}
+
+char *findBarcodeName(char *barcode, va_t *barcodeArray, HashTable *barcodeHash, HashTable *tagHopHash, bc_counter_set_t *counters, decode_opts_t *opts, bool isPf, bool isUpdateMetrics)
+{
+    return findBarcode(barcode, barcodeArray, barcodeHash, tagHopHash, counters, opts, isPf, isUpdateMetrics)->name;
+}
+
+/*
+ * The aux tags processTemplate() uses, as returned by bam_aux_get()
+ */
+typedef struct {
+    uint8_t *bc, *qt, *rg;
+} aux_index_t;
+
+/*
+ * Size of the aux field starting at s (its tag), or -1 if it runs past end
+ */
+static int auxFieldSize(const uint8_t *s, const uint8_t *end)
+{
+    const uint8_t *z;
+    uint32_t count;
+    int size;
+
+    if (end - s < 3) return -1;
+    switch (s[2]) {
+    case 'A': case 'c': case 'C': size = 1; break;
+    case 's': case 'S':           size = 2; break;
+    case 'i': case 'I': case 'f': size = 4; break;
+    case 'd':                     size = 8; break;
+    case 'Z': case 'H':
+        z = memchr(s + 3, 0, end - s - 3);
+        if (!z) return -1;
+        size = z - s - 2;
+        break;
+    case 'B':
+        if (end - s < 8) return -1;
+        memcpy(&count, s + 4, 4);
+        switch (s[3]) {
+        case 'c': case 'C':           size = 1; break;
+        case 's': case 'S':           size = 2; break;
+        case 'i': case 'I': case 'f': size = 4; break;
+        default: return -1;
+        }
+        if (count > (end - s - 8) / size) return -1;
+        size = 5 + count * size;
+        break;
+    default:
+        return -1;
+    }
+    return (end - s - 3 < size) ? -1 : 3 + size;
+}
+
+/*
+ * Find the barcode, quality and RG tags in one pass over the aux data.
+ * Like bam_aux_get(), this finds the first of each.
+ */
+static void indexAux(bam1_t *rec, const char *bc_name, const char *qt_name, aux_index_t *ai)
+{
+    uint8_t *s = bam_get_aux(rec), *end = rec->data + rec->l_data;
+
+    ai->bc = ai->qt = ai->rg = NULL;
+    while (s < end) {
+        int size = auxFieldSize(s, end);
+        if (size < 0) {
+            // leave anything odd to htslib
+            ai->bc = bam_aux_get(rec, bc_name);
+            ai->qt = bam_aux_get(rec, qt_name);
+            ai->rg = bam_aux_get(rec, "RG");
+            return;
         }
+        if (!ai->bc && s[0] == bc_name[0] && s[1] == bc_name[1]) ai->bc = s + 2;
+        if (!ai->qt && s[0] == qt_name[0] && s[1] == qt_name[1]) ai->qt = s + 2;
+        if (!ai->rg && s[0] == 'R' && s[1] == 'G') ai->rg = s + 2;
+        s += size;
     }
-    return bcd->name;
 }
 
 /*
- * make a new tag by appending #<name> to the old tag
+ * make a new RG value by appending #<name> to the old one
  */
-static void makeNewTag(bam1_t *rec, char *tag, char *name, char **newtag, size_t newtag_sz)
+static void makeNewTag(uint8_t *rg_aux, char *name, char **newtag, size_t newtag_sz)
 {
     char *rg = "";
-    uint8_t *p = bam_aux_get(rec,tag);
     size_t name_len = strlen(name), rg_len;
-    if (p) rg = bam_aux2Z(p);
+    if (rg_aux) rg = bam_aux2Z(rg_aux);
     rg_len = strlen(rg);
     if (name_len + rg_len + 2 > newtag_sz) {
         *newtag = malloc(name_len + rg_len + 2);
@@ -952,27 +2202,60 @@ static void makeNewTag(bam1_t *rec, char *tag, char *name, char **newtag, size_t
 }
 
 /*
- * Change the read name by adding "#<suffix>"
+ * Set the RG tag to newrg (rg_len long, including the NUL), where rg_aux
+ * is the old one from indexAux(), or NULL. If suffix is not NULL, add
+ * "#<suffix>" to the read name.
+ * This does the work of bam_aux_update_str() and renaming the read with
+ * no more than two moves of the record data.
+ * Returns 0 on success, or -1 (leaving the record alone) if the old RG
+ * runs past the end of the record.
  */
-static void add_suffix(bam1_t *rec, char *suffix)
+static int rewriteRecord(bam1_t *rec, uint8_t *rg_aux, const char *newrg, size_t rg_len, const char *suffix)
 {
-    int oldqlen = strlen((char *)rec->data);
-    int newlen = rec->l_data + strlen(suffix) + 1;
+    size_t qlen = strlen(bam_get_qname(rec));
+    size_t name_shift = suffix ? strlen(suffix) + 1 : 0;
+    size_t rg_start, old_size = 0, new_size = 3 + rg_len;
+
+    if (rg_aux) {
+        int size = auxFieldSize(rg_aux - 2, rec->data + rec->l_data);
+        if (size < 0) return -1;
+        rg_start = rg_aux - 2 - rec->data;
+        old_size = size;
+    } else {
+        rg_start = rec->l_data;
+    }
+    size_t tail_start = rg_start + old_size, tail_len = rec->l_data - tail_start;
+    ptrdiff_t tail_shift = name_shift + new_size - old_size;
+    size_t l_data = rec->l_data + tail_shift;
 
-    if (newlen > rec->m_data) {
-        rec->m_data = newlen;
+    if (l_data > rec->m_data) {
+        rec->m_data = l_data;
         kroundup32(rec->m_data);
         rec->data = (uint8_t *)realloc(rec->data, rec->m_data);
+        if (!rec->data) die("Out of memory");
     }
-    memmove(rec->data + oldqlen + strlen(suffix) + 1,
-            rec->data + oldqlen,
-            rec->l_data - oldqlen);
-    rec->data[oldqlen] = '#';
-    memmove(rec->data + oldqlen + 1,
-            suffix,
-            strlen(suffix) + 1);
-    rec->l_data = newlen;
-    rec->core.l_qname += strlen(suffix) + 1;
+
+    // the fields after RG and the ones before it move by different amounts,
+    // so move first whichever goes furthest right
+    uint8_t *d = rec->data;
+    if (tail_shift >= 0) {
+        memmove(d + tail_start + tail_shift, d + tail_start, tail_len);
+        if (name_shift) memmove(d + qlen + name_shift, d + qlen, rg_start - qlen);
+    } else {
+        if (name_shift) memmove(d + qlen + name_shift, d + qlen, rg_start - qlen);
+        memmove(d + tail_start + tail_shift, d + tail_start, tail_len);
+    }
+
+    uint8_t *rg = d + rg_start + name_shift;
+    rg[0] = 'R'; rg[1] = 'G'; rg[2] = 'Z';
+    memcpy(rg + 3, newrg, rg_len);
+    if (suffix) {
+        d[qlen] = '#';
+        memcpy(d + qlen + 1, suffix, name_shift);
+        rec->core.l_qname += name_shift;
+    }
+    rec->l_data = l_data;
+    return 0;
 }
 
 /*
@@ -1021,11 +2304,12 @@ static void addNewRG(SAM_hdr *sh, char *entry, char *bcname, char *lib, char *sa
 
 /*
  * for each "@RG ID:x" in the header, replace with
- * "@RG IDx#barcode" for each barcode
+ * "@RG IDx#barcode" for each barcode, or only for barcode bc_index if
+ * it is not -1
  *
  * And don't forget to add a @PG header
  */ 
-static void changeHeader(va_t *barcodeArray, bam_hdr_t *h, char *argv_list)
+static void changeHeader(va_t *barcodeArray, bam_hdr_t *h, char *argv_list, int bc_index)
 {
     SAM_hdr *sh = sam_hdr_parse_(h->text, h->l_text);
     char **rgArray = malloc(sizeof(char*) * sh->nrg);
@@ -1068,13 +2352,16 @@ static void changeHeader(va_t *barcodeArray, bam_hdr_t *h, char *argv_list)
 
     // add the new RG lines
     for (n=0; n<nrg; n++) {
-        char *entry = strdup(rgArray[n]);
-        addNewRG(sh, entry, "0", NULL, NULL, NULL);
-        free(entry);
+        if (bc_index <= 0) {
+            char *entry = strdup(rgArray[n]);
+            addNewRG(sh, entry, "0", NULL, NULL, NULL);
+            free(entry);
+        }
 
         // for each tag in barcodeArray
         for (i=1; i < barcodeArray->end; i++) {
             bc_details_t *bcd = barcodeArray->entries[i];
+            if (bc_index >= 0 && i != bc_index) continue;
 
             char *entry = strdup(rgArray[n]);
             addNewRG(sh, entry, bcd->name, bcd->lib, bcd->sample, bcd->desc);
@@ -1094,12 +2381,73 @@ static void changeHeader(va_t *barcodeArray, bam_hdr_t *h, char *argv_list)
     sam_hdr_free(sh);
 }
 
+static void free_rg_table(rg_table_t *t)
+{
+    if (!t) return;
+    HashTableDestroy(t->rgs, 0);
+    free(t->values);
+    free(t->lens);
+    free(t->buf);
+    free(t);
+}
+
+/*
+ * Make the new RG value for each read group in the input header, and for
+ * records without an RG, with each barcode, so that processTemplate()
+ * doesn't have to build them for every record
+ */
+static rg_table_t *make_rg_table(va_t *barcodeArray, bam_hdr_t *h)
+{
+    SAM_hdr *sh = sam_hdr_parse_(h->text, h->l_text);
+    if (!sh) return NULL;
+
+    rg_table_t *t = calloc(1, sizeof(rg_table_t));
+    int nrows = sh->nrg + 1;
+    size_t buf_len = 0;
+    if (!t) die("Out of memory");
+    t->nbarcodes = barcodeArray->end;
+    t->rgs = HashTableCreate(0, HASH_DYNAMIC_SIZE | HASH_FUNC_JENKINS);
+    t->values = malloc(nrows * t->nbarcodes * sizeof(char *));
+    t->lens = malloc(nrows * t->nbarcodes * sizeof(size_t));
+    if (!t->rgs || !t->values || !t->lens) die("Out of memory");
+
+    for (int row = 0; row < nrows; row++) {
+        const char *rg = row ? sh->rg[row-1].name : "";
+        for (int n = 0; n < t->nbarcodes; n++) {
+            bc_details_t *bcd = barcodeArray->entries[n];
+            t->lens[row * t->nbarcodes + n] = strlen(rg) + strlen(bcd->name) + 2;
+            buf_len += t->lens[row * t->nbarcodes + n];
+        }
+    }
+    t->buf = malloc(buf_len);
+    if (!t->buf) die("Out of memory");
+
+    char *p = t->buf;
+    for (int row = 0; row < nrows; row++) {
+        const char *rg = row ? sh->rg[row-1].name : "";
+        if (row) {
+            HashData hd;
+            hd.i = row;
+            if (!HashTableAdd(t->rgs, (char *)rg, 0, hd, NULL)) die("Out of memory");
+        }
+        for (int n = 0; n < t->nbarcodes; n++) {
+            bc_details_t *bcd = barcodeArray->entries[n];
+            t->values[row * t->nbarcodes + n] = p;
+            p += sprintf(p, "%s#%s", rg, bcd->name) + 1;
+        }
+    }
+
+    sam_hdr_free(sh);
+    return t;
+}
+
 /*
- * Process one template
+ * Process one template, and set bc_index to the barcode it matched
+ * (0 if it didn't match, or had no barcode tag)
  */
-static int processTemplate(va_t *template, va_t *barcodeArray, HashTable *barcodeHash, HashTable *tagHopHash, decode_opts_t *opts)
+static int processTemplate(va_t *template, va_t *barcodeArray, HashTable *barcodeHash, HashTable *tagHopHash, decode_opts_t *opts, int *bc_index)
 {
-    char *name = NULL;
+    bc_details_t *bcd = NULL;
     char *bc_tag = NULL;
     char *qt_tag = NULL;
     char *newtag = NULL;
@@ -1108,11 +2456,18 @@ static int processTemplate(va_t *template, va_t *barcodeArray, HashTable *barcod
     char stack_bc_tag[STACK_BC_LEN];
     char stack_qt_tag[STACK_BC_LEN];
     char stack_newtag[STACK_BC_LEN];
+    aux_index_t stack_aux[8], *aux = stack_aux;
+
+    if (template->end > sizeof(stack_aux) / sizeof(stack_aux[0])) {
+        aux = malloc(template->end * sizeof(aux_index_t));
+        if (!aux) die("Out of memory");
+    }
 
     // look for barcode tag
     for (int n=0; n < template->end; n++) {
         bam1_t *rec = template->entries[n];
-        uint8_t *p = bam_aux_get(rec,opts->barcode_tag_name);
+        indexAux(rec, opts->barcode_tag_name, opts->quality_tag_name, &aux[n]);
+        uint8_t *p = aux[n].bc;
         if (p) {
             if (bc_tag) { // have we already found a tag?
                 if (strcmp(bc_tag,bam_aux2Z(p)) != 0) {
@@ -1120,6 +2475,7 @@ static int processTemplate(va_t *template, va_t *barcodeArray, HashTable *barcod
                                    bam_get_qname(rec), bc_tag, bam_aux2Z(p));
                     if (bc_tag != stack_bc_tag) free(bc_tag);
                     if (qt_tag != stack_qt_tag) free(qt_tag);
+                    if (aux != stack_aux) free(aux);
                     return -1;
                 }
             } else {
@@ -1132,7 +2488,7 @@ static int processTemplate(va_t *template, va_t *barcodeArray, HashTable *barcod
                     bc_tag = strdup(bc);
                     if (!bc_tag) die("Out of memory");
                 }
-                p = bam_aux_get(rec,opts->quality_tag_name);
+                p = aux[n].qt;
                 if (p) {
                     char *qt = bam_aux2Z(p);
                     size_t qt_len = strlen(qt);
@@ -1177,19 +2533,45 @@ static int processTemplate(va_t *template, va_t *barcodeArray, HashTable *barcod
         if (idx2 != stack_idx2) free(idx2);
     }
 
-    for (int n=0; n < template->end; n++) {
-        bam1_t *rec = template->entries[n];
+    if (opts->metrics_only) {
+        // just count the barcode
         if (newtag) {
-            char stack_newrg[256];
-            char *newrg = stack_newrg;
-            if (n==0) name = findBarcodeName(newtag,barcodeArray, barcodeHash, tagHopHash, opts,!(rec->core.flag & BAM_FQCFAIL), n==0);
-            makeNewTag(rec,"RG",name, &newrg, sizeof(stack_newrg));
-            bam_aux_update_str(rec,"RG",strlen(newrg)+1, newrg);
-            if (newrg != stack_newrg) free(newrg);
-            if (opts->change_read_name) add_suffix(rec, name);
+            bam1_t *rec = template->entries[0];
+            bcd = findBarcode(newtag, barcodeArray, barcodeHash, tagHopHash, opts->counters, opts, !(rec->core.flag & BAM_FQCFAIL), true);
+        }
+    } else {
+        for (int n=0; n < template->end; n++) {
+            bam1_t *rec = template->entries[n];
+            if (opts->qual_bin) qualbin_apply(bam_get_qual(rec), rec->core.l_qseq, opts->qual_map);
+            if (newtag) {
+                char stack_newrg[256];
+                char *newrg = stack_newrg;
+                if (n==0) bcd = findBarcode(newtag,barcodeArray, barcodeHash, tagHopHash, opts->counters, opts,!(rec->core.flag & BAM_FQCFAIL), n==0);
+                char *suffix = opts->change_read_name ? bcd->name : NULL;
+
+                // use the precomputed RG if the record's RG is in the header
+                HashItem *hi = NULL;
+                int r;
+                if (opts->rg_table && aux[n].rg && *aux[n].rg == 'Z') hi = HashTableSearch(opts->rg_table->rgs, bam_aux2Z(aux[n].rg), 0);
+                if (opts->rg_table && (hi || !aux[n].rg)) {
+                    int i = (hi ? hi->data.i : 0) * opts->rg_table->nbarcodes + bcd->index;
+                    r = rewriteRecord(rec, aux[n].rg, opts->rg_table->values[i], opts->rg_table->lens[i], suffix);
+                } else {
+                    makeNewTag(aux[n].rg, bcd->name, &newrg, sizeof(stack_newrg));
+                    r = rewriteRecord(rec, aux[n].rg, newrg, strlen(newrg) + 1, suffix);
+                    if (newrg != stack_newrg) free(newrg);
+                }
+                if (r < 0) {
+                    fprintf(stderr, "Record %s has a malformed RG tag\n", bam_get_qname(rec));
+                    error_code = -1;
+                    break;
+                }
+            }
         }
     }
 
+    *bc_index = bcd ? bcd->index : 0;
+    if (aux != stack_aux) free(aux);
     if (newtag != bc_tag && newtag != stack_newtag) free(newtag);
     if (qt_tag && qt_tag != stack_qt_tag) free(qt_tag);
     if (bc_tag && bc_tag != stack_bc_tag) free(bc_tag);
@@ -1212,41 +2594,219 @@ static va_t *loadTemplate(BAMit_t *bit, char *qname)
     return recordSet;
 }
 
-static int processTemplatesNoThreads(BAMit_t *bam_in, BAMit_t *bam_out, va_t *barcodeArray, HashTable *barcodeHash, HashTable *tagHopHash, decode_opts_t* opts)
+/*
+ * Have we sampled as many templates as --sample asked for?
+ */
+static inline bool sampleDone(decode_opts_t *opts)
 {
-    char qname[257] = {0};
+    return opts->sample_max && opts->nsampled >= opts->sample_max;
+}
 
-    while (BAMit_hasnext(bam_in)) {
-        bam1_t *rec = BAMit_peek(bam_in);
-        va_t *template;
-        memcpy(qname, bam_get_qname(rec), rec->core.l_qname);
-        template = loadTemplate(bam_in, qname);
-        if (processTemplate(template, barcodeArray, barcodeHash, tagHopHash, opts)) break;
-        for (int n = 0; n < template->end; n++) {
-            bam1_t *rec_n = template->entries[n];
-            int r = sam_write1(bam_out->f, bam_out->h, rec_n);
-            if (r < 0) {
-                fprintf(stderr, "Could not write sequence\n");
-                return -1;
-            }
+/*
+ * With --sample-fraction, choose templates by a hash of the read name, so
+ * the same templates are always chosen and they are spread over every tile.
+ * Skips the template and returns true if it isn't chosen.
+ */
+static bool skipUnsampled(BAMit_t *bam_in, const char *qname, decode_opts_t *opts)
+{
+    if (opts->sample_fraction) {
+        uint32_t h = hash(HASH_FUNC_JENKINS, (uint8_t *)qname, strlen(qname));
+        if (h >= opts->sample_fraction * 4294967296.0) {
+            while (BAMit_hasnext(bam_in) && strcmp(bam_get_qname(BAMit_peek(bam_in)),qname) == 0) BAMit_next(bam_in);
+            return true;
         }
-        va_free(template);
     }
-    return 0;
+    opts->nsampled++;
+    return false;
 }
 
-static void *decode_job(void *arg)
+/*
+ * Choose the ranges of the input to sample: with --sample-fraction, that
+ * fraction of the n ranges at offsets (see BAMit_split()), evenly spaced,
+ * otherwise all of them. Their start and end offsets go in opts->sample_ranges.
+ */
+static void selectSampleRanges(int64_t *offsets, int n, decode_opts_t *opts)
 {
-    decode_thread_data_t *job_data = (decode_thread_data_t *) arg;
-    va_t template = { 0, 0, NULL, NULL };
-    size_t start_rec = 0;
+    int count = n;
+    if (opts->sample_fraction) {
+        count = (int)(n * opts->sample_fraction + 0.5);
+        if (count < 1) count = 1;
+    }
+    opts->sample_ranges = malloc(2 * count * sizeof(int64_t));
+    if (!opts->sample_ranges) die("Out of memory");
+    for (int k = 0; k < count; k++) {
+        int i = (int)((2 * (int64_t)k + 1) * n / (2 * count));
+        opts->sample_ranges[2*k] = offsets[i];
+        opts->sample_ranges[2*k+1] = i + 1 < n ? offsets[i+1] : 0;
+    }
+    opts->nsample_ranges = count;
+    opts->sample_range = -1;
+}
 
-    job_data->result = -1;
+/*
+ * Plan where to take the sample from. A BAM file is split into ranges so
+ * that the sample is spread through it, rather than taken from the first
+ * tiles, and so that --sample-fraction only reads that much of it. Other
+ * inputs are read from the start.
+ */
+static void planSample(decode_opts_t *opts)
+{
+    struct stat st;
+    int64_t *offsets = NULL;
+    int n = -1;
+
+    if (!isSampling(opts)) return;
+    if (stat(opts->input_name, &st) == 0 && S_ISREG(st.st_mode)) {
+        int64_t nranges = SAMPLE_RANGES;
+        if (opts->sample_max && opts->sample_max < SAMPLE_RANGES) nranges = opts->sample_max;
+        n = BAMit_split(opts->input_name, st.st_size / nranges, &offsets);
+    }
+    if (n < 0) {
+        if (opts->sample_max) fprintf(stderr, "WARNING: %s can't be split into ranges, so the sample is taken from the start of it\n", opts->input_name);
+        if (opts->sample_fraction) fprintf(stderr, "WARNING: %s can't be split into ranges, so all of it is read to take the sample\n", opts->input_name);
+    } else {
+        selectSampleRanges(offsets, n, opts);
+        if (opts->verbose) fprintf(stderr, "Sampling %d of %d ranges of %s\n", opts->nsample_ranges, n, opts->input_name);
+    }
+    free(offsets);
+}
+
+/*
+ * How many templates should have been sampled by the end of the current range.
+ * --sample is shared equally between the ranges, and a range which is short
+ * of templates leaves its share to the next one.
+ */
+static uint64_t sampleTarget(decode_opts_t *opts)
+{
+    uint64_t n = opts->nsample_ranges, k = opts->sample_range + 1;
+    if (!opts->sample_max) return UINT64_MAX;
+    if (k == n) return opts->sample_max;
+    return opts->sample_max / n * k + opts->sample_max % n * k / n;
+}
+
+/*
+ * Move to the next template to be processed, and copy its name to qname.
+ * Returns false at the end of the input or of the sample.
+ */
+static bool nextTemplate(BAMit_t *bam_in, char *qname, decode_opts_t *opts)
+{
+    while (!sampleDone(opts)) {
+        if (opts->sample_ranges &&
+            (opts->sample_range < 0 || !BAMit_hasnext(bam_in) || opts->nsampled >= sampleTarget(opts))) {
+            if (++opts->sample_range == opts->nsample_ranges) return false;
+            int64_t *range = opts->sample_ranges + 2 * opts->sample_range;
+            if (BAMit_seek_range(bam_in, range[0], range[1]) < 0) {
+                die("Couldn't read %s from offset %"PRId64"\n", opts->input_name, range[0]);
+            }
+            continue;
+        }
+        if (!BAMit_hasnext(bam_in)) return false;
+        bam1_t *rec = BAMit_peek(bam_in);
+        memcpy(qname, bam_get_qname(rec), rec->core.l_qname);
+        if (opts->sample_ranges) {
+            opts->nsampled++;
+            return true;
+        }
+        if (!skipUnsampled(bam_in, qname, opts)) return true;
+    }
+    return false;
+}
+
+/*
+ * The output file for a template which matched barcode bc_index
+ */
+static inline BAMit_t *template_output(BAMit_t **bam_out, int bc_index, decode_opts_t *opts)
+{
+    if (opts->metrics_only) return NULL;
+    return bam_out[opts->output_per_barcode ? bc_index : 0];
+}
+
+static int processTemplatesNoThreads(BAMit_t *bam_in, BAMit_t **bam_out, va_t *barcodeArray, HashTable *barcodeHash, HashTable *tagHopHash, decode_opts_t* opts)
+{
+    char qname[257] = {0};
+
+    while (nextTemplate(bam_in, qname, opts)) {
+        va_t *template;
+        int bc_index;
+        template = loadTemplate(bam_in, qname);
+        if (processTemplate(template, barcodeArray, barcodeHash, tagHopHash, opts, &bc_index)) break;
+        BAMit_t *out = template_output(bam_out, bc_index, opts);
+        for (int n = 0; out && n < template->end; n++) {
+            bam1_t *rec_n = template->entries[n];
+            int r = sam_write1(out->f, out->h, rec_n);
+            if (r < 0) {
+                fprintf(stderr, "Could not write sequence\n");
+                return -1;
+            }
+        }
+        va_free(template);
+    }
+    return 0;
+}
+
+/*
+ * Add the next template from bam_in to a job
+ */
+static void add_template(decode_thread_data_t *job_data, BAMit_t *bam_in, const char *qname)
+{
+    int rec_count = 0;
+    while (BAMit_hasnext(bam_in) && strcmp(bam_get_qname(BAMit_peek(bam_in)),qname) == 0) {
+        if (job_data->nrec < job_data->record_set->end) {
+            bam_copy1(job_data->record_set->entries[job_data->nrec], BAMit_next(bam_in));
+        } else {
+            bam1_t *rec = bam_init1();
+            if (!rec) { die("Out of memory"); }
+            bam_copy1(rec, BAMit_next(bam_in));
+            va_push(job_data->record_set, rec);
+        }
+        job_data->nrec++;
+        rec_count++;
+    }
+    ia_push(job_data->template_counts, rec_count);
+}
+
+/*
+ * Read the templates in the job's range of the input file (--split-input)
+ */
+static int load_range(decode_thread_data_t *job_data)
+{
+    decode_opts_t *opts = job_data->opts;
+    char qname[257] = { 0 };
+
+    if (!job_data->bam_in) {
+        job_data->bam_in = BAMit_open(opts->input_name, 'r', opts->input_fmt, 0, NULL, 0);
+    }
+    if (BAMit_seek_range(job_data->bam_in, job_data->range_start, job_data->range_end) < 0) {
+        fprintf(stderr, "Couldn't read %s from offset %"PRId64"\n", opts->input_name, job_data->range_start);
+        return -1;
+    }
+    job_data->nrec = 0;
+    job_data->template_counts->end = 0;
+    while (BAMit_hasnext(job_data->bam_in)) {
+        bam1_t *rec = BAMit_peek(job_data->bam_in);
+        memcpy(qname, bam_get_qname(rec), rec->core.l_qname);
+        add_template(job_data, job_data->bam_in, qname);
+    }
+    return 0;
+}
+
+static void *decode_job(void *arg)
+{
+    decode_thread_data_t *job_data = (decode_thread_data_t *) arg;
+    va_t template = { 0, 0, NULL, NULL };
+    size_t start_rec = 0;
+
+    numautil_bind(job_data->node);
+    job_data->result = -1;
+    if (job_data->range_start >= 0 && load_range(job_data) < 0) goto fail;
+    job_data->template_barcodes->end = 0;
     for (int i = 0; i < job_data->template_counts->end; i++) {
+        int bc_index;
         template.end = template.max = job_data->template_counts->entries[i];
         template.entries = &job_data->record_set->entries[start_rec];
         start_rec += template.end;
-        if (processTemplate(&template, job_data->barcode_array, job_data->barcodeHash, job_data->tagHopHash, job_data->opts)) goto fail;
+        if (processTemplate(&template, job_data->barcode_array, job_data->barcodeHash, job_data->tagHopHash, job_data->opts, &bc_index)) goto fail;
+        ia_push(job_data->template_barcodes, bc_index);
     }
     assert(start_rec == job_data->nrec);
 
@@ -1255,41 +2815,34 @@ static void *decode_job(void *arg)
     return job_data;
 }
 
-static void output_job_results(BAMit_t *bam_out, decode_thread_data_t *job_data)
+static void output_job_results(BAMit_t **bam_out, decode_thread_data_t *job_data)
 {
+    int i = 0;
+
     if (job_data->result != 0) {
         die("Processing job failed to return a result\n");
     }
+    if (job_data->opts->metrics_only) return;
 
     // Write out result records
-    for (int i = 0; i < job_data->nrec; i++) {
-        bam1_t *rec = job_data->record_set->entries[i];
-        int r = sam_write1(bam_out->f, bam_out->h, rec);
-        if (r < 0) {
-            die("Could not write sequence\n");
+    for (int t = 0; t < job_data->template_counts->end; t++) {
+        BAMit_t *out = template_output(bam_out, job_data->template_barcodes->entries[t], job_data->opts);
+        for (int end = i + job_data->template_counts->entries[t]; i < end; i++) {
+            bam1_t *rec = job_data->record_set->entries[i];
+            int r = sam_write1(out->f, out->h, rec);
+            if (r < 0) {
+                die("Could not write sequence\n");
+            }
         }
     }
 }
 
-void accumulate_job_metrics(va_t *job_barcodes, HashTable *job_tag_hops, va_t *barcodeArray, HashTable *tagHopHash)
+void accumulate_tag_hops(HashTable *job_tag_hops, HashTable *tagHopHash)
 {
-    // Accumulate metrics
     HashIter *iter = HashTableIterCreate();
     if (!iter) die("Out of memory");
     HashItem *hi;
 
-    for (int i = 0; i < barcodeArray->end; i++) {
-        bc_details_t *bc = barcodeArray->entries[i];
-        bc_details_t *job_bc = job_barcodes->entries[i];
-        bc->reads           += job_bc->reads;
-        bc->pf_reads        += job_bc->pf_reads;
-        bc->perfect         += job_bc->perfect;
-        bc->pf_perfect      += job_bc->pf_perfect;
-        bc->one_mismatch    += job_bc->one_mismatch;
-        bc->pf_one_mismatch += job_bc->pf_one_mismatch;
-    }
-
-    // Accumulate tag hops
     while ((hi = HashTableIterNext(job_tag_hops, iter)) != NULL) {
         int added = -1;
         HashItem *hi2 = HashTableAdd(tagHopHash, hi->key, hi->key_len, hi->data, &added);
@@ -1329,6 +2882,11 @@ va_t *copy_barcode_array(va_t *barcode_array)
         barcodes[i].lib    = bc->lib;
         barcodes[i].sample = bc->sample;
         barcodes[i].desc   = bc->desc;
+        barcodes[i].pseq   = bc->pseq;
+        barcodes[i].pidx1  = bc->pidx1;
+        barcodes[i].pidx2  = bc->pidx2;
+        barcodes[i].index  = bc->index;
+        barcodes[i].unmatched = bc->unmatched ? unmatched_init(bc->unmatched->size) : NULL;
         va_push(copy, &barcodes[i]);
     }
     return copy;
@@ -1336,6 +2894,9 @@ va_t *copy_barcode_array(va_t *barcode_array)
 
 void delete_barcode_array_copy(va_t *barcode_array)
 {
+    for (int i = 0; i < barcode_array->end; i++) {
+        unmatched_free(((bc_details_t *)barcode_array->entries[i])->unmatched);
+    }
     if (barcode_array->end > 0) free(barcode_array->entries[0]);
     va_free(barcode_array);
 }
@@ -1344,8 +2905,9 @@ static void job_free(decode_thread_data_t *job_data)
 {
     va_free(job_data->record_set);
     ia_free(job_data->template_counts);
-    delete_barcode_array_copy(job_data->barcode_array);
+    ia_free(job_data->template_barcodes);
     HashTableDestroy(job_data->tagHopHash, 0);
+    BAMit_free(job_data->bam_in);
     free(job_data);
 }
 
@@ -1354,77 +2916,100 @@ static decode_thread_data_t *init_job(va_t *barcode_array, HashTable *barcodeHas
     decode_thread_data_t *job_data = calloc(1, sizeof(*job_data));
     if (!job_data) die("Out of memory\n");
 
-    job_data->barcode_array = copy_barcode_array(barcode_array);
-    job_data->barcodes = job_data->barcode_array->end > 0 ? job_data->barcode_array->entries[0] : NULL;
+    job_data->barcode_array = barcode_array;
     job_data->tagHopHash = HashTableCreate(0, HASH_DYNAMIC_SIZE | HASH_FUNC_JENKINS);
-    if (!job_data->tagHopHash) die("Out of memory");
+    job_data->template_barcodes = ia_init(TEMPLATES_PER_JOB);
+    if (!job_data->tagHopHash || !job_data->template_barcodes) die("Out of memory");
     job_data->barcodeHash = barcodeHash;
     job_data->opts = opts;
     job_data->result = -1;
+    job_data->range_start = -1;
     job_data->next = NULL;
 
     return job_data;
 }
 
-static int processTemplatesThreads(hts_tpool *pool, BAMit_t *bam_in, BAMit_t *bam_out, va_t *barcodeArray, HashTable *barcodeHash, HashTable *tagHopHash, decode_opts_t* opts)
+/*
+ * Get the oldest outstanding job. Jobs are dispatched round-robin to the
+ * queues, so collecting them in the same order keeps the output in order.
+ * Returns NULL if wait is false and the job has not finished.
+ */
+static decode_thread_data_t *collect_job(hts_tpool_process **queues, int nqueues, uint64_t *collected, bool wait)
+{
+    hts_tpool_process *queue = queues[*collected % nqueues];
+    hts_tpool_result *job_result = wait ? hts_tpool_next_result_wait(queue) : hts_tpool_next_result(queue);
+    if (!job_result) {
+        if (wait) die("Failed to get processing job result");
+        return NULL;
+    }
+    decode_thread_data_t *finished_job = hts_tpool_result_data(job_result);
+    hts_tpool_delete_result(job_result, 0);
+    (*collected)++;
+    return finished_job;
+}
+
+static int processTemplatesThreads(hts_tpool **pools, int npools, BAMit_t *bam_in, BAMit_t **bam_out, va_t *barcodeArray, HashTable *barcodeHash, HashTable *tagHopHash, decode_opts_t* opts)
 {
-    hts_tpool_result *job_result = NULL;
-    hts_tpool_process *queue = hts_tpool_process_init(pool, 2 * opts->nthreads, 0);
+    hts_tpool_process **queues = calloc(npools, sizeof(hts_tpool_process *));
     decode_thread_data_t *job_freelist = NULL;
     decode_thread_data_t *job_data = init_job(barcodeArray, barcodeHash, opts);
+    decode_thread_data_t *finished_job;
+    uint64_t dispatched = 0, collected = 0;
     char qname[257] = { 0 };
-
-    if (!queue) {
-        perror("hts_tpool_process_init");
-        return -1;
+    int64_t *ranges = NULL;
+    int nranges = 0, next_range = 0;
+
+    if (!queues) die("Out of memory");
+    if (opts->split_input) {
+        nranges = BAMit_split(opts->input_name, RANGE_SIZE, &ranges);
+        if (nranges < 0) {
+            fprintf(stderr, "WARNING: %s can't be split into ranges, so it is read in one stream\n", opts->input_name);
+            opts->split_input = false;
+        } else if (opts->verbose) {
+            fprintf(stderr, "Reading %s in %d ranges\n", opts->input_name, nranges);
+        }
+    }
+    opts->counters = counter_set_init(barcodeArray);
+    for (int i = 0; i < npools; i++) {
+        queues[i] = hts_tpool_process_init(pools[i], 2 * opts->nthreads / npools, 0);
+        if (!queues[i]) {
+            perror("hts_tpool_process_init");
+            return -1;
+        }
     }
 
     job_data->record_set = va_init(TEMPLATES_PER_JOB * 2, freeRecord);
     job_data->template_counts = ia_init(TEMPLATES_PER_JOB);
     job_data->nrec = 0;
 
-    while (BAMit_hasnext(bam_in)) {
-        bam1_t *rec = BAMit_peek(bam_in);
-        int rec_count = 0;
-        memcpy(qname, bam_get_qname(rec), rec->core.l_qname);
-        while (BAMit_hasnext(bam_in) && strcmp(bam_get_qname(BAMit_peek(bam_in)),qname) == 0) {
-            if (job_data->nrec < job_data->record_set->end) {
-                bam_copy1(job_data->record_set->entries[job_data->nrec], BAMit_next(bam_in));
-            } else {
-                bam1_t *rec = bam_init1();
-                if (!rec) { die("Out of memory"); }
-                bam_copy1(rec, BAMit_next(bam_in));
-                va_push(job_data->record_set, rec);
-            }
-            job_data->nrec++;
-            rec_count++;
+    while (1) {
+        if (opts->split_input) {
+            // each job reads its own range of the input; they are still collected in order
+            if (next_range == nranges) break;
+            job_data->range_start = ranges[next_range++];
+            job_data->range_end = next_range < nranges ? ranges[next_range] : 0;
+        } else {
+            if (!nextTemplate(bam_in, qname, opts)) break;
+            add_template(job_data, bam_in, qname);
         }
-        ia_push(job_data->template_counts, rec_count);
 
-        if (job_data->template_counts->end == TEMPLATES_PER_JOB) {
+        if (job_data->range_start >= 0 || job_data->template_counts->end == TEMPLATES_PER_JOB) {
             while (job_data != NULL) {
-                int blk = hts_tpool_dispatch2(pool, queue, decode_job, job_data, 1);
+                int i = dispatched % npools;
+                job_data->node = npools > 1 ? i : -1;
+                int blk = hts_tpool_dispatch2(pools[i], queues[i], decode_job, job_data, 1);
                 if (!blk) {
                     job_data = NULL;
+                    dispatched++;
                 } else if (errno != EAGAIN) {
                     die("Thread pool dispatch failed");
                 }
 
-                if (blk) {
-                    job_result = hts_tpool_next_result_wait(queue);
-                    if (!job_result) {
-                        die("Failed to get processing job result");
-                    }
-                } else {
-                    job_result = hts_tpool_next_result(queue);
-                }
-
-                if (job_result != NULL) {
-                    decode_thread_data_t *finished_job = hts_tpool_result_data(job_result);
+                finished_job = collect_job(queues, npools, &collected, blk);
+                if (finished_job != NULL) {
                     output_job_results(bam_out, finished_job);
                     finished_job->next = job_freelist;
                     job_freelist = finished_job;
-                    hts_tpool_delete_result(job_result, 0);
                 }
             }
 
@@ -1432,6 +3017,7 @@ static int processTemplatesThreads(hts_tpool *pool, BAMit_t *bam_in, BAMit_t *ba
                 job_data = job_freelist;
                 job_freelist = job_data->next;
                 job_data->template_counts->end = 0;
+                job_data->range_start = -1;
             }  else {
                 job_data = init_job(barcodeArray, barcodeHash, opts);
                 job_data->record_set = va_init(TEMPLATES_PER_JOB * 2, freeRecord);
@@ -1443,35 +3029,37 @@ static int processTemplatesThreads(hts_tpool *pool, BAMit_t *bam_in, BAMit_t *ba
 
     if (job_data->template_counts->end > 0) {
         // Deal with left-over items
-        if (hts_tpool_dispatch(pool, queue, decode_job, job_data) < 0) {
+        int i = dispatched % npools;
+        job_data->node = npools > 1 ? i : -1;
+        if (hts_tpool_dispatch(pools[i], queues[i], decode_job, job_data) < 0) {
             die("Thread pool dispatch failed");
         }
+        dispatched++;
     } else {
         // Not used, put back on free list
         job_data->next = job_freelist;
         job_freelist = job_data;
     }
 
-    while (!hts_tpool_process_empty(queue)) {
-        job_result = hts_tpool_next_result_wait(queue);
-        if (!job_result) {
-            die("Failed to get processing job result");
-        }
-        decode_thread_data_t *finished_job = hts_tpool_result_data(job_result);
+    while (collected < dispatched) {
+        finished_job = collect_job(queues, npools, &collected, true);
         output_job_results(bam_out, finished_job);
         finished_job->next = job_freelist;
         job_freelist = finished_job;
-        hts_tpool_delete_result(job_result, 0);
     }
 
     while (job_freelist != NULL) {
         decode_thread_data_t *next = job_freelist->next;
-        accumulate_job_metrics(job_freelist->barcode_array, job_freelist->tagHopHash, barcodeArray, tagHopHash);
+        accumulate_tag_hops(job_freelist->tagHopHash, tagHopHash);
         job_free(job_freelist);
         job_freelist = next;
     }
+    counter_set_merge(opts->counters, barcodeArray);
+    opts->counters = NULL;
 
-    hts_tpool_process_destroy(queue);
+    for (int i = 0; i < npools; i++) hts_tpool_process_destroy(queues[i]);
+    free(queues);
+    free(ranges);
 
     return 0;
 }
@@ -1494,6 +3082,557 @@ HashTable *make_barcode_hash(va_t *barcodeArray)
     return barcodeHash;
 }
 
+/*
+ * Add one sequence from the neighbourhood of barcode idx, which has nm
+ * mismatches against it. Barcodes are added in order, so this keeps the
+ * best and second best matches exactly as findBestMatch() would find them.
+ */
+static void nbhdAdd(barcode_nbhd_t *nbhd, char *seq, int idx, int nm, int d2_init, int min_delta)
+{
+    HashItem *hi = HashTableSearch(nbhd->hash, seq, nbhd->len);
+    uint32_t d1, d2;
+
+    if (!hi) {
+        HashData hd;
+        char *key = nbhd->keys + nbhd->nkeys++ * (nbhd->len + 1);
+        memcpy(key, seq, nbhd->len + 1);
+        hd.i = 0;
+        hi = HashTableAdd(nbhd->hash, key, nbhd->len, hd, NULL);
+        if (!hi) die("Out of memory");
+        hi->data.i32[0] = idx;
+        d1 = nm; d2 = d2_init;
+    } else {
+        uint32_t x = hi->data.i32[1];
+        d1 = NBHD_D1(x); d2 = NBHD_D2(x);
+        if (nm < d1) {
+            d2 = d1; d1 = nm;
+            hi->data.i32[0] = idx;
+        } else if (nm < d2) {
+            d2 = nm;
+        }
+    }
+    hi->data.i32[1] = d1 | (d2 << 8) | ((int)(d2 - d1) < min_delta ? NBHD_AMBIGUOUS : 0);
+}
+
+/*
+ * Enumerate the neighbourhood of barcode bc from position pos onwards,
+ * having made nm substitutions and nN no-calls so far.
+ */
+static void nbhdEnumerate(barcode_nbhd_t *nbhd, const char *bc, char *seq, int pos, int nm, int nN,
+                          int idx, int d2_init, int min_delta)
+{
+    if (pos == nbhd->len) {
+        nbhdAdd(nbhd, seq, idx, nm, d2_init, min_delta);
+        return;
+    }
+
+    nbhdEnumerate(nbhd, bc, seq, pos+1, nm, nN, idx, d2_init, min_delta);
+    if (nm < nbhd->radius) {
+        for (char *a = nbhd->alpha + pos * (NBHD_ALPHA_MAX+1); *a; a++) {
+            if (*a == bc[pos]) continue;
+            seq[pos] = *a;
+            nbhdEnumerate(nbhd, bc, seq, pos+1, nm+1, nN, idx, d2_init, min_delta);
+        }
+    }
+    // an N in the read never counts as a mismatch
+    if (nN < nbhd->max_n && bc[pos] != 'N') {
+        seq[pos] = 'N';
+        nbhdEnumerate(nbhd, bc, seq, pos+1, nm, nN+1, idx, d2_init, min_delta);
+    }
+    seq[pos] = bc[pos];
+}
+
+/*
+ * Number of sequences in the neighbourhood of one barcode
+ */
+static double nbhdSize(int len, int radius, int alpha, int max_n)
+{
+    double total = 0;
+    double c_k = 1;     // len choose k
+    double subs = 1;    // (alpha-1)^k
+    for (int k = 0; k <= radius && k <= len; k++) {
+        double n_sum = 0, c_j = 1;
+        for (int j = 0; j <= max_n && j <= len - k; j++) {
+            n_sum += c_j;
+            c_j = c_j * (len - k - j) / (j + 1);
+        }
+        total += c_k * subs * n_sum;
+        c_k = c_k * (len - k) / (k + 1);
+        subs *= alpha - 1;
+    }
+    return total;
+}
+
+static void free_barcode_nbhd(barcode_nbhd_t *nbhd)
+{
+    if (!nbhd) return;
+    if (nbhd->hash) HashTableDestroy(nbhd->hash, 0);
+    if (nbhd->map) munmap(nbhd->map, nbhd->map_len);
+    else free(nbhd->keys);
+    free(nbhd->alpha);
+    free(nbhd);
+}
+
+/*
+ * Precompute the result of findBestMatch() for every sequence within
+ * max_mismatches of a barcode, including those with up to max_no_calls Ns,
+ * so that most reads are decoded with one hash lookup.
+ *
+ * Sequences are enumerated to max_mismatches + min_mismatch_delta - 1
+ * mismatches, so that the second best match is known whenever it could
+ * make the best one ambiguous. If that would make the hash too big, fewer
+ * Ns are allowed, and reads with more fall back to the linear search.
+ */
+static void make_barcode_neighbourhood(va_t *barcodeArray, decode_opts_t *opts)
+{
+    free_barcode_nbhd(opts->nbhd);
+    opts->nbhd = NULL;
+
+    int nbarcodes = barcodeArray->end - 1;
+    int delta = opts->min_mismatch_delta > 1 ? opts->min_mismatch_delta : 1;
+    int radius = opts->max_mismatches + delta - 1;
+    int bcLen = opts->idx1_len + opts->idx2_len + 1;
+    int len, alpha_max = 0;
+
+    if (nbarcodes < 1 || opts->max_mismatches < 0) return;
+    len = strlen(((bc_details_t *)barcodeArray->entries[1])->seq);
+    if (len == 0 || len > 255 || radius > 255) return;
+
+    barcode_nbhd_t *nbhd = calloc(1, sizeof(barcode_nbhd_t));
+    if (!nbhd) die("Out of memory");
+    nbhd->len = len;
+    nbhd->radius = radius;
+    nbhd->alpha = calloc(len, NBHD_ALPHA_MAX+1);
+    if (!nbhd->alpha) die("Out of memory");
+
+    // the characters which can appear at each position
+    for (int i = 0; i < len; i++) {
+        strcpy(nbhd->alpha + i * (NBHD_ALPHA_MAX+1), "ACGT");
+    }
+    for (int n = 1; n < barcodeArray->end; n++) {
+        bc_details_t *bcd = barcodeArray->entries[n];
+        if (strlen(bcd->seq) != len) { free_barcode_nbhd(nbhd); return; }
+        for (int i = 0; i < len; i++) {
+            char *a = nbhd->alpha + i * (NBHD_ALPHA_MAX+1);
+            if (bcd->seq[i] == 'N' || strchr(a, bcd->seq[i])) continue;
+            if (strlen(a) == NBHD_ALPHA_MAX) { free_barcode_nbhd(nbhd); return; }
+            a[strlen(a)] = bcd->seq[i];
+        }
+    }
+    for (int i = 0; i < len; i++) {
+        int a = strlen(nbhd->alpha + i * (NBHD_ALPHA_MAX+1));
+        if (a > alpha_max) alpha_max = a;
+    }
+
+    // allow as many Ns as the size limit permits
+    double size = 0;
+    for (nbhd->max_n = opts->max_no_calls < len ? opts->max_no_calls : len; nbhd->max_n >= 0; nbhd->max_n--) {
+        size = nbarcodes * nbhdSize(len, radius, alpha_max, nbhd->max_n);
+        if (size <= NBHD_MAX_KEYS) break;
+    }
+    if (nbhd->max_n < 0) {
+        if (opts->verbose) fprintf(stderr, "Barcode neighbourhood is too big, using linear search\n");
+        free_barcode_nbhd(nbhd);
+        return;
+    }
+
+    nbhd->keys = malloc(((size_t)size + 1) * (len + 1));
+    nbhd->hash = HashTableCreate((int)size, HASH_DYNAMIC_SIZE | HASH_FUNC_JENKINS | HASH_NONVOLATILE_KEYS);
+    if (!nbhd->keys || !nbhd->hash) die("Out of memory");
+
+    // without another barcode within the radius, the second best is at least radius+1 away
+    int d2_init = radius + 1 < bcLen ? radius + 1 : bcLen;
+    char *seq = malloc(len + 1);
+    if (!seq) die("Out of memory");
+    for (int n = 1; n < barcodeArray->end; n++) {
+        bc_details_t *bcd = barcodeArray->entries[n];
+        memcpy(seq, bcd->seq, len + 1);
+        nbhdEnumerate(nbhd, bcd->seq, seq, 0, 0, 0, n, d2_init, opts->min_mismatch_delta);
+    }
+    free(seq);
+
+    if (opts->verbose) {
+        fprintf(stderr, "Barcode neighbourhood: %zu sequences, up to %d mismatches and %d Ns\n",
+                nbhd->nkeys, radius, nbhd->max_n);
+    }
+    opts->nbhd = nbhd;
+}
+
+/*
+ * Checksum of the barcode sequences, in order, which identifies the
+ * barcode set a saved neighbourhood was built from
+ */
+static uint64_t barcode_set_checksum(va_t *barcodeArray)
+{
+    uint64_t checksum = barcodeArray->end;
+    for (int n = 1; n < barcodeArray->end; n++) {
+        bc_details_t *bcd = barcodeArray->entries[n];
+        checksum = checksum * 1000003 ^ hash64(HASH_FUNC_JENKINS, (uint8_t *)bcd->seq, strlen(bcd->seq));
+    }
+    return checksum;
+}
+
+/*
+ * Write the neighbourhood to a file which can be loaded by load_barcode_nbhd()
+ * Returns 0 on success, -1 on failure.
+ */
+static int save_barcode_nbhd(barcode_nbhd_t *nbhd, uint64_t checksum, decode_opts_t *opts, const char *fname)
+{
+    nbhd_file_header_t hdr;
+    uint64_t nslots = 2;
+    while (nslots < 2 * nbhd->nkeys) nslots *= 2;
+    uint32_t *slots = calloc(nslots, sizeof(uint32_t));
+    if (!slots) die("Out of memory");
+    FILE *f = fopen(fname, "wb");
+    if (!f) { free(slots); return -1; }
+
+    memset(&hdr, 0, sizeof(hdr));
+    memcpy(hdr.magic, NBHD_FILE_MAGIC, 4);
+    hdr.version = NBHD_FILE_VERSION;
+    hdr.checksum = checksum;
+    hdr.max_mismatches = opts->max_mismatches;
+    hdr.min_mismatch_delta = opts->min_mismatch_delta;
+    hdr.max_no_calls = opts->max_no_calls;
+    hdr.len = nbhd->len;
+    hdr.radius = nbhd->radius;
+    hdr.max_n = nbhd->max_n;
+    hdr.nkeys = nbhd->nkeys;
+    hdr.nslots = nslots;
+    fwrite(&hdr, sizeof(hdr), 1, f);
+    for (size_t k = 0; k < nbhd->nkeys; k++) {
+        char *key = nbhd->keys + k * (nbhd->len + 1);
+        uint32_t *data = nbhdLookup(nbhd, key);
+        assert(data);
+        fwrite(data, sizeof(uint32_t), 2, f);
+        uint64_t h = hash64(HASH_FUNC_JENKINS, (uint8_t *)key, nbhd->len) & (nslots - 1);
+        while (slots[h]) h = (h + 1) & (nslots - 1);
+        slots[h] = k + 1;
+    }
+    fwrite(slots, sizeof(uint32_t), nslots, f);
+    free(slots);
+    fwrite(nbhd->alpha, NBHD_ALPHA_MAX+1, nbhd->len, f);
+    fwrite(nbhd->keys, nbhd->len + 1, nbhd->nkeys, f);
+
+    if (ferror(f)) { fclose(f); return -1; }
+    return fclose(f) == 0 ? 0 : -1;
+}
+
+/*
+ * Map a neighbourhood saved by save_barcode_nbhd(). It is searched in place,
+ * so nothing has to be built.
+ * Returns NULL, with a warning, if the file can't be read or was saved
+ * for a different barcode set or options.
+ */
+static barcode_nbhd_t *load_barcode_nbhd(const char *fname, uint64_t checksum, decode_opts_t *opts)
+{
+    struct stat st;
+    nbhd_file_header_t *hdr;
+    int fd = open(fname, O_RDONLY);
+    if (fd < 0) {
+        fprintf(stderr, "WARNING: Can't open barcode index %s: %s\n", fname, strerror(errno));
+        return NULL;
+    }
+    if (fstat(fd, &st) < 0 || st.st_size < sizeof(*hdr)) {
+        fprintf(stderr, "WARNING: %s is not a barcode index\n", fname);
+        close(fd);
+        return NULL;
+    }
+    void *map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        fprintf(stderr, "WARNING: Can't map barcode index %s: %s\n", fname, strerror(errno));
+        return NULL;
+    }
+
+    // the counts are bounded by the file size first, so the sizes can't overflow
+    hdr = map;
+    bool valid = memcmp(hdr->magic, NBHD_FILE_MAGIC, 4) == 0 && hdr->version == NBHD_FILE_VERSION
+        && hdr->len >= 1 && hdr->len <= 255
+        && hdr->nkeys <= st.st_size / (2 * sizeof(uint32_t) + hdr->len + 1)
+        && hdr->nslots <= st.st_size / sizeof(uint32_t)
+        && hdr->nslots >= 2 && hdr->nslots >= 2 * hdr->nkeys && !(hdr->nslots & (hdr->nslots - 1))
+        && st.st_size == sizeof(*hdr) + hdr->nkeys * (2 * sizeof(uint32_t) + hdr->len + 1)
+                                      + hdr->nslots * sizeof(uint32_t)
+                                      + hdr->len * (NBHD_ALPHA_MAX+1);
+    if (valid) {
+        // the alphabets are searched with strchr(), so must be terminated
+        char *alpha = (char *)((uint32_t *)(hdr + 1) + 2 * hdr->nkeys + hdr->nslots);
+        for (int i = 0; i < hdr->len; i++) {
+            if (alpha[i * (NBHD_ALPHA_MAX+1) + NBHD_ALPHA_MAX]) valid = false;
+        }
+    }
+    if (!valid) {
+        fprintf(stderr, "WARNING: %s is not a barcode index\n", fname);
+        munmap(map, st.st_size);
+        return NULL;
+    }
+    if (hdr->checksum != checksum
+        || hdr->max_mismatches != opts->max_mismatches
+        || hdr->min_mismatch_delta != opts->min_mismatch_delta
+        || hdr->max_no_calls != opts->max_no_calls) {
+        fprintf(stderr, "WARNING: barcode index %s was made for different barcodes or options, rebuilding it\n", fname);
+        munmap(map, st.st_size);
+        return NULL;
+    }
+
+    barcode_nbhd_t *nbhd = calloc(1, sizeof(barcode_nbhd_t));
+    if (!nbhd) die("Out of memory");
+    char *alpha;
+    nbhd->map = map;
+    nbhd->map_len = st.st_size;
+    nbhd->len = hdr->len;
+    nbhd->radius = hdr->radius;
+    nbhd->max_n = hdr->max_n;
+    nbhd->nkeys = hdr->nkeys;
+    nbhd->data = (uint32_t *)(hdr + 1);
+    nbhd->slots = nbhd->data + 2 * hdr->nkeys;
+    nbhd->slot_mask = hdr->nslots - 1;
+    alpha = (char *)(nbhd->slots + hdr->nslots);
+    nbhd->keys = alpha + hdr->len * (NBHD_ALPHA_MAX+1);
+    nbhd->alpha = malloc(hdr->len * (NBHD_ALPHA_MAX+1));
+    if (!nbhd->alpha) die("Out of memory");
+    memcpy(nbhd->alpha, alpha, hdr->len * (NBHD_ALPHA_MAX+1));
+    return nbhd;
+}
+
+static void free_barcode_seeds(barcode_seeds_t *seeds)
+{
+    if (!seeds) return;
+    for (int s = 0; seeds->hash && s < seeds->nsegs; s++) {
+        HashIter *iter = HashTableIterCreate();
+        HashItem *hi;
+        if (!iter) die("Out of memory");
+        while ((hi = HashTableIterNext(seeds->hash[s], iter)) != NULL) ia_free(hi->data.p);
+        HashTableIterDestroy(iter);
+        HashTableDestroy(seeds->hash[s], 0);
+    }
+    free(seeds->hash);
+    free(seeds->seg_start);
+    free(seeds);
+}
+
+/*
+ * Make the pigeonhole index. Returns NULL if the barcodes are too short to
+ * split into segments, or are not all the same length.
+ */
+static barcode_seeds_t *make_barcode_seeds(va_t *barcodeArray, decode_opts_t *opts)
+{
+    int delta = opts->min_mismatch_delta > 1 ? opts->min_mismatch_delta : 1;
+    int radius = opts->max_mismatches + delta - 1;
+    int nsegs = radius + 1 + (opts->max_no_calls > 0 ? 1 : 0);
+    int len;
+
+    if (barcodeArray->end < 2 || opts->max_mismatches < 0) return NULL;
+    len = strlen(((bc_details_t *)barcodeArray->entries[1])->seq);
+    if (len / nsegs < SEED_MIN_SEGMENT) return NULL;
+    for (int n = 1; n < barcodeArray->end; n++) {
+        if (strlen(((bc_details_t *)barcodeArray->entries[n])->seq) != len) return NULL;
+    }
+
+    barcode_seeds_t *seeds = calloc(1, sizeof(barcode_seeds_t));
+    if (!seeds) die("Out of memory");
+    seeds->len = len;
+    seeds->radius = radius;
+    seeds->nsegs = nsegs;
+    seeds->seg_start = calloc(nsegs + 1, sizeof(int));
+    seeds->hash = calloc(nsegs, sizeof(HashTable *));
+    if (!seeds->seg_start || !seeds->hash) die("Out of memory");
+
+    for (int s = 0; s <= nsegs; s++) seeds->seg_start[s] = s * len / nsegs;
+    for (int s = 0; s < nsegs; s++) {
+        int start = seeds->seg_start[s], seg_len = seeds->seg_start[s+1] - start;
+        seeds->hash[s] = HashTableCreate(0, HASH_DYNAMIC_SIZE | HASH_FUNC_JENKINS);
+        if (!seeds->hash[s]) die("Out of memory");
+        for (int n = 1; n < barcodeArray->end; n++) {
+            bc_details_t *bcd = barcodeArray->entries[n];
+            HashData hd;
+            int added;
+            hd.p = NULL;
+            HashItem *hi = HashTableAdd(seeds->hash[s], bcd->seq + start, seg_len, hd, &added);
+            if (!hi) die("Out of memory");
+            if (added) hi->data.p = ia_init(4);
+            ia_push(hi->data.p, n);
+        }
+    }
+    return seeds;
+}
+
+/*
+ * Set up the fastest matchers for this barcode set: the neighbourhood hash
+ * if it isn't too big, and the seed index for big sets where some (or all)
+ * reads aren't covered by the neighbourhood. Anything else falls back to
+ * the linear search.
+ */
+static void make_length_matchers(va_t *barcodeArray, decode_opts_t *opts)
+{
+    uint64_t checksum = 0;
+    bool loaded = false;
+
+    if (opts->load_index_name || opts->save_index_name) checksum = barcode_set_checksum(barcodeArray);
+    if (opts->load_index_name) {
+        free_barcode_nbhd(opts->nbhd);
+        opts->nbhd = load_barcode_nbhd(opts->load_index_name, checksum, opts);
+        loaded = opts->nbhd != NULL;
+        if (opts->verbose && loaded) {
+            fprintf(stderr, "Barcode neighbourhood: %zu sequences loaded from %s\n", opts->nbhd->nkeys, opts->load_index_name);
+        }
+    }
+    if (!loaded) make_barcode_neighbourhood(barcodeArray, opts);
+    if (opts->save_index_name && !loaded) {
+        if (!opts->nbhd) {
+            fprintf(stderr, "WARNING: no barcode neighbourhood was built, so %s was not written\n", opts->save_index_name);
+        } else if (save_barcode_nbhd(opts->nbhd, checksum, opts, opts->save_index_name) != 0) {
+            die("Could not write barcode index %s\n", opts->save_index_name);
+        }
+    }
+
+    // the seed index is cheap to build, so it isn't saved
+    free_barcode_seeds(opts->seeds);
+    opts->seeds = NULL;
+    if (barcodeArray->end - 1 >= SEED_MIN_BARCODES && (!opts->nbhd || opts->nbhd->max_n < opts->max_no_calls)) {
+        opts->seeds = make_barcode_seeds(barcodeArray, opts);
+        if (opts->verbose && opts->seeds) {
+            fprintf(stderr, "Barcode seed index: %d segments, up to %d mismatches\n", opts->seeds->nsegs, opts->seeds->radius);
+        }
+    }
+}
+
+static void free_barcode_class(void *entry)
+{
+    barcode_class_t *cls = entry;
+    if (!cls) return;
+    if (cls->barcodeArray && cls->barcodeArray->end) free_bcd(cls->barcodeArray->entries[0]);
+    va_free(cls->barcodeArray);
+    HashTableDestroy(cls->barcodeHash, 0);
+    if (cls->opts) {
+        free_barcode_nbhd(cls->opts->nbhd);
+        free_barcode_seeds(cls->opts->seeds);
+        free_packed_set(cls->opts->packed);
+        HashTableDestroy(cls->opts->idx1Hash, 0);
+        HashTableDestroy(cls->opts->idx2Hash, 0);
+        free(cls->opts);
+    }
+    free(cls);
+}
+
+/*
+ * Order of the classes, which is the order ties are broken in: longest first,
+ * then by the position of their first barcode in the barcode file
+ */
+static int compareClasses(const void *c1, const void *c2)
+{
+    barcode_class_t *a = *(barcode_class_t **)c1;
+    barcode_class_t *b = *(barcode_class_t **)c2;
+    if (a->idx1_len + a->idx2_len != b->idx1_len + b->idx2_len) return (b->idx1_len + b->idx2_len) - (a->idx1_len + a->idx2_len);
+    return ((bc_details_t *)a->barcodeArray->entries[1])->index - ((bc_details_t *)b->barcodeArray->entries[1])->index;
+}
+
+/*
+ * Group the barcodes into classes with the same index lengths, longest first.
+ * Also sets each barcode's index. Returns NULL if they all have the same lengths.
+ */
+static va_t *group_barcode_classes(va_t *barcodeArray, decode_opts_t *opts)
+{
+    va_t *classes = va_init(4, free_barcode_class);
+    for (int n = 1; n < barcodeArray->end; n++) {
+        bc_details_t *bcd = barcodeArray->entries[n];
+        int len1 = strlen(bcd->idx1), len2 = strlen(bcd->idx2);
+        barcode_class_t *cls = NULL;
+        for (int c = 0; c < classes->end && !cls; c++) {
+            barcode_class_t *cl = classes->entries[c];
+            if (cl->idx1_len == len1 && cl->idx2_len == len2) cls = cl;
+        }
+        if (!cls) {
+            cls = calloc(1, sizeof(barcode_class_t));
+            if (!cls) die("Out of memory");
+            cls->idx1_len = len1;
+            cls->idx2_len = len2;
+            cls->barcodeArray = va_init(barcodeArray->end, NULL);
+
+            // a null barcode of the right length, for the unmatched reads
+            bc_details_t *null_bcd = bcd_init();
+            null_bcd->idx1 = calloc(1, len1 + 1);
+            null_bcd->idx2 = calloc(1, len2 + 1);
+            null_bcd->seq = calloc(1, len1 + len2 + 2);
+            if (!null_bcd->idx1 || !null_bcd->idx2 || !null_bcd->seq) die("Out of memory");
+            memset(null_bcd->idx1, 'N', len1);
+            memset(null_bcd->idx2, 'N', len2);
+            strcpy(null_bcd->seq, null_bcd->idx1);
+            if (len2 && !opts->dual_tag) strcat(null_bcd->seq, INDEX_SEPARATOR);
+            strcat(null_bcd->seq, null_bcd->idx2);
+            va_push(cls->barcodeArray, null_bcd);
+            va_push(classes, cls);
+        }
+        bcd->index = n;
+        va_push(cls->barcodeArray, bcd);
+    }
+
+    if (classes->end < 2) {
+        va_free(classes);
+        return NULL;
+    }
+
+    qsort(classes->entries, classes->end, sizeof(barcode_class_t *), compareClasses);
+    return classes;
+}
+
+/*
+ * If the barcodes don't all have the same index lengths, split them into
+ * classes of the same length, each with its own matchers
+ */
+static void make_barcode_classes(va_t *barcodeArray, decode_opts_t *opts)
+{
+    va_free(opts->classes);
+    opts->classes = NULL;
+
+    va_t *classes = group_barcode_classes(barcodeArray, opts);
+    if (!classes) return;
+
+    for (int c = 0; c < classes->end; c++) {
+        barcode_class_t *cls = classes->entries[c];
+        decode_opts_t *copts = malloc(sizeof(decode_opts_t));
+        if (!copts) die("Out of memory");
+        *copts = *opts;
+        copts->idx1_len = cls->idx1_len;
+        copts->idx2_len = cls->idx2_len;
+        copts->save_index_name = copts->load_index_name = NULL;
+        copts->nbhd = NULL;
+        copts->seeds = NULL;
+        copts->packed = NULL;
+        copts->idx1Hash = copts->idx2Hash = NULL;
+        copts->classes = NULL;
+        cls->opts = copts;
+        cls->barcodeHash = make_barcode_hash(cls->barcodeArray);
+        packBarcodes(cls->barcodeArray, copts);
+        make_length_matchers(cls->barcodeArray, copts);
+        if (opts->verbose) {
+            fprintf(stderr, "Barcode class %d-%d: %d barcodes\n", cls->idx1_len, cls->idx2_len, cls->barcodeArray->end - 1);
+        }
+    }
+    opts->classes = classes;
+}
+
+/*
+ * Set up the matchers for this barcode set, one set for each length
+ * if the barcodes have different lengths
+ */
+void make_barcode_matchers(va_t *barcodeArray, decode_opts_t *opts)
+{
+    make_barcode_classes(barcodeArray, opts);
+    if (!opts->classes) {
+        make_length_matchers(barcodeArray, opts);
+        return;
+    }
+
+    free_barcode_nbhd(opts->nbhd);
+    free_barcode_seeds(opts->seeds);
+    opts->nbhd = NULL;
+    opts->seeds = NULL;
+    if (opts->load_index_name || opts->save_index_name) {
+        fprintf(stderr, "WARNING: the barcodes have different lengths, so the barcode index is not saved or loaded\n");
+    }
+}
+
 /*
  * Returns the length of the longest name
  */
@@ -1524,23 +3663,130 @@ int get_barcode_metadata(va_t *barcodeArray, int idx,
 /*
  * Main code
  */
+/*
+ * Make the output file name for one barcode from the --output-per-barcode template
+ * Returns NULL if the barcode name can't be used in a file name: it mustn't
+ * take the file out of the directory in the template.
+ */
+static char *per_barcode_name(const char *template, const char *name)
+{
+    if (!*name || strchr(name, '/') || strstr(name, "..")) return NULL;
+    const char *p = strstr(template, "%s");
+    char *fname = malloc(strlen(template) + strlen(name) + 1);
+    if (!fname) die("Out of memory");
+    sprintf(fname, "%.*s%s%s", (int)(p - template), template, name, p + 2);
+    return fname;
+}
+
+/*
+ * Number of output files: one for each barcode with --output-per-barcode,
+ * none with --metrics-only, otherwise one
+ */
+static int output_count(va_t *barcodeArray, decode_opts_t *opts)
+{
+    return opts->metrics_only ? 0 : opts->output_per_barcode ? barcodeArray->end : 1;
+}
+
+/*
+ * Can nout output files be open at once, as well as the input and metrics files?
+ * The soft limit on open files is raised to the hard limit if need be.
+ */
+static bool enough_files(int nout)
+{
+    struct rlimit rl;
+    rlim_t need = nout + 16;
+
+    if (getrlimit(RLIMIT_NOFILE, &rl) < 0 || rl.rlim_cur == RLIM_INFINITY || rl.rlim_cur >= need) return true;
+    if (rl.rlim_max != RLIM_INFINITY && rl.rlim_max < need) {
+        fprintf(stderr, "--output-per-barcode needs %d output files open at once, but only %lu files can be open "
+                        "(see ulimit -n)\n", nout, (unsigned long)rl.rlim_max);
+        return false;
+    }
+    rl.rlim_cur = need;
+    if (setrlimit(RLIMIT_NOFILE, &rl) < 0) {
+        fprintf(stderr, "--output-per-barcode needs %d output files open at once, but the limit on open files "
+                        "couldn't be raised: %s\n", nout, strerror(errno));
+        return false;
+    }
+    return true;
+}
+
+/*
+ * Open the nout output files (see output_count()): one for each barcode with
+ * --output-per-barcode, each with only its own RG lines in the header,
+ * otherwise just one.
+ * The files are compressed by the npools pools in turn, starting with the one
+ * after the input's (pools[0]), so that with --numa the input and output BGZF
+ * work is on different nodes. One file is compressed by one pool.
+ * Returns 0 on success, or -1 on failure.
+ */
+static int open_outputs(BAMit_t **bam_out, int nout, BAMit_t *bam_in, va_t *barcodeArray, hts_tpool **pools, int npools, decode_opts_t *opts)
+{
+    if (opts->output_per_barcode) {
+        // check every name before creating any of the files
+        for (int n = 1; n < nout; n++) {
+            bc_details_t *bcd = barcodeArray->entries[n];
+            char *fname = per_barcode_name(opts->output_per_barcode, bcd->name);
+            if (!fname) {
+                fprintf(stderr, "Barcode name '%s' can't be used in an output file name with --output-per-barcode\n", bcd->name);
+                return -1;
+            }
+            free(fname);
+        }
+        if (!enough_files(nout)) return -1;
+    }
+
+    for (int n = 0; n < nout; n++) {
+        bc_details_t *bcd = barcodeArray->entries[n];
+        char *fname = opts->output_per_barcode ? per_barcode_name(opts->output_per_barcode, n ? bcd->name : "0")
+                                               : strdup(opts->output_name);
+        if (!fname) die("Out of memory");
+        htsThreadPool hts_threads = { npools ? pools[(n + 1) % npools] : NULL, 0 };
+        bam_out[n] = BAMit_open(fname, 'w', opts->output_fmt, opts->compression_level, hts_threads.pool ? &hts_threads : NULL, 0);
+        free(fname);
+        if (!bam_out[n]) return -1;
+
+        // copy input to output header, and add PG and RG lines
+        bam_hdr_destroy(bam_out[n]->h); bam_out[n]->h = bam_hdr_dup(bam_in->h);
+        changeHeader(barcodeArray, bam_out[n]->h, opts->argv_list, opts->output_per_barcode ? n : -1);
+        if (sam_hdr_write(bam_out[n]->f, bam_out[n]->h) != 0) {
+            fprintf(stderr, "Could not write output file header\n");
+            return -1;
+        }
+    }
+    return 0;
+}
+
 static int decode(decode_opts_t* opts)
 {
     int retcode = 1;
     BAMit_t *bam_in = NULL;
-    BAMit_t *bam_out = NULL;
+    BAMit_t **bam_out = NULL;
+    int nout = 0;
     va_t *barcodeArray = NULL;
     HashTable *tagHopHash = NULL;
     HashTable *barcodeHash = NULL;
     htsThreadPool hts_threads = { NULL, 0 };
+    hts_tpool **pools = NULL;
+    int npools = 0;
 
     while (1) {
         if (opts->nthreads > 1) {
-            hts_threads.pool = hts_tpool_init(opts->nthreads);
-            if (!hts_threads.pool) {
+            // One pool per NUMA node with --numa, whose threads run on the node, otherwise just one
+            npools = opts->numa ? numautil_nodes() : 1;
+            if (opts->numa && npools == 1) fprintf(stderr, "WARNING: only one NUMA node is available, ignoring --numa\n");
+            if (npools > opts->nthreads) npools = opts->nthreads;
+            pools = calloc(npools, sizeof(hts_tpool *));
+            if (!pools) die("Out of memory");
+            for (int i = 0; i < npools; i++) {
+                pools[i] = numautil_tpool_init(opts->nthreads / npools, npools > 1 ? i : -1);
+                if (!pools[i]) break;
+            }
+            if (!pools[npools-1]) {
                 fprintf(stderr, "Couldn't set up thread pool\n");
                 break;
             }
+            hts_threads.pool = pools[0];
         }
 
         /*
@@ -1551,34 +3797,33 @@ static int decode(decode_opts_t* opts)
 
         // create hash from barcodeArray
         barcodeHash = make_barcode_hash(barcodeArray);
+        make_barcode_matchers(barcodeArray, opts);
 
         tagHopHash = HashTableCreate(0, HASH_DYNAMIC_SIZE | HASH_FUNC_JENKINS);
 
         /*
          * Open input fnd output BAM files
          */
-        bam_in = BAMit_open(opts->input_name, 'r', opts->input_fmt, 0, hts_threads.pool ? &hts_threads : NULL);
+        // with --metrics-only, only the read name, flags and tags are needed
+        bam_in = BAMit_open(opts->input_name, 'r', opts->input_fmt, 0, hts_threads.pool ? &hts_threads : NULL,
+                            opts->metrics_only ? SAM_QNAME | SAM_FLAG | SAM_AUX : 0);
         if (!bam_in) break;
-        bam_out = BAMit_open(opts->output_name, 'w', opts->output_fmt, opts->compression_level, hts_threads.pool ? &hts_threads : NULL);
-        if (!bam_out) break;
-        // copy input to output header
-        bam_hdr_destroy(bam_out->h); bam_out->h = bam_hdr_dup(bam_in->h);
-
-        // Change header by adding PG and RG lines
-        changeHeader(barcodeArray, bam_out->h, opts->argv_list);
-        if (sam_hdr_write(bam_out->f, bam_out->h) != 0) {
-            fprintf(stderr, "Could not write output file header\n");
-            break;
-        }
+        bam_out = calloc(barcodeArray->end, sizeof(BAMit_t *));
+        if (!bam_out) die("Out of memory");
+        nout = output_count(barcodeArray, opts);
+        if (open_outputs(bam_out, nout, bam_in, barcodeArray, pools, npools, opts) < 0) break;
+        if (!opts->metrics_only) opts->rg_table = make_rg_table(barcodeArray, bam_in->h);
 
         // Read and process each template in the input BAM
+        planSample(opts);
         if (opts->nthreads < 2) {
             if (processTemplatesNoThreads(bam_in, bam_out, barcodeArray, barcodeHash, tagHopHash, opts) < 0) break;
         } else {
-            if (processTemplatesThreads(hts_threads.pool, bam_in, bam_out, barcodeArray, barcodeHash, tagHopHash, opts) < 0) break;
+            if (processTemplatesThreads(pools, npools, bam_in, bam_out, barcodeArray, barcodeHash, tagHopHash, opts) < 0) break;
         }
 
-        if (BAMit_hasnext(bam_in)) break;   // we must has exited the above loop early
+        if (!opts->split_input && !opts->sample_ranges && BAMit_hasnext(bam_in) && !sampleDone(opts)) break;   // we must has exited the above loop early
+        if (opts->verbose && isSampling(opts)) fprintf(stderr, "Sampled %"PRIu64" templates\n", opts->nsampled);
 
         /*
          * And finally.....the metrics
@@ -1604,8 +3849,12 @@ static int decode(decode_opts_t* opts)
     HashTableDestroy(barcodeHash, 0);
     HashTableDestroy(tagHopHash, 0);
     BAMit_free(bam_in);
-    BAMit_free(bam_out);
-    if (hts_threads.pool) hts_tpool_destroy(hts_threads.pool);
+    for (int n = 0; n < nout; n++) BAMit_free(bam_out[n]);
+    free(bam_out);
+    for (int i = 0; i < npools; i++) {
+        if (pools[i]) hts_tpool_destroy(pools[i]);
+    }
+    free(pools);
 
     return retcode;
 }
@@ -1628,3 +3877,269 @@ int main_decode(int argc, char *argv[])
     decode_free_opts(opts);
     return ret;
 }
+
+/*
+ * display usage information for decode-metrics-merge
+ */
+static void merge_usage(FILE *write_to)
+{
+    fprintf(write_to,
+"Usage: bambi decode-metrics-merge [options] counts-file...\n"
+"\n"
+"Combine the counts files written (with --counts-file) when parts of a run are decoded\n"
+"separately, with the same barcode file and options, into one set of metrics\n"
+"\n"
+"Options:\n"
+"  -o   --metrics-file                  Per-barcode and per-lane metrics written to this file, along with\n"
+"                                       the .hops and .unmatched files that decode would write\n"
+"  -c   --counts-file                   Write the combined counts to this file, so they can be merged again\n"
+"  -v   --verbose                       verbose output\n"
+);
+}
+
+static bc_details_t *merge_bcd(char *idx1, char *idx2)
+{
+    bc_details_t *bcd = bcd_init();
+    bcd->idx1 = strdup(idx1);
+    bcd->idx2 = strdup(idx2);
+    bcd->seq = malloc(strlen(idx1) + strlen(idx2) + 2);
+    if (!bcd->idx1 || !bcd->idx2 || !bcd->seq) die("Out of memory");
+    strcpy(bcd->seq, idx1);
+    if (*idx2) strcat(bcd->seq, INDEX_SEPARATOR);
+    strcat(bcd->seq, idx2);
+    return bcd;
+}
+
+/*
+ * Add the counts in one file written by writeCounts() to barcodeArray, tagHopHash and
+ * the unmatched sequences. The first file sets up the barcodes and options,
+ * and the others must match them.
+ *
+ * returns 0 on success, 1 if there was a problem
+ */
+static int loadCounts(const char *fname, va_t *barcodeArray, HashTable *tagHopHash, decode_opts_t *opts)
+{
+    bool first = barcodeArray->end == 0;
+    bool header = false;
+    int nbarcodes = 0, lineno = 0, monitored = 0, ret = 1;
+    uint64_t unmatched_reads = 0;
+    unmatched_sketch_t *unmatched = NULL;   // this file's unmatched sequences
+    decode_opts_t o = { 0 };
+    char *buf = NULL;
+    size_t sz = 0;
+
+    FILE *fh = fopen(fname, "r");
+    if (!fh) {
+        fprintf(stderr,"ERROR: Can't open counts file %s\n", fname);
+        return 1;
+    }
+
+    while (getline(&buf, &sz, fh) > 0) {
+        lineno++;
+        buf[strcspn(buf, "\n")] = 0;
+
+        if (strncmp(buf, "# BAMBI_DECODE_COUNTS=", 22) == 0) {
+            char *s, *save;
+            for (s = strtok_r(buf + 2, " ", &save); s; s = strtok_r(NULL, " ", &save)) {
+                char *val = strchr(s, '=');
+                if (!val) continue;
+                *val++ = 0;
+                     if (strcmp(s, "BAMBI_DECODE_COUNTS") == 0)   header = atoi(val) == COUNTS_FILE_VERSION;
+                else if (strcmp(s, "BARCODE_TAG_NAME") == 0)      { free(o.barcode_tag_name); o.barcode_tag_name = strdup(val); }
+                else if (strcmp(s, "MAX_MISMATCHES") == 0)        o.max_mismatches = atoi(val);
+                else if (strcmp(s, "MIN_MISMATCH_DELTA") == 0)    o.min_mismatch_delta = atoi(val);
+                else if (strcmp(s, "MAX_NO_CALLS") == 0)          o.max_no_calls = atoi(val);
+                else if (strcmp(s, "IGNORE_PF") == 0)             o.ignore_pf = atoi(val);
+                else if (strcmp(s, "IDX1_LEN") == 0)              o.idx1_len = atoi(val);
+                else if (strcmp(s, "IDX2_LEN") == 0)              o.idx2_len = atoi(val);
+                else if (strcmp(s, "SAMPLE_FRACTION") == 0)       o.sample_fraction = atof(val);
+                else if (strcmp(s, "SAMPLE_MAX") == 0)            o.sample_max = strtoull(val, NULL, 10);
+                else if (strcmp(s, "SAMPLED_TEMPLATES") == 0)     o.nsampled = strtoull(val, NULL, 10);
+                else if (strcmp(s, "UNMATCHED_TOP") == 0)         o.unmatched_top = atoi(val);
+                else if (strcmp(s, "SEQUENCES_MONITORED") == 0)   monitored = atoi(val);
+                else if (strcmp(s, "TOTAL_UNMATCHED_READS") == 0) unmatched_reads = strtoull(val, NULL, 10);
+            }
+            if (!header) {
+                fprintf(stderr,"ERROR: %s is from a different version of bambi\n", fname);
+                goto out;
+            }
+            if (!o.barcode_tag_name) o.barcode_tag_name = strdup("");
+
+            if (first) {
+                free(opts->barcode_tag_name);
+                opts->barcode_tag_name = strdup(o.barcode_tag_name);
+                opts->max_mismatches = o.max_mismatches;
+                opts->min_mismatch_delta = o.min_mismatch_delta;
+                opts->max_no_calls = o.max_no_calls;
+                opts->ignore_pf = o.ignore_pf;
+                opts->idx1_len = o.idx1_len;
+                opts->idx2_len = o.idx2_len;
+                opts->sample_fraction = o.sample_fraction;
+                opts->unmatched_top = o.unmatched_top;
+            } else if (strcmp(opts->barcode_tag_name, o.barcode_tag_name) ||
+                       opts->max_mismatches != o.max_mismatches ||
+                       opts->min_mismatch_delta != o.min_mismatch_delta ||
+                       opts->max_no_calls != o.max_no_calls ||
+                       opts->ignore_pf != o.ignore_pf ||
+                       opts->sample_fraction != o.sample_fraction) {
+                fprintf(stderr,"ERROR: %s was decoded with different options\n", fname);
+                goto out;
+            }
+            opts->sample_max += o.sample_max;
+            opts->nsampled += o.nsampled;
+            continue;
+        }
+        if (!*buf || *buf == '#' || strncmp(buf, "TYPE\t", 5) == 0) continue;
+        if (!header) {
+            fprintf(stderr,"ERROR: %s is not a decode counts file\n", fname);
+            goto out;
+        }
+
+        // TYPE INDEX1 INDEX2 BARCODE_NAME LIBRARY_NAME SAMPLE_NAME DESCRIPTION, then the counts
+        char *field[14], *s = buf;
+        uint64_t counts[7];
+        int nfields = 0;
+        while (nfields < 14 && (field[nfields] = strsep(&s, "\t")) != NULL) nfields++;
+        if (nfields < 14) {
+            fprintf(stderr,"ERROR: Can't read counts file %s: Line %d\n", fname, lineno);
+            goto out;
+        }
+        for (int n = 0; n < 7; n++) counts[n] = strtoull(field[7+n], NULL, 10);
+
+        bc_details_t *bcd = NULL;
+        if (strcmp(field[0], "BARCODE") == 0) {
+            if (first) {
+                bcd = merge_bcd(field[1], field[2]);
+                bcd->name = strdup(field[3]);
+                bcd->lib = strdup(field[4]);
+                bcd->sample = strdup(field[5]);
+                bcd->desc = strdup(field[6]);
+                va_push(barcodeArray, bcd);
+            } else {
+                bcd = nbarcodes < barcodeArray->end ? barcodeArray->entries[nbarcodes] : NULL;
+                if (!bcd || strcmp(bcd->idx1, field[1]) || strcmp(bcd->idx2, field[2]) || strcmp(bcd->name, field[3])) {
+                    fprintf(stderr,"ERROR: %s was decoded with a different barcode file\n", fname);
+                    goto out;
+                }
+            }
+            nbarcodes++;
+        } else if (strcmp(field[0], "HOP") == 0) {
+            bc_details_t *hop = merge_bcd(field[1], field[2]);
+            HashItem *hi = HashTableSearch(tagHopHash, hop->seq, 0);
+            if (hi) {
+                bcd = hi->data.p;
+                free_bcd(hop);
+            } else {
+                HashData hd;
+                hd.p = bcd = hop;
+                if (!HashTableAdd(tagHopHash, bcd->seq, 0, hd, NULL)) die("Out of memory");
+            }
+        } else if (strcmp(field[0], "UNMATCHED") == 0 && barcodeArray->end) {
+            if (!unmatched) unmatched = unmatched_init(monitored > 0 ? monitored : 1);
+            unmatchedInsert(unmatched, field[1], counts[0], counts[6]);
+            continue;
+        } else {
+            fprintf(stderr,"ERROR: Can't read counts file %s: Line %d\n", fname, lineno);
+            goto out;
+        }
+        bcd->reads += counts[0];
+        bcd->pf_reads += counts[1];
+        bcd->perfect += counts[2];
+        bcd->pf_perfect += counts[3];
+        bcd->one_mismatch += counts[4];
+        bcd->pf_one_mismatch += counts[5];
+    }
+
+    if (!header || !nbarcodes || nbarcodes != barcodeArray->end) {
+        fprintf(stderr,"ERROR: %s is incomplete, or was decoded with a different barcode file\n", fname);
+        goto out;
+    }
+    bc_details_t *null_bcd = barcodeArray->entries[0];
+    if (!null_bcd->unmatched && (monitored || unmatched)) null_bcd->unmatched = unmatched_init(monitored > 0 ? monitored : 1);
+    if (unmatched) {
+        unmatched->total = unmatched_reads;
+        unmatchedMerge(null_bcd->unmatched, unmatched);
+    } else if (null_bcd->unmatched) {
+        null_bcd->unmatched->total += unmatched_reads;
+    }
+    ret = 0;
+
+ out:
+    unmatched_free(unmatched);
+    free(o.barcode_tag_name);
+    free(buf);
+    fclose(fh);
+    return ret;
+}
+
+/*
+ * called from bambi to merge the metrics from several decode runs
+ *
+ * returns 0 on success, 1 if there was a problem
+ */
+int main_decode_metrics_merge(int argc, char *argv[])
+{
+    if (argc == 1) { merge_usage(stdout); return 1; }
+
+    const char* optstring = "o:c:v";
+
+    static const struct option lopts[] = {
+        { "metrics-file",               1, 0, 'o' },
+        { "counts-file",                1, 0, 'c' },
+        { "verbose",                    0, 0, 'v' },
+        { NULL, 0, NULL, 0 }
+    };
+
+    decode_opts_t* opts = decode_init_opts(argc+1, argv-1);
+    int opt;
+    int option_index = 0;
+    while ((opt = getopt_long(argc, argv, optstring, lopts, &option_index)) != -1) {
+        switch (opt) {
+        case 'o':   free(opts->metrics_name);
+                    opts->metrics_name = strdup(optarg);
+                    break;
+        case 'c':   free(opts->counts_name);
+                    opts->counts_name = strdup(optarg);
+                    break;
+        case 'v':   opts->verbose = true;
+                    break;
+        default:    merge_usage(stdout); decode_free_opts(opts); optind = 0; return 1;
+        }
+    }
+
+    argc -= optind;
+    argv += optind;
+    optind = 0;
+
+    if (!opts->metrics_name || argc < 1) {
+        fprintf(stderr,"You must specify a metrics file (-o or --metrics-file) and at least one counts file\n");
+        merge_usage(stderr); decode_free_opts(opts);
+        return 1;
+    }
+
+    va_t *barcodeArray = va_init(100, free_bcd);
+    HashTable *tagHopHash = HashTableCreate(0, HASH_DYNAMIC_SIZE | HASH_FUNC_JENKINS);
+    int ret = 0;
+
+    for (int n = 0; n < argc && !ret; n++) {
+        if (opts->verbose) fprintf(stderr, "Reading %s\n", argv[n]);
+        ret = loadCounts(argv[n], barcodeArray, tagHopHash, opts);
+    }
+    if (!ret) {
+        opts->classes = group_barcode_classes(barcodeArray, opts);
+        ret = writeMetrics(barcodeArray, tagHopHash, opts);
+    }
+
+    HashIter *iter = HashTableIterCreate();
+    if (iter) {
+        HashItem *hi;
+        while ((hi = HashTableIterNext(tagHopHash, iter)) != NULL) {
+            free_bcd(hi->data.p);
+        }
+        HashTableIterDestroy(iter);
+    }
+    HashTableDestroy(tagHopHash, 0);
+    va_free(barcodeArray);
+    decode_free_opts(opts);
+    return ret;
+}
@@ -45,6 +45,9 @@ va_t *loadBarcodeFile(decode_opts_t *opts);
 // Create a hash table to speed up barcode searches
 HashTable *make_barcode_hash(va_t *barcodeArray);
 
+// Choose and build the indexes used to match barcodes (kept in opts)
+void make_barcode_matchers(va_t *barcodeArray, decode_opts_t *opts);
+
 // Returns the length of the longest name
 size_t find_longest_barcode_name(va_t *barcodeArray);
 
@@ -59,11 +62,20 @@ va_t *copy_barcode_array(va_t *barcode_array);
 // Clean up a barcode array copy
 void delete_barcode_array_copy(va_t *barcode_array);
 
-// Barcode look-up.  Also updates metrics.
-char *findBarcodeName(char *barcode, va_t *barcodeArray, HashTable *barcodeHash, HashTable *tagHopHash, decode_opts_t *opts, bool isPf, bool isUpdateMetrics);
+// Per-thread metrics counters for a barcode array
+typedef struct bc_counter_set_t bc_counter_set_t;
+
+// Make a set of per-thread counters for the barcodes in barcodeArray
+bc_counter_set_t *counter_set_init(va_t *barcodeArray);
+
+// Add every thread's counts into barcodeArray, and free the counters
+void counter_set_merge(bc_counter_set_t *set, va_t *barcodeArray);
+
+// Barcode look-up.  Also updates metrics, in the calling thread's counters if counters isn't NULL.
+char *findBarcodeName(char *barcode, va_t *barcodeArray, HashTable *barcodeHash, HashTable *tagHopHash, bc_counter_set_t *counters, decode_opts_t *opts, bool isPf, bool isUpdateMetrics);
 
-// Accumulate metrics in per-thread copies
-void accumulate_job_metrics(va_t *job_barcodes, HashTable *job_tag_hops, va_t *barcodeArray, HashTable *tagHopHash);
+// Add the tag hops counted by a job into tagHopHash
+void accumulate_tag_hops(HashTable *job_tag_hops, HashTable *tagHopHash);
 
 // Write out metrics
 int writeMetrics(va_t *barcodeArray, HashTable *tagHopHash, decode_opts_t *opts);
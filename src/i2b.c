@@ -36,6 +36,9 @@ along with this program.  If not, see <http://www.gnu.org/licenses/>.
 #include <fcntl.h>
 #include <errno.h>
 #include <pthread.h>
+#include <sys/stat.h>
+#include <sys/resource.h>
+#include <inttypes.h>
 
 #include <cram/sam_header.h>
 #include <htslib/thread_pool.h>
@@ -47,6 +50,9 @@ along with this program.  If not, see <http://www.gnu.org/licenses/>.
 #include "bclfile.h"
 #include "array.h"
 #include "parse.h"
+#include "qualbin.h"
+#include "numa_util.h"
+#include "tileidx.h"
 
 #define DEFAULT_BARCODE_TAG "BC"
 #define DEFAULT_QUALITY_TAG "QT"
@@ -54,12 +60,133 @@ along with this program.  If not, see <http://www.gnu.org/licenses/>.
 #define DEFAULT_MAX_BARCODES 10
 #define QUEUELEN "1000000"
 #define CLUSTERS_PER_THREAD 25000
+#define MIN_CLUSTERS_PER_THREAD 1024
+#define DEFAULT_WATCH_INTERVAL "60"
+#define DEFAULT_WATCH_TIMEOUT "86400"
+
+/*
+ * Memory accountant
+ *
+ * Tile buffers, job results and bcl cache entries are charged against
+ * the --max-memory budget (a limit of 0 means no limit).
+ */
+typedef struct mem_account_t {
+    pthread_mutex_t lock;
+    size_t limit;
+    size_t used;
+    size_t peak;
+} mem_account_t;
+
+static void mem_charge(mem_account_t *mem, size_t sz)
+{
+    if (!mem) return;
+    if (pthread_mutex_lock(&mem->lock) < 0) die("pthread_mutex_lock failed\n");
+    mem->used += sz;
+    if (mem->used > mem->peak) mem->peak = mem->used;
+    if (pthread_mutex_unlock(&mem->lock) < 0) die("pthread_mutex_unlock failed\n");
+}
+
+static void mem_release(mem_account_t *mem, size_t sz)
+{
+    if (!mem) return;
+    if (pthread_mutex_lock(&mem->lock) < 0) die("pthread_mutex_lock failed\n");
+    assert(mem->used >= sz);
+    mem->used -= sz;
+    if (pthread_mutex_unlock(&mem->lock) < 0) die("pthread_mutex_unlock failed\n");
+}
+
+// Amount of budget left, or SIZE_MAX if there is no limit
+static size_t mem_available(mem_account_t *mem)
+{
+    size_t avail;
+    if (!mem || !mem->limit) return SIZE_MAX;
+    if (pthread_mutex_lock(&mem->lock) < 0) die("pthread_mutex_lock failed\n");
+    avail = mem->used < mem->limit ? mem->limit - mem->used : 0;
+    if (pthread_mutex_unlock(&mem->lock) < 0) die("pthread_mutex_unlock failed\n");
+    return avail;
+}
+
+/*
+ * Thread scheduler
+ *
+ * Three stages share the threads: loading BCL files (I/O), building the BAM
+ * records (compute) and BGZF compression of the output. Unless the split is
+ * fixed with --io-threads / --compress-threads, the number of concurrent
+ * jobs allowed in the I/O and compute stages is adjusted after every tile
+ * from the measured I/O throughput and the time the writer spent stalled.
+ */
+typedef struct thread_sched_t {
+    int node;               // NUMA node the threads are bound to, or -1
+    hts_tpool *pool;        // pool used to build records
+    hts_tpool *io_pool;     // pool used to load BCL files
+    int io_jobs;            // number of BCL files loaded concurrently
+    int io_max;
+    int io_step;            // direction of the last change to io_jobs
+    double io_rate;         // bytes per second loaded for the previous tile
+    bool io_fixed;          // set by --io-threads
+    int compute_jobs;       // number of processRecords() jobs in flight
+    int compute_max;
+    bool compute_fixed;     // set by --compress-threads
+    double wait_secs;       // writer waiting for processRecords() results
+    double write_secs;      // writer blocked writing (compressing) records
+} thread_sched_t;
+
+static double wallClock(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+/*
+ * Hill-climb the number of concurrent BCL loads: keep moving in the same
+ * direction while throughput improves, turn round when it gets worse.
+ */
+static void schedIoTile(thread_sched_t *sched, size_t bytes, double secs, int verbose)
+{
+    if (sched->io_fixed || secs <= 0) return;
+    double rate = bytes / secs;
+    if (sched->io_rate > 0 && rate < sched->io_rate * 0.95) sched->io_step = -sched->io_step;
+    sched->io_rate = rate;
+    sched->io_jobs += sched->io_step;
+    if (sched->io_jobs < 1) { sched->io_jobs = 1; sched->io_step = 1; }
+    if (sched->io_jobs > sched->io_max) { sched->io_jobs = sched->io_max; sched->io_step = -1; }
+    if (verbose) display("I/O: %.1f MB/s, next tile uses %d concurrent BCL loads\n", rate / 1e6, sched->io_jobs);
+}
+
+/*
+ * If the writer spent longer blocked on compression than waiting for
+ * records, allow fewer record jobs in flight so compression gets more of
+ * the pool; if it spent longer waiting for records, allow more.
+ */
+static void schedComputeTile(thread_sched_t *sched, int verbose)
+{
+    if (!sched->compute_fixed) {
+        if (sched->write_secs > sched->wait_secs * 1.1 && sched->compute_jobs > 1) sched->compute_jobs--;
+        else if (sched->wait_secs > sched->write_secs * 1.1 && sched->compute_jobs < sched->compute_max) sched->compute_jobs++;
+        if (verbose) display("Writer: %.2fs waiting, %.2fs writing, next tile uses %d record jobs\n",
+                             sched->wait_secs, sched->write_secs, sched->compute_jobs);
+    }
+    sched->wait_secs = sched->write_secs = 0;
+}
+
+/*
+ * With --numa, tiles are processed on each node in parallel, but the
+ * records must still be written in tile order. A tile waits for its turn
+ * before writing its first record, and passes the turn on when finished.
+ */
+typedef struct tile_order_t {
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    int next;       // sequence number of the tile allowed to write
+} tile_order_t;
 
 // BCL file cache
 KHASH_MAP_INIT_INT(bcl_cache, bclfile_t *);
 typedef struct lockable_bcl_cache {
     pthread_mutex_t lock;
     khash_t(bcl_cache) *cache;
+    mem_account_t *mem;
 } lockable_bcl_cache;
 
 char *strptime(const char *s, const char *format, struct tm *tm);
@@ -127,9 +254,15 @@ typedef struct {
     char *run_folder;
     char *intensity_dir;
     char *basecalls_dir;
-    int lane;
+    ia_t *lanes;
     int nthreads;
     int pool_size;
+    int io_threads;
+    int compress_threads;
+    bool numa;
+    int max_open_files;
+    bcl_fd_cache_t *fd_cache;   // shared by all the BCL files
+    bool tile_index;
     char *output_file;
     char *output_fmt;
     char compression_level;
@@ -139,12 +272,17 @@ typedef struct {
     char *library_name;
     char *study_name;
     char *platform_unit;
+    bool default_platform_unit;
     char *run_start_date;
     char *sequencing_centre;
     char *platform;
     int first_tile;
     int tile_limit;
     int qlen;
+    size_t max_memory;
+    bool watch;
+    int watch_interval;
+    int watch_timeout;
     va_t *barcode_tag;
     va_t *quality_tag;
     ia_t *bc_read;
@@ -158,6 +296,7 @@ typedef struct {
     xmlDocPtr runinfoConfig;
     decode_opts_t *decode_opts;
     const char *decode_calls_tag;
+    char *metrics_file;
     va_t *barcodeArray;
     const char *unmatched_barcode_name;
     bool decode_tags;
@@ -165,6 +304,8 @@ typedef struct {
     bool change_read_name;
     bool convert_low_quality;
     int max_low_quality_to_convert;
+    bool qual_bin;
+    uint8_t qual_map[QUAL_MAP_SIZE];
 } opts_t;
 
 /*
@@ -177,10 +318,12 @@ typedef struct {
 } barcode_spec_t;
 
 typedef struct {
+    int lane;
     unsigned int tile;
     unsigned int next_tile;
     samFile *output_file;
     bam_hdr_t *output_header;
+    tileidx_t *tileidx;     // index of the lane's output, or NULL
     opts_t *opts;
     va_t *cycleRange;
     va_t *tileIndex;
@@ -191,6 +334,14 @@ typedef struct {
     hts_tpool_process *thread_q;
     HashTable *barcodes_hash;
     HashTable *tag_hops;
+    mem_account_t *mem;
+    thread_sched_t *sched;
+    tile_order_t *order;    // NULL unless tiles are processed in parallel
+    int seq;                // position of this tile in the output
+    bool my_turn;
+    uint64_t records_written;
+    va_t *barcodeArray; // per-lane metrics
+    bc_counter_set_t *counters; // per-thread counts for barcodeArray
     size_t longest_barcode_name;
 } job_data_t;
 
@@ -209,6 +360,7 @@ void i2b_free_opts(opts_t* opts)
     free(opts->argv_list);
     free(opts->output_file);
     free(opts->output_fmt);
+    free(opts->metrics_file);
     free(opts->read_group_id);
     free(opts->sample_alias);
     free(opts->library_name);
@@ -219,6 +371,7 @@ void i2b_free_opts(opts_t* opts)
     free(opts->platform);
     va_free(opts->barcode_tag);
     va_free(opts->quality_tag);
+    ia_free(opts->lanes);
     ia_free(opts->bc_read);
     ia_free(opts->first_cycle);
     ia_free(opts->final_cycle);
@@ -385,6 +538,53 @@ static xmlDocPtr loadXML(char *dir, char *fname, int verbose)
     return doc;
 }
 
+/*
+ * Make a per-lane file name by replacing the first "%d" in fname with the lane number.
+ * If there is no "%d" the name is returned unchanged.
+ */
+static char *laneFileName(const char *fname, int lane)
+{
+    const char *p = strstr(fname, "%d");
+    char *name = calloc(1, strlen(fname) + 16);
+    if (!name) die("Out of memory");
+    if (p) sprintf(name, "%.*s%d%s", (int)(p - fname), fname, lane, p + 2);
+    else   strcpy(name, fname);
+    return name;
+}
+
+/*
+ * Parse a memory size such as "512M" or "8G" into bytes.
+ * Returns 0 on success, -1 on error.
+ */
+static int parseMemory(const char *str, size_t *bytes)
+{
+    char *end;
+    errno = 0;
+    unsigned long long n = strtoull(str, &end, 10);
+    if (errno || end == str || *str == '-') return -1;
+    switch (toupper(*end)) {
+        case 'G': n <<= 10; // fall through
+        case 'M': n <<= 10; // fall through
+        case 'K': n <<= 10; end++; break;
+        case '\0': break;
+        default: return -1;
+    }
+    if (*end) return -1;
+    *bytes = n;
+    return 0;
+}
+
+/*
+ * Default limit on open BCL files: the open file limit, less some for
+ * the other files we need
+ */
+static int defaultMaxOpenFiles(void)
+{
+    struct rlimit rl;
+    if (getrlimit(RLIMIT_NOFILE, &rl) < 0 || rl.rlim_cur == RLIM_INFINITY || rl.rlim_cur > INT_MAX) return 0;
+    return rl.rlim_cur > 128 ? rl.rlim_cur - 64 : rl.rlim_cur / 2;
+}
+
 /*
  * display usage information
  */
@@ -401,8 +601,10 @@ static void usage(FILE *write_to)
 "  -b   --basecalls-dir                 Illumina basecalls directory including config xml file, and filter files,\n"
 "                                       bcl files under lane cycle directory\n"
 "                                       [default: BaseCalls directory under intensities]\n"
-"  -l   --lane                          Lane number. Required\n"
+"  -l   --lane                          Lane number, or comma separated list of lane numbers. Required\n"
 "  -o   --output-file                   Output file name. May be '-' for stdout. Required\n"
+"                                       If more than one lane is given, the name must contain '%%d', which is\n"
+"                                       replaced by the lane number to give one output file per lane\n"
 "       --no-filter                     Do not filter cluster [default: false]\n"
 "       --read-group-id                 ID used to link RG header record with RG tag in SAM record. [default: '1']\n"
 "       --library-name                  The name of the sequenced library. [default: 'unknown']\n"
@@ -428,10 +630,33 @@ static void usage(FILE *write_to)
 "       --final-cycle                   Last cycle for each standard (non-index) read. Comma separated list.\n"
 "       --first-index-cycle             First cycle for each index read. Comma separated list.\n"
 "       --final-index-cycle             Last cycle for each index read. Comma separated list.\n"
+"       --watch                         Process the run while it is still being written by the sequencer. Each\n"
+"                                       BCL file is used as soon as it is complete (the run has finished, or the\n"
+"                                       file has not changed for --watch-interval seconds). All tiles are loaded\n"
+"                                       together, so use --max-memory to limit how many are open at once\n"
+"       --watch-interval                Seconds between checks of the runfolder [default: " DEFAULT_WATCH_INTERVAL "]\n"
+"       --watch-timeout                 Give up if no file has been completed for this many seconds. 0 means\n"
+"                                       wait forever [default: " DEFAULT_WATCH_TIMEOUT "]\n"
 "  -q   --queue-len                     Size of output record queue (number of records) [default " QUEUELEN "]\n"
+"       --max-open-files                Maximum number of BCL files to keep open. 0 means use most of the\n"
+"                                       open file limit (ulimit -n) [default: 0]\n"
+"       --max-memory                    Approximate limit on memory used for tile data and queued records.\n"
+"                                       May have a K, M or G suffix. 0 means no limit [default: 0]\n"
 "  -S   --no-index-separator            Do NOT separate dual indexes with a '" INDEX_SEPARATOR "' character. Just concatenate instead.\n"
 "  -v   --verbose                       verbose output\n"
 "  -t   --threads                       maximum number of threads to use [default: " DEFAULT_MAX_THREADS "]\n"
+"       --io-threads                    Use this many threads to load BCL files, instead of adjusting the\n"
+"                                       number of concurrent loads as the run progresses\n"
+"       --compress-threads              Use this many threads to compress the output, instead of sharing\n"
+"                                       the pool with record building\n"
+"       --numa                          Split the threads between the NUMA nodes, and process tiles on each\n"
+"                                       node in parallel so that tile data stays in node-local memory. The\n"
+"                                       lane output files are compressed on the nodes in turn, so one lane\n"
+"                                       is compressed on one node\n"
+"       --tile-index                    Write an index of where each tile starts in the output file to\n"
+"                                       <output-file>.tileidx, so that tiles can be read in parallel. BAM only\n"
+"       --qual-bin                      Bin quality values. Either 'illumina8' (8-level binning), 'illumina4'\n"
+"                                       (4-level binning), or a file with lines of 'low high binned-value'\n"
 "       --output-fmt                    [sam/bam/cram] [default: bam]\n"
 "       --compression-level             [0..9]\n"
 "Barcode decoding options:\n"
@@ -502,6 +727,16 @@ static opts_t* i2b_parse_args(int argc, char *argv[])
         { "min-mismatch-delta",         1, 0, 0 },
         { "change-read-name",           0, 0, 0 },
         { "ignore-pf",                  0, 0, 0 },
+        { "watch",                      0, 0, 0 },
+        { "qual-bin",                   1, 0, 0 },
+        { "max-memory",                 1, 0, 0 },
+        { "io-threads",                 1, 0, 0 },
+        { "compress-threads",           1, 0, 0 },
+        { "numa",                       0, 0, 0 },
+        { "max-open-files",             1, 0, 0 },
+        { "tile-index",                 0, 0, 0 },
+        { "watch-interval",             1, 0, 0 },
+        { "watch-timeout",              1, 0, 0 },
         { NULL, 0, NULL, 0 }
     };
 
@@ -511,6 +746,7 @@ static opts_t* i2b_parse_args(int argc, char *argv[])
     opts->argv_list = stringify_argv(argc+1, argv-1);
     if (opts->argv_list[strlen(opts->argv_list)-1] == ' ') opts->argv_list[strlen(opts->argv_list)-1] = 0;
 
+    opts->lanes = ia_init(8);
     opts->bc_read = ia_init(5);
     opts->first_cycle = ia_init(5);
     opts->final_cycle = ia_init(5);
@@ -521,6 +757,8 @@ static opts_t* i2b_parse_args(int argc, char *argv[])
     opts->separator = true;
     opts->nthreads = atoi(DEFAULT_MAX_THREADS);
     opts->qlen = atoi(QUEUELEN);
+    opts->watch_interval = atoi(DEFAULT_WATCH_INTERVAL);
+    opts->watch_timeout = atoi(DEFAULT_WATCH_TIMEOUT);
     opts->decode_opts = decode_init_opts(argc - 1, argv + 1);
     opts->decode_tags = false;
     opts->decode_calls_tag = NULL;
@@ -538,7 +776,7 @@ static opts_t* i2b_parse_args(int argc, char *argv[])
                     break;
         case 'o':   opts->output_file = strdup(optarg);
                     break;
-        case 'l':   opts->lane = atoi(optarg);
+        case 'l':   parse_int(opts->lanes, optarg);
                     break;
         case 'v':   opts->verbose++;
                     break;
@@ -574,6 +812,8 @@ static opts_t* i2b_parse_args(int argc, char *argv[])
                     else if (strcmp(arg, "first-index-cycle") == 0)            parse_int(opts->first_index_cycle,optarg);
                     else if (strcmp(arg, "final-index-cycle") == 0)            parse_int(opts->final_index_cycle,optarg);
                     else if (strcmp(arg, "metrics-file") == 0) {
+                        free(opts->metrics_file);
+                        opts->metrics_file = strdup(optarg);
                         set_decode_opt_metrics_name(opts->decode_opts, optarg);
                         opts->write_decode_metrics = true;
                     } else if (strcmp(arg, "barcode-file") == 0) {
@@ -591,6 +831,29 @@ static opts_t* i2b_parse_args(int argc, char *argv[])
                         set_decode_opt_change_read_name(opts->decode_opts, true);
                         opts->change_read_name = true;
                     } else if (strcmp(arg, "ignore-pf") == 0)                    set_decode_opt_ignore_pf(opts->decode_opts, true);
+                    else if (strcmp(arg, "watch") == 0)                        opts->watch = true;
+                    else if (strcmp(arg, "max-memory") == 0) {
+                        if (parseMemory(optarg, &opts->max_memory) < 0) {
+                            fprintf(stderr,"Invalid max-memory: %s\n", optarg);
+                            i2b_free_opts(opts);
+                            return NULL;
+                        }
+                    }
+                    else if (strcmp(arg, "qual-bin") == 0) {
+                        if (qualbin_make_map(optarg, opts->qual_map) < 0) {
+                            fprintf(stderr,"Invalid quality binning scheme: %s\n", optarg);
+                            i2b_free_opts(opts);
+                            return NULL;
+                        }
+                        opts->qual_bin = true;
+                    }
+                    else if (strcmp(arg, "io-threads") == 0)                   opts->io_threads = atoi(optarg);
+                    else if (strcmp(arg, "compress-threads") == 0)             opts->compress_threads = atoi(optarg);
+                    else if (strcmp(arg, "numa") == 0)                         opts->numa = true;
+                    else if (strcmp(arg, "max-open-files") == 0)               opts->max_open_files = atoi(optarg);
+                    else if (strcmp(arg, "tile-index") == 0)                   opts->tile_index = true;
+                    else if (strcmp(arg, "watch-interval") == 0)               opts->watch_interval = atoi(optarg);
+                    else if (strcmp(arg, "watch-timeout") == 0)                opts->watch_timeout = atoi(optarg);
                     else {
                         fprintf(stderr,"\nUnknown option: %s\n\n", arg); 
                         usage(stdout); i2b_free_opts(opts);
@@ -615,28 +878,72 @@ static opts_t* i2b_parse_args(int argc, char *argv[])
         usage(stderr); return NULL;
     }
 
-    if (opts->lane <= 0) {
+    if (opts->lanes->end == 0) {
         fprintf(stderr,"You must specify a lane number (-l or --lane)\n");
         usage(stderr); return NULL;
     }
 
-    if (opts->lane > 999) {
-        fprintf(stderr,"I can't handle a lane number greater than 999\n");
-        usage(stderr); return NULL;
+    for (int n = 0; n < opts->lanes->end; n++) {
+        int lane = opts->lanes->entries[n];
+        if (lane <= 0) {
+            fprintf(stderr,"Invalid lane number: %d\n", lane);
+            usage(stderr); return NULL;
+        }
+        if (lane > 999) {
+            fprintf(stderr,"I can't handle a lane number greater than 999\n");
+            usage(stderr); return NULL;
+        }
+        for (int m = 0; m < n; m++) {
+            if (opts->lanes->entries[m] == lane) {
+                fprintf(stderr,"Lane %d has been specified more than once\n", lane);
+                usage(stderr); return NULL;
+            }
+        }
     }
-
     if (!opts->output_file) {
         fprintf(stderr,"You must specify an output file (-o or --output-file)\n");
         usage(stderr); return NULL;
     }
 
+    if (opts->lanes->end > 1) {
+        if (!strstr(opts->output_file, "%d")) {
+            fprintf(stderr,"Output file name must contain '%%d' when processing more than one lane\n");
+            usage(stderr); return NULL;
+        }
+        if (opts->write_decode_metrics && !strstr(opts->metrics_file, "%d")) {
+            fprintf(stderr,"Metrics file name must contain '%%d' when processing more than one lane\n");
+            usage(stderr); return NULL;
+        }
+    }
+
     if (opts->compression_level && !isdigit(opts->compression_level)) {
         fprintf(stderr, "compression-level must be a digit in the range [0..9], not '%c'\n", opts->compression_level);
         usage(stderr); return NULL;
     }
 
+    if (opts->qlen <= 0) {
+        fprintf(stderr,"queue-len must be greater than zero\n");
+        usage(stderr); return NULL;
+    }
+
+    if (opts->watch && opts->watch_interval <= 0) {
+        fprintf(stderr,"watch-interval must be greater than zero\n");
+        usage(stderr); return NULL;
+    }
+
+    if (opts->max_open_files < 0) {
+        fprintf(stderr,"max-open-files must not be negative\n");
+        usage(stderr); return NULL;
+    }
+
+    if (opts->io_threads < 0 || opts->compress_threads < 0) {
+        fprintf(stderr,"io-threads and compress-threads must not be negative\n");
+        usage(stderr); return NULL;
+    }
+
     if (opts->nthreads < 4) opts->nthreads = 4;
-    opts->pool_size = opts->nthreads - 3;
+    opts->pool_size = opts->nthreads - 3 - opts->io_threads - opts->compress_threads;
+    if (opts->pool_size < 1) opts->pool_size = 1;
 
     // Set defaults
     if (!opts->read_group_id) opts->read_group_id = strdup("1");
@@ -687,15 +994,20 @@ static opts_t* i2b_parse_args(int argc, char *argv[])
     if (!opts->run_folder) { perror("run_folder"); return NULL; }
     free(tmp);
 
-    if (!opts->platform_unit) {
-        // default is runfolder + lane
-        char *rf = basename(opts->run_folder);
-        opts->platform_unit = calloc(1, strlen(rf) + 5);
-        sprintf(opts->platform_unit, "%s_%d", rf, opts->lane);
-    }
+    // default is runfolder + lane, which is filled in for each lane's header
+    if (!opts->platform_unit) opts->default_platform_unit = true;
 
     // Once we have a basecalls directory, we can find the machine type
     machineType = determineMachineType(opts->basecalls_dir);
+    if (opts->watch) {
+        // the first cycle may not have been written yet
+        time_t start = time(NULL);
+        while (machineType == MT_UNKNOWN) {
+            if (opts->watch_timeout && time(NULL) - start > opts->watch_timeout) break;
+            sleep(opts->watch_interval);
+            machineType = determineMachineType(opts->basecalls_dir);
+        }
+    }
     if (machineType == MT_UNKNOWN) die("Unable to determine machine type\n");
     if (opts->verbose) {
         if (machineType == MT_MISEQ) display("Machine Type: MISEQ\n");
@@ -800,7 +1112,7 @@ static void sam_hdr_unparse(SAM_hdr *sh, bam_hdr_t *h)
 /*
  * Add the header lines to the BAM file
  */
-static int addHeader(samFile *output_file, bam_hdr_t *output_header, opts_t *opts)
+static int addHeader(samFile *output_file, bam_hdr_t *output_header, const char *platform_unit, opts_t *opts)
 {
     SAM_hdr *sh = sam_hdr_parse_(output_header->text,output_header->l_text);
     char *version = NULL;
@@ -824,7 +1136,7 @@ static int addHeader(samFile *output_file, bam_hdr_t *output_header, opts_t *opt
     if (opts->barcodeArray) {
         size_t longest_name = find_longest_barcode_name(opts->barcodeArray);
         char *id = malloc(strlen(opts->read_group_id) + longest_name + 2);
-        char *pu = malloc(strlen(opts->platform_unit) + longest_name + 2);
+        char *pu = malloc(strlen(platform_unit) + longest_name + 2);
         if (!id || !pu) die("Out of memory");
         for (int idx = 0; ; idx++) {
             const char *name = NULL, *lib = NULL, *sample = NULL, *desc = NULL;
@@ -835,7 +1147,7 @@ static int addHeader(samFile *output_file, bam_hdr_t *output_header, opts_t *opt
                 desc   = opts->study_name;
             }
             sprintf(id, "%s#%s", opts->read_group_id, name);
-            sprintf(pu, "%s#%s", opts->platform_unit, name);
+            sprintf(pu, "%s#%s", platform_unit, name);
             sam_hdr_add(sh, "RG",
                         "ID", id,
                         "DT", opts->run_start_date,
@@ -854,7 +1166,7 @@ static int addHeader(samFile *output_file, bam_hdr_t *output_header, opts_t *opt
         sam_hdr_add(sh, "RG",
                         "ID", opts->read_group_id,
                         "DT", opts->run_start_date,
-                        "PU", opts->platform_unit,
+                        "PU", platform_unit,
                         "LB", opts->library_name,
                         "PG", "SCS",
                         "SM", opts->sample_alias,
@@ -942,12 +1254,12 @@ static char *getId(opts_t *opts)
  * Load the tile index array (the BCI file)
  * This is only for NextSeq 
  */
-static va_t *getTileIndex(opts_t *opts)
+static va_t *getTileIndex(int lane, opts_t *opts)
 {
     va_t *tileIndex = NULL;
     if (machineType != MT_NEXTSEQ) return tileIndex;
     char *fname = calloc(1,strlen(opts->basecalls_dir)+64);
-    sprintf(fname, "%s/L%03d/s_%d.bci", opts->basecalls_dir, opts->lane, opts->lane);
+    sprintf(fname, "%s/L%03d/s_%d.bci", opts->basecalls_dir, lane, lane);
     FILE *fhandle = fopen(fname, "rb");
     if (fhandle == NULL) die("Can't open BCI file %s\n", fname);
     tileIndex = va_init(100,free);
@@ -976,7 +1288,7 @@ static va_t *getTileIndex(opts_t *opts)
 /*
  * load tile list from basecallsConfig or intensityConfig
  */
-static ia_t *getTileList(opts_t *opts)
+static ia_t *getTileList(int lane, opts_t *opts)
 {
     ia_t *tiles = ia_init(100);
     xmlXPathObjectPtr ptr;
@@ -985,7 +1297,7 @@ static ia_t *getTileList(opts_t *opts)
 
     doc = opts->basecallsConfig ? opts->basecallsConfig : opts->intensityConfig;
 
-    sprintf(xpath, "//TileSelection/Lane[@Index=\"%d\"]/Tile", opts->lane);
+    sprintf(xpath, "//TileSelection/Lane[@Index=\"%d\"]/Tile", lane);
     assert(strlen(xpath) < 64);
     ptr = getnodeset(doc, xpath);
     free(xpath);
@@ -1008,10 +1320,10 @@ static ia_t *getTileList(opts_t *opts)
                 char *t = (char *)ptr->nodesetval->nodeTab[n]->children->content;
                 char *saveptr;
                 assert(t != NULL);
-                char *lane = strtok_r(t, "_", &saveptr);
+                char *tlane = strtok_r(t, "_", &saveptr);
                 char *tileno = strtok_r(NULL, "_", &saveptr);
-                if (lane && tileno) {
-                    if (atoi(lane) == opts->lane) {
+                if (tlane && tileno) {
+                    if (atoi(tlane) == lane) {
                         ia_push(tiles,atoi(tileno));
                     }
                 }
@@ -1228,6 +1540,73 @@ static int findClusters(int tile, va_t *tileIndex)
     return -1;
 }
 
+/*
+ * Watch mode.
+ *
+ * A file is complete once the run has finished (RTAComplete.txt or
+ * CopyComplete.txt is in the runfolder), or when it has not been modified
+ * for watch_interval seconds and its size has stopped changing.
+ */
+static bool runComplete(opts_t *opts)
+{
+    static const char *markers[] = { "RTAComplete.txt", "CopyComplete.txt" };
+    bool complete = false;
+    char *fname;
+
+    // not remembered in opts, as the workers of each lane check it
+    fname = calloc(1, strlen(opts->run_folder) + 32);
+    if (!fname) die("Out of memory");
+    for (int n = 0; n < sizeof(markers) / sizeof(markers[0]) && !complete; n++) {
+        sprintf(fname, "%s/%s", opts->run_folder, markers[n]);
+        if (access(fname, F_OK) == 0) complete = true;
+    }
+    free(fname);
+    return complete;
+}
+
+/*
+ * Check whether one of the candidate files is complete, and return its
+ * index, or -1 if none of them is yet. last_size holds the size of each
+ * file at the previous check (-1 to start with).
+ */
+static int fileReady(char **fnames, int nfiles, off_t *last_size, opts_t *opts)
+{
+    bool complete = runComplete(opts);
+    struct stat st;
+    int found = -1;
+
+    for (int n = 0; n < nfiles && found < 0; n++) {
+        if (stat(fnames[n], &st) != 0) { last_size[n] = -1; continue; }
+        if (complete
+            || time(NULL) - st.st_mtime >= opts->watch_interval
+            || (st.st_size > 0 && st.st_size == last_size[n])) {
+            found = n;
+        }
+        last_size[n] = st.st_size;
+    }
+    return found;
+}
+
+/*
+ * Check whether the filter file of a tile is complete.
+ * last_size must have room for 3 entries.
+ */
+static bool filterFileReady(int tile, int lane, off_t *last_size, opts_t *opts)
+{
+    char *fnames[3];
+    int found;
+    for (int n = 0; n < 3; n++) {
+        fnames[n] = calloc(1, strlen(opts->basecalls_dir) + 128);
+        if (!fnames[n]) die("Out of memory");
+    }
+    sprintf(fnames[0], "%s/L%03d/s_%d_%04d.filter", opts->basecalls_dir, lane, lane, tile);
+    sprintf(fnames[1], "%s/s_%d_%04d.filter", opts->basecalls_dir, lane, tile);
+    sprintf(fnames[2], "%s/L%03d/s_%d.filter", opts->basecalls_dir, lane, lane);
+    found = fileReady(fnames, 3, last_size, opts);
+    for (int n = 0; n < 3; n++) free(fnames[n]);
+    return found >= 0;
+}
+
 /*
  * Open the position file
  *
@@ -1236,18 +1615,18 @@ static int findClusters(int tile, va_t *tileIndex)
  * Open and return the first one found, or NULL if not found.
  */
 
-static posfile_t *openPositionFile(int tile, va_t *tileIndex, opts_t *opts)
+static posfile_t *openPositionFile(int tile, int lane, va_t *tileIndex, opts_t *opts)
 {
     posfile_t *posfile = NULL;
 
     char *fname = calloc(1, strlen(opts->intensity_dir)+64);
 
-    sprintf(fname, "%s/L%03d/s_%d_%04d.clocs", opts->intensity_dir, opts->lane, opts->lane, tile);
+    sprintf(fname, "%s/L%03d/s_%d_%04d.clocs", opts->intensity_dir, lane, lane, tile);
     posfile = posfile_open(fname);
 
     if (posfile->errmsg) {
         posfile_close(posfile);
-        sprintf(fname, "%s/L%03d/s_%d_%04d.locs", opts->intensity_dir, opts->lane, opts->lane, tile);
+        sprintf(fname, "%s/L%03d/s_%d_%04d.locs", opts->intensity_dir, lane, lane, tile);
         posfile = posfile_open(fname);
     }
 
@@ -1260,12 +1639,12 @@ static posfile_t *openPositionFile(int tile, va_t *tileIndex, opts_t *opts)
     // if still not found, try NewSeq format files
     if (posfile->errmsg) {
         posfile_close(posfile);
-        sprintf(fname, "%s/L%03d/s_%d.clocs", opts->intensity_dir, opts->lane, opts->lane);
+        sprintf(fname, "%s/L%03d/s_%d.clocs", opts->intensity_dir, lane, lane);
         posfile = posfile_open(fname);
 
         if (posfile->errmsg) {
             posfile_close(posfile);
-            sprintf(fname, "%s/L%03d/s_%d.locs", opts->intensity_dir, opts->lane, opts->lane);
+            sprintf(fname, "%s/L%03d/s_%d.locs", opts->intensity_dir, lane, lane);
             posfile = posfile_open(fname);
         }
 
@@ -1291,21 +1670,21 @@ static posfile_t *openPositionFile(int tile, va_t *tileIndex, opts_t *opts)
 /*
  * find and open the filter file
  */
-static filter_t *openFilterFile(int tile, va_t *tileIndex, opts_t *opts)
+static filter_t *openFilterFile(int tile, int lane, va_t *tileIndex, opts_t *opts)
 {
     filter_t *filter = NULL;
     char *fname = calloc(1,strlen(opts->basecalls_dir)+128); // a bit arbitrary :-(
 
-    sprintf(fname, "%s/L%03d/s_%d_%04d.filter", opts->basecalls_dir, opts->lane, opts->lane, tile);
+    sprintf(fname, "%s/L%03d/s_%d_%04d.filter", opts->basecalls_dir, lane, lane, tile);
     filter = filter_open(fname);
     if (filter->errmsg) {
         filter_close(filter);
-        sprintf(fname, "%s/s_%d_%04d.filter", opts->basecalls_dir, opts->lane, tile);
+        sprintf(fname, "%s/s_%d_%04d.filter", opts->basecalls_dir, lane, tile);
         filter = filter_open(fname);
     }
     if (filter->errmsg) {
         filter_close(filter);
-        sprintf(fname, "%s/L%03d/s_%d.filter", opts->basecalls_dir, opts->lane, opts->lane);
+        sprintf(fname, "%s/L%03d/s_%d.filter", opts->basecalls_dir, lane, lane);
         filter = filter_open(fname);
     }
 
@@ -1333,6 +1712,12 @@ static  bclfile_t *get_cached_bclfile(lockable_bcl_cache *bcl_cache, int lane, i
      return bcl;
 }
 
+// Memory held by a cache entry, apart from the tile data which is charged per tile
+static size_t bclCacheEntrySize(bclfile_t *bcl)
+{
+    return sizeof(*bcl) + bcl->tiles->end * (sizeof(tilerec_t) + sizeof(void *));
+}
+
 static void insert_bclfile_to_cache(bclfile_t *bcl, lockable_bcl_cache *bcl_cache, int lane, int cycle, int surface) {
     khint32_t key;
     khiter_t i;
@@ -1348,6 +1733,7 @@ static void insert_bclfile_to_cache(bclfile_t *bcl, lockable_bcl_cache *bcl_cach
     bcl->is_cached = 1; // Prevent premature close
     kh_value(bcl_cache->cache, i) = bcl;
     if (pthread_mutex_unlock(&bcl_cache->lock) < 0) die("pthread_mutex_unlock failed\n");
+    mem_charge(bcl_cache->mem, bclCacheEntrySize(bcl));
 }
 
 static void clear_bcl_cache(lockable_bcl_cache *bcl_cache) {
@@ -1359,6 +1745,7 @@ static void clear_bcl_cache(lockable_bcl_cache *bcl_cache) {
         bclfile_t *bcl;
         if (!kh_exist(bcl_cache->cache, k)) continue;
         bcl = kh_value(bcl_cache->cache, k);
+        mem_release(bcl_cache->mem, bclCacheEntrySize(bcl));
         bcl->is_cached = 0;
         bclfile_close(bcl);
         kh_value(bcl_cache->cache, k) = NULL;
@@ -1369,11 +1756,10 @@ static void clear_bcl_cache(lockable_bcl_cache *bcl_cache) {
 }
 
 /*
- * Open a single bcl file
+ * Make the name of a single bcl file
  */
-static bclfile_t *openBclFile(char *basecalls, int lane, int tile, int cycle, int surface, va_t *tileIndex, filter_t *filter)
+static char *bclFileName(char *basecalls, int lane, int tile, int cycle, int surface)
 {
-    bclfile_t *bcl = NULL;
     char *fname = calloc(1, strlen(basecalls)+128);
     if (!fname) die("Out of memory");
 
@@ -1393,7 +1779,18 @@ static bclfile_t *openBclFile(char *basecalls, int lane, int tile, int cycle, in
         sprintf(fname, "%s/L%03d/C%d.1/s_%d_%04d.bcl", basecalls, lane, cycle, lane, tile);
     }
 
-    bcl = bclfile_open(fname, machineType, tile);
+    return fname;
+}
+
+/*
+ * Open a single bcl file
+ */
+static bclfile_t *openBclFile(char *basecalls, int lane, int tile, int cycle, int surface, va_t *tileIndex, filter_t *filter, const uint8_t *qual_map, bcl_fd_cache_t *fd_cache)
+{
+    bclfile_t *bcl = NULL;
+    char *fname = bclFileName(basecalls, lane, tile, cycle, surface);
+
+    bcl = bclfile_open(fname, machineType, tile, qual_map, fd_cache);
 
     if (bcl->errmsg) {
         bclfile_close(bcl);
@@ -1418,6 +1815,7 @@ struct bcl_opt {
     hts_tpool_process *q;
     cycleRangeEntry_t *cr;
     opts_t *opts;
+    int lane;
     int tile;
     int cycle;
     int surface;
@@ -1427,19 +1825,22 @@ struct bcl_opt {
     va_t *bclFileArray;
     lockable_bcl_cache *bcl_cache;
     pthread_mutex_t *lock;
+    int node;
 };
 
 static void *bcl_thread(void *arg)
 {
     struct bcl_opt *o = (struct bcl_opt *)arg;
     bclfile_t *bcl = NULL;
+    numautil_bind(o->node);   // so the tile data is allocated on this node
     if (o->bcl_cache) {
-        bcl = get_cached_bclfile(o->bcl_cache, o->opts->lane, o->cycle, o->surface);
+        bcl = get_cached_bclfile(o->bcl_cache, o->lane, o->cycle, o->surface);
     }
     if (!bcl) {
-        bcl = openBclFile(o->opts->basecalls_dir, o->opts->lane, o->tile, o->cycle, o->surface, o->tileIndex, o->filter);
+        bcl = openBclFile(o->opts->basecalls_dir, o->lane, o->tile, o->cycle, o->surface, o->tileIndex, o->filter,
+                          o->opts->qual_bin ? o->opts->qual_map : NULL, o->opts->fd_cache);
         if (o->bcl_cache) {
-            insert_bclfile_to_cache(bcl, o->bcl_cache, o->opts->lane, o->cycle, o->surface);
+            insert_bclfile_to_cache(bcl, o->bcl_cache, o->lane, o->cycle, o->surface);
         }
     }
 
@@ -1464,12 +1865,13 @@ static void *bcl_thread(void *arg)
     return NULL;
 }
 
-static va_t *openBclFiles(va_t *cycleRange, opts_t *opts, int tile, int next_tile, va_t *tileIndex, filter_t *filter, hts_tpool *p, lockable_bcl_cache *bcl_cache)
+/*
+ * Make an array with a slot for each of a tile's bcl files, in the order
+ * cycle range, surface, cycle
+ */
+static va_t *newBclReadArray(va_t *cycleRange)
 {
-    pthread_mutex_t bcl_array_lock = PTHREAD_MUTEX_INITIALIZER;
     va_t *bclReadArray = va_init(cycleRange->end * 2, freeBCLReadArray);
-    hts_tpool_process *q = hts_tpool_process_init(p, 2 * opts->pool_size, 1);
-    if (!q) die("hts_tpool_process_init failed\n");
 
     for (int n=0; n < cycleRange->end; n++) {
         for (int surface = 1; surface <= 2; surface++) {
@@ -1484,41 +1886,98 @@ static va_t *openBclFiles(va_t *cycleRange, opts_t *opts, int tile, int next_til
 
             va_push(bclReadArray,ra);
 
-            struct bcl_opt o = { p, q, cr, opts, tile, 0, surface, next_tile, tileIndex, filter, ra->bclFileArray, bcl_cache, &bcl_array_lock };
-
             for (int cycle = cr->first; cycle <= cr->last; cycle++) {
                 va_push(ra->bclFileArray, NULL);
             }
-            for (int cycle = cr->first; cycle <= cr->last; cycle++) {
+        }
+    }
+    return bclReadArray;
+}
+
+/*
+ * Load the bcl files which are not in bclReadArray yet, using the thread pool.
+ * In watch mode last_size is not NULL, and only the files which are complete
+ * are loaded; it holds the size of each file at the previous call.
+ */
+static void loadBclFiles(va_t *bclReadArray, va_t *cycleRange, opts_t *opts, int lane, int tile, int next_tile, va_t *tileIndex, filter_t *filter, thread_sched_t *sched, lockable_bcl_cache *bcl_cache, off_t *last_size)
+{
+    pthread_mutex_t bcl_array_lock = PTHREAD_MUTEX_INITIALIZER;
+    hts_tpool *p = sched->io_pool;
+    hts_tpool_process *q = hts_tpool_process_init(p, 2 * sched->io_max, 0);
+    if (!q) die("hts_tpool_process_init failed\n");
+    int in_flight = 0;
+    int slot = 0;
+
+    for (int n=0; n < cycleRange->end; n++) {
+        for (int surface = 1; surface <= 2; surface++) {
+            cycleRangeEntry_t *cr = cycleRange->entries[n];
+            bclReadArrayEntry_t *ra = bclReadArray->entries[n * 2 + surface - 1];
+
+            struct bcl_opt o = { p, q, cr, opts, lane, tile, 0, surface, next_tile, tileIndex, filter, ra->bclFileArray, bcl_cache, &bcl_array_lock, sched->node };
+
+            for (int cycle = cr->first; cycle <= cr->last; cycle++, slot++) {
+                // slots are only filled by the loads dispatched here, so no lock is needed to check one
+                if (ra->bclFileArray->entries[cycle - cr->first]) continue;
+                if (last_size) {
+                    char *fname = bclFileName(opts->basecalls_dir, lane, tile, cycle, surface);
+                    int ready = fileReady(&fname, 1, &last_size[slot], opts);
+                    free(fname);
+                    if (ready < 0) continue;
+                }
                 struct bcl_opt *o2 = malloc(sizeof(*o2));
                 if (!o2) die("Out of memory");
                 memcpy(o2, &o, sizeof(o));
                 o2->cycle = cycle;
+                // Limit the number of files being loaded at once
+                while (in_flight >= sched->io_jobs) {
+                    hts_tpool_delete_result(hts_tpool_next_result_wait(q), 0);
+                    in_flight--;
+                }
                 if (hts_tpool_dispatch(p, q, bcl_thread, o2) < 0) {
                     die("Thread pool dispatch failed");
                 }
+                in_flight++;
             }
-            hts_tpool_process_flush(q);
         }
     }
 
     // Wait for all the jobs to finish
-    hts_tpool_process_flush(q);
+    while (in_flight > 0) {
+        hts_tpool_delete_result(hts_tpool_next_result_wait(q), 0);
+        in_flight--;
+    }
     hts_tpool_process_destroy(q);
+}
 
-    // Check we got all the bcl files
+/*
+ * Count the bcl files not loaded yet, and how many of them are for read 2
+ */
+static int missingBclFiles(va_t *bclReadArray, int *missing_read2)
+{
     int missing = 0;
-    if (pthread_mutex_lock(&bcl_array_lock) < 0) die("Mutex lock failed\n");
+    if (missing_read2) *missing_read2 = 0;
     for (int n=0; n < bclReadArray->end; n++) {
         bclReadArrayEntry_t *ra = bclReadArray->entries[n];
         for (int i = 0; i < ra->bclFileArray->end; i++) {
-            if (ra->bclFileArray->entries[i] == NULL) ++missing;
+            if (ra->bclFileArray->entries[i] != NULL) continue;
+            missing++;
+            if (missing_read2 && strcmp(ra->readname, "read2") == 0) (*missing_read2)++;
         }
     }
-    if (pthread_mutex_unlock(&bcl_array_lock) < 0) die("Mutex unlock failed\n");
-    if (missing > 0) die("Missing %d bcl files\b", missing);
+    return missing;
+}
 
-    return bclReadArray;
+/*
+ * Number of bcl files in bclReadArray
+ */
+static int bclFileCount(va_t *bclReadArray)
+{
+    int count = 0;
+    for (int n=0; n < bclReadArray->end; n++) {
+        bclReadArrayEntry_t *ra = bclReadArray->entries[n];
+        count += ra->bclFileArray->end;
+    }
+    return count;
 }
 
 /*
@@ -1595,14 +2054,24 @@ struct processRecordResult_struct {
     bam1_t *records;
     unsigned char *data;
     size_t num_records;
+    char **barcode_names;   // decoded barcode of each cluster, or NULL
 };
 
+/*
+ * In watch mode the records are built in two passes: read 1 (and the
+ * barcodes, which come from the index reads) as soon as those cycles are
+ * loaded, then read 2 once it lands. Otherwise they are built in one go.
+ */
+enum record_pass { PASS_ALL, PASS_FIRST, PASS_FINISH };
+
 struct barcode_bcl_files {
     char tag[2];           // tag type
     va_t *bcl_files_array; // bcl files with the tag data
 };
 
 struct processRecordJob_struct {
+    int node;
+    enum record_pass pass;
     int start_cluster;
     int end_cluster;
     int tile;
@@ -1623,9 +2092,11 @@ struct processRecordJob_struct {
     size_t read_len[2];
     size_t total_bc_tag_len[2];
     size_t max_data_len[2];
+    size_t mem_charged;
     va_t *barcodeArray;
     HashTable *barcodes_hash;
     HashTable *tag_hops;
+    bc_counter_set_t *counters;
     struct barcode_bcl_files *decode_calls;
     struct processRecordResult_struct results;
     struct processRecordJob_struct *next;
@@ -1699,7 +2170,8 @@ static void bam_add_names(bam1_t *recs, struct processRecordJob_struct *job,
 
 static void bam_add_calls_quals(bam1_t *recs,
                                 struct processRecordJob_struct *job,
-                                int cluster_from, int cluster_to, int nreads) {
+                                int cluster_from, int cluster_to, int nreads,
+                                int rd_from, int rd_to) {
     // Table to convert calls from ASCII to BAM nibble encoding
     static const char L[256] = {
         15,15,15,15,15,15,15,15,15,15,15,15,15,15,15,15,
@@ -1721,18 +2193,15 @@ static void bam_add_calls_quals(bam1_t *recs,
     };
     int nrecs = (cluster_to - cluster_from) * nreads;
 
-    // paranoia check - will base calls be in the right place?
-    for (int i = 0; i < nrecs; i++) {
-        assert(bam_get_seq(&recs[i]) == &recs[i].data[recs[i].l_data]);
-    }
-    // paranoia check - enough room for base calls and qualities?
-    for (int rd = 0; rd < nreads; rd++) {
+    // paranoia check - will base calls be in the right place, with enough room for them and the qualities?
+    for (int rd = rd_from; rd < rd_to; rd++) {
         for (int i = rd; i < nrecs; i+=nreads) {
+            assert(bam_get_seq(&recs[i]) == &recs[i].data[recs[i].l_data]);
             assert(recs[i].l_data + ((job->read_files[rd]->end + 1) >> 1) + job->read_files[rd]->end <= recs[i].m_data);
         }
     }
 
-    for (int rd = 0; rd < nreads; rd++) {
+    for (int rd = rd_from; rd < rd_to; rd++) {
         int cycle;
         // Bam packs two bases into each byte.
         for (cycle = 0; cycle < job->read_files[rd]->end - 1; cycle+=2) {
@@ -1777,28 +2246,27 @@ static void bam_add_calls_quals(bam1_t *recs,
 static void bam_add_rg_tags(bam1_t *recs,
                             struct processRecordJob_struct *job,
                             int cluster_from, int cluster_to, int nreads,
-                            char **barcodes) {
+                            int rd_from, int rd_to, char **barcodes) {
     int nrecs = (cluster_to - cluster_from) * nreads;
 
     // Note: job->read_group_tag_len includes the RGZ and trailing NUL
-    for (int i = 0; i < nrecs; i++) {
-        // paranoia check - enough room for RG tag?
-        assert(recs[i].l_data + job->read_group_tag_len <= recs[i].m_data);
-        memcpy(&recs[i].data[recs[i].l_data], "RGZ", 3);
-        memcpy(&recs[i].data[recs[i].l_data + 3], job->opts->read_group_id, job->read_group_tag_len - 3);
-        recs[i].l_data += job->read_group_tag_len;
+    for (int rd = rd_from; rd < rd_to; rd++) {
+        for (int i = rd; i < nrecs; i += nreads) {
+            // paranoia check - enough room for RG tag?
+            assert(recs[i].l_data + job->read_group_tag_len <= recs[i].m_data);
+            memcpy(&recs[i].data[recs[i].l_data], "RGZ", 3);
+            memcpy(&recs[i].data[recs[i].l_data + 3], job->opts->read_group_id, job->read_group_tag_len - 3);
+            recs[i].l_data += job->read_group_tag_len;
+        }
     }
     if (barcodes) {
         for (int c = 0; c < cluster_to - cluster_from; c++) {
             size_t bc_len = strlen(barcodes[c]);
-            int i = c * nreads;
-            recs[i].data[recs[i].l_data - 1] = '#';
-            memcpy(&recs[i].data[recs[i].l_data], barcodes[c], bc_len + 1);
-            recs[i].l_data += bc_len + 1;
-            if (nreads > 1) {
-                recs[i + 1].data[recs[i + 1].l_data - 1] = '#';
-                memcpy(&recs[i + 1].data[recs[i + 1].l_data], barcodes[c], bc_len + 1);
-                recs[i + 1].l_data += bc_len + 1;
+            for (int rd = rd_from; rd < rd_to; rd++) {
+                int i = c * nreads + rd;
+                recs[i].data[recs[i].l_data - 1] = '#';
+                memcpy(&recs[i].data[recs[i].l_data], barcodes[c], bc_len + 1);
+                recs[i].l_data += bc_len + 1;
             }
         }
     }
@@ -1850,13 +2318,13 @@ static void get_barcodes(char *buffer, unsigned int bc_len,
 /*
  * Decode sequence barcodes
  */
-static char **decode_tags(bam1_t *recs,
-                          struct processRecordJob_struct *job,
-                          int cluster_from, int cluster_to, int nreads)
+static void decode_tags(bam1_t *recs,
+                        struct processRecordJob_struct *job,
+                        int cluster_from, int cluster_to, int nreads,
+                        char **barcode_names)
 {
     size_t index_separator_len = strlen(INDEX_SEPARATOR);
     char *barcode_calls = NULL;
-    char **barcode_names = NULL;
     int nclusters = cluster_to - cluster_from;
     size_t bc_len = 1;
     int mlq = job->opts->convert_low_quality ? job->opts->max_low_quality_to_convert : -1;
@@ -1872,8 +2340,7 @@ static char **decode_tags(bam1_t *recs,
     }
 
     barcode_calls = malloc(nclusters * bc_len);
-    barcode_names = malloc(nclusters * sizeof(*barcode_names));
-    if (!barcode_names || !barcode_calls) die("Out of memory");
+    if (!barcode_calls) die("Out of memory");
 
     get_barcodes(barcode_calls, bc_len, job->decode_calls,
                  cluster_from, cluster_to, mlq, INDEX_SEPARATOR,
@@ -1884,14 +2351,13 @@ static char **decode_tags(bam1_t *recs,
         if (is_pf || job->opts->no_filter) {
             barcode_names[c] = findBarcodeName(barcode_calls + c * bc_len,
                                                job->barcodeArray, job->barcodes_hash,
-                                               job->tag_hops, job->opts->decode_opts,
+                                               job->tag_hops, job->counters, job->opts->decode_opts,
                                                is_pf, true);
         } else {
             barcode_names[c] = ""; // Won't be used, anyway.
         }
     }
     free(barcode_calls);
-    return barcode_names;
 }
 
 /*
@@ -1947,19 +2413,20 @@ static void bam_write_barcode_tag(bam1_t *recs, struct barcode_bcl_files *bcls,
 
 static void bam_add_barcode_tags(bam1_t *recs,
                                  struct processRecordJob_struct *job,
-                                 int cluster_from, int cluster_to, int nreads) {
+                                 int cluster_from, int cluster_to, int nreads,
+                                 int rd_from, int rd_to) {
     size_t index_separator_len = strlen(INDEX_SEPARATOR);
     size_t qual_separator_len = strlen(QUAL_SEPARATOR);
     int nrecs = (cluster_to - cluster_from) * nreads;
 
     // paranoia check - enough room for barcode tags?
-    for (int rd = 0; rd < nreads; rd++) {
+    for (int rd = rd_from; rd < rd_to; rd++) {
         for (int i = rd; i < nrecs; i += nreads) {
             assert(recs[i].l_data + job->total_bc_tag_len[rd] <= recs[i].m_data);
         }
     }
 
-    for (int rd = 0; rd < nreads; rd++) {
+    for (int rd = rd_from; rd < rd_to; rd++) {
         // Alternate between calls and qualities.
         // It's a bit more complicated but puts the two closer together in the
         // output, and better matches what older versions of i2b produced.
@@ -1993,42 +2460,47 @@ static void bam_add_barcode_tags(bam1_t *recs,
 }
 
 /*
- * Build BAM records for a group of clusters.
+ * Build BAM records for a group of clusters, or the reads of them
+ * for this job's pass.
  */
 
 static void processRecordGroup(struct processRecordJob_struct *job, int cluster_from, int cluster_to, struct processRecordResult_struct *res) {
     int nreads = job->read_files[1] != NULL ? 2 : 1;
     int nclusters = cluster_to - cluster_from;
     int nrecs = nclusters * nreads;
+    int rd_from = job->pass == PASS_FINISH ? 1 : 0;
+    int rd_to = job->pass == PASS_FIRST ? 1 : nreads;
     bam1_t *recs = &res->records[(cluster_from - job->start_cluster) * nreads];
-    char **barcode_names = NULL;
+    char **barcode_names = res->barcode_names ? &res->barcode_names[cluster_from - job->start_cluster] : NULL;
     int i;
 
-    // Core bam struct.  Also set up data pointers.
-    bam_fill_core(recs, res->data, job, cluster_from, cluster_to, nreads);
+    if (rd_from == 0) {
+        // Core bam struct.  Also set up data pointers.
+        bam_fill_core(recs, res->data, job, cluster_from, cluster_to, nreads);
 
-    if (job->barcodeArray) {
-        barcode_names = decode_tags(recs, job, cluster_from, cluster_to, nreads);
-    }
+        if (barcode_names) {
+            decode_tags(recs, job, cluster_from, cluster_to, nreads, barcode_names);
+        }
 
-    // Read names
-    bam_add_names(recs, job, cluster_from, cluster_to, nreads, barcode_names);
+        // Read names
+        bam_add_names(recs, job, cluster_from, cluster_to, nreads, barcode_names);
+    }
 
     // Base calls and quality values
-    bam_add_calls_quals(recs, job, cluster_from, cluster_to, nreads);
+    bam_add_calls_quals(recs, job, cluster_from, cluster_to, nreads, rd_from, rd_to);
 
     // paranoia check - will aux tags be in the right place?
-    for (i = 0; i < nrecs; i++) {
-        assert(bam_get_aux(&recs[i]) == &recs[i].data[recs[i].l_data]);
+    for (int rd = rd_from; rd < rd_to; rd++) {
+        for (i = rd; i < nrecs; i += nreads) {
+            assert(bam_get_aux(&recs[i]) == &recs[i].data[recs[i].l_data]);
+        }
     }
 
     // Add RG aux tag
-    bam_add_rg_tags(recs, job, cluster_from, cluster_to, nreads, barcode_names);
+    bam_add_rg_tags(recs, job, cluster_from, cluster_to, nreads, rd_from, rd_to, barcode_names);
 
     // Add barcode tags
-    bam_add_barcode_tags(recs, job, cluster_from, cluster_to, nreads);
-
-    free(barcode_names);
+    bam_add_barcode_tags(recs, job, cluster_from, cluster_to, nreads, rd_from, rd_to);
 }
 
 /*
@@ -2045,11 +2517,19 @@ static void *processRecords(void *arg)
     int is_paired = job_struct->read_files[1] != NULL;
     int num_clusters = job_struct->end_cluster + 1 - job_struct->start_cluster;
     if (!res) die("Out of memory");
-    res->num_records = (is_paired ? 2 : 1) * num_clusters;
-    res->records = calloc(res->num_records, sizeof(bam1_t));
-    if (!res->records) die("Out of memory");
-    res->data = malloc(num_clusters * (job_struct->max_data_len[0] + job_struct->max_data_len[1]));
-    if (!res->data) die("Out of memory");
+    numautil_bind(job_struct->node);
+    if (job_struct->pass != PASS_FINISH) {
+        res->num_records = (is_paired ? 2 : 1) * num_clusters;
+        res->records = calloc(res->num_records, sizeof(bam1_t));
+        if (!res->records) die("Out of memory");
+        res->data = malloc(num_clusters * (job_struct->max_data_len[0] + job_struct->max_data_len[1]));
+        if (!res->data) die("Out of memory");
+        res->barcode_names = NULL;
+        if (job_struct->barcodeArray) {
+            res->barcode_names = malloc(num_clusters * sizeof(*res->barcode_names));
+            if (!res->barcode_names) die("Out of memory");
+        }
+    }
  
     for (int cluster = job_struct->start_cluster; cluster <= job_struct->end_cluster; cluster+=RECORD_GROUP_SIZE) {
         int end = cluster + RECORD_GROUP_SIZE <= job_struct->end_cluster + 1 ? cluster + RECORD_GROUP_SIZE : job_struct->end_cluster + 1;
@@ -2125,93 +2605,272 @@ static struct barcode_bcl_files *find_tag_bcls(va_t *barcode_bcls[2], int nreads
 }
 
 /*
- * Write all the BAM records for a given tile
- * Records are written to the global FIFO queue
+ * Memory held by the decoded bases and qualities of a tile (so far)
  */
-static void processTile(job_data_t *job_data)
+static size_t tileBufferSize(va_t *bclReadArray)
+{
+    size_t sz = 0;
+    for (int n = 0; n < bclReadArray->end; n++) {
+        bclReadArrayEntry_t *ra = bclReadArray->entries[n];
+        for (int i = 0; i < ra->bclFileArray->end; i++) {
+            bclfile_t *bcl = ra->bclFileArray->entries[i];
+            if (bcl) sz += 2 * (size_t)bcl->bases_size;
+        }
+    }
+    return sz;
+}
+
+/*
+ * Worst-case memory used by the results of a processRecords() job
+ */
+static size_t jobMemSize(struct processRecordJob_struct *job)
+{
+    size_t num_clusters = job->end_cluster + 1 - job->start_cluster;
+    size_t nreads = job->read_files[1] ? 2 : 1;
+    return num_clusters * (nreads * sizeof(bam1_t) + job->max_data_len[0] + job->max_data_len[1]);
+}
+
+/*
+ * Choose how many clusters go into each job, so that a full job queue
+ * fits into --queue-len records and the remaining --max-memory budget
+ */
+static int clustersPerJob(struct processRecordJob_struct *job, opts_t *opts, mem_account_t *mem)
+{
+    size_t nreads = job->read_files[1] ? 2 : 1;
+    size_t per_cluster = nreads * sizeof(bam1_t) + job->max_data_len[0] + job->max_data_len[1];
+    size_t max_jobs = 2 * opts->pool_size;
+    size_t avail = mem_available(mem);
+    size_t clusters = CLUSTERS_PER_THREAD;
+
+    if (avail != SIZE_MAX && avail / (per_cluster * max_jobs) < clusters) {
+        clusters = avail / (per_cluster * max_jobs);
+    }
+    if (opts->qlen / nreads < clusters) clusters = opts->qlen / nreads;
+    if (clusters < MIN_CLUSTERS_PER_THREAD) clusters = MIN_CLUSTERS_PER_THREAD;
+    return clusters;
+}
+
+/*
+ * Write the records made by a processRecords() job, free them, and
+ * return the job so it can be reused
+ */
+static struct processRecordJob_struct *writeJobRecords(hts_tpool_result *r, samFile *output_file, bam_hdr_t *output_header, opts_t *opts, mem_account_t *mem, uint64_t *nwritten)
+{
+    struct processRecordJob_struct *job = (struct processRecordJob_struct *) hts_tpool_result_data(r);
+    struct processRecordResult_struct *res = &job->results;
+    for (int n=0; n < res->num_records; n++) {
+        if (!opts->no_filter && (res->records[n].core.flag & BAM_FQCFAIL)) continue;
+        int ret = sam_write1(output_file, output_header, &res->records[n]);
+        if (ret < 0) {
+            die("Problem writing record %s  : r=%d\n", bam_get_qname(&res->records[n]), ret);
+        }
+        (*nwritten)++;
+    }
+    free(res->records);
+    free(res->data);
+    free(res->barcode_names);
+    mem_release(mem, job->mem_charged);
+    hts_tpool_delete_result(r, 0);
+    return job;
+}
+
+/*
+ * Wait until it is this tile's turn to write records
+ */
+static void waitTurn(job_data_t *job_data)
 {
+    tile_order_t *order = job_data->order;
+    if (!order || job_data->my_turn) return;
+    if (pthread_mutex_lock(&order->lock) < 0) die("pthread_mutex_lock failed\n");
+    while (order->next != job_data->seq) pthread_cond_wait(&order->cond, &order->lock);
+    if (pthread_mutex_unlock(&order->lock) < 0) die("pthread_mutex_unlock failed\n");
+    job_data->my_turn = true;
+}
+
+/*
+ * Let the next tile write its records
+ */
+static void endTurn(job_data_t *job_data)
+{
+    tile_order_t *order = job_data->order;
+    if (!order) return;
+    if (pthread_mutex_lock(&order->lock) < 0) die("pthread_mutex_lock failed\n");
+    order->next++;
+    pthread_cond_broadcast(&order->cond);
+    if (pthread_mutex_unlock(&order->lock) < 0) die("pthread_mutex_unlock failed\n");
+}
+
+/*
+ * Get the next finished processRecords() job and write its records,
+ * timing both for the thread scheduler. The records of a first pass job
+ * are kept for its finishing pass instead.
+ * Returns NULL if wait is false and no job has finished.
+ */
+static struct processRecordJob_struct *collectJob(hts_tpool_process *q, bool wait, job_data_t *job_data)
+{
+    double t0 = wallClock();
+    hts_tpool_result *r = wait ? hts_tpool_next_result_wait(q) : hts_tpool_next_result(q);
+    if (!r) return NULL;
+    struct processRecordJob_struct *job = (struct processRecordJob_struct *) hts_tpool_result_data(r);
+    if (job->pass == PASS_FIRST) {
+        hts_tpool_delete_result(r, 0);
+        return job;
+    }
+    waitTurn(job_data);
+    double t1 = wallClock();
+    writeJobRecords(r, job_data->output_file, job_data->output_header, job_data->opts, job_data->mem, &job_data->records_written);
+    job_data->sched->wait_secs += t1 - t0;
+    job_data->sched->write_secs += wallClock() - t1;
+    return job;
+}
+
+/*
+ * A tile being converted. In watch mode this is the partial state of the
+ * tile, kept while it waits for the rest of its cycles.
+ */
+typedef struct {
+    job_data_t *job_data;
+    filter_t *filter;
+    posfile_t *posfile;
+    int max_cluster;
+    char *id;
+    char read_name_prefix[128];
+    size_t read_name_prefix_len;
+    va_t *bclReadArray;
+    size_t tile_mem;            // charged for the BCL data loaded so far
+    int missing;                // BCL files not loaded yet
+    int missing_read2;          // ... of which are read 2 cycles
+    off_t *last_size;           // watch mode: size of each BCL file at the last check
+    bool first_pass_done;       // watch mode: read 1 records have been built
+    struct processRecordJob_struct *partial;       // jobs waiting for read 2, in cluster order
+    struct processRecordJob_struct *job_freelist;
+} tile_data_t;
+
+/*
+ * Open the filter and position files of a tile, ready to load its BCL files
+ */
+static tile_data_t *openTile(job_data_t *job_data)
+{
+    int lane = job_data->lane;
     int tile = job_data->tile;
-    int next_tile = job_data->next_tile;
-    samFile *output_file = job_data->output_file;
-    bam_hdr_t *output_header = job_data->output_header;
-    va_t *cycleRange = job_data->cycleRange;
     va_t *tileIndex = job_data->tileIndex;
     opts_t *opts = job_data->opts;
+    tile_data_t *t = calloc(1, sizeof(tile_data_t));
+    if (!t) die("Out of memory");
+    t->job_data = job_data;
 
-    va_t *bclReadArray;
-    int max_cluster = 0;
-    int surface = bcl_tile2surface(tile);
+    if (opts->verbose) fprintf(stderr,"Processing Lane %d Tile %d\n", lane, tile);
 
-    hts_tpool *p = job_data->thread_p;
-    hts_tpool_process *q = job_data->thread_q;
-    hts_tpool_result *r;
-    char read_name_prefix[128];
-    size_t read_name_prefix_len;
-    size_t index_separator_len = strlen(INDEX_SEPARATOR);
-    size_t qual_separator_len = strlen(QUAL_SEPARATOR);
-    size_t barcode_name_extra = opts->decode_tags && opts->change_read_name ? job_data->longest_barcode_name + 1 : 0;
-    size_t barcode_rg_extra = opts->decode_tags ? job_data->longest_barcode_name + 1 : 0;
+    t->filter = openFilterFile(tile,lane,tileIndex,opts);
+    if (t->filter->errmsg) {
+        die("Can't find filter file for tile %d\n%s\n", tile, t->filter->errmsg);
+    }
 
-    if (opts->verbose) fprintf(stderr,"Processing Tile %d\n", tile);
+    if (tileIndex) t->max_cluster = findClusters(tile, tileIndex);
+    else           t->max_cluster = t->filter->total_clusters;
 
-    filter_t *filter = openFilterFile(tile,tileIndex,opts);
-    if (filter->errmsg) {
-        die("Can't find filter file for tile %d\n%s\n", tile, filter->errmsg);
+    t->posfile = openPositionFile(tile, lane, tileIndex, opts);
+    if (t->posfile->errmsg) {
+        die("Can't find position file for Tile %d\n%s\n", tile, t->posfile->errmsg);
     }
+    posfile_load(t->posfile, t->max_cluster, (machineType == MT_NOVASEQ) ? t->filter : NULL);
+    t->max_cluster = t->posfile->size;
 
-    if (tileIndex) max_cluster = findClusters(tile, tileIndex);
-    else           max_cluster = filter->total_clusters;
+    t->id = getId(opts);
 
-    posfile_t *posfile = openPositionFile(tile, tileIndex, opts);
-    if (posfile->errmsg) {
-        die("Can't find position file for Tile %d\n%s\n", tile, posfile->errmsg);
+    // This part of the read name is the same for all clusters in this tile
+    t->read_name_prefix_len = getReadNamePrefix(t->read_name_prefix, sizeof(t->read_name_prefix), t->id, lane, tile);
+
+    t->bclReadArray = newBclReadArray(job_data->cycleRange);
+    t->missing = bclFileCount(t->bclReadArray);
+    if (opts->watch) {
+        t->last_size = malloc((t->missing ? t->missing : 1) * sizeof(off_t));
+        if (!t->last_size) die("Out of memory");
+        for (int n = 0; n < t->missing; n++) t->last_size[n] = -1;
     }
-    posfile_load(posfile, max_cluster, (machineType == MT_NOVASEQ) ? filter : NULL);
-    max_cluster = posfile->size;
+    return t;
+}
 
-    bclReadArray = openBclFiles(cycleRange, opts, tile, next_tile, tileIndex, filter, p, job_data->bcl_cache);
-    char *id = getId(opts);
+/*
+ * Load the BCL files of a tile which are not loaded yet (in watch mode,
+ * the ones which are complete)
+ */
+static void loadTile(tile_data_t *t)
+{
+    job_data_t *job_data = t->job_data;
+    size_t tile_mem;
 
-    if (opts->verbose) fprintf(stderr,"Tile %d : opened all BCL files\n", tile);
+    loadBclFiles(t->bclReadArray, job_data->cycleRange, job_data->opts, job_data->lane, job_data->tile, job_data->next_tile,
+                 job_data->tileIndex, t->filter, job_data->sched, job_data->bcl_cache, t->last_size);
+    t->missing = missingBclFiles(t->bclReadArray, &t->missing_read2);
 
-    // This part of the read name is the same for all clusters in this tile
-    read_name_prefix_len = getReadNamePrefix(read_name_prefix, sizeof(read_name_prefix), id, opts->lane, tile);
+    tile_mem = tileBufferSize(t->bclReadArray);
+    mem_charge(job_data->mem, tile_mem - t->tile_mem);
+    t->tile_mem = tile_mem;
+}
 
-    //
-    // write all the records
-    //
-    int cluster;
-    struct processRecordJob_struct *job_freelist = NULL;
+/*
+ * Build the BAM records for a tile, or one pass of them
+ */
+static void makeRecords(tile_data_t *t, enum record_pass pass)
+{
+    job_data_t *job_data = t->job_data;
+    int tile = job_data->tile;
+    opts_t *opts = job_data->opts;
+    int surface = bcl_tile2surface(tile);
+
+    hts_tpool *p = job_data->thread_p;
+    hts_tpool_process *q = job_data->thread_q;
+    size_t index_separator_len = strlen(INDEX_SEPARATOR);
+    size_t qual_separator_len = strlen(QUAL_SEPARATOR);
+    size_t barcode_name_extra = opts->decode_tags && opts->change_read_name ? job_data->longest_barcode_name + 1 : 0;
+    size_t barcode_rg_extra = opts->decode_tags ? job_data->longest_barcode_name + 1 : 0;
 
-    for (cluster = 0; cluster < max_cluster; cluster += CLUSTERS_PER_THREAD) {
+    int cluster = 0;
+    int clusters_per_job = 0;
+    int in_flight_jobs = 0;
+    size_t in_flight_records = 0;
+    struct processRecordJob_struct *to_finish = NULL;
+    struct processRecordJob_struct **partial_end = &t->partial;
+
+    if (pass == PASS_FINISH) {
+        to_finish = t->partial;
+        t->partial = NULL;
+    }
+
+    while (pass == PASS_FINISH ? to_finish != NULL : cluster < t->max_cluster) {
         int blk = 0, nreads = 1;
-        struct processRecordJob_struct *job_struct = job_freelist;
-        if (job_struct) {
-            job_freelist = job_struct->next;
+        struct processRecordJob_struct *job_struct;
+
+        if (pass == PASS_FINISH) {
+            // the records already have read 1
+            job_struct = to_finish;
+            to_finish = job_struct->next;
+            job_struct->next = NULL;
+        } else if ((job_struct = t->job_freelist) != NULL) {
+            t->job_freelist = job_struct->next;
             job_struct->next = NULL;
         } else {
             job_struct = malloc(sizeof(*job_struct));
             if (!job_struct) die("Out of memory");
             job_struct->next = NULL;
-            job_struct->start_cluster = cluster;
-            job_struct->end_cluster = cluster+CLUSTERS_PER_THREAD-1;
-            if (job_struct->end_cluster >= max_cluster) job_struct->end_cluster = max_cluster - 1;
+            job_struct->node = job_data->sched->node;
             job_struct->tile = tile;
-            job_struct->filter = filter;
-            job_struct->posfile = posfile;
-            job_struct->id = id;
-            job_struct->id_len = id ? strlen(id) : 0;
+            job_struct->filter = t->filter;
+            job_struct->posfile = t->posfile;
+            job_struct->id = t->id;
+            job_struct->id_len = t->id ? strlen(t->id) : 0;
             job_struct->opts = opts;
-            job_struct->cycleRange = cycleRange;
+            job_struct->cycleRange = job_data->cycleRange;
             job_struct->surface = surface;
-            job_struct->bclReadArray = bclReadArray;
-            job_struct->read_name_prefix = read_name_prefix;
-            job_struct->read_name_prefix_len = read_name_prefix_len;
+            job_struct->bclReadArray = t->bclReadArray;
+            job_struct->read_name_prefix = t->read_name_prefix;
+            job_struct->read_name_prefix_len = t->read_name_prefix_len;
             job_struct->read_group_tag_len = opts->read_group_id ? strlen(opts->read_group_id) + 4 : 0;
             /* Find bcl file arrays for reads 1 (always), 2 (if present) */
-            job_struct->read_files[0] = getBclFileArray(bclReadArray, "read1", surface);
+            job_struct->read_files[0] = getBclFileArray(t->bclReadArray, "read1", surface);
             if (!job_struct->read_files[0]) die("Couldn't find read1 bcl file data");
-            job_struct->read_files[1] = getBclFileArray(bclReadArray, "read2", surface);
+            job_struct->read_files[1] = getBclFileArray(t->bclReadArray, "read2", surface);
             if (job_struct->read_files[1]) nreads = 2;
             /* Get read lengths */
             job_struct->read_len[0] = job_struct->read_files[0]->end;
@@ -2223,19 +2882,21 @@ static void processTile(job_data_t *job_data)
             job_struct->total_bc_tag_len[0] = 0;
             job_struct->total_bc_tag_len[1] = 0;
             for (int rd = 0; rd < nreads; rd++) {
-                job_struct->bc_calls_tags[rd] = get_barcode_bcl_files(job_data->barcode_calls[rd], bclReadArray, surface, opts->separator ? index_separator_len : 0, &job_struct->total_bc_tag_len[rd]);
-                job_struct->bc_quals_tags[rd] = get_barcode_bcl_files(job_data->barcode_quals[rd], bclReadArray, surface, opts->separator ? qual_separator_len : 0, &job_struct->total_bc_tag_len[rd]);
+                job_struct->bc_calls_tags[rd] = get_barcode_bcl_files(job_data->barcode_calls[rd], t->bclReadArray, surface, opts->separator ? index_separator_len : 0, &job_struct->total_bc_tag_len[rd]);
+                job_struct->bc_quals_tags[rd] = get_barcode_bcl_files(job_data->barcode_quals[rd], t->bclReadArray, surface, opts->separator ? qual_separator_len : 0, &job_struct->total_bc_tag_len[rd]);
             }
 
             if (opts->decode_tags) {
                 job_struct->decode_calls = find_tag_bcls(job_struct->bc_calls_tags, nreads, opts->decode_calls_tag);
-                job_struct->barcodeArray = copy_barcode_array(opts->barcodeArray);
+                job_struct->barcodeArray = job_data->barcodeArray;
+                job_struct->counters = job_data->counters;
                 job_struct->barcodes_hash = job_data->barcodes_hash;
                 job_struct->tag_hops = HashTableCreate(0, HASH_DYNAMIC_SIZE | HASH_FUNC_JENKINS);
                 if (!job_struct->tag_hops) die("Out of memory");
             } else {
                 job_struct->decode_calls = NULL;
                 job_struct->barcodeArray = NULL;
+                job_struct->counters = NULL;
                 job_struct->barcodes_hash = NULL;
                 job_struct->tag_hops = NULL;
             }
@@ -2259,9 +2920,49 @@ static void processTile(job_data_t *job_data)
                 job_struct->max_data_len[1] = 0;
             }
         }
-        job_struct->start_cluster = cluster;
-        job_struct->end_cluster = cluster+CLUSTERS_PER_THREAD-1;
-        if (job_struct->end_cluster >= max_cluster) job_struct->end_cluster = max_cluster - 1;
+        job_struct->pass = pass;
+        if (pass != PASS_FINISH) {
+            if (!clusters_per_job) {
+                clusters_per_job = clustersPerJob(job_struct, opts, job_data->mem);
+                if (opts->verbose && clusters_per_job != CLUSTERS_PER_THREAD) {
+                    display("Tile %d : %d clusters per job\n", tile, clusters_per_job);
+                }
+            }
+            job_struct->start_cluster = cluster;
+            job_struct->end_cluster = cluster+clusters_per_job-1;
+            if (job_struct->end_cluster >= t->max_cluster) job_struct->end_cluster = t->max_cluster - 1;
+            cluster += clusters_per_job;
+        }
+
+        /*
+         * Backpressure: hold off dispatching while the scheduler's job limit
+         * is reached, or the queued records would exceed --queue-len or the
+         * results would exceed --max-memory. A finishing pass reuses the
+         * results of the first, which are already charged.
+         */
+        int job_records = (job_struct->read_files[1] ? 2 : 1) * (job_struct->end_cluster + 1 - job_struct->start_cluster);
+        size_t job_mem = pass == PASS_FINISH ? 0 : jobMemSize(job_struct);
+        while (in_flight_jobs > 0
+               && (in_flight_jobs >= job_data->sched->compute_jobs
+                   || in_flight_records + job_records > opts->qlen
+                   || job_mem > mem_available(job_data->mem))) {
+            struct processRecordJob_struct *job = collectJob(q, true, job_data);
+            in_flight_jobs--;
+            in_flight_records -= job->results.num_records;
+            if (job->pass == PASS_FIRST) {
+                *partial_end = job;
+                partial_end = &job->next;
+            } else {
+                job->next = t->job_freelist;
+                t->job_freelist = job;
+            }
+        }
+        if (pass != PASS_FINISH) {
+            job_struct->mem_charged = job_mem;
+            mem_charge(job_data->mem, job_mem);
+        }
+        in_flight_jobs++;
+        in_flight_records += job_records;
 
         while (job_struct != NULL) {
             blk = hts_tpool_dispatch2(p, q, processRecords, job_struct, 1);
@@ -2272,77 +2973,174 @@ static void processTile(job_data_t *job_data)
             }
 
             // Check for results.
-            if (blk) {
-                r = hts_tpool_next_result_wait(q);
-            } else {
-                r = hts_tpool_next_result(q);
-            }
-            if (r != NULL) {
-                struct processRecordJob_struct *job = (struct processRecordJob_struct *) hts_tpool_result_data(r);
-                struct processRecordResult_struct *res = &job->results;
-                for (int n=0; n < res->num_records; n++) {
-                    if (!opts->no_filter && (res->records[n].core.flag & BAM_FQCFAIL)) continue;
-                    int ret = sam_write1(output_file, output_header, &res->records[n]);
-                    if (ret < 0) {
-                        die("Problem writing record %s  : r=%d\n", bam_get_qname(&res->records[n]), ret);
-                    }
+            struct processRecordJob_struct *job = collectJob(q, blk, job_data);
+            if (job != NULL) {
+                in_flight_jobs--;
+                in_flight_records -= job->results.num_records;
+                if (job->pass == PASS_FIRST) {
+                    *partial_end = job;
+                    partial_end = &job->next;
+                } else {
+                    job->next = t->job_freelist;
+                    t->job_freelist = job;
                 }
-                free(res->records);
-                free(res->data);
-                job->next = job_freelist;
-                job_freelist = job;
-                hts_tpool_delete_result(r, 0);
             }
         }
     }
 
     // Wait for any input-queued up jobs or in-progress jobs to complete.
     while (!hts_tpool_process_empty(q)) {
-        r = hts_tpool_next_result_wait(q);
-        struct processRecordJob_struct *job = (struct processRecordJob_struct *) hts_tpool_result_data(r);
-        struct processRecordResult_struct *res = &job->results;
-        for (int n=0; n < res->num_records; n++) {
-            if (!opts->no_filter && (res->records[n].core.flag & BAM_FQCFAIL)) continue;
-            int ret = sam_write1(output_file, output_header, &res->records[n]);
-            if (ret < 0) {
-                die("Problem writing record %s  : r=%d\n", bam_get_qname(&res->records[n]), ret);
-            }
+        struct processRecordJob_struct *job = collectJob(q, true, job_data);
+        if (job->pass == PASS_FIRST) {
+            *partial_end = job;
+            partial_end = &job->next;
+        } else {
+            job->next = t->job_freelist;
+            t->job_freelist = job;
         }
-        free(res->records);
-        free(res->data);
-        job->next = job_freelist;
-        job_freelist = job;
-        hts_tpool_delete_result(r, 0);
     }
+}
 
-    while (job_freelist != NULL) {
-        struct processRecordJob_struct *next = job_freelist->next;
-        int is_paired = job_freelist->read_files[1] != NULL;
-        if (opts->barcodeArray) {
-            accumulate_job_metrics(job_freelist->barcodeArray, job_freelist->tag_hops, opts->barcodeArray, job_data->tag_hops);
+/*
+ * Accumulate the metrics of a finished tile, mark it in the tile index and
+ * free it
+ */
+static void closeTile(tile_data_t *t)
+{
+    job_data_t *job_data = t->job_data;
+    opts_t *opts = job_data->opts;
+
+    // tag hops are accumulated in tile order too
+    waitTurn(job_data);
+    assert(t->partial == NULL);
+    while (t->job_freelist != NULL) {
+        struct processRecordJob_struct *next = t->job_freelist->next;
+        int is_paired = t->job_freelist->read_files[1] != NULL;
+        if (t->job_freelist->tag_hops) {
+            accumulate_tag_hops(t->job_freelist->tag_hops, job_data->tag_hops);
+            HashTableDestroy(t->job_freelist->tag_hops, 0);
         }
         for (int rd = 0; rd < (is_paired ? 2 : 1); rd++) {
-            va_free(job_freelist->bc_calls_tags[rd]);
-            va_free(job_freelist->bc_quals_tags[rd]);
-        }
-        if (job_freelist->barcodeArray) {
-            delete_barcode_array_copy(job_freelist->barcodeArray);
+            va_free(t->job_freelist->bc_calls_tags[rd]);
+            va_free(t->job_freelist->bc_quals_tags[rd]);
         }
-        if (job_freelist->tag_hops) {
-            HashTableDestroy(job_freelist->tag_hops, 0);
-        }
-        free(job_freelist);
-        job_freelist = next;
+        free(t->job_freelist);
+        t->job_freelist = next;
     }
 
-    free(id);
-    va_free(bclReadArray);
-    filter_close(filter);
-    posfile_close(posfile);
+    free(t->id);
+    va_free(t->bclReadArray);
+    mem_release(job_data->mem, t->tile_mem);
+    schedComputeTile(job_data->sched, opts->verbose);
+    filter_close(t->filter);
+    posfile_close(t->posfile);
+    free(t->last_size);
+
+    if (opts->verbose) display("Finished processing Lane %d Tile: %d\n", job_data->lane, job_data->tile);
 
-    if (opts->verbose) display("Finished processing Tile: %d\n", tile);
+    // the next tile starts on a new BGZF block
+    if (job_data->tileidx && tileidx_mark(job_data->tileidx, job_data->tile, job_data->records_written) < 0) {
+        die("Can't write tile index entry for tile %d\n", job_data->tile);
+    }
 
+    endTurn(job_data);
     free(job_data);
+    free(t);
+}
+
+/*
+ * Write all the BAM records for a given tile
+ * Records are written to the global FIFO queue
+ */
+static void processTile(job_data_t *job_data)
+{
+    int tile = job_data->tile;
+    opts_t *opts = job_data->opts;
+    tile_data_t *t = openTile(job_data);
+
+    double io_start = wallClock();
+    loadTile(t);
+    if (t->missing > 0) die("Missing %d bcl files\n", t->missing);
+    schedIoTile(job_data->sched, t->tile_mem / 2, wallClock() - io_start, opts->verbose);
+    if (opts->max_memory && t->tile_mem > opts->max_memory) {
+        fprintf(stderr,"WARNING: tile %d needs %zu bytes of BCL data, more than --max-memory\n", tile, t->tile_mem);
+    }
+
+    if (opts->verbose) fprintf(stderr,"Tile %d : opened all BCL files\n", tile);
+
+    makeRecords(t, PASS_ALL);
+    closeTile(t);
+}
+
+/*
+ * Watch mode: the sequencer writes each cycle for all of the tiles in turn,
+ * so a worker keeps its tiles open together (as many as --max-memory
+ * allows). Each open tile loads its BCL files as they become complete, and
+ * builds the read 1 part of its records as soon as it has every cycle but
+ * those of read 2. The tiles are finished and written in order as read 2
+ * lands.
+ */
+static void watchTiles(job_data_t **jobs, int njobs, int first, int step)
+{
+    int ntiles = njobs > first ? (njobs - first + step - 1) / step : 0;
+    tile_data_t **tiles = calloc(ntiles ? ntiles : 1, sizeof(tile_data_t *));
+    off_t *filter_size = malloc(3 * (ntiles ? ntiles : 1) * sizeof(off_t));
+    opts_t *opts = ntiles ? jobs[first]->opts : NULL;
+    time_t last_progress = time(NULL);
+    int next_write = 0;
+
+    if (!tiles || !filter_size) die("Out of memory");
+    for (int n = 0; n < 3 * ntiles; n++) filter_size[n] = -1;
+
+    while (next_write < ntiles) {
+        bool progress = false;
+
+        for (int n = next_write; n < ntiles; n++) {
+            job_data_t *job_data = jobs[first + n * step];
+            tile_data_t *t = tiles[n];
+
+            if (!t) {
+                // the next tile to be written can always be opened
+                if (n > next_write && mem_available(job_data->mem) == 0) continue;
+                if (!filterFileReady(job_data->tile, job_data->lane, &filter_size[3 * n], opts)) continue;
+                t = tiles[n] = openTile(job_data);
+                progress = true;
+            }
+
+            int missing = t->missing;
+            if (missing > 0) loadTile(t);
+            if (t->missing < missing) progress = true;
+
+            if (!t->first_pass_done && t->missing_read2 > 0 && t->missing == t->missing_read2) {
+                makeRecords(t, PASS_FIRST);
+                t->first_pass_done = true;
+                if (opts->verbose) display("Lane %d Tile %d : built read 1 records, waiting for read 2\n", job_data->lane, job_data->tile);
+            }
+        }
+
+        // Finish the tiles which have all of their cycles, in order
+        while (next_write < ntiles && tiles[next_write] && tiles[next_write]->missing == 0) {
+            tile_data_t *t = tiles[next_write];
+            makeRecords(t, t->first_pass_done ? PASS_FINISH : PASS_ALL);
+            closeTile(t);
+            tiles[next_write++] = NULL;
+            progress = true;
+        }
+
+        if (next_write >= ntiles) break;
+        if (progress) {
+            last_progress = time(NULL);
+        } else {
+            if (opts->watch_timeout && time(NULL) - last_progress > opts->watch_timeout) {
+                die("Timed out waiting for the run to progress\n");
+            }
+            if (opts->verbose > 1) display("Waiting for the run to progress\n");
+            sleep(opts->watch_interval);
+        }
+    }
+
+    free(filter_size);
+    free(tiles);
 }
 
 /*
@@ -2390,27 +3188,86 @@ void getBarcodeSpecs(va_t *specs[2], va_t *tags_array, ia_t *bc_read) {
 }
 
 /*
- * process all the tiles and write all the BAM records
+ * With --numa, each node processes its share of the tiles in its own thread
+ */
+typedef struct {
+    job_data_t **jobs;
+    int njobs;
+    int first;
+    int step;
+} node_worker_t;
+
+static void *nodeWorker(void *arg)
+{
+    node_worker_t *w = (node_worker_t *)arg;
+    if (w->first < w->njobs && w->jobs[w->first]->opts->watch) {
+        numautil_bind(w->jobs[w->first]->sched->node);
+        watchTiles(w->jobs, w->njobs, w->first, w->step);
+        return NULL;
+    }
+    for (int n = w->first; n < w->njobs; n += w->step) {
+        numautil_bind(w->jobs[n]->sched->node);
+        processTile(w->jobs[n]);
+    }
+    return NULL;
+}
+
+/*
+ * Output, tiles and metrics of one lane
  */
-static int createBAM(samFile *output_file, bam_hdr_t *output_header, hts_tpool *thread_p, opts_t *opts)
+typedef struct {
+    int lane;
+    char *output_name;
+    samFile *output_file;
+    bam_hdr_t *output_header;
+    tileidx_t *tileidx;         // index of the output, or NULL
+    ia_t *tiles;
+    va_t *tileIndex;
+    va_t *barcodeArray;         // metrics
+    bc_counter_set_t *counters; // per-thread counts for barcodeArray
+    HashTable *tag_hops;
+    tile_order_t order;
+    job_data_t **jobs;
+} lane_data_t;
+
+/*
+ * process all the tiles of all the lanes and write all the BAM records
+ *
+ * Each lane has a worker thread on each node, with its own result queue on
+ * the node's pool, so the tiles of different lanes share the pool at the
+ * same time. A lane's tiles are shared round-robin between its workers.
+ */
+static int createBAM(lane_data_t *lanes, int nlanes, thread_sched_t *sched, int nnodes, mem_account_t *mem, opts_t *opts)
 {
     int retcode = 0;
+    int nworkers = nlanes * nnodes;
 
-    hts_tpool_process *thread_q = hts_tpool_process_init(thread_p, 2 * opts->pool_size, 0);
+    hts_tpool_process **thread_q = calloc(nworkers, sizeof(hts_tpool_process *));
+    thread_sched_t *worker_sched = calloc(nworkers, sizeof(thread_sched_t));
+    lockable_bcl_cache *bcl_cache = calloc(nnodes, sizeof(lockable_bcl_cache));
+    if (!thread_q || !worker_sched || !bcl_cache) die("Out of memory");
+    for (int node = 0; node < nnodes; node++) {
+        // Each node has its own cache, as cached BCL files hold the data of the tile being loaded.
+        // For the same reason there is none in watch mode, which loads several tiles at once.
+        pthread_mutex_init(&bcl_cache[node].lock, NULL);
+        bcl_cache[node].mem = mem;
+        if (machineType == MT_NOVASEQ && !opts->watch) {
+            bcl_cache[node].cache = kh_init(bcl_cache);
+            if (!bcl_cache[node].cache) die("Out of memory");
+        }
+    }
+    for (int w = 0; w < nworkers; w++) {
+        // workers share their node's pools, but tune their own share of them
+        worker_sched[w] = sched[w % nnodes];
+        thread_q[w] = hts_tpool_process_init(worker_sched[w].pool, worker_sched[w].compute_max, 0);
+        if (!thread_q[w]) die("hts_tpool_process_init failed\n");
+    }
 
-    ia_t *tiles = getTileList(opts);
     va_t *cycleRange = getCycleRange(opts);;
-    va_t *tileIndex = getTileIndex(opts);
     va_t *barcode_calls[2];
     va_t *barcode_quals[2];
     HashTable *barcodeHash = NULL;
-    HashTable *tag_hops = NULL;
     size_t longest_barcode_name = 0;
-    lockable_bcl_cache bcl_cache = { PTHREAD_MUTEX_INITIALIZER, NULL };
-    if (machineType == MT_NOVASEQ) {
-        bcl_cache.cache = kh_init(bcl_cache);
-        if (!bcl_cache.cache) die("Out of memory");
-    }
 
     barcode_calls[0] = va_init(4, free_barcode_spec);
     barcode_calls[1] = va_init(4, free_barcode_spec);
@@ -2420,9 +3277,8 @@ static int createBAM(samFile *output_file, bam_hdr_t *output_header, hts_tpool *
     getBarcodeSpecs(barcode_quals, opts->quality_tag, opts->bc_read);
 
     if (opts->barcodeArray) {
-        tag_hops = HashTableCreate(0, HASH_DYNAMIC_SIZE | HASH_FUNC_JENKINS);
-        if (!tag_hops) die("Out of memory");
         barcodeHash = make_barcode_hash(opts->barcodeArray);
+        make_barcode_matchers(opts->barcodeArray, opts->decode_opts);
         longest_barcode_name = find_longest_barcode_name(opts->barcodeArray);
         if (get_barcode_metadata(opts->barcodeArray, 0, &opts->unmatched_barcode_name, NULL, NULL, NULL) < 0) {
             opts->unmatched_barcode_name = "0";
@@ -2434,46 +3290,116 @@ static int createBAM(samFile *output_file, bam_hdr_t *output_header, hts_tpool *
             cycleRangeEntry_t *cr = (cycleRangeEntry_t *)cycleRange->entries[n];
             fprintf(stderr,"CycleRange: %s\t%d\t%d\n", cr->readname, cr->first, cr->last);
         }
-        for (int n=0; n < tiles->end; n++) {
-            fprintf(stderr,"Tile %d\n", tiles->entries[n]);
-        }
     }
 
-    if (tiles->end == 0) fprintf(stderr, "There are no tiles to process\n");
-
     /*
-     * Loop to create input threads - one for each tile
+     * Set up a job for each tile of each lane
      */
-    for (int n=0; n < tiles->end; n++) {
-        job_data_t *job_data = malloc(sizeof(job_data_t));
-        if (!job_data) { die("Can't allocate memory for job_data\n"); }
-        job_data->tile = tiles->entries[n];
-        job_data->next_tile = n + 1 < tiles->end ? tiles->entries[n + 1] : -1;
-        job_data->output_file = output_file;
-        job_data->output_header = output_header;
-        job_data->opts = opts;
-        job_data->cycleRange = cycleRange;
-        job_data->tileIndex = tileIndex;
-        job_data->barcode_calls[0] = barcode_calls[0];
-        job_data->barcode_calls[1] = barcode_calls[1];
-        job_data->barcode_quals[0] = barcode_quals[0];
-        job_data->barcode_quals[1] = barcode_quals[1];
-        job_data->bcl_cache = bcl_cache.cache ? &bcl_cache : NULL;
-        job_data->thread_p = thread_p;
-        job_data->thread_q = thread_q;
-        job_data->barcodes_hash = barcodeHash;
-        job_data->tag_hops = tag_hops;
-        job_data->longest_barcode_name = longest_barcode_name;
-
-        processTile(job_data);
-    }
-
-    if (opts->write_decode_metrics) {
-        writeMetrics(opts->barcodeArray, tag_hops, opts->decode_opts);
-    }
-
-    if (bcl_cache.cache)
-        clear_bcl_cache(&bcl_cache);
+    for (int l = 0; l < nlanes; l++) {
+        lane_data_t *ld = &lanes[l];
+        ld->tiles = getTileList(ld->lane, opts);
+        ld->tileIndex = getTileIndex(ld->lane, opts);
+        if (opts->barcodeArray) {
+            ld->barcodeArray = copy_barcode_array(opts->barcodeArray);
+            ld->counters = counter_set_init(ld->barcodeArray);
+            ld->tag_hops = HashTableCreate(0, HASH_DYNAMIC_SIZE | HASH_FUNC_JENKINS);
+            if (!ld->tag_hops) die("Out of memory");
+        }
+        pthread_mutex_init(&ld->order.lock, NULL);
+        pthread_cond_init(&ld->order.cond, NULL);
+        ld->order.next = 0;
+
+        if (opts->verbose) {
+            for (int n=0; n < ld->tiles->end; n++) {
+                fprintf(stderr,"Lane %d Tile %d\n", ld->lane, ld->tiles->entries[n]);
+            }
+        }
+        if (ld->tiles->end == 0) fprintf(stderr, "There are no tiles to process in lane %d\n", ld->lane);
+
+        ld->jobs = calloc(ld->tiles->end ? ld->tiles->end : 1, sizeof(job_data_t *));
+        if (!ld->jobs) die("Out of memory");
+        for (int n=0; n < ld->tiles->end; n++) {
+            int w = l * nnodes + n % nnodes;
+            job_data_t *job_data = malloc(sizeof(job_data_t));
+            if (!job_data) { die("Can't allocate memory for job_data\n"); }
+            job_data->lane = ld->lane;
+            job_data->tile = ld->tiles->entries[n];
+            job_data->next_tile = n + 1 < ld->tiles->end ? ld->tiles->entries[n + 1] : -1;
+            job_data->output_file = ld->output_file;
+            job_data->output_header = ld->output_header;
+            job_data->tileidx = ld->tileidx;
+            job_data->opts = opts;
+            job_data->cycleRange = cycleRange;
+            job_data->tileIndex = ld->tileIndex;
+            job_data->barcode_calls[0] = barcode_calls[0];
+            job_data->barcode_calls[1] = barcode_calls[1];
+            job_data->barcode_quals[0] = barcode_quals[0];
+            job_data->barcode_quals[1] = barcode_quals[1];
+            job_data->bcl_cache = bcl_cache[w % nnodes].cache ? &bcl_cache[w % nnodes] : NULL;
+            job_data->thread_p = worker_sched[w].pool;
+            job_data->thread_q = thread_q[w];
+            job_data->barcodes_hash = barcodeHash;
+            job_data->tag_hops = ld->tag_hops;
+            job_data->barcodeArray = ld->barcodeArray;
+            job_data->counters = ld->counters;
+            job_data->longest_barcode_name = longest_barcode_name;
+            job_data->mem = mem;
+            job_data->sched = &worker_sched[w];
+            job_data->order = nnodes > 1 ? &ld->order : NULL;
+            job_data->seq = n;
+            job_data->my_turn = false;
+            job_data->records_written = 0;
+            ld->jobs[n] = job_data;
+        }
+    }
+
+    if (nworkers == 1 && opts->watch) {
+        watchTiles(lanes[0].jobs, lanes[0].tiles->end, 0, 1);
+    } else if (nworkers == 1) {
+        for (int n=0; n < lanes[0].tiles->end; n++) processTile(lanes[0].jobs[n]);
+    } else {
+        pthread_t *workers = calloc(nworkers, sizeof(pthread_t));
+        node_worker_t *w = calloc(nworkers, sizeof(node_worker_t));
+        if (!workers || !w) die("Out of memory");
+        for (int n = 0; n < nworkers; n++) {
+            lane_data_t *ld = &lanes[n / nnodes];
+            w[n].jobs = ld->jobs;
+            w[n].njobs = ld->tiles->end;
+            w[n].first = n % nnodes;
+            w[n].step = nnodes;
+            if (pthread_create(&workers[n], NULL, nodeWorker, &w[n]) != 0) die("Can't create thread\n");
+        }
+        for (int n = 0; n < nworkers; n++) pthread_join(workers[n], NULL);
+        free(workers);
+        free(w);
+    }
+
+    for (int l = 0; l < nlanes; l++) {
+        lane_data_t *ld = &lanes[l];
+        if (ld->counters) counter_set_merge(ld->counters, ld->barcodeArray);
+        if (opts->write_decode_metrics) {
+            char *metrics_name = laneFileName(opts->metrics_file, ld->lane);
+            set_decode_opt_metrics_name(opts->decode_opts, metrics_name);
+            writeMetrics(ld->barcodeArray, ld->tag_hops, opts->decode_opts);
+            free(metrics_name);
+        }
+        if (ld->barcodeArray) delete_barcode_array_copy(ld->barcodeArray);
+        if (ld->tag_hops) HashTableDestroy(ld->tag_hops, 0);
+        pthread_mutex_destroy(&ld->order.lock);
+        pthread_cond_destroy(&ld->order.cond);
+        free(ld->jobs);
+        va_free(ld->tileIndex);
+        ia_free(ld->tiles);
+    }
+
+    for (int node = 0; node < nnodes; node++) {
+        if (bcl_cache[node].cache)
+            clear_bcl_cache(&bcl_cache[node]);
+    }
+    for (int w = 0; w < nworkers; w++) hts_tpool_process_destroy(thread_q[w]);
+    free(bcl_cache);
+    free(thread_q);
+    free(worker_sched);
 
     HashTableDestroy(barcodeHash, 0);
     va_free(barcode_calls[0]);
@@ -2481,11 +3407,81 @@ static int createBAM(samFile *output_file, bam_hdr_t *output_header, hts_tpool *
     va_free(barcode_quals[0]);
     va_free(barcode_quals[1]);
     va_free(cycleRange);
-    va_free(tileIndex);
-    ia_free(tiles);
 
-    hts_tpool_process_destroy(thread_q);
+    return retcode;
+}
+
+/*
+ * Open a lane's output file and write its header
+ */
+static int openLaneOutput(lane_data_t *ld, const char *mode, htsFormat *out_fmt, htsThreadPool *compress_threads, opts_t *opts)
+{
+    char *platform_unit = opts->platform_unit;
+
+    if (opts->verbose) display("Opening output for Lane %d\n", ld->lane);
+
+    ld->output_name = laneFileName(opts->output_file, ld->lane);
+    ld->output_file = hts_open_format(ld->output_name, mode, out_fmt);
+    if (!ld->output_file) {
+        fprintf(stderr, "Could not open output file (%s)\n", ld->output_name);
+        return 1;
+    }
+
+    if (hts_set_thread_pool(ld->output_file, compress_threads) < 0) {
+        fprintf(stderr, "Couldn't set thread pool on output file\n");
+        return 1;
+    }
+
+    ld->output_header = bam_hdr_init();
+    if (!ld->output_header) {
+        fprintf(stderr, "Failed to initialise output header\n");
+        return 1;
+    }
+    ld->output_header->text = calloc(1,1); ld->output_header->l_text=0;
+
+    // default platform unit is runfolder + lane
+    if (opts->default_platform_unit) {
+        char *rf = basename(opts->run_folder);
+        platform_unit = calloc(1, strlen(rf) + 5);
+        if (!platform_unit) die("Out of memory");
+        sprintf(platform_unit, "%s_%d", rf, ld->lane);
+    }
+    int r = !ld->output_header->text || addHeader(ld->output_file, ld->output_header, platform_unit, opts) != 0;
+    if (platform_unit != opts->platform_unit) free(platform_unit);
+    if (r) {
+        fprintf(stderr,"Failed to write header\n");
+        return 1;
+    }
+
+    if (opts->tile_index && strcmp(ld->output_name, "-") == 0) {
+        fprintf(stderr, "WARNING: can't write a tile index when writing to stdout\n");
+    } else if (opts->tile_index) {
+        char *idx_name = tileidx_name(ld->output_name);
+        ld->tileidx = tileidx_create(idx_name, ld->output_file);
+        if (!ld->tileidx) fprintf(stderr, "WARNING: not writing tile index %s\n", idx_name);
+        free(idx_name);
+    }
+    return 0;
+}
+
+/*
+ * Close a lane's output file and tile index
+ */
+static int closeLaneOutput(lane_data_t *ld)
+{
+    int retcode = 0;
 
+    if (ld->tileidx && tileidx_close(ld->tileidx) < 0) {
+        fprintf(stderr, "Error closing tile index for %s\n", ld->output_name);
+        retcode = 1;
+    }
+    ld->tileidx = NULL;
+    if (ld->output_header) bam_hdr_destroy(ld->output_header);
+    if (ld->output_file && sam_close(ld->output_file) < 0) {
+        fprintf(stderr, "Error closing output file (%s)\n", ld->output_name);
+        retcode = 1;
+    }
+    free(ld->output_name);
     return retcode;
 }
 
@@ -2495,62 +3491,116 @@ static int createBAM(samFile *output_file, bam_hdr_t *output_header, hts_tpool *
 static int i2b(opts_t* opts)
 {
     int retcode = 1;
-    samFile *output_file = NULL;
-    bam_hdr_t *output_header = NULL;
     htsFormat out_fmt = { 0 };
-    htsThreadPool hts_threads = { NULL, 0 };
+    htsThreadPool *compress_threads = NULL;
+    thread_sched_t *sched = NULL;
+    lane_data_t *lanes = NULL;
+    int nnodes = 1;
+    mem_account_t mem = { PTHREAD_MUTEX_INITIALIZER, opts->max_memory, 0, 0 };
     char mode[] = "wbC";
 
-    while (1) {
+    if (opts->numa) {
+        nnodes = numautil_nodes();
+        if (nnodes == 1) fprintf(stderr, "WARNING: only one NUMA node is available, ignoring --numa\n");
+        if (nnodes > opts->pool_size) nnodes = opts->pool_size;
+        if (opts->verbose) display("Using %d NUMA nodes\n", nnodes);
+    }
 
-        /* Set up the thread pool */
-        hts_threads.pool = hts_tpool_init(opts->pool_size);
-        if (!hts_threads.pool) {
+    /*
+     * Set up the thread pools, shared by all of the lanes. There is one pool
+     * per NUMA node (just one without --numa), and optional dedicated pools
+     * for BCL loading and for compression. With --numa, each pool's threads
+     * run on its node.
+     */
+    sched = calloc(nnodes, sizeof(thread_sched_t));
+    compress_threads = calloc(nnodes, sizeof(htsThreadPool));
+    if (!sched || !compress_threads) die("Out of memory");
+    for (int node = 0; node < nnodes; node++) {
+        thread_sched_t *s = &sched[node];
+        int pool_size = opts->pool_size / nnodes;
+        int io_threads = opts->io_threads ? (opts->io_threads + nnodes - 1) / nnodes : 0;
+        s->node = nnodes > 1 ? node : -1;
+        s->pool = numautil_tpool_init(pool_size, s->node);
+        s->io_pool = s->pool;
+        s->io_max = pool_size;
+        if (io_threads) {
+            s->io_pool = numautil_tpool_init(io_threads, s->node);
+            s->io_max = io_threads;
+            s->io_fixed = true;
+        }
+        s->io_jobs = s->io_max;
+        s->io_step = -1;
+        s->compute_max = 2 * pool_size;
+        s->compute_jobs = s->compute_max;
+        s->compute_fixed = opts->compress_threads > 0;
+        if (!s->pool || !s->io_pool) {
             fprintf(stderr, "Couldn't set up thread pool\n");
-            break;
-        }
-
-        /*
-         * Open output file and header
-         */
-        if (opts->output_fmt) {
-            if (hts_parse_format(&out_fmt, opts->output_fmt) < 0) {
-                fprintf(stderr,"Unknown output format: %s\n", opts->output_fmt);
-                break;
+            retcode = 1;
+            goto cleanup;
+        }
+    }
+
+    // Each node compresses its share of the lane outputs, which are given out
+    // round-robin (see below). The BGZF compression of one file uses a single
+    // pool, so a run with fewer lanes than nodes compresses on fewer nodes.
+    for (int node = 0; node < nnodes; node++) {
+        compress_threads[node].pool = sched[node].pool;
+        if (opts->compress_threads) {
+            int threads = (opts->compress_threads + nnodes - 1) / nnodes;
+            compress_threads[node].pool = numautil_tpool_init(threads, sched[node].node);
+            if (!compress_threads[node].pool) {
+                fprintf(stderr, "Couldn't set up thread pool\n");
+                retcode = 1;
+                goto cleanup;
             }
         }
-        mode[2] = opts->compression_level ? opts->compression_level : '\0';
-        output_file = hts_open_format(opts->output_file, mode, &out_fmt);
-        if (!output_file) {
-            fprintf(stderr, "Could not open output file (%s)\n", opts->output_file);
-            break;
-        }
+    }
 
-        if (hts_set_thread_pool(output_file, &hts_threads) < 0) {
-            fprintf(stderr, "Couldn't set thread pool on output file\n");
-            break;
+    if (opts->output_fmt) {
+        if (hts_parse_format(&out_fmt, opts->output_fmt) < 0) {
+            fprintf(stderr,"Unknown output format: %s\n", opts->output_fmt);
+            retcode = 1;
+            goto cleanup;
         }
+    }
+    mode[2] = opts->compression_level ? opts->compression_level : '\0';
 
-        output_header = bam_hdr_init();
-        if (!output_header) {
-            fprintf(stderr, "Failed to initialise output header\n");
-            break;
-        }
-        output_header->text = calloc(1,1); output_header->l_text=0;
+    opts->fd_cache = bcl_fd_cache_init(opts->max_open_files ? opts->max_open_files : defaultMaxOpenFiles());
 
-        if (!output_header->text || addHeader(output_file, output_header, opts) != 0) {
-            fprintf(stderr,"Failed to write header\n");
-            break;
-        }
+    /*
+     * Open all the output files, then process the tiles of all the lanes together
+     */
+    lanes = calloc(opts->lanes->end, sizeof(lane_data_t));
+    if (!lanes) die("Out of memory");
+    retcode = 0;
+    for (int n = 0; n < opts->lanes->end && !retcode; n++) {
+        lanes[n].lane = opts->lanes->entries[n];
+        retcode = openLaneOutput(&lanes[n], mode, &out_fmt, &compress_threads[n % nnodes], opts);
+    }
+    if (!retcode) retcode = createBAM(lanes, opts->lanes->end, sched, nnodes, &mem, opts);
+    for (int n = 0; n < opts->lanes->end; n++) {
+        if (closeLaneOutput(&lanes[n])) retcode = 1;
+    }
+    free(lanes);
 
-        retcode = createBAM(output_file, output_header, hts_threads.pool, opts);
-        break;
+    if (opts->verbose) display("Peak accounted memory: %zu bytes\n", mem.peak);
+    if (opts->verbose) {
+        display("BCL file handles: %" PRIu64 " hits, %" PRIu64 " misses, %" PRIu64 " evictions (limit %d)\n",
+                opts->fd_cache->hits, opts->fd_cache->misses, opts->fd_cache->evictions, opts->fd_cache->max_open);
     }
 
-    // tidy up after us
-    if (output_header) bam_hdr_destroy(output_header);
-    if (output_file) sam_close(output_file);
-    if (hts_threads.pool) hts_tpool_destroy(hts_threads.pool);
+ cleanup:
+    for (int node = 0; compress_threads && node < nnodes; node++) {
+        if (compress_threads[node].pool && compress_threads[node].pool != sched[node].pool) hts_tpool_destroy(compress_threads[node].pool);
+    }
+    free(compress_threads);
+    for (int node = 0; sched && node < nnodes; node++) {
+        if (sched[node].io_pool && sched[node].io_pool != sched[node].pool) hts_tpool_destroy(sched[node].io_pool);
+        if (sched[node].pool) hts_tpool_destroy(sched[node].pool);
+    }
+    free(sched);
+    bcl_fd_cache_free(opts->fd_cache);
+    opts->fd_cache = NULL;
 
     return retcode;
 }
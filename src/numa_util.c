@@ -0,0 +1,86 @@
+/*  numa_util.c -- NUMA node placement of threads
+
+    Copyright (C) 2026 Genome Research Ltd.
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU Affero General Public License as published
+by the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+You should have received a copy of the GNU Affero General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <pthread.h>
+
+#include "bambi.h"
+#include "numa_util.h"
+
+#if defined(HAVE_LIBNUMA) && defined(HAVE_NUMA_H)
+#include <numa.h>
+
+int numautil_nodes(void)
+{
+    if (numa_available() < 0) return 1;
+    int n = numa_num_configured_nodes();
+    return n > 0 ? n : 1;
+}
+
+void numautil_bind(int node)
+{
+    static __thread int bound_node = -1;
+
+    if (node < 0 || node == bound_node) return;
+    if (numa_run_on_node(node) < 0) {
+        fprintf(stderr,"WARNING: can't bind thread to NUMA node %d\n", node);
+    }
+    numa_set_localalloc();
+    bound_node = node;
+}
+
+typedef struct {
+    int n, node;
+    hts_tpool *pool;
+} tpool_args_t;
+
+static void *tpool_on_node(void *arg)
+{
+    tpool_args_t *a = (tpool_args_t *)arg;
+    numautil_bind(a->node);
+    a->pool = hts_tpool_init(a->n);
+    return NULL;
+}
+
+hts_tpool *numautil_tpool_init(int n, int node)
+{
+    tpool_args_t a = { n, node, NULL };
+    pthread_t t;
+
+    if (node < 0) return hts_tpool_init(n);
+    if (pthread_create(&t, NULL, tpool_on_node, &a) != 0) return NULL;
+    pthread_join(t, NULL);
+    return a.pool;
+}
+
+#else
+
+int numautil_nodes(void)
+{
+    return 1;
+}
+
+void numautil_bind(int node)
+{
+}
+
+hts_tpool *numautil_tpool_init(int n, int node)
+{
+    return hts_tpool_init(n);
+}
+
+#endif
@@ -0,0 +1,44 @@
+/*  numa_util.h -- NUMA node placement of threads
+
+    Copyright (C) 2026 Genome Research Ltd.
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU Affero General Public License as published
+by the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+You should have received a copy of the GNU Affero General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef __NUMA_UTIL_H__
+#define __NUMA_UTIL_H__
+
+#include <htslib/thread_pool.h>
+
+/*
+ * Number of NUMA nodes available to this process.
+ * Returns 1 if bambi was built without libnuma or the system is not NUMA.
+ */
+int numautil_nodes(void);
+
+/*
+ * Bind the calling thread, and the memory it allocates, to a NUMA node.
+ * Pages are placed on first touch, so buffers filled by a bound thread
+ * end up on that node. Does nothing if node is negative, or the thread is
+ * already bound to it.
+ */
+void numautil_bind(int node);
+
+/*
+ * Make a thread pool of n threads which run on a NUMA node. The pool is made
+ * by a thread bound to the node, and its threads inherit the binding, so that
+ * work given to the pool (eg BGZF compression) stays on the node.
+ * If node is negative, this is just hts_tpool_init(n).
+ */
+hts_tpool *numautil_tpool_init(int n, int node);
+
+#endif
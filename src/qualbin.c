@@ -0,0 +1,116 @@
+/*  qualbin.c -- quality score binning
+
+    Copyright (C) 2026 Genome Research Ltd.
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU Affero General Public License as published
+by the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+You should have received a copy of the GNU Affero General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#include "qualbin.h"
+
+typedef struct {
+    int low, high, value;
+} qualbin_range_t;
+
+/*
+ * Illumina 8-level binning (HiSeq 2500, RTA 1.18 and later)
+ */
+static const qualbin_range_t illumina8[] = {
+    {  2,  9,  6 },
+    { 10, 19, 15 },
+    { 20, 24, 22 },
+    { 25, 29, 27 },
+    { 30, 34, 33 },
+    { 35, 39, 37 },
+    { 40, QUAL_MAP_SIZE-1, 40 },
+    { -1, -1, -1 }
+};
+
+/*
+ * Illumina 4-level binning (NovaSeq, RTA 3)
+ */
+static const qualbin_range_t illumina4[] = {
+    {  2,  2,  2 },
+    {  3, 14, 12 },
+    { 15, 30, 23 },
+    { 31, QUAL_MAP_SIZE-1, 37 },
+    { -1, -1, -1 }
+};
+
+static void add_range(uint8_t map[QUAL_MAP_SIZE], int low, int high, int value)
+{
+    for (int q = low; q <= high; q++) map[q] = value;
+}
+
+/*
+ * Read a binning table from a file.
+ * Each line is "low high value", meaning qualities low..high become value.
+ * Quality 0 marks a no-call, so it can be neither binned nor binned to.
+ * Blank lines and lines starting with '#' are ignored.
+ */
+static int load_map(const char *fname, uint8_t map[QUAL_MAP_SIZE])
+{
+    char line[256];
+    int lineno = 0;
+    FILE *f = fopen(fname, "r");
+    if (!f) {
+        fprintf(stderr, "Can't open quality binning file %s: %s\n", fname, strerror(errno));
+        return -1;
+    }
+
+    while (fgets(line, sizeof(line), f)) {
+        int low, high, value;
+        char *p = line;
+        lineno++;
+        while (*p == ' ' || *p == '\t') p++;
+        if (*p == '#' || *p == '\n' || *p == '\r' || *p == 0) continue;
+        if (sscanf(p, "%d %d %d", &low, &high, &value) != 3
+            || low < 1 || low > high || high >= QUAL_MAP_SIZE
+            || value < 1 || value >= QUAL_MAP_SIZE) {
+            fprintf(stderr, "Invalid quality binning line %d in %s: %s", lineno, fname, line);
+            fclose(f);
+            return -1;
+        }
+        add_range(map, low, high, value);
+    }
+
+    fclose(f);
+    return 0;
+}
+
+int qualbin_make_map(const char *scheme, uint8_t map[QUAL_MAP_SIZE])
+{
+    const qualbin_range_t *ranges = NULL;
+
+    // anything not covered by the scheme is left unchanged
+    for (int q = 0; q < QUAL_MAP_SIZE; q++) map[q] = q;
+
+    if (strcmp(scheme, "illumina8") == 0) ranges = illumina8;
+    if (strcmp(scheme, "illumina4") == 0) ranges = illumina4;
+    if (!ranges) return load_map(scheme, map);
+
+    for (int n = 0; ranges[n].low >= 0; n++) {
+        add_range(map, ranges[n].low, ranges[n].high, ranges[n].value);
+    }
+    return 0;
+}
+
+void qualbin_apply(uint8_t *qual, size_t len, const uint8_t map[QUAL_MAP_SIZE])
+{
+    for (size_t n = 0; n < len; n++) {
+        if (qual[n] && qual[n] < QUAL_MAP_SIZE) qual[n] = map[qual[n]];
+    }
+}
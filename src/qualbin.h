@@ -0,0 +1,41 @@
+/*  qualbin.h -- quality score binning
+
+    Copyright (C) 2026 Genome Research Ltd.
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU Affero General Public License as published
+by the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+You should have received a copy of the GNU Affero General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef __QUALBIN_H__
+#define __QUALBIN_H__
+
+#include <stdint.h>
+#include <stddef.h>
+
+// BCL files hold 6-bit quality values, so this covers every value they can contain
+#define QUAL_MAP_SIZE 64
+
+/*
+ * Fill map with the binning scheme given by 'scheme', which is either the name
+ * of a built-in scheme ("illumina8" or "illumina4") or the name of a file.
+ *
+ * Returns 0 on success, -1 on failure.
+ */
+int qualbin_make_map(const char *scheme, uint8_t map[QUAL_MAP_SIZE]);
+
+/*
+ * Bin len phred quality values in place.
+ * No-calls (0) and values outside the map, such as 0xff (quality not present),
+ * are left alone.
+ */
+void qualbin_apply(uint8_t *qual, size_t len, const uint8_t map[QUAL_MAP_SIZE]);
+
+#endif
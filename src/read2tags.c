@@ -38,6 +38,7 @@ along with this program.  If not, see <http://www.gnu.org/licenses/>.
 #include "array.h"
 #include "bamit.h"
 #include "parse.h"
+#include "qualbin.h"
 
 #define DEFAULT_KEEP_TAGS "BC,QT,RG"
 #define DEFAULT_DISCARD_TAGS "as,af,aa,a3,ah"
@@ -70,6 +71,8 @@ typedef struct {
     va_t *discard_tags;
     bool merge;
     bool replace;
+    bool qual_bin;
+    uint8_t qual_map[QUAL_MAP_SIZE];
 } opts_t;
 
 /*
@@ -187,6 +190,8 @@ static void usage(FILE *write_to)
 "       --input-fmt             [sam/bam/cram] [default: bam]\n"
 "       --output-fmt            [sam/bam/cram] [default: bam]\n"
 "       --compression-level     [0..9]\n"
+"       --qual-bin              Bin quality values. Either 'illumina8' (8-level binning), 'illumina4'\n"
+"                               (4-level binning), or a file with lines of 'low high binned-value'\n"
 );
 }
 
@@ -213,6 +218,7 @@ opts_t* read2tags_parse_args(int argc, char *argv[])
         { "compression-level",  1, 0, 0 },
         { "input-fmt",          1, 0, 0 },
         { "output-fmt",         1, 0, 0 },
+        { "qual-bin",           1, 0, 0 },
         { NULL, 0, NULL, 0 }
     };
 
@@ -257,6 +263,14 @@ opts_t* read2tags_parse_args(int argc, char *argv[])
                          if (strcmp(arg, "output-fmt") == 0)              opts->output_fmt = strdup(optarg);
                     else if (strcmp(arg, "input-fmt") == 0)               opts->input_fmt = strdup(optarg);
                     else if (strcmp(arg, "compression-level") == 0)       opts->compression_level = *optarg;
+                    else if (strcmp(arg, "qual-bin") == 0) {
+                        if (qualbin_make_map(optarg, opts->qual_map) < 0) {
+                            fprintf(stderr,"Invalid quality binning scheme: %s\n", optarg);
+                            free_opts(opts);
+                            return NULL;
+                        }
+                        opts->qual_bin = true;
+                    }
                     else {
                         fprintf(stderr,"\nUnknown option: %s\n\n", arg); 
                         usage(stdout); free_opts(opts);
@@ -747,8 +761,8 @@ int process(opts_t* opts)
     int nrec = 0;
     int r;
 
-    BAMit_t *bam_in = BAMit_open(opts->in_file, 'r', opts->input_fmt, 0, NULL);
-    BAMit_t *bam_out = BAMit_open(opts->out_file, 'w', opts->output_fmt, opts->compression_level, NULL);
+    BAMit_t *bam_in = BAMit_open(opts->in_file, 'r', opts->input_fmt, 0, NULL, 0);
+    BAMit_t *bam_out = BAMit_open(opts->out_file, 'w', opts->output_fmt, opts->compression_level, NULL, 0);
 
     // copy input to output header
     bam_hdr_destroy(bam_out->h); bam_out->h = bam_hdr_dup(bam_in->h);
@@ -762,12 +776,14 @@ int process(opts_t* opts)
     while (BAMit_hasnext(bam_in)) {
         bam1_t *rec = BAMit_next(bam_in);
         if (invalid_record(rec,++nrec)) return -1;
+        if (opts->qual_bin) qualbin_apply(bam_get_qual(rec), rec->core.l_qseq, opts->qual_map);
         bam1_t *newrec = process_record(rec,opts);
 
         bam1_t *rec2 = BAMit_peek(bam_in);
         if (rec2 && strcmp(bam_get_qname(rec), bam_get_qname(rec2)) == 0) {
             rec2 = BAMit_next(bam_in);
             if (invalid_record(rec2,++nrec)) return -1;
+            if (opts->qual_bin) qualbin_apply(bam_get_qual(rec2), rec2->core.l_qseq, opts->qual_map);
             bam1_t *newrec2 = process_record(rec2,opts);
             if ((newrec->core.l_qseq == 0) || (newrec2->core.l_qseq == 0)) {
                 bam1_t *merged_rec = merge_records(newrec, newrec2, opts);
@@ -1371,7 +1371,7 @@ static void calculateFilter(opts_t *opts)
 
 	RegionTable ***rts = NULL;
     
-	fp_input_bam = BAMit_open(opts->in_bam_file, 'r', opts->input_fmt, 0, NULL);
+	fp_input_bam = BAMit_open(opts->in_bam_file, 'r', opts->input_fmt, 0, NULL, 0);
 	if (NULL == fp_input_bam) {
 		die("ERROR: can't open bam file %s: %s\n", opts->in_bam_file, strerror(errno));
 	}
@@ -1456,13 +1456,13 @@ static void applyFilter(opts_t *s)
     }
     strcat(apply_stats_file, s->apply_stats_out);
 
-	fp_input_bam = BAMit_open(s->in_bam_file, 'r', s->input_fmt, 0, NULL);
+	fp_input_bam = BAMit_open(s->in_bam_file, 'r', s->input_fmt, 0, NULL, 0);
 	if (NULL == fp_input_bam) {
 		die("ERROR: can't open bam file %s: %s\n", s->in_bam_file, strerror(errno));
 	}
 
 
-	fp_output_bam = BAMit_open(out_bam_file, 'w', s->output_fmt, s->compression_level, NULL);
+	fp_output_bam = BAMit_open(out_bam_file, 'w', s->output_fmt, s->compression_level, NULL, 0);
 	if (NULL == fp_output_bam) {
 		die("ERROR: can't open bam file %s: %s\n", out_bam_file, strerror(errno));
 	}
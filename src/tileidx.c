@@ -0,0 +1,177 @@
+/*  tileidx.c -- per-tile index of an unaligned BAM file
+
+    Copyright (C) 2026 Genome Research Ltd.
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU Affero General Public License as published
+by the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+You should have received a copy of the GNU Affero General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+#include <htslib/thread_pool.h>
+
+#include "bambi.h"
+#include "tileidx.h"
+
+char *tileidx_name(const char *bam_name)
+{
+    char *fname = malloc(strlen(bam_name) + 9);
+    if (!fname) die("Out of memory");
+    sprintf(fname, "%s.tileidx", bam_name);
+    return fname;
+}
+
+tileidx_t *tileidx_create(const char *fname, samFile *output_file)
+{
+    if (output_file->format.format != bam) return NULL;
+
+    tileidx_t *idx = calloc(1, sizeof(tileidx_t));
+    if (!idx) die("Out of memory");
+    idx->bgzf = output_file->fp.bgzf;
+
+    // the first tile starts on the block after the header
+    if (bgzf_flush(idx->bgzf) < 0) { free(idx); return NULL; }
+    idx->start = bgzf_tell(idx->bgzf);
+
+    idx->fp = fopen(fname, "w");
+    if (!idx->fp) {
+        fprintf(stderr, "Can't open tile index %s\n", fname);
+        free(idx);
+        return NULL;
+    }
+    fprintf(idx->fp, "#tile\tvoffset\trecords\n");
+    return idx;
+}
+
+int tileidx_mark(tileidx_t *idx, int tile, uint64_t nrecords)
+{
+    if (bgzf_flush(idx->bgzf) < 0) return -1;
+    int64_t end = bgzf_tell(idx->bgzf);
+    if (fprintf(idx->fp, "%d\t%" PRId64 "\t%" PRIu64 "\n", tile, idx->start, nrecords) < 0) return -1;
+    idx->start = end;
+    return 0;
+}
+
+int tileidx_close(tileidx_t *idx)
+{
+    if (!idx) return 0;
+    int r = fclose(idx->fp);
+    free(idx);
+    return r ? -1 : 0;
+}
+
+va_t *tileidx_load(const char *fname)
+{
+    char line[256];
+    int lineno = 0;
+    FILE *fp = fopen(fname, "r");
+    if (!fp) {
+        fprintf(stderr, "Can't open tile index %s\n", fname);
+        return NULL;
+    }
+
+    va_t *idx = va_init(100, free);
+    while (fgets(line, sizeof(line), fp)) {
+        lineno++;
+        if (line[0] == '#' || line[0] == '\n') continue;
+        tileidx_entry_t *e = calloc(1, sizeof(tileidx_entry_t));
+        if (!e) die("Out of memory");
+        if (sscanf(line, "%d\t%" SCNd64 "\t%" SCNu64, &e->tile, &e->voffset, &e->nrecords) != 3) {
+            fprintf(stderr, "Bad tile index entry at %s line %d\n", fname, lineno);
+            free(e);
+            va_free(idx);
+            fclose(fp);
+            return NULL;
+        }
+        va_push(idx, e);
+    }
+    fclose(fp);
+    return idx;
+}
+
+/*
+ * Read one tile
+ */
+typedef struct {
+    const char *bam_name;
+    tileidx_entry_t *entry;
+    tileidx_func_t func;
+    void *arg;
+    int ret;
+} tileidx_job_t;
+
+static void *tileidx_read_tile(void *arg)
+{
+    tileidx_job_t *job = (tileidx_job_t *)arg;
+    bam_hdr_t *h = NULL;
+    bam1_t *rec = NULL;
+    samFile *f = hts_open(job->bam_name, "r");
+
+    job->ret = -1;
+    if (!f) {
+        fprintf(stderr, "Could not open file (%s)\n", job->bam_name);
+        return NULL;
+    }
+    h = sam_hdr_read(f);
+    rec = bam_init1();
+    if (!h || !rec || f->format.format != bam) goto cleanup;
+
+    if (bgzf_seek(f->fp.bgzf, job->entry->voffset, SEEK_SET) < 0) {
+        fprintf(stderr, "Can't seek to tile %d in %s\n", job->entry->tile, job->bam_name);
+        goto cleanup;
+    }
+    for (uint64_t n = 0; n < job->entry->nrecords; n++) {
+        if (sam_read1(f, h, rec) < 0) {
+            fprintf(stderr, "Tile %d in %s is truncated\n", job->entry->tile, job->bam_name);
+            goto cleanup;
+        }
+        if (job->func(job->entry->tile, rec, h, job->arg)) goto cleanup;
+    }
+    job->ret = 0;
+
+ cleanup:
+    if (rec) bam_destroy1(rec);
+    if (h) bam_hdr_destroy(h);
+    sam_close(f);
+    return NULL;
+}
+
+int tileidx_run(const char *bam_name, va_t *idx, int nthreads, tileidx_func_t func, void *arg)
+{
+    int ret = 0;
+    if (idx->end == 0) return 0;
+    if (nthreads < 1) nthreads = 1;
+
+    tileidx_job_t *jobs = calloc(idx->end, sizeof(tileidx_job_t));
+    hts_tpool *p = hts_tpool_init(nthreads);
+    hts_tpool_process *q = p ? hts_tpool_process_init(p, 2 * nthreads, 1) : NULL;
+    if (!jobs || !q) die("Couldn't set up thread pool\n");
+
+    for (int n = 0; n < idx->end; n++) {
+        jobs[n].bam_name = bam_name;
+        jobs[n].entry = (tileidx_entry_t *)idx->entries[n];
+        jobs[n].func = func;
+        jobs[n].arg = arg;
+        if (hts_tpool_dispatch(p, q, tileidx_read_tile, &jobs[n]) < 0) die("Thread pool dispatch failed");
+    }
+    hts_tpool_process_flush(q);
+
+    for (int n = 0; n < idx->end; n++) {
+        if (jobs[n].ret) ret = -1;
+    }
+
+    hts_tpool_process_destroy(q);
+    hts_tpool_destroy(p);
+    free(jobs);
+    return ret;
+}
@@ -0,0 +1,97 @@
+/*  tileidx.h -- per-tile index of an unaligned BAM file
+
+    Copyright (C) 2026 Genome Research Ltd.
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU Affero General Public License as published
+by the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+You should have received a copy of the GNU Affero General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef __TILEIDX_H__
+#define __TILEIDX_H__
+
+#include <stdio.h>
+#include <stdint.h>
+#include "htslib/bgzf.h"
+#include "htslib/sam.h"
+#include "array.h"
+
+/*
+ * The tile index is a small text file written alongside the BAM file
+ * (<output>.tileidx) with one line per tile:
+ *
+ *     tile <TAB> virtual offset of first record <TAB> number of records
+ *
+ * Each tile starts on a new BGZF block, so tiles can be read in parallel
+ * by seeking to their offset.
+ */
+
+typedef struct {
+    int tile;
+    int64_t voffset;
+    uint64_t nrecords;
+} tileidx_entry_t;
+
+/*
+ * Writer
+ */
+typedef struct {
+    FILE *fp;
+    BGZF *bgzf;
+    int64_t start;
+} tileidx_t;
+
+/*
+ * Return the name of the index for a BAM file. The caller must free it.
+ */
+char *tileidx_name(const char *bam_name);
+
+/*
+ * Create the index for a BAM file which has just had its header written.
+ * Returns NULL if the file is not BAM, or the index can't be created.
+ */
+tileidx_t *tileidx_create(const char *fname, samFile *output_file);
+
+/*
+ * Record a finished tile. Flushes the BAM file so that the next tile
+ * starts on a new block. Returns 0 on success, -1 on error.
+ */
+int tileidx_mark(tileidx_t *idx, int tile, uint64_t nrecords);
+
+/*
+ * Close the index. Returns 0 on success, -1 on error.
+ */
+int tileidx_close(tileidx_t *idx);
+
+/*
+ * Reader
+ */
+
+/*
+ * Load an index. Returns an array of tileidx_entry_t, or NULL on error.
+ */
+va_t *tileidx_load(const char *fname);
+
+/*
+ * Called once for each record in a tile. Calls for different tiles may be
+ * made concurrently. Returns 0 to carry on, or non-zero to stop reading
+ * the tile.
+ */
+typedef int (*tileidx_func_t)(int tile, bam1_t *rec, bam_hdr_t *h, void *arg);
+
+/*
+ * Read the tiles of a BAM file in parallel, using nthreads threads, and
+ * call func for each record. Returns 0 on success, -1 if a tile could not
+ * be read or func returned non-zero.
+ */
+int tileidx_run(const char *bam_name, va_t *idx, int nthreads, tileidx_func_t func, void *arg);
+
+#endif
+
@@ -0,0 +1,202 @@
+/*  test/b_decode.c -- barcode matching microbenchmark.
+
+    Copyright (C) 2018 Genome Research Ltd.
+
+    Author: Jennifer Liddle <js10@sanger.ac.uk>
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU Affero General Public License as published
+by the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU Affero General Public License for more details.
+
+You should have received a copy of the GNU Affero General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+
+*/
+#include "../src/hts_addendum.c"
+#include "../src/decode.c"
+
+#include <stdlib.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <time.h>
+
+/*
+ * Time countMismatches() against the packed kernels, scoring random reads
+ * against a random barcode set.
+ *
+ * usage: b_decode [-b barcodes] [-r reads] [-l index length]
+ */
+
+const char * bambi_version(void)
+{
+    return "12.34";
+}
+
+void die(const char *fmt, ...)
+{
+    va_list ap;
+    va_start(ap,fmt);
+    fflush(stdout);
+    vfprintf(stderr, fmt, ap);
+    va_end(ap);
+    fflush(stderr);
+    exit(EXIT_FAILURE);
+}
+
+static double now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static void report(const char *name, double secs, long comparisons, long checksum)
+{
+    printf("%-22s %8.3f s %8.2f ns/comparison  (checksum %ld)\n", name, secs, secs * 1e9 / comparisons, checksum);
+}
+
+int main(int argc, char **argv)
+{
+    int nbarcodes = 384, nreads = 100000, idx_len = 8;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "b:r:l:")) != -1) {
+        switch (opt) {
+            case 'b': nbarcodes = atoi(optarg); break;
+            case 'r': nreads = atoi(optarg); break;
+            case 'l': idx_len = atoi(optarg); break;
+            default: fprintf(stderr, "usage: b_decode [-b barcodes] [-r reads] [-l index length]\n"); return EXIT_FAILURE;
+        }
+    }
+    if (nbarcodes < 1 || nreads < 1 || idx_len < 1 || 2 * idx_len + 1 > 255) {
+        fprintf(stderr, "Invalid arguments\n");
+        return EXIT_FAILURE;
+    }
+
+    int len = 2 * idx_len + 1;
+    decode_opts_t opts = { 0 };
+    va_t *barcodeArray = va_init(nbarcodes + 1, free_bcd);
+    char **reads = calloc(nreads, sizeof(char *));
+    packed_bc_t *preads = calloc(nreads, sizeof(packed_bc_t));
+    if (!reads || !preads) die("Out of memory");
+
+    srand(1);
+    for (int n = 0; n <= nbarcodes; n++) {
+        bc_details_t *bcd = bcd_init();
+        bcd->seq = malloc(len + 1);
+        if (!bcd->seq) die("Out of memory");
+        for (int i = 0; i < len; i++) bcd->seq[i] = n ? "ACGT"[rand() % 4] : 'N';
+        bcd->seq[idx_len] = INDEX_SEPARATOR[0];
+        bcd->seq[len] = 0;
+        bcd->idx1 = strndup(bcd->seq, idx_len);
+        bcd->idx2 = strdup(bcd->seq + idx_len + 1);
+        va_push(barcodeArray, bcd);
+    }
+    opts.idx1_len = opts.idx2_len = idx_len;
+    packBarcodes(barcodeArray, &opts);
+
+    // reads are barcodes with a few errors and no-calls
+    for (int r = 0; r < nreads; r++) {
+        bc_details_t *bcd = barcodeArray->entries[1 + rand() % nbarcodes];
+        reads[r] = strdup(bcd->seq);
+        if (!reads[r]) die("Out of memory");
+        for (int e = rand() % 3; e > 0; e--) {
+            int i = rand() % len;
+            if (i != idx_len) reads[r][i] = "ACGTN"[rand() % 5];
+        }
+        packBarcode(reads[r], &preads[r]);
+    }
+
+    long comparisons = (long)nreads * nbarcodes;
+    long checksum;
+    double t;
+
+    checksum = 0;
+    t = now();
+    for (int r = 0; r < nreads; r++) {
+        for (int n = 1; n <= nbarcodes; n++) {
+            bc_details_t *bcd = barcodeArray->entries[n];
+            checksum += countMismatches(bcd->seq, reads[r], 999);
+        }
+    }
+    report("countMismatches", now() - t, comparisons, checksum);
+
+    checksum = 0;
+    t = now();
+    for (int r = 0; r < nreads; r++) {
+        for (int n = 1; n <= nbarcodes; n++) {
+            bc_details_t *bcd = barcodeArray->entries[n];
+            checksum += packedMismatches(&bcd->pseq, &preads[r]);
+        }
+    }
+    report("packedMismatches", now() - t, comparisons, checksum);
+
+    checksum = 0;
+    t = now();
+    for (int r = 0; r < nreads; r++) {
+        uint8_t counts[PACKED_BLOCK];
+        for (int first = 1; first <= nbarcodes; first += PACKED_BLOCK) {
+            int count = nbarcodes + 1 - first < PACKED_BLOCK ? nbarcodes + 1 - first : PACKED_BLOCK;
+            packedMismatchesMany(opts.packed, &preads[r], first, count, counts);
+            for (int b = 0; b < count; b++) checksum += counts[b];
+        }
+    }
+    report("packedMismatchesMany", now() - t, comparisons, checksum);
+
+    checksum = 0;
+    t = now();
+    for (int r = 0; r < nreads; r++) {
+        checksum += noCalls(reads[r]);
+    }
+    report("noCalls", now() - t, nreads, checksum);
+
+    checksum = 0;
+    t = now();
+    for (int r = 0; r < nreads; r++) {
+        packed_bc_t p;
+        packBarcode(reads[r], &p);
+        checksum += packedNoCalls(&p);
+    }
+    report("packBarcode+NoCalls", now() - t, nreads, checksum);
+
+    // whole-read matching, with and without the seed index
+    opts.max_mismatches = 2;
+    opts.min_mismatch_delta = 1;
+    opts.max_no_calls = 2;
+    HashTable *barcodeHash = make_barcode_hash(barcodeArray);
+    barcode_seeds_t *seeds = make_barcode_seeds(barcodeArray, &opts);
+
+    checksum = 0;
+    t = now();
+    for (int r = 0; r < nreads; r++) {
+        bc_details_t *bcd = findBestMatch(reads[r], &preads[r], barcodeArray, barcodeHash, &opts);
+        checksum += bcd->seq[0];
+    }
+    report("findBestMatch", now() - t, nreads, checksum);
+
+    opts.seeds = seeds;
+    checksum = 0;
+    t = now();
+    for (int r = 0; r < nreads; r++) {
+        bc_details_t *bcd = findBestMatch(reads[r], &preads[r], barcodeArray, barcodeHash, &opts);
+        checksum += bcd->seq[0];
+    }
+    report("findBestMatch+seeds", now() - t, nreads, checksum);
+    opts.seeds = NULL;
+    free_barcode_seeds(seeds);
+    HashTableDestroy(barcodeHash, 0);
+
+    for (int r = 0; r < nreads; r++) free(reads[r]);
+    free(reads);
+    free(preads);
+    free_packed_set(opts.packed);
+    va_free(barcodeArray);
+    return EXIT_SUCCESS;
+}
@@ -107,15 +107,48 @@ int main(int argc, char**argv)
     icheckEqual("End of records", false, BAMit_hasnext(bit));
     BAMit_free(bit);
 
-    bit = BAMit_open(MKNAME(DATA_DIR,"/bamit.bam"), 'r', NULL, 0, NULL);
+    bit = BAMit_open(MKNAME(DATA_DIR,"/bamit.bam"), 'r', NULL, 0, NULL, 0);
     rec = BAMit_next(bit);
     checkEqual("First name", "IL16_986:1:9:9:307", bam_get_qname(rec));
     BAMit_free(bit);
 
-    bit = BAMit_open(MKNAME(DATA_DIR,"/bamit_empty.bam"), 'r', NULL, 0, NULL);
+    bit = BAMit_open(MKNAME(DATA_DIR,"/bamit_empty.bam"), 'r', NULL, 0, NULL, 0);
     icheckEqual("Empty bam file", false, BAMit_hasnext(bit));
     BAMit_free(bit);
 
+    // reading sf.bam in ranges gives the same records as reading it in one go,
+    // and no template is split between ranges
+    int64_t *offsets;
+    int nranges = BAMit_split(MKNAME(DATA_DIR,"/sf.bam"), 1, &offsets);
+    icheckEqual("Split into ranges", true, nranges > 1);
+    BAMit_t *seq = BAMit_open(MKNAME(DATA_DIR,"/sf.bam"), 'r', NULL, 0, NULL, 0);
+    bit = BAMit_open(MKNAME(DATA_DIR,"/sf.bam"), 'r', NULL, 0, NULL, 0);
+    char last[256] = "";
+    n = 0;
+    for (int i = 0; i < nranges; i++) {
+        icheckEqual("Seek range", 0, BAMit_seek_range(bit, offsets[i], i+1 < nranges ? offsets[i+1] : 0));
+        if (BAMit_hasnext(bit) && !strcmp(last, bam_get_qname(BAMit_peek(bit)))) {
+            fprintf(stderr, "Template %s split at range %d\n", last, i);
+            failure++;
+        }
+        while (BAMit_hasnext(bit)) {
+            rec = BAMit_next(bit);
+            bam1_t *srec = BAMit_next(seq);
+            if (!srec || strcmp(bam_get_qname(srec), bam_get_qname(rec)) || srec->core.flag != rec->core.flag) {
+                fprintf(stderr, "Range %d record %d differs\n", i, n);
+                failure++;
+                break;
+            }
+            strcpy(last, bam_get_qname(rec));
+            n++;
+        }
+    }
+    icheckEqual("Range records", 24264, n);
+    icheckEqual("End of sequential records", false, BAMit_hasnext(seq));
+    free(offsets);
+    BAMit_free(seq);
+    BAMit_free(bit);
+
 
     printf("BAMit tests: %s\n", failure ? "FAILED" : "Passed");
     return failure ? EXIT_FAILURE : EXIT_SUCCESS;
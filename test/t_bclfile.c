@@ -23,6 +23,8 @@ along with this program.  If not, see <http://www.gnu.org/licenses/>.
 #include <stdio.h>
 #include <unistd.h>
 #include <string.h>
+#include <zlib.h>
+#include <pthread.h>
 #include "bclfile.h"
 
 #define xMKNAME(d,f) #d f
@@ -85,6 +87,77 @@ void icheckEqual(char *name, int expected, int actual)
     }
 }
 
+static void put_u32(FILE *f, uint32_t v)
+{
+    uint8_t b[4] = { v & 0xff, (v >> 8) & 0xff, (v >> 16) & 0xff, v >> 24 };
+    fwrite(b, 1, 4, f);
+}
+
+/*
+ * Write a single tile (1101) CBCL file with the given layout
+ */
+static void write_cbcl(char *fname, int bits_per_base, int bits_per_qual, int nbins, const uint32_t qbins[][2],
+                       const uint8_t *data, uint32_t data_len, uint32_t nclusters)
+{
+    uint8_t zbuf[256];
+    uLongf zlen = sizeof(zbuf);
+    uint16_t version = 1;
+    FILE *f = fopen(fname, "wb");
+    if (!f || compress2(zbuf, &zlen, data, data_len, 6) != Z_OK) die("Can't write %s\n", fname);
+    fwrite(&version, 2, 1, f);
+    put_u32(f, 2 + 4 + 1 + 1 + 4 + 8 * nbins + 4 + 16 + 1);
+    fputc(bits_per_base, f);
+    fputc(bits_per_qual, f);
+    put_u32(f, nbins);
+    for (int n = 0; n < nbins; n++) { put_u32(f, qbins[n][0]); put_u32(f, qbins[n][1]); }
+    put_u32(f, 1);  // ntiles
+    put_u32(f, 1101); put_u32(f, nclusters); put_u32(f, data_len); put_u32(f, zlen);
+    fputc(1, f);    // pfFlag
+    fwrite(zbuf, 1, zlen, f);
+    fclose(f);
+}
+
+// Handle cache stress test: several threads read their own BCL files through
+// one cache which has room for fewer files than any one thread reads, so
+// handles are evicted all the time. The first file is read twice in a row,
+// so most of its reads find the handle still open.
+
+#define STRESS_THREADS 8
+#define STRESS_FILES 4
+#define STRESS_LOOPS 200
+
+typedef struct {
+    pthread_barrier_t *start;
+    bcl_fd_cache_t *fd_cache;
+    char **expected;
+    int failures;
+} stress_t;
+
+static char *cycle_name(char *name, size_t len, int cycle)
+{
+    snprintf(name, len, "%s/novaseq/Data/Intensities/BaseCalls/L001/C%d.1/L001_1.cbcl", MKNAME(DATA_DIR,""), cycle);
+    return name;
+}
+
+static void *stress_thread(void *arg)
+{
+    stress_t *st = (stress_t *)arg;
+    bclfile_t *bcl[STRESS_FILES];
+    char name[512];
+
+    pthread_barrier_wait(st->start);
+    for (int f = 0; f < STRESS_FILES; f++) bcl[f] = bclfile_open(cycle_name(name, sizeof(name), f+1), MT_NOVASEQ, 1101, NULL, st->fd_cache);
+    for (int loop = 0; loop < STRESS_LOOPS; loop++) {
+        for (int f = -1; f < STRESS_FILES; f++) {
+            int i = f < 0 ? 0 : f;
+            bclfile_load_tile(bcl[i], 1101, NULL, -1);
+            if (memcmp(bcl[i]->bases, st->expected[i], bcl[i]->bases_size)) st->failures++;
+        }
+    }
+    for (int f = 0; f < STRESS_FILES; f++) bclfile_close(bcl[f]);
+    return NULL;
+}
+
 int main(int argc, char**argv)
 {
     int n;
@@ -93,7 +166,7 @@ int main(int argc, char**argv)
 
     // BCL tests
 
-    bclfile = bclfile_open(MKNAME(DATA_DIR,"/s_1_1101.bcl.gz"), MT_HISEQX, -1);
+    bclfile = bclfile_open(MKNAME(DATA_DIR,"/s_1_1101.bcl.gz"), MT_HISEQX, -1, NULL, NULL);
     if (bclfile->errmsg) {
         fprintf(stderr,"Error opening file: %s\n", bclfile->errmsg);
         failure++;
@@ -109,9 +182,49 @@ int main(int argc, char**argv)
 
     bclfile_close(bclfile);
 
+    // Quality binning tests
+
+    uint8_t qual_map[QUAL_MAP_SIZE];
+    icheckEqual("illumina8 map", 0, qualbin_make_map("illumina8", qual_map));
+    bclfile = bclfile_open(MKNAME(DATA_DIR,"/s_1_1101.bcl.gz"), MT_HISEQX, -1, qual_map, NULL);
+    ccheckEqual("Binned Base", 'N', bclfile_base(bclfile,0));
+    icheckEqual("Binned Quality", 0, bclfile_quality(bclfile,0));
+    ccheckEqual("Binned 307 Base", 'A', bclfile_base(bclfile,306));
+    icheckEqual("Binned 307 Quality", 33, bclfile_quality(bclfile,306));
+    bclfile_close(bclfile);
+
+    icheckEqual("illumina4 map", 0, qualbin_make_map("illumina4", qual_map));
+    icheckEqual("illumina4 30", 23, qual_map[30]);
+    icheckEqual("illumina4 0", 0, qual_map[0]);
+    icheckEqual("missing map file", -1, qualbin_make_map("no/such/file", qual_map));
+
+    // quality 0 is a no-call, which map files can't bin or bin to
+    char map_name[] = "/tmp/bambi_qualbin.XXXXXX";
+    int map_fd = mkstemp(map_name);
+    if (map_fd < 0) die("Can't make temporary file\n");
+    const char *bad_maps[] = { "0 5 3\n", "2 5 0\n" };
+    for (n = 0; n < 2; n++) {
+        if (ftruncate(map_fd, 0) < 0 || pwrite(map_fd, bad_maps[n], strlen(bad_maps[n]), 0) < 0) die("Can't write %s\n", map_name);
+        icheckEqual("map file binning quality 0", -1, qualbin_make_map(map_name, qual_map));
+    }
+    const char *good_map = "# comment\n2 9 6\n10 63 30\n";
+    if (ftruncate(map_fd, 0) < 0 || pwrite(map_fd, good_map, strlen(good_map), 0) < 0) die("Can't write %s\n", map_name);
+    icheckEqual("map file", 0, qualbin_make_map(map_name, qual_map));
+    icheckEqual("map file 12", 30, qual_map[12]);
+    close(map_fd);
+    unlink(map_name);
+
+    uint8_t quals[] = { 0, 7, 40, 0xff };
+    qual_map[0] = 5;    // even if a map did bin 0, no-calls are left alone
+    qualbin_apply(quals, sizeof(quals), qual_map);
+    icheckEqual("apply no-call", 0, quals[0]);
+    icheckEqual("apply 7", 6, quals[1]);
+    icheckEqual("apply 40", 30, quals[2]);
+    icheckEqual("apply missing", 0xff, quals[3]);
+
     // CBCL tests
 
-    bclfile = bclfile_open(MKNAME(DATA_DIR,"/novaseq/Data/Intensities/BaseCalls/L001/C1.1/L001_1.cbcl"), MT_NOVASEQ, 1101);
+    bclfile = bclfile_open(MKNAME(DATA_DIR,"/novaseq/Data/Intensities/BaseCalls/L001/C1.1/L001_1.cbcl"), MT_NOVASEQ, 1101, NULL, NULL);
     if (bclfile->errmsg) {
         fprintf(stderr,"Error opening file: %s\n", bclfile->errmsg);
         failure++;
@@ -139,6 +252,112 @@ int main(int argc, char**argv)
 
     bclfile_close(bclfile);
 
+    // File handle cache with room for one open file
+
+    bcl_fd_cache_t *fd_cache = bcl_fd_cache_init(1);
+    bclfile_t *bcl2;
+    bclfile = bclfile_open(MKNAME(DATA_DIR,"/novaseq/Data/Intensities/BaseCalls/L001/C1.1/L001_1.cbcl"), MT_NOVASEQ, 1101, NULL, fd_cache);
+    bcl2 = bclfile_open(MKNAME(DATA_DIR,"/novaseq/Data/Intensities/BaseCalls/L001/C2.1/L001_1.cbcl"), MT_NOVASEQ, 1101, NULL, fd_cache);
+    icheckEqual("Handle evicted", 1, fd_cache->evictions);
+    ccheckEqual("Evicted handle closed", 1, bclfile->fhandle == NULL);
+    bclfile_load_tile(bclfile,1101,NULL,-1);
+    icheckEqual("Handle reopened", 3, fd_cache->misses);
+    icheckEqual("Second handle evicted", 2, fd_cache->evictions);
+    ccheckEqual("Reopened CBCL First Base", 'T', bclfile_base(bclfile,0));
+    ccheckEqual("Reopened CBCL Third Base", 'N', bclfile_base(bclfile,2));
+    bclfile_load_tile(bclfile,1101,NULL,-1);
+    icheckEqual("Handle cache hit", 1, fd_cache->hits);
+    icheckEqual("Open handles", 1, fd_cache->nopen);
+    bclfile_close(bclfile);
+    bclfile_close(bcl2);
+    icheckEqual("Open handles after close", 0, fd_cache->nopen);
+    bcl_fd_cache_free(fd_cache);
+
+    char *expected[STRESS_FILES];
+    char name[512];
+    int nbases = 0;
+    for (n = 0; n < STRESS_FILES; n++) {
+        bclfile = bclfile_open(cycle_name(name, sizeof(name), n+1), MT_NOVASEQ, 1101, NULL, NULL);
+        bclfile_load_tile(bclfile,1101,NULL,-1);
+        nbases = bclfile->bases_size;
+        expected[n] = malloc(nbases);
+        memcpy(expected[n], bclfile->bases, nbases);
+        bclfile_close(bclfile);
+    }
+    fd_cache = bcl_fd_cache_init(STRESS_FILES - 1);
+    pthread_t threads[STRESS_THREADS];
+    stress_t stress[STRESS_THREADS];
+    pthread_barrier_t start;
+    pthread_barrier_init(&start, NULL, STRESS_THREADS);
+    for (n = 0; n < STRESS_THREADS; n++) {
+        stress[n].start = &start;
+        stress[n].fd_cache = fd_cache;
+        stress[n].expected = expected;
+        stress[n].failures = 0;
+        if (pthread_create(&threads[n], NULL, stress_thread, &stress[n])) die("Can't create thread\n");
+    }
+    int stress_failures = 0;
+    for (n = 0; n < STRESS_THREADS; n++) {
+        pthread_join(threads[n], NULL);
+        stress_failures += stress[n].failures;
+    }
+    pthread_barrier_destroy(&start);
+    icheckEqual("Stress test bases", 0, stress_failures);
+    icheckEqual("Stress test evicted handles", 1, fd_cache->evictions > 0);
+    icheckEqual("Stress test reused handles", 1, fd_cache->hits > 0);
+    icheckEqual("Stress test open handles after close", 0, fd_cache->nopen);
+    icheckEqual("Stress test idle handles after close", 1, fd_cache->head == NULL && fd_cache->tail == NULL);
+    bcl_fd_cache_free(fd_cache);
+    for (n = 0; n < STRESS_FILES; n++) free(expected[n]);
+
+    // CBCL files with other layouts
+
+    char cbcl_name[] = "/tmp/bambi_cbcl.XXXXXX";
+    int fd = mkstemp(cbcl_name);
+    if (fd < 0) die("Can't make temporary file\n");
+    close(fd);
+
+    // 2 bit bases, 6 bit qbins: one cluster per byte
+    const uint32_t qbins6[][2] = { {0, 0}, {1, 12}, {2, 25}, {63, 40} };
+    const uint8_t data8[] = { 0x00, 0x05, 0x0a, 0xff };
+    write_cbcl(cbcl_name, 2, 6, 4, qbins6, data8, sizeof(data8), 4);
+    bclfile = bclfile_open(cbcl_name, MT_NOVASEQ, 1101, NULL, NULL);
+    bclfile_load_tile(bclfile,1101,NULL,-1);
+    icheckEqual("2/6 Number of bases", 4, bclfile->bases_size);
+    ccheckEqual("2/6 First Base", 'N', bclfile_base(bclfile,0));
+    ccheckEqual("2/6 Second Base", 'C', bclfile_base(bclfile,1));
+    icheckEqual("2/6 Second Quality", 12, bclfile_quality(bclfile,1));
+    ccheckEqual("2/6 Third Base", 'G', bclfile_base(bclfile,2));
+    icheckEqual("2/6 Third Quality", 25, bclfile_quality(bclfile,2));
+    ccheckEqual("2/6 Last Base", 'T', bclfile_base(bclfile,3));
+    icheckEqual("2/6 Last Quality", 40, bclfile_quality(bclfile,3));
+    bclfile_close(bclfile);
+
+    // binning leaves the no-call qbin alone
+    bclfile = bclfile_open(cbcl_name, MT_NOVASEQ, 1101, qual_map, NULL);
+    bclfile_load_tile(bclfile,1101,NULL,-1);
+    ccheckEqual("2/6 Binned First Base", 'N', bclfile_base(bclfile,0));
+    icheckEqual("2/6 Binned First Quality", 0, bclfile_quality(bclfile,0));
+    icheckEqual("2/6 Binned Second Quality", 30, bclfile_quality(bclfile,1));
+    bclfile_close(bclfile);
+
+    // 2 bit bases, 3 bit qbins: clusters straddle bytes
+    // A/qbin 1, T/qbin 2, C/qbin 1 = 4 | 11 << 5 | 5 << 10
+    const uint32_t qbins3[][2] = { {0, 0}, {1, 14}, {2, 37} };
+    const uint8_t data5[] = { 0x64, 0x15 };
+    write_cbcl(cbcl_name, 2, 3, 3, qbins3, data5, sizeof(data5), 3);
+    bclfile = bclfile_open(cbcl_name, MT_NOVASEQ, 1101, NULL, NULL);
+    bclfile_load_tile(bclfile,1101,NULL,-1);
+    icheckEqual("2/3 Number of bases", 3, bclfile->bases_size);
+    ccheckEqual("2/3 First Base", 'A', bclfile_base(bclfile,0));
+    icheckEqual("2/3 First Quality", 14, bclfile_quality(bclfile,0));
+    ccheckEqual("2/3 Second Base", 'T', bclfile_base(bclfile,1));
+    icheckEqual("2/3 Second Quality", 37, bclfile_quality(bclfile,1));
+    ccheckEqual("2/3 Third Base", 'C', bclfile_base(bclfile,2));
+    icheckEqual("2/3 Third Quality", 14, bclfile_quality(bclfile,2));
+    bclfile_close(bclfile);
+    unlink(cbcl_name);
+
     printf("bclfile tests: %s\n", failure ? "FAILED" : "Passed");
     return failure ? EXIT_FAILURE : EXIT_SUCCESS;
 }
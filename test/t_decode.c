@@ -18,6 +18,9 @@ You should have received a copy of the GNU Affero General Public License
 along with this program.  If not, see <http://www.gnu.org/licenses/>.
 
 */
+// small enough to split sf.bam into many ranges with --split-input
+#define RANGE_SIZE (64 << 10)
+
 #include "../src/hts_addendum.c"
 #include "../src/decode.c"
 
@@ -143,7 +146,7 @@ void setup_test_3(int* argc, char*** argv, char *outputfile, char *metricsfile,
 void setup_test_4(int* argc, char*** argv, char *outputfile, char* metricsfile,
                   int threads)
 {
-    *argc = 15 + (threads ? 2 : 0);
+    *argc = 19 + (threads ? 2 : 0);
     *argv = (char**)calloc(sizeof(char*), *argc);
     (*argv)[0] = strdup("bambi");
     (*argv)[1] = strdup("decode");
@@ -160,9 +163,61 @@ void setup_test_4(int* argc, char*** argv, char *outputfile, char* metricsfile,
     (*argv)[12] = strdup("--metrics-file");
     (*argv)[13] = strdup(metricsfile);
     (*argv)[14] = strdup("--ignore-pf");
+    (*argv)[15] = strdup("--unmatched-top");
+    (*argv)[16] = strdup("20");
+    (*argv)[17] = strdup("--counts-file");
+    (*argv)[18] = malloc(strlen(metricsfile) + 8);
+    sprintf((*argv)[18], "%s.counts", metricsfile);
     if (threads) {
-        (*argv)[15] = strdup("--threads");
-        (*argv)[16] = itoa(threads);
+        (*argv)[19] = strdup("--threads");
+        (*argv)[20] = itoa(threads);
+    }
+}
+
+void setup_test_6(int* argc, char*** argv, char *metricsfile, int threads)
+{
+    *argc = 13 + (threads ? 2 : 0);
+    *argv = (char**)calloc(sizeof(char*), *argc);
+    (*argv)[0] = strdup("bambi");
+    (*argv)[1] = strdup("decode");
+    (*argv)[2] = strdup("-i");
+    (*argv)[3] = strdup(MKNAME(DATA_DIR,"/decode_1.sam"));
+    (*argv)[4] = strdup("--metrics-only");
+    (*argv)[5] = strdup("--input-fmt");
+    (*argv)[6] = strdup("sam");
+    (*argv)[7] = strdup("--barcode-file");
+    (*argv)[8] = strdup(MKNAME(DATA_DIR,"/decode_1.tag"));
+    (*argv)[9] = strdup("--metrics-file");
+    (*argv)[10] = strdup(metricsfile);
+    (*argv)[11] = strdup("--barcode-tag-name");
+    (*argv)[12] = strdup("RT");
+    if (threads) {
+        (*argv)[13] = strdup("-t");
+        (*argv)[14] = itoa(threads);
+    }
+}
+
+void setup_test_8(int* argc, char*** argv, char *outputfile, char *metricsfile,
+                  char *barcodefile, int threads)
+{
+    *argc = 12 + (threads ? 3 : 0);
+    *argv = (char**)calloc(sizeof(char*), *argc);
+    (*argv)[0] = strdup("bambi");
+    (*argv)[1] = strdup("decode");
+    (*argv)[2] = strdup("-i");
+    (*argv)[3] = strdup(MKNAME(DATA_DIR,"/sf.bam"));
+    (*argv)[4] = strdup("-o");
+    (*argv)[5] = strdup(outputfile);
+    (*argv)[6] = strdup("--output-fmt");
+    (*argv)[7] = strdup("sam");
+    (*argv)[8] = strdup("--barcode-file");
+    (*argv)[9] = strdup(barcodefile);
+    (*argv)[10] = strdup("--metrics-file");
+    (*argv)[11] = strdup(metricsfile);
+    if (threads) {
+        (*argv)[12] = strdup("--split-input");
+        (*argv)[13] = strdup("-t");
+        (*argv)[14] = itoa(threads);
     }
 }
 
@@ -186,6 +241,879 @@ void test_countMismatches(char *a, char *b, int e)
     else { failure++; fprintf(stderr, "countMismatches(%s,%s) returned %d: expected %d\n", a,b,n,e); }
 }
 
+void test_per_barcode_name(char *template, char *name, char *e)
+{
+    char *fname = per_barcode_name(template, name);
+    if (e ? fname && strcmp(fname, e) == 0 : !fname) success++;
+    else { failure++; fprintf(stderr, "per_barcode_name(%s,%s) returned %s: expected %s\n", template, name, fname ? fname : "NULL", e ? e : "NULL"); }
+    free(fname);
+}
+
+void test_parse_count(char *str, uint64_t max, uint64_t e)
+{
+    uint64_t n = parse_count(str, max);
+    if (n == e) success++;
+    else { failure++; fprintf(stderr, "parse_count(%s,%"PRIu64") returned %"PRIu64": expected %"PRIu64"\n", str, max, n, e); }
+}
+
+void test_packedMismatches(char *a, char *b, int e)
+{
+    packed_bc_t pa, pb;
+    int n;
+    packBarcode(a, &pa);
+    packBarcode(b, &pb);
+    if ((n=packedMismatches(&pa,&pb)) == e) success++;
+    else { failure++; fprintf(stderr, "packedMismatches(%s,%s) returned %d: expected %d\n", a,b,n,e); }
+}
+
+/*
+ * Compare packedMismatches() with countMismatches() for random sequences,
+ * long enough to need both words
+ */
+void test_packedMismatches_random(void)
+{
+    const char *alphabet = "ACGTN-";
+    char a[PACKED_BC_MAX+1], b[PACKED_BC_MAX+1];
+    int errors = 0;
+    srand(42);
+    for (int t = 0; t < 10000; t++) {
+        int la = 1 + rand() % PACKED_BC_MAX, lb = 1 + rand() % PACKED_BC_MAX;
+        for (int i = 0; i < la; i++) a[i] = alphabet[rand() % 6];
+        for (int i = 0; i < lb; i++) b[i] = rand() % 3 ? a[i % la] : alphabet[rand() % 6];
+        a[la] = b[lb] = 0;
+        packed_bc_t pa, pb;
+        packBarcode(a, &pa);
+        packBarcode(b, &pb);
+        int e = countMismatches(a, b, 999), n = packedMismatches(&pa, &pb);
+        if (n != e && errors++ < 5) fprintf(stderr, "packedMismatches(%s,%s) returned %d: expected %d\n", a, b, n, e);
+        e = noCalls(b); n = packedNoCalls(&pb);
+        if (n != e && errors++ < 5) fprintf(stderr, "packedNoCalls(%s) returned %d: expected %d\n", b, n, e);
+    }
+    if (errors) failure++;
+    else success++;
+}
+
+/*
+ * Check that the barcode neighbourhood gives the same answer as the
+ * linear search for every short read
+ */
+void test_neighbourhood(int max_mismatches, int min_mismatch_delta, int max_no_calls)
+{
+    char *seqs[] = { "NNN-NNN", "ACG-TTA", "ACG-TTC", "CAG-GTA", "TTT-AAA", "ANG-CCA" };
+    const char *alphabet = "ACGTN-n";
+    int nseqs = sizeof(seqs) / sizeof(seqs[0]);
+    int alen = strlen(alphabet);
+    decode_opts_t opts = { 0 };
+    char read[8];
+    long nreads = 1;
+    int errors = 0;
+
+    va_t *barcodeArray = va_init(nseqs, NULL);
+    for (int n = 0; n < nseqs; n++) {
+        bc_details_t *bcd = bcd_init();
+        bcd->seq = seqs[n];
+        bcd->idx1 = strndup(seqs[n], 3);
+        bcd->idx2 = strdup(seqs[n] + 4);
+        bcd->name = seqs[n];
+        va_push(barcodeArray, bcd);
+    }
+    opts.idx1_len = 3;
+    opts.idx2_len = 3;
+    opts.max_mismatches = max_mismatches;
+    opts.min_mismatch_delta = min_mismatch_delta;
+    opts.max_no_calls = max_no_calls;
+
+    HashTable *barcodeHash = make_barcode_hash(barcodeArray);
+    packBarcodes(barcodeArray, &opts);
+    make_barcode_neighbourhood(barcodeArray, &opts);
+    barcode_nbhd_t *nbhd = opts.nbhd;
+    packed_set_t *packed = opts.packed;
+    packed_bc_t pread, unpacked = { .len = -1 };
+    if (!nbhd) {
+        fprintf(stderr, "make_barcode_neighbourhood(%d,%d,%d) failed\n", max_mismatches, min_mismatch_delta, max_no_calls);
+        failure++;
+    }
+
+    for (int i = 0; i < 7; i++) nreads *= alen;
+    for (long x = 0; x < nreads && nbhd; x++) {
+        long y = x;
+        for (int i = 0; i < 7; i++, y /= alen) read[i] = alphabet[y % alen];
+        read[7] = 0;
+        packBarcode(read, &pread);
+        opts.nbhd = nbhd;
+        opts.packed = packed;
+        bc_details_t *got = findBestMatch(read, &pread, barcodeArray, barcodeHash, &opts);
+        opts.nbhd = NULL;
+        opts.packed = NULL;
+        bc_details_t *expected = findBestMatch(read, &unpacked, barcodeArray, barcodeHash, &opts);
+        if (got != expected && errors++ < 5) {
+            fprintf(stderr, "neighbourhood(%d,%d,%d): %s matched %s, expected %s\n",
+                    max_mismatches, min_mismatch_delta, max_no_calls, read, got->seq, expected->seq);
+        }
+    }
+    if (errors) failure++;
+    else success++;
+
+    free_barcode_nbhd(nbhd);
+    free_packed_set(packed);
+    HashTableDestroy(barcodeHash, 0);
+    for (int n = 0; n < nseqs; n++) {
+        bc_details_t *bcd = barcodeArray->entries[n];
+        free(bcd->idx1);
+        free(bcd->idx2);
+        free(bcd);
+    }
+    va_free(barcodeArray);
+}
+
+/*
+ * Check that the seed index gives the same answer as the linear search,
+ * for reads made by adding errors and no-calls to random barcodes
+ */
+void test_seeds(int nbarcodes, int max_mismatches, int min_mismatch_delta, int max_no_calls)
+{
+    const int idx_len = 6, len = 2 * idx_len + 1;
+    decode_opts_t opts = { 0 };
+    packed_bc_t pread, unpacked = { .len = -1 };
+    char read[16];
+    int errors = 0, used = 0;
+
+    srand(nbarcodes);
+    va_t *barcodeArray = va_init(nbarcodes + 1, free_bcd);
+    for (int n = 0; n <= nbarcodes; n++) {
+        bc_details_t *bcd = bcd_init();
+        bcd->seq = calloc(1, len + 1);
+        for (int i = 0; i < len; i++) bcd->seq[i] = n ? "ACGT"[rand() % 4] : 'N';
+        bcd->seq[idx_len] = '-';
+        bcd->idx1 = strndup(bcd->seq, idx_len);
+        bcd->idx2 = strdup(bcd->seq + idx_len + 1);
+        va_push(barcodeArray, bcd);
+    }
+    opts.idx1_len = opts.idx2_len = idx_len;
+    opts.max_mismatches = max_mismatches;
+    opts.min_mismatch_delta = min_mismatch_delta;
+    opts.max_no_calls = max_no_calls;
+
+    HashTable *barcodeHash = make_barcode_hash(barcodeArray);
+    packBarcodes(barcodeArray, &opts);
+    barcode_seeds_t *seeds = make_barcode_seeds(barcodeArray, &opts);
+    packed_set_t *packed = opts.packed;
+    if (!seeds) {
+        fprintf(stderr, "make_barcode_seeds(%d,%d,%d,%d) failed\n", nbarcodes, max_mismatches, min_mismatch_delta, max_no_calls);
+        failure++;
+    }
+
+    for (int r = 0; r < 20000 && seeds; r++) {
+        bc_details_t *bcd = barcodeArray->entries[1 + rand() % nbarcodes];
+        strcpy(read, bcd->seq);
+        for (int e = rand() % (max_mismatches + 3); e > 0; e--) read[rand() % len] = "ACGTN"[rand() % 5];
+        if (noCalls(read) > max_no_calls) continue;
+        packBarcode(read, &pread);
+        opts.seeds = seeds;
+        opts.packed = packed;
+        bc_details_t *got = findBestMatch(read, &pread, barcodeArray, barcodeHash, &opts);
+        if (seedSearch(seeds, read, &pread, barcodeArray, &opts)) used++;
+        opts.seeds = NULL;
+        opts.packed = NULL;
+        bc_details_t *expected = findBestMatch(read, &unpacked, barcodeArray, barcodeHash, &opts);
+        if (got != expected && errors++ < 5) {
+            fprintf(stderr, "seeds(%d,%d,%d,%d): %s matched %s, expected %s\n", nbarcodes,
+                    max_mismatches, min_mismatch_delta, max_no_calls, read, got->seq, expected->seq);
+        }
+    }
+    if (seeds && !used) {
+        fprintf(stderr, "seeds(%d,%d,%d,%d): index never used\n", nbarcodes, max_mismatches, min_mismatch_delta, max_no_calls);
+        errors++;
+    }
+    if (errors) failure++;
+    else success++;
+
+    free_barcode_seeds(seeds);
+    free_packed_set(packed);
+    HashTableDestroy(barcodeHash, 0);
+    va_free(barcodeArray);
+}
+
+static void free_tag_hops(HashTable *tagHopHash)
+{
+    HashIter *iter = HashTableIterCreate();
+    HashItem *hi;
+    while ((hi = HashTableIterNext(tagHopHash, iter)) != NULL) free_taghop_bcd(hi->data.p);
+    HashTableIterDestroy(iter);
+    HashTableDestroy(tagHopHash, 0);
+}
+
+/*
+ * Check that tag hops found through the index hashes are the same as
+ * those found by scanning the barcode array
+ */
+void test_tag_hopping(void)
+{
+    const int idx_len = 8, n_i7 = 24, n_i5 = 16;
+    char i7[24][9], i5[16][9], read[32];
+    decode_opts_t opts = { 0 };
+    int errors = 0, hops = 0;
+
+    srand(38);
+    for (int i = 0; i < n_i7; i++) {
+        for (int j = 0; j < idx_len; j++) i7[i][j] = "ACGT"[rand() % 4];
+        i7[i][idx_len] = 0;
+    }
+    for (int i = 0; i < n_i5; i++) {
+        for (int j = 0; j < idx_len; j++) i5[i][j] = "ACGT"[rand() % 4];
+        i5[i][idx_len] = 0;
+    }
+
+    // a plate where the i7s are shared between barcodes, but only some combinations are used
+    va_t *barcodeArray = va_init(n_i7 * n_i5, free_bcd);
+    bc_details_t *null_bcd = bcd_init();
+    null_bcd->idx1 = strdup("NNNNNNNN");
+    null_bcd->idx2 = strdup("NNNNNNNN");
+    null_bcd->seq = strdup("NNNNNNNN-NNNNNNNN");
+    va_push(barcodeArray, null_bcd);
+    for (int i = 0; i < n_i7; i++) {
+        for (int j = 0; j < n_i5; j++) {
+            if ((i + j) % 3 == 0) continue;
+            bc_details_t *bcd = bcd_init();
+            bcd->idx1 = strdup(i7[i]);
+            bcd->idx2 = strdup(i5[j]);
+            bcd->seq = malloc(2 * idx_len + 2);
+            sprintf(bcd->seq, "%s-%s", i7[i], i5[j]);
+            va_push(barcodeArray, bcd);
+        }
+    }
+    opts.idx1_len = opts.idx2_len = idx_len;
+    opts.dual_tag = 0;
+    packBarcodes(barcodeArray, &opts);
+    make_index_hashes(barcodeArray, &opts);
+    if (!opts.idx1Hash || !opts.idx2Hash) {
+        fprintf(stderr, "test_tag_hopping: index hashes not built\n");
+        errors++;
+    }
+    HashTable *idx1Hash = opts.idx1Hash, *idx2Hash = opts.idx2Hash;
+    HashTable *hashHops = HashTableCreate(0, HASH_DYNAMIC_SIZE | HASH_FUNC_JENKINS);
+    HashTable *scanHops = HashTableCreate(0, HASH_DYNAMIC_SIZE | HASH_FUNC_JENKINS);
+
+    for (int r = 0; r < 20000; r++) {
+        sprintf(read, "%s-%s", i7[rand() % n_i7], i5[rand() % n_i5]);
+        for (int e = rand() % 3; e > 0; e--) {
+            int i = rand() % (2 * idx_len + 1);
+            if (i != idx_len) read[i] = "ACGTN"[rand() % 5];
+        }
+        opts.idx1Hash = idx1Hash;
+        opts.idx2Hash = idx2Hash;
+        bc_details_t *got = check_tag_hopping(read, barcodeArray, hashHops, &opts);
+        opts.idx1Hash = opts.idx2Hash = NULL;
+        bc_details_t *expected = check_tag_hopping(read, barcodeArray, scanHops, &opts);
+        if (got) hops++;
+        if ((!got != !expected || (got && strcmp(got->seq, expected->seq))) && errors++ < 5) {
+            fprintf(stderr, "test_tag_hopping: %s gave %s, expected %s\n", read,
+                    got ? got->seq : "none", expected ? expected->seq : "none");
+        }
+    }
+    if (hashHops->nused != scanHops->nused) {
+        fprintf(stderr, "test_tag_hopping: %d tag hops, expected %d\n", (int)hashHops->nused, (int)scanHops->nused);
+        errors++;
+    }
+    if (!hops) {
+        fprintf(stderr, "test_tag_hopping: no tag hops found\n");
+        errors++;
+    }
+    if (errors) failure++;
+    else success++;
+
+    opts.idx1Hash = idx1Hash;
+    opts.idx2Hash = idx2Hash;
+    free_tag_hops(hashHops);
+    free_tag_hops(scanHops);
+    HashTableDestroy(opts.idx1Hash, 0);
+    HashTableDestroy(opts.idx2Hash, 0);
+    free_packed_set(opts.packed);
+    va_free(barcodeArray);
+}
+
+/*
+ * Check that a saved barcode index loads back to the same neighbourhood,
+ * and is rebuilt if the options have changed
+ */
+void test_save_index(const char *dir)
+{
+    const int idx_len = 8, nbarcodes = 96;
+    char fname[512];
+    decode_opts_t opts = { 0 }, load_opts = { 0 };
+    int errors = 0;
+
+    srand(39);
+    va_t *barcodeArray = va_init(nbarcodes + 1, free_bcd);
+    for (int n = 0; n <= nbarcodes; n++) {
+        bc_details_t *bcd = bcd_init();
+        bcd->seq = calloc(1, 2 * idx_len + 2);
+        for (int i = 0; i < 2 * idx_len + 1; i++) bcd->seq[i] = n ? "ACGT"[rand() % 4] : 'N';
+        bcd->seq[idx_len] = '-';
+        bcd->idx1 = strndup(bcd->seq, idx_len);
+        bcd->idx2 = strdup(bcd->seq + idx_len + 1);
+        va_push(barcodeArray, bcd);
+    }
+    snprintf(fname, sizeof(fname), "%s/decode.idx", dir);
+    opts.idx1_len = opts.idx2_len = idx_len;
+    opts.max_mismatches = 1;
+    opts.min_mismatch_delta = 1;
+    opts.max_no_calls = 2;
+    load_opts = opts;
+    opts.save_index_name = fname;
+    load_opts.load_index_name = fname;
+
+    make_barcode_matchers(barcodeArray, &opts);
+    make_barcode_matchers(barcodeArray, &load_opts);
+    barcode_nbhd_t *saved = opts.nbhd, *loaded = load_opts.nbhd;
+    if (!saved || !loaded || !loaded->map) {
+        fprintf(stderr, "test_save_index: index was not saved and loaded\n");
+        errors++;
+    } else if (saved->nkeys != loaded->nkeys || saved->max_n != loaded->max_n || saved->radius != loaded->radius) {
+        fprintf(stderr, "test_save_index: loaded %zu sequences, expected %zu\n", loaded->nkeys, saved->nkeys);
+        errors++;
+    } else {
+        for (size_t k = 0; k < saved->nkeys; k++) {
+            char *key = saved->keys + k * (saved->len + 1);
+            uint32_t *data = nbhdLookup(saved, key);
+            uint32_t *data2 = nbhdLookup(loaded, key);
+            if (!data2 || data[0] != data2[0] || data[1] != data2[1]) {
+                if (errors++ < 5) fprintf(stderr, "test_save_index: %s differs after loading\n", key);
+            }
+        }
+        // and sequences which aren't in the neighbourhood must not be found
+        for (int r = 0; r < 10000; r++) {
+            char read[32];
+            for (int i = 0; i < saved->len; i++) read[i] = "ACGTN"[rand() % 5];
+            read[idx_len] = '-';
+            read[saved->len] = 0;
+            if (!nbhdLookup(saved, read) != !nbhdLookup(loaded, read)) {
+                if (errors++ < 5) fprintf(stderr, "test_save_index: %s found in only one index\n", read);
+            }
+        }
+    }
+
+    // a different max_mismatches must not use the saved index
+    free_barcode_nbhd(load_opts.nbhd);
+    load_opts.nbhd = NULL;
+    load_opts.max_mismatches = 2;
+    make_barcode_matchers(barcodeArray, &load_opts);
+    if (load_opts.nbhd && load_opts.nbhd->map) {
+        fprintf(stderr, "test_save_index: index was loaded with different options\n");
+        errors++;
+    }
+
+    // a key count which only matches the file size because the size overflows
+    // must be rejected, as must bad slots in a file of the right size
+    free_barcode_nbhd(load_opts.nbhd);
+    load_opts.nbhd = NULL;
+    load_opts.max_mismatches = 1;
+    if (saved) {
+        nbhd_file_header_t hdr;
+        FILE *f = fopen(fname, "r+b");
+        if (!f || fread(&hdr, sizeof(hdr), 1, f) != 1) die("Can't read %s", fname);
+        uint64_t nkeys = hdr.nkeys;
+        hdr.nkeys += (uint64_t)1 << 63;
+        fseek(f, 0, SEEK_SET);
+        fwrite(&hdr, sizeof(hdr), 1, f);
+        fflush(f);
+        if (load_barcode_nbhd(fname, barcode_set_checksum(barcodeArray), &load_opts)) {
+            fprintf(stderr, "test_save_index: index with an overflowing key count was loaded\n");
+            errors++;
+        }
+        hdr.nkeys = nkeys;
+        fseek(f, 0, SEEK_SET);
+        fwrite(&hdr, sizeof(hdr), 1, f);
+        // every slot full (so the probe never meets an empty one), then every
+        // slot past the last key
+        for (uint32_t k = 1; k <= nkeys + 1; k += nkeys) {
+            fseek(f, sizeof(hdr) + 2 * sizeof(uint32_t) * nkeys, SEEK_SET);
+            for (uint64_t n = 0; n < hdr.nslots; n++) fwrite(&k, sizeof(k), 1, f);
+            fflush(f);
+            free_barcode_nbhd(load_opts.nbhd);
+            load_opts.nbhd = load_barcode_nbhd(fname, barcode_set_checksum(barcodeArray), &load_opts);
+            char *key = saved->keys + (saved->nkeys - 1) * (saved->len + 1);
+            if (!load_opts.nbhd || nbhdLookup(load_opts.nbhd, key)) {
+                fprintf(stderr, "test_save_index: bad slots gave a match\n");
+                errors++;
+            }
+        }
+        fclose(f);
+    }
+
+    if (errors) failure++;
+    else success++;
+
+    free_barcode_nbhd(opts.nbhd);
+    free_barcode_seeds(opts.seeds);
+    free_packed_set(opts.packed);
+    free_barcode_nbhd(load_opts.nbhd);
+    free_barcode_seeds(load_opts.seeds);
+    free_packed_set(load_opts.packed);
+    va_free(barcodeArray);
+}
+
+/*
+ * Check decoding with a barcode file which mixes index lengths
+ */
+void test_mixed_lengths(const char *dir)
+{
+    char *seqs[] = { "NNNNNNNNNN-NNNNNNNNNN",
+                     "ACGTACGT-TTGGCCAA", "ACGTACGTCC-TTGGCCAAGG", "GGGGCCCCAA-CATCATCATC", "TGCATGCA" };
+    struct { char *read, *name; } reads[] = {
+        { "ACGTACGTCC-TTGGCCAAGG", "2" },   // both 1 and 2 match exactly, the longer wins
+        { "ACGTACGTAT-TTGGCCAATT", "1" },
+        { "ACGTACGTCC-TTGGCCAAGT", "1" },   // fewest mismatches wins
+        { "GGGGCCCCAA-CATCATCATG", "3" },
+        { "TGCATGCAGG-AAAAAAAAAA", "4" },   // single index
+        { "TGCATGCA", "4" },
+        { "ACGTACGT-TTGGCCAA", "1" },       // too short for 2 and 3
+        { "AAAAAAAAAA-AAAAAAAAAA", "0" },
+        { "GGGGCCCCAA-CATCAGGATG", "0" },
+    };
+    int nseqs = sizeof(seqs) / sizeof(seqs[0]);
+    int nreads = sizeof(reads) / sizeof(reads[0]);
+    decode_opts_t opts = { 0 };
+    char fname[512], cmd[1024];
+    int errors = 0;
+
+    va_t *barcodeArray = va_init(nseqs, free_bcd);
+    for (int n = 0; n < nseqs; n++) {
+        bc_details_t *bcd = bcd_init();
+        char name[8];
+        sprintf(name, "%d", n);
+        bcd->seq = strdup(seqs[n]);
+        bcd->name = strdup(name);
+        bcd->lib = strdup("");
+        bcd->sample = strdup("");
+        bcd->desc = strdup("");
+        split_index(bcd->seq, strlen(bcd->seq), 0, &bcd->idx1, &bcd->idx2, 0, 0);
+        va_push(barcodeArray, bcd);
+    }
+    opts.idx1_len = opts.idx2_len = 10;
+    opts.max_mismatches = 1;
+    opts.min_mismatch_delta = 1;
+    opts.max_no_calls = 2;
+    opts.barcode_tag_name = "BC";
+    opts.argv_list = "test";
+    packBarcodes(barcodeArray, &opts);
+    make_barcode_matchers(barcodeArray, &opts);
+    if (!opts.classes || opts.classes->end != 3) {
+        fprintf(stderr, "test_mixed_lengths: expected 3 barcode classes\n");
+        failure++;
+        return;
+    }
+
+    HashTable *barcodeHash = make_barcode_hash(barcodeArray);
+    HashTable *tagHopHash = HashTableCreate(0, HASH_DYNAMIC_SIZE | HASH_FUNC_JENKINS);
+    for (int r = 0; r < nreads; r++) {
+        char *name = findBarcodeName(reads[r].read, barcodeArray, barcodeHash, tagHopHash, NULL, &opts, true, true);
+        if (strcmp(name, reads[r].name)) {
+            fprintf(stderr, "test_mixed_lengths: %s matched %s, expected %s\n", reads[r].read, name, reads[r].name);
+            errors++;
+        }
+    }
+
+    // the metrics are summarised for each class
+    snprintf(fname, sizeof(fname), "%s/mixed.metrics", dir);
+    opts.metrics_name = fname;
+    if (writeMetrics(barcodeArray, NULL, &opts) != 0) errors++;
+    snprintf(cmd, sizeof(cmd), "grep -q '^# BARCODE_CLASS=10-10 BARCODES=2 READS=2 PERFECT_MATCHES=1' %s"
+                               " && grep -q '^# BARCODE_CLASS=8-8 BARCODES=1 READS=3 PERFECT_MATCHES=3' %s"
+                               " && grep -q '^# BARCODE_CLASS=8 BARCODES=1 READS=2 PERFECT_MATCHES=2' %s", fname, fname, fname);
+    if (system(cmd)) {
+        fprintf(stderr, "test_mixed_lengths: wrong class metrics in %s\n", fname);
+        errors++;
+    }
+
+    if (errors) failure++;
+    else success++;
+
+    free_tag_hops(tagHopHash);
+    HashTableDestroy(barcodeHash, 0);
+    va_free(opts.classes);
+    free_packed_set(opts.packed);
+    va_free(barcodeArray);
+}
+
+/*
+ * A read which matches barcodes of two classes equally well, where the classes
+ * are the same length, goes to the barcode which is earlier in the file
+ */
+void test_class_ties(char *first, char *second, char *read, char *e)
+{
+    char *seqs[] = { "NNNNNN-NNNNNN", first, second };
+    decode_opts_t opts = { 0 };
+
+    va_t *barcodeArray = va_init(3, free_bcd);
+    for (int n = 0; n < 3; n++) {
+        bc_details_t *bcd = bcd_init();
+        char name[8];
+        sprintf(name, "%d", n);
+        bcd->seq = strdup(seqs[n]);
+        bcd->name = strdup(name);
+        bcd->lib = strdup("");
+        bcd->sample = strdup("");
+        bcd->desc = strdup("");
+        split_index(bcd->seq, strlen(bcd->seq), 0, &bcd->idx1, &bcd->idx2, 0, 0);
+        va_push(barcodeArray, bcd);
+    }
+    opts.idx1_len = opts.idx2_len = 6;
+    opts.max_mismatches = 1;
+    opts.min_mismatch_delta = 1;
+    opts.max_no_calls = 2;
+    packBarcodes(barcodeArray, &opts);
+    make_barcode_matchers(barcodeArray, &opts);
+
+    HashTable *barcodeHash = make_barcode_hash(barcodeArray);
+    HashTable *tagHopHash = HashTableCreate(0, HASH_DYNAMIC_SIZE | HASH_FUNC_JENKINS);
+    char *name = findBarcodeName(read, barcodeArray, barcodeHash, tagHopHash, NULL, &opts, true, false);
+    if (strcmp(name, e) == 0) success++;
+    else { failure++; fprintf(stderr, "test_class_ties: %s matched %s, expected %s\n", read, name, e); }
+
+    free_tag_hops(tagHopHash);
+    HashTableDestroy(barcodeHash, 0);
+    va_free(opts.classes);
+    free_packed_set(opts.packed);
+    va_free(barcodeArray);
+}
+
+typedef struct {
+    va_t *barcodeArray;
+    HashTable *barcodeHash;
+    decode_opts_t *opts;
+    char **reads;
+    int nreads;
+} counter_thread_t;
+
+static void *count_reads(void *arg)
+{
+    counter_thread_t *t = arg;
+    HashTable *tagHopHash = HashTableCreate(0, HASH_DYNAMIC_SIZE | HASH_FUNC_JENKINS);
+    for (int r = 0; r < t->nreads; r++) {
+        findBarcodeName(t->reads[r], t->barcodeArray, t->barcodeHash, tagHopHash, t->opts->counters, t->opts, r % 3 != 0, true);
+    }
+    free_tag_hops(tagHopHash);
+    return NULL;
+}
+
+/*
+ * Check that the per-thread counters add up to the same metrics as
+ * counting in one thread
+ */
+void test_thread_counters(void)
+{
+    char *seqs[] = { "NNNNNNNN", "ACGTACGT", "TTGGCCAA", "GGGGCCCC" };
+    char *reads[] = { "ACGTACGT", "ACGTACGA", "TTGGCCAA", "GGGGCCCC", "GGGGCCCA", "AAAAAAAA", "CCCCCCCC", "TTGGCCAA" };
+    int nseqs = sizeof(seqs) / sizeof(seqs[0]);
+    int nreads = sizeof(reads) / sizeof(reads[0]);
+    const int nthreads = 4;
+    decode_opts_t opts = { 0 };
+    va_t *arrays[2];
+    pthread_t threads[4];
+    int errors = 0;
+
+    opts.idx1_len = 8;
+    opts.max_mismatches = 1;
+    opts.min_mismatch_delta = 1;
+    opts.max_no_calls = 2;
+    for (int a = 0; a < 2; a++) {
+        arrays[a] = va_init(nseqs, free_bcd);
+        for (int n = 0; n < nseqs; n++) {
+            bc_details_t *bcd = bcd_init();
+            bcd->seq = strdup(seqs[n]);
+            bcd->name = strdup(seqs[n]);
+            split_index(bcd->seq, strlen(bcd->seq), 0, &bcd->idx1, &bcd->idx2, 0, 0);
+            bcd->index = n;
+            va_push(arrays[a], bcd);
+        }
+        ((bc_details_t *)arrays[a]->entries[0])->unmatched = unmatched_init(16);
+    }
+    packBarcodes(arrays[0], &opts);
+    packBarcodes(arrays[1], &opts);
+    HashTable *barcodeHash = make_barcode_hash(arrays[0]);
+
+    // count in one thread, once for each of the threads below
+    counter_thread_t single = { arrays[1], barcodeHash, &opts, reads, nreads };
+    for (int t = 0; t < nthreads; t++) count_reads(&single);
+
+    counter_thread_t multi = { arrays[0], barcodeHash, &opts, reads, nreads };
+    opts.counters = counter_set_init(arrays[0]);
+    for (int t = 0; t < nthreads; t++) pthread_create(&threads[t], NULL, count_reads, &multi);
+    for (int t = 0; t < nthreads; t++) pthread_join(threads[t], NULL);
+    counter_set_merge(opts.counters, arrays[0]);
+    opts.counters = NULL;
+
+    for (int n = 0; n < nseqs; n++) {
+        bc_details_t *b0 = arrays[0]->entries[n], *b1 = arrays[1]->entries[n];
+        if (b0->reads != b1->reads || b0->pf_reads != b1->pf_reads || b0->perfect != b1->perfect
+            || b0->pf_perfect != b1->pf_perfect || b0->one_mismatch != b1->one_mismatch
+            || b0->pf_one_mismatch != b1->pf_one_mismatch) {
+            fprintf(stderr, "test_thread_counters: %s has different counts\n", seqs[n]);
+            errors++;
+        }
+    }
+    bc_details_t *u0 = arrays[0]->entries[0], *u1 = arrays[1]->entries[0];
+    if (u0->unmatched->total != u1->unmatched->total) {
+        fprintf(stderr, "test_thread_counters: different unmatched totals\n");
+        errors++;
+    }
+
+    if (errors) failure++;
+    else success++;
+
+    HashTableDestroy(barcodeHash, 0);
+    free_packed_set(opts.packed);
+    va_free(arrays[0]);
+    va_free(arrays[1]);
+}
+
+/*
+ * Make a record with no sequence and the given Z tags
+ */
+static bam1_t *make_aux_record(char *qname, char **tags)
+{
+    bam1_t *rec = bam_init1();
+    size_t l_qname = strlen(qname) + 1;
+    rec->data = malloc(l_qname);
+    memcpy(rec->data, qname, l_qname);
+    rec->l_data = rec->m_data = l_qname;
+    rec->core.l_qname = l_qname;
+    for (int i = 0; tags[i]; i += 2) {
+        bam_aux_append(rec, tags[i], 'Z', strlen(tags[i+1]) + 1, (uint8_t *)tags[i+1]);
+    }
+    return rec;
+}
+
+/*
+ * Check the single pass aux indexing and record rewriting
+ */
+void test_rewriteRecord(char *qname, char **tags, char *name, bool change_read_name,
+                        char *e_qname, char **e_tags)
+{
+    char stack_newrg[8], *newrg = stack_newrg;
+    aux_index_t ai;
+    bam1_t *rec = make_aux_record(qname, tags);
+    bam1_t *expected = make_aux_record(e_qname, e_tags);
+
+    indexAux(rec, "BC", "QT", &ai);
+    if (ai.bc != bam_aux_get(rec, "BC") || ai.qt != bam_aux_get(rec, "QT") || ai.rg != bam_aux_get(rec, "RG")) {
+        fprintf(stderr, "indexAux(%s) found different tags to bam_aux_get()\n", qname);
+        failure++;
+    } else {
+        success++;
+    }
+
+    makeNewTag(ai.rg, name, &newrg, sizeof(stack_newrg));
+    if (rewriteRecord(rec, ai.rg, newrg, strlen(newrg) + 1, change_read_name ? name : NULL) != 0
+        || rec->l_data != expected->l_data || rec->core.l_qname != expected->core.l_qname
+        || memcmp(rec->data, expected->data, rec->l_data)) {
+        fprintf(stderr, "rewriteRecord(%s, %s) gave the wrong record\n", qname, name);
+        failure++;
+    } else {
+        success++;
+    }
+
+    if (newrg != stack_newrg) free(newrg);
+    bam_destroy1(rec);
+    bam_destroy1(expected);
+}
+
+/*
+ * An RG at the end of a record without its NUL must leave the record alone
+ */
+void test_rewriteRecord_bad_rg(void)
+{
+    bam1_t *rec = make_aux_record("read1", (char *[]){ "BC", "ACGT", "RG", "1234", NULL });
+    rec->l_data--;
+    bam1_t *copy = bam_dup1(rec);
+    uint8_t *rg = rec->data + rec->l_data - 5;      // RG's type, as indexAux() finds it
+
+    if (rewriteRecord(rec, rg, "1234#1", 7, "1") != -1
+        || rec->l_data != copy->l_data || memcmp(rec->data, copy->data, rec->l_data)) {
+        fprintf(stderr, "rewriteRecord() changed a record with a bad RG\n");
+        failure++;
+    } else {
+        success++;
+    }
+    bam_destroy1(rec);
+    bam_destroy1(copy);
+}
+
+/*
+ * Check the precomputed read group values
+ */
+void test_rg_table(void)
+{
+    char text[] = "@HD\tVN:1.4\n@RG\tID:1\tPL:illumina\n@RG\tID:lane2\n";
+    bam_hdr_t h = { .text = text, .l_text = strlen(text) };
+    bc_details_t bcd[2] = { { .name = "0", .index = 0 }, { .name = "tag1", .index = 1 } };
+    va_t *barcodeArray = va_init(2, NULL);
+    va_push(barcodeArray, &bcd[0]);
+    va_push(barcodeArray, &bcd[1]);
+
+    rg_table_t *t = make_rg_table(barcodeArray, &h);
+    HashItem *hi = t ? HashTableSearch(t->rgs, "lane2", 0) : NULL;
+    if (!hi || strcmp(t->values[hi->data.i * 2 + 1], "lane2#tag1") || t->lens[hi->data.i * 2 + 1] != 11
+        || strcmp(t->values[0], "#0") || HashTableSearch(t->rgs, "2", 0)) {
+        fprintf(stderr, "make_rg_table() made the wrong read group values\n");
+        failure++;
+    } else {
+        success++;
+    }
+
+    free_rg_table(t);
+    va_free(barcodeArray);
+}
+
+/*
+ * Check that the unmatched sketch finds the common sequences in a stream of
+ * mostly unique ones, when it is filled in one go or merged from two halves
+ */
+void test_unmatched_sketch(void)
+{
+    char *common[3] = { "AAAAAAAA", "CCCCCCCC", "GGGGGGGG" };
+    int expected[3] = { 1000, 500, 200 };
+    unmatched_sketch_t *all = unmatched_init(64);
+    unmatched_sketch_t *half[2] = { unmatched_init(64), unmatched_init(64) };
+    char seq[9];
+
+    srand(7);
+    for (int i = 0; i < 10000; i++) {
+        if (i % 5 == 0 && i / 5 < 1700) {
+            int j = i / 5;
+            strcpy(seq, common[j < 1000 ? 0 : j < 1500 ? 1 : 2]);
+        } else {
+            for (int k = 0; k < 8; k++) seq[k] = "ACGT"[rand() & 3];
+            seq[8] = 0;
+        }
+        unmatchedAdd(all, seq);
+        unmatchedAdd(half[i & 1], seq);
+    }
+    unmatchedMerge(half[0], half[1]);
+
+    unmatched_sketch_t *sketches[2] = { all, half[0] };
+    for (int n = 0; n < 2; n++) {
+        unmatched_sketch_t *sk = sketches[n];
+        bool ok = sk->total == 10000;
+        for (int c = 0; c < 3; c++) {
+            HashItem *hi = HashTableSearch(sk->hash, common[c], 0);
+            int slot = hi ? hi->data.i : 0;
+            if (!hi || sk->counts[slot] < expected[c] || sk->counts[slot] - sk->errors[slot] > expected[c]) ok = false;
+        }
+        if (!ok) {
+            fprintf(stderr, "unmatched sketch (%s) lost a common sequence\n", n ? "merged" : "single");
+            failure++;
+        } else {
+            success++;
+        }
+    }
+
+    unmatched_free(all);
+    unmatched_free(half[0]);
+    unmatched_free(half[1]);
+}
+
+/*
+ * Merge two full sketches, each of which has evicted a sequence the other
+ * still monitors
+ */
+void test_unmatched_merge(void)
+{
+    unmatched_sketch_t *s1 = unmatched_init(2), *s2 = unmatched_init(2);
+    char *seqs[2] = { "XXXXXXXX", "YYYYYYYY" };
+    uint64_t counts[2] = { 8, 8 }, errors[2] = { 2, 4 };
+    bool ok;
+
+    // s1 sees X 5 times, Y 3 times and Z once, and Z replaces Y
+    for (int i = 0; i < 5; i++) unmatchedAdd(s1, "XXXXXXXX");
+    for (int i = 0; i < 3; i++) unmatchedAdd(s1, "YYYYYYYY");
+    unmatchedAdd(s1, "ZZZZZZZZ");
+    // s2 sees Y 4 times, W twice and X once, and X replaces W
+    for (int i = 0; i < 4; i++) unmatchedAdd(s2, "YYYYYYYY");
+    for (int i = 0; i < 2; i++) unmatchedAdd(s2, "WWWWWWWW");
+    unmatchedAdd(s2, "XXXXXXXX");
+
+    // Y may have been seen up to 4 times by s1 (its lowest count), and
+    // Z up to 3 times by s2, so Z (7) drops out below X and Y (8 each)
+    unmatchedMerge(s1, s2);
+    ok = s1->total == 16 && s1->nused == 2;
+    for (int n = 0; ok && n < 2; n++) {
+        HashItem *hi = HashTableSearch(s1->hash, seqs[n], 0);
+        if (!hi || s1->counts[hi->data.i] != counts[n] || s1->errors[hi->data.i] != errors[n]) ok = false;
+    }
+    if (!ok) {
+        fprintf(stderr, "unmatchedMerge gave the wrong counts\n");
+        failure++;
+    } else {
+        success++;
+    }
+
+    unmatched_free(s1);
+    unmatched_free(s2);
+}
+
+/*
+ * Check the confidence intervals given for sampled metrics
+ */
+void test_wilsonInterval(uint64_t k, uint64_t n, double e_lo, double e_hi)
+{
+    double lo, hi;
+    wilsonInterval(k, n, &lo, &hi);
+    if (fabs(lo - e_lo) > 0.001 || fabs(hi - e_hi) > 0.001) {
+        fprintf(stderr, "wilsonInterval(%"PRIu64", %"PRIu64") gave %.4f-%.4f, expected %.4f-%.4f\n", k, n, lo, hi, e_lo, e_hi);
+        failure++;
+    } else {
+        success++;
+    }
+}
+
+/*
+ * Check the ranges of the input chosen for --sample-fraction, and the share
+ * of --sample taken from each of them
+ */
+void test_sampleRanges(void)
+{
+    int64_t offsets[10] = { 0, 100, 200, 300, 400, 500, 600, 700, 800, 900 };
+    int64_t expected[4] = { 200, 300, 700, 800 };
+    uint64_t targets[3] = { 2, 5, 25 };
+    int ranges[3] = { 0, 1, 9 };
+    decode_opts_t opts = { 0 };
+
+    opts.sample_fraction = 0.2;
+    selectSampleRanges(offsets, 10, &opts);
+    if (opts.nsample_ranges != 2 || memcmp(opts.sample_ranges, expected, sizeof(expected))) {
+        fprintf(stderr, "selectSampleRanges(0.2) chose %d ranges, from %"PRId64"\n", opts.nsample_ranges, opts.sample_ranges[0]);
+        failure++;
+    } else {
+        success++;
+    }
+    free(opts.sample_ranges);
+
+    // the last range ends at the end of the file
+    opts.sample_fraction = 0;
+    selectSampleRanges(offsets, 10, &opts);
+    if (opts.nsample_ranges != 10 || opts.sample_ranges[18] != 900 || opts.sample_ranges[19] != 0) {
+        fprintf(stderr, "selectSampleRanges(all) chose %d ranges\n", opts.nsample_ranges);
+        failure++;
+    } else {
+        success++;
+    }
+    free(opts.sample_ranges);
+
+    // 25 templates from 10 ranges: 2 or 3 from each, and all of them by the end
+    opts.sample_max = 25;
+    for (int i = 0; i < 3; i++) {
+        opts.sample_range = ranges[i];
+        if (sampleTarget(&opts) != targets[i]) {
+            fprintf(stderr, "sampleTarget(%d) gave %"PRIu64", expected %"PRIu64"\n", ranges[i], sampleTarget(&opts), targets[i]);
+            failure++;
+        } else {
+            success++;
+        }
+    }
+}
+
 int main(int argc, char**argv)
 {
     // test state
@@ -241,6 +1169,86 @@ int main(int argc, char**argv)
     test_countMismatches("xBCiXYZ","NBCNXYz",1);
     test_countMismatches("AGCACGTT","AxCACGTTXXXXXX",1);
 
+    // test packedMismatches()
+    test_packedMismatches("ACG","ATG",1);
+    test_packedMismatches("ACG","TGC",3);
+    test_packedMismatches("ACG-TTA","ACG-TTA",0);
+    test_packedMismatches("ACG-TTA","ACGNTTA",0);
+    test_packedMismatches("ACGNTTA","ACG-TTA",1);
+    test_packedMismatches("ACG-TTA","ACGTTTA",1);
+    test_packedMismatches("AGCACGTT","ATCACGTTGGGGGG",1);
+    test_packedMismatches_random();
+
+    // barcode names which would take the output file out of its directory are refused
+    test_per_barcode_name("out/%s.bam", "lib_1", "out/lib_1.bam");
+    test_per_barcode_name("out/x_%s.sam", "0", "out/x_0.sam");
+    test_per_barcode_name("out/%s.bam", "../lib_1", NULL);
+    test_per_barcode_name("out/%s", "..", NULL);
+    test_per_barcode_name("out/%s.bam", "a/b", NULL);
+    test_per_barcode_name("out/%s.bam", "", NULL);
+
+    // test rewriting the RG tag and read name
+    test_rewriteRecord("read1", (char *[]){ "BC", "ACGT", "RG", "1234", "QT", "FFFF", NULL }, "7", false,
+                       "read1", (char *[]){ "BC", "ACGT", "RG", "1234#7", "QT", "FFFF", NULL });
+    test_rewriteRecord("read1", (char *[]){ "BC", "ACGT", "RG", "1234", "QT", "FFFF", NULL }, "7", true,
+                       "read1#7", (char *[]){ "BC", "ACGT", "RG", "1234#7", "QT", "FFFF", NULL });
+    test_rewriteRecord("read1", (char *[]){ "QT", "FFFF", "RG", "a_long_read_group", "BC", "ACGT", NULL }, "a_long_name", true,
+                       "read1#a_long_name", (char *[]){ "QT", "FFFF", "RG", "a_long_read_group#a_long_name", "BC", "ACGT", NULL });
+    test_rewriteRecord("read1", (char *[]){ "BC", "ACGT", NULL }, "12", true,
+                       "read1#12", (char *[]){ "BC", "ACGT", "RG", "#12", NULL });
+    test_rewriteRecord("read1", (char *[]){ "RG", "a_long_read_group", "BC", "ACGT", NULL }, "1", false,
+                       "read1", (char *[]){ "RG", "a_long_read_group#1", "BC", "ACGT", NULL });
+    test_rewriteRecord_bad_rg();
+    test_rg_table();
+
+    // test the checks on numeric options
+    test_parse_count("20", MAX_UNMATCHED_TOP, 20);
+    test_parse_count("10000", MAX_UNMATCHED_TOP, 10000);
+    test_parse_count("10001", MAX_UNMATCHED_TOP, 0);
+    test_parse_count("0", MAX_UNMATCHED_TOP, 0);
+    test_parse_count("-5", MAX_UNMATCHED_TOP, 0);
+    test_parse_count(" 5", MAX_UNMATCHED_TOP, 0);
+    test_parse_count("5x", MAX_UNMATCHED_TOP, 0);
+    test_parse_count("", MAX_UNMATCHED_TOP, 0);
+    test_parse_count("18446744073709551615", UINT64_MAX, UINT64_MAX);
+    test_parse_count("18446744073709551616", UINT64_MAX, 0);
+
+    test_unmatched_sketch();
+    test_unmatched_merge();
+    test_thread_counters();
+
+    // test the sampling confidence intervals
+    test_wilsonInterval(50, 100, 0.4038, 0.5962);
+    test_wilsonInterval(0, 100, 0.0, 0.0370);
+    test_wilsonInterval(1000, 1000, 0.9962, 1.0);
+    test_wilsonInterval(0, 0, 0.0, 0.0);
+    test_sampleRanges();
+
+    // test the barcode neighbourhood against the linear search
+    test_neighbourhood(0, 1, 2);
+    test_neighbourhood(1, 1, 2);
+    test_neighbourhood(1, 2, 1);
+    test_neighbourhood(2, 0, 3);
+    test_neighbourhood(2, 3, 0);
+
+    // test tag hop detection through the index hashes
+    test_tag_hopping();
+
+    // test saving and loading the barcode index
+    test_save_index(TMPDIR);
+
+    // test a barcode file with mixed index lengths
+    test_mixed_lengths(TMPDIR);
+    test_class_ties("CCCC-GGGGTT", "CCCCAA-GGGG", "CCCCAA-GGGGTT", "1");
+    test_class_ties("CCCCAA-GGGG", "CCCC-GGGGTT", "CCCCAA-GGGGTT", "1");
+
+    // test the seed index against the linear search
+    test_seeds(1000, 1, 1, 2);
+    test_seeds(1000, 2, 1, 0);
+    test_seeds(2000, 2, 1, 1);
+    test_seeds(500, 1, 2, 1);
+    test_seeds(500, 1, 0, 2);
+
     //
     // Now test the actual decoding
     //
@@ -282,6 +1290,65 @@ int main(int argc, char**argv)
         }
     }
 
+    // --output-per-barcode option, which should split the records of test 1
+    for (int threads = 0; threads <= NTHREADS; threads += NTHREADS) {
+        int argc_5;
+        char** argv_5;
+        int result;
+        char *dash_o;
+
+        snprintf(outputfile, max_path_length, "%s/decode_5%s_%%s.sam", TMPDIR, threads ? "threads" : "");
+        snprintf(metricsfile, max_path_length, "%s/decode_5%s.metrics", TMPDIR, threads ? "threads" : "");
+        setup_test_1(&argc_5, &argv_5, outputfile, metricsfile, threads);
+        dash_o = argv_5[4];
+        argv_5[4] = strdup("--output-per-barcode");
+        free(dash_o);
+        main_decode(argc_5-1, argv_5+1);
+        free_argv(argc_5,argv_5);
+
+        snprintf(cmd, sizeof(cmd), "grep -hv '^@' %s/decode_5%s_*.sam | sort > %s/decode_5.records && "
+                 "grep -v '^@' %s | sort | diff -q %s/decode_5.records -",
+                 TMPDIR, threads ? "threads" : "", TMPDIR, MKNAME(DATA_DIR,"/out/6383_9_nosplit_nochange.sam"), TMPDIR);
+        result = system(cmd);
+        if (result) {
+            fprintf(stderr, "test 5 failed at records diff\n");
+            failure++;
+        } else {
+            success++;
+        }
+
+        snprintf(cmd, sizeof(cmd), "test \"$(grep '^@RG' %s/decode_5%s_2.sam | cut -f2)\" = ID:1#2",
+                 TMPDIR, threads ? "threads" : "");
+        result = system(cmd);
+        if (result) {
+            fprintf(stderr, "test 5 failed at header RG lines\n");
+            failure++;
+        } else {
+            success++;
+        }
+    }
+
+    // --metrics-only option, which should give the same metrics as test 1
+    for (int threads = 0; threads <= NTHREADS; threads += NTHREADS) {
+        int argc_6;
+        char** argv_6;
+        int result;
+
+        snprintf(metricsfile, max_path_length, "%s/decode_6%s.metrics", TMPDIR, threads ? "threads" : "");
+        setup_test_6(&argc_6, &argv_6, metricsfile, threads);
+        main_decode(argc_6-1, argv_6+1);
+        free_argv(argc_6,argv_6);
+
+        snprintf(cmd, sizeof(cmd), "diff -I ID:bambi %s %s", metricsfile, MKNAME(DATA_DIR,"/out/decode_1.metrics"));
+        result = system(cmd);
+        if (result) {
+            fprintf(stderr, "test 6 failed at metrics file diff\n");
+            failure++;
+        } else {
+            success++;
+        }
+    }
+
     // --convert_low_quality option
     for (int threads = 0; threads <= NTHREADS; threads += NTHREADS) {
         int argc_2;
@@ -363,6 +1430,90 @@ int main(int argc, char**argv)
         }
     }
 
+    // decode-metrics-merge of the counts from test 4 should give the same
+    // metrics, and merging them twice should double the counts
+    {
+        char *countsfile = calloc(1,max_path_length);
+        char *argv_m[] = { "bambi", "decode-metrics-merge", "-o", metricsfile, countsfile, countsfile };
+        int result;
+
+        snprintf(countsfile, max_path_length, "%s/decode_4.metrics.counts", TMPDIR);
+        snprintf(metricsfile, max_path_length, "%s/decode_4merged.metrics", TMPDIR);
+        result = main_decode_metrics_merge(4, argv_m+1);
+        snprintf(cmd, sizeof(cmd), "diff -I ID:bambi %s %s && diff -I ID:bambi %s.hops %s && diff %s.unmatched %s/decode_4.metrics.unmatched",
+                 metricsfile, MKNAME(DATA_DIR,"/out/decode_4.metrics"),
+                 metricsfile, MKNAME(DATA_DIR,"/out/decode_4.metrics.hops"),
+                 metricsfile, TMPDIR);
+        if (result || system(cmd)) {
+            fprintf(stderr, "test 7 failed merging one counts file\n");
+            failure++;
+        } else {
+            success++;
+        }
+
+        result = main_decode_metrics_merge(5, argv_m+1);
+        snprintf(cmd, sizeof(cmd), "awk -F'\\t' '$1 == \"TATG-TATGT\" && $6 == 6 && $7 == 6 { found = 1 } END { exit !found }' %s"
+                                   " && grep -q '^# TOTAL_READS=22,' %s.hops", metricsfile, metricsfile);
+        if (result || system(cmd)) {
+            fprintf(stderr, "test 7 failed merging two counts files\n");
+            failure++;
+        } else {
+            success++;
+        }
+        free(countsfile);
+    }
+
+    // --split-input reads sf.bam in ranges of RANGE_SIZE, in parallel, which
+    // should give the same records and metrics as reading it in one go
+    {
+        char *barcodefile = calloc(1,max_path_length);
+        char *splitfile = calloc(1,max_path_length);
+        char *splitmetrics = calloc(1,max_path_length);
+        int argc_8;
+        char** argv_8;
+        FILE *f;
+
+        snprintf(barcodefile, max_path_length, "%s/decode_8.tag", TMPDIR);
+        f = fopen(barcodefile, "w");
+        if (!f) die("Can't create %s", barcodefile);
+        fprintf(f, "barcode_sequence\tbarcode_name\tlibrary_name\tsample_name\tdescription\n");
+        fprintf(f, "ACAACGCA\t1\tlib1\tsample1\tstudy1\n");
+        fprintf(f, "ACCACGCA\t2\tlib2\tsample2\tstudy1\n");
+        fprintf(f, "ACACGCAA\t3\tlib3\tsample3\tstudy1\n");
+        fclose(f);
+
+        snprintf(outputfile, max_path_length, "%s/decode_8.sam", TMPDIR);
+        snprintf(metricsfile, max_path_length, "%s/decode_8.metrics", TMPDIR);
+        setup_test_8(&argc_8, &argv_8, outputfile, metricsfile, barcodefile, 0);
+        main_decode(argc_8-1, argv_8+1);
+        free_argv(argc_8,argv_8);
+
+        snprintf(splitfile, max_path_length, "%s/decode_8split.sam", TMPDIR);
+        snprintf(splitmetrics, max_path_length, "%s/decode_8split.metrics", TMPDIR);
+        setup_test_8(&argc_8, &argv_8, splitfile, splitmetrics, barcodefile, NTHREADS);
+        main_decode(argc_8-1, argv_8+1);
+        free_argv(argc_8,argv_8);
+
+        snprintf(cmd, sizeof(cmd), "diff -I ID:bambi %s %s", splitfile, outputfile);
+        if (system(cmd)) {
+            fprintf(stderr, "test 8 failed\n");
+            failure++;
+        } else {
+            success++;
+        }
+
+        snprintf(cmd, sizeof(cmd), "diff -I ID:bambi %s %s", splitmetrics, metricsfile);
+        if (system(cmd)) {
+            fprintf(stderr, "test 8 failed at metrics file diff\n");
+            failure++;
+        } else {
+            success++;
+        }
+        free(splitmetrics);
+        free(splitfile);
+        free(barcodefile);
+    }
+
     free(metricsfile);
     free(outputfile);
 
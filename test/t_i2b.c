@@ -24,7 +24,11 @@ along with this program.  If not, see <http://www.gnu.org/licenses/>.
 //#include "../src/i2b.c"
 #include <stdlib.h>
 #include <unistd.h>
+#include <sys/wait.h>
 #include <assert.h>
+#include <pthread.h>
+
+#include "tileidx.h"
 
 #define xMKNAME(d,f) #d f
 #define MKNAME(d,f) xMKNAME(d,f)
@@ -155,6 +159,63 @@ void setup_simple_test(int* argc, char*** argv, char *outputfile, bool verbose)
     assert(*argc<100);
 }
 
+void setup_watch_test(int* argc, char*** argv, char *outputfile, char *intensity_dir, bool watch, bool verbose)
+{
+    *argc = 0;
+    *argv = (char**)calloc(sizeof(char*), 100);
+    (*argv)[(*argc)++] = strdup("bambi");
+    (*argv)[(*argc)++] = strdup("i2b");
+    (*argv)[(*argc)++] = strdup("-i");
+    (*argv)[(*argc)++] = strdup(intensity_dir);
+    (*argv)[(*argc)++] = strdup("-o");
+    (*argv)[(*argc)++] = strdup(outputfile);
+    (*argv)[(*argc)++] = strdup("--lane");
+    (*argv)[(*argc)++] = strdup("1");
+    (*argv)[(*argc)++] = strdup("--first-tile");
+    (*argv)[(*argc)++] = strdup("1101");
+    (*argv)[(*argc)++] = strdup("--tile-limit");
+    (*argv)[(*argc)++] = strdup("2");
+    (*argv)[(*argc)++] = strdup("--library-name");
+    (*argv)[(*argc)++] = strdup("Test library");
+    (*argv)[(*argc)++] = strdup("--sample-alias");
+    (*argv)[(*argc)++] = strdup("Test Sample");
+    (*argv)[(*argc)++] = strdup("--study-name");
+    (*argv)[(*argc)++] = strdup("Study testStudy");
+    (*argv)[(*argc)++] = strdup("--run-start-date");
+    (*argv)[(*argc)++] = strdup("2011-03-23T00:00:00+0000");
+    if (watch) {
+        (*argv)[(*argc)++] = strdup("--watch");
+        (*argv)[(*argc)++] = strdup("--watch-interval");
+        (*argv)[(*argc)++] = strdup("1");
+        (*argv)[(*argc)++] = strdup("--watch-timeout");
+        (*argv)[(*argc)++] = strdup("60");
+    }
+    if (verbose) (*argv)[(*argc)++] = strdup("--verbose");
+
+    assert(*argc<100);
+}
+
+void setup_lanes_test(int* argc, char*** argv, char *outputfile, char *intensity_dir, char *lanes, bool verbose)
+{
+    *argc = 0;
+    *argv = (char**)calloc(sizeof(char*), 100);
+    (*argv)[(*argc)++] = strdup("bambi");
+    (*argv)[(*argc)++] = strdup("i2b");
+    (*argv)[(*argc)++] = strdup("-i");
+    (*argv)[(*argc)++] = strdup(intensity_dir);
+    (*argv)[(*argc)++] = strdup("-o");
+    (*argv)[(*argc)++] = strdup(outputfile);
+    (*argv)[(*argc)++] = strdup("--lane");
+    (*argv)[(*argc)++] = strdup(lanes);
+    (*argv)[(*argc)++] = strdup("--threads");
+    (*argv)[(*argc)++] = strdup("4");
+    (*argv)[(*argc)++] = strdup("--run-start-date");
+    (*argv)[(*argc)++] = strdup("2011-03-23T00:00:00+0000");
+    if (verbose) (*argv)[(*argc)++] = strdup("--verbose");
+
+    assert(*argc<100);
+}
+
 void setup_readgroup_test(int* argc, char*** argv, char *outputfile, bool verbose)
 {
     *argc = 0;
@@ -587,6 +648,44 @@ void checkFiles(char *name, char *outputfile, char *fname)
     }
 }
 
+/*
+ * count the lines of a file which contain a string
+ */
+int count_lines(char *fname, char *str)
+{
+    char line[1024];
+    int count = 0;
+    FILE *f = fopen(fname, "r");
+    if (!f) return 0;
+    while (fgets(line, sizeof(line), f)) {
+        if (strstr(line, str)) count++;
+    }
+    fclose(f);
+    return count;
+}
+
+/*
+ * count the records read through the tile index, and check that each one
+ * is named for the tile it was found in
+ */
+typedef struct {
+    pthread_mutex_t lock;
+    uint64_t nrecords;
+    int misplaced;
+} tile_count_t;
+
+static int count_tile_record(int tile, bam1_t *rec, bam_hdr_t *h, void *arg)
+{
+    tile_count_t *count = (tile_count_t *)arg;
+    char tag[16];
+    snprintf(tag, sizeof(tag), ":%d:", tile);
+    pthread_mutex_lock(&count->lock);
+    count->nrecords++;
+    if (!strstr(bam_get_qname(rec), tag)) count->misplaced++;
+    pthread_mutex_unlock(&count->lock);
+    return 0;
+}
+
 void compare_metrics(const char *name, const char *expected, const char *result)
 {
     char cmd[1024];
@@ -654,6 +753,182 @@ int main(int argc, char**argv)
     checkFiles("Simple test", outputfile, MKNAME(DATA_DIR,"/out/test1.bam"));
     free_args(argv_1);
 
+    //
+    // Per-lane output file name
+    //
+
+    if (verbose) fprintf(stderr,"\n===> Lane output name test\n");
+    snprintf(outputfile, filename_len, "%s/i2b_1_L%%d.bam", TMPDIR);
+    setup_simple_test(&argc_1, &argv_1, outputfile, verbose);
+    main_i2b(argc_1-1, argv_1+1);
+    snprintf(outputfile, filename_len, "%s/i2b_1_L1.bam", TMPDIR);
+    checkFiles("Lane output name test", outputfile, MKNAME(DATA_DIR,"/out/test1.bam"));
+    free_args(argv_1);
+
+    //
+    // Fixed I/O and compression threads
+    //
+
+    if (verbose) fprintf(stderr,"\n===> Thread split test\n");
+    snprintf(outputfile, filename_len, "%s/i2b_threads.bam", TMPDIR);
+    setup_simple_test(&argc_1, &argv_1, outputfile, verbose);
+    argv_1[argc_1++] = strdup("--io-threads");
+    argv_1[argc_1++] = strdup("2");
+    argv_1[argc_1++] = strdup("--compress-threads");
+    argv_1[argc_1++] = strdup("1");
+    main_i2b(argc_1-1, argv_1+1);
+    checkFiles("Thread split test", outputfile, MKNAME(DATA_DIR,"/out/test1.bam"));
+    free_args(argv_1);
+
+    //
+    // NUMA mode (falls back to a single node if that is all there is)
+    //
+
+    if (verbose) fprintf(stderr,"\n===> NUMA test\n");
+    snprintf(outputfile, filename_len, "%s/i2b_numa.bam", TMPDIR);
+    setup_simple_test(&argc_1, &argv_1, outputfile, verbose);
+    argv_1[argc_1++] = strdup("--numa");
+    main_i2b(argc_1-1, argv_1+1);
+    checkFiles("NUMA test", outputfile, MKNAME(DATA_DIR,"/out/test1.bam"));
+    free_args(argv_1);
+
+    //
+    // Tile index
+    //
+
+    if (verbose) fprintf(stderr,"\n===> Tile index test\n");
+    snprintf(outputfile, filename_len, "%s/i2b_tileidx.bam", TMPDIR);
+    setup_simple_test(&argc_1, &argv_1, outputfile, verbose);
+    argv_1[argc_1++] = strdup("--tile-index");
+    main_i2b(argc_1-1, argv_1+1);
+    checkFiles("Tile index test", outputfile, MKNAME(DATA_DIR,"/out/test1.bam"));
+    free_args(argv_1);
+    {
+        char *idx_name = tileidx_name(outputfile);
+        va_t *idx = tileidx_load(idx_name);
+        tile_count_t count = { PTHREAD_MUTEX_INITIALIZER, 0, 0 };
+        uint64_t expected = 0;
+
+        if (!idx) {
+            fprintf(stderr, "Tile index test: can't load %s\n", idx_name);
+            failure++;
+        } else {
+            icheckEqual("Tile index test: number of tiles", 1, idx->end);
+            for (int n = 0; n < idx->end; n++) expected += ((tileidx_entry_t *)idx->entries[n])->nrecords;
+            icheckEqual("Tile index test: tileidx_run", 0, tileidx_run(outputfile, idx, 2, count_tile_record, &count));
+            icheckEqual("Tile index test: records", (int)expected, (int)count.nrecords);
+            icheckEqual("Tile index test: misplaced records", 0, count.misplaced);
+            if (expected == 0) { fprintf(stderr, "Tile index test: no records indexed\n"); failure++; }
+            va_free(idx);
+        }
+        free(idx_name);
+    }
+
+    //
+    // Watch a runfolder which is still being written
+    //
+
+    if (verbose) fprintf(stderr,"\n===> Watch test\n");
+    {
+        char command[1024];
+        char intensity_dir[512];
+        char logfile[512];
+        char expected[512];
+        int status = 0;
+        int partial = 0;
+        pid_t pid;
+
+        // Copy the run, holding back the read 2 cycles
+        snprintf(command, sizeof(command),
+                 "mkdir %s/watch %s/watch_hold && cp -r %s %s/watch/ && "
+                 "for c in $(seq 17 32); do mv %s/watch/160916_miseq_0966_FC/Data/Intensities/BaseCalls/L001/C$c.1 %s/watch_hold/; done",
+                 TMPDIR, TMPDIR, MKNAME(DATA_DIR,"/160916_miseq_0966_FC"), TMPDIR, TMPDIR, TMPDIR);
+        if (system(command)) { fprintf(stderr,"Can't set up watch runfolder\n"); failure++; }
+        snprintf(intensity_dir, sizeof(intensity_dir), "%s/watch/160916_miseq_0966_FC/Data/Intensities", TMPDIR);
+        snprintf(logfile, sizeof(logfile), "%s/i2b_watch.log", TMPDIR);
+        snprintf(outputfile, filename_len, "%s/i2b_watch.bam", TMPDIR);
+        setup_watch_test(&argc_1, &argv_1, outputfile, intensity_dir, true, true);
+
+        pid = fork();
+        if (pid == 0) {
+            if (!freopen(logfile, "w", stderr)) _exit(EXIT_FAILURE);
+            setvbuf(stderr, NULL, _IONBF, 0);
+            _exit(main_i2b(argc_1-1, argv_1+1));
+        }
+        free_args(argv_1);
+
+        // Both tiles should build their read 1 records while read 2 is still missing
+        for (int n = 0; n < 60 && pid > 0 && partial < 2; n++) {
+            sleep(1);
+            partial = count_lines(logfile, "built read 1 records");
+        }
+        icheckEqual("Watch test: tiles waiting for read 2", 2, partial);
+
+        // Let the "sequencer" finish the run
+        snprintf(command, sizeof(command),
+                 "mv %s/watch_hold/* %s/watch/160916_miseq_0966_FC/Data/Intensities/BaseCalls/L001/ && touch %s/watch/160916_miseq_0966_FC/RTAComplete.txt",
+                 TMPDIR, TMPDIR, TMPDIR);
+        if (system(command)) { fprintf(stderr,"Can't complete watch runfolder\n"); failure++; }
+        if (pid < 0 || waitpid(pid, &status, 0) < 0 || !WIFEXITED(status) || WEXITSTATUS(status)) {
+            fprintf(stderr,"Watch test: i2b failed\n");
+            failure++;
+        }
+
+        // and the output should be the same as from the finished run
+        snprintf(expected, sizeof(expected), "%s/i2b_watch_expected.bam", TMPDIR);
+        setup_watch_test(&argc_1, &argv_1, expected, MKNAME(DATA_DIR,"/160916_miseq_0966_FC/Data/Intensities"), false, verbose);
+        main_i2b(argc_1-1, argv_1+1);
+        free_args(argv_1);
+        checkFiles("Watch test", outputfile, expected);
+    }
+
+    //
+    // More than one lane needs a per-lane output file name
+    //
+
+    if (verbose) fprintf(stderr,"\n===> Multiple lane option test\n");
+    snprintf(outputfile, filename_len, "%s/i2b_multi.bam", TMPDIR);
+    setup_simple_test(&argc_1, &argv_1, outputfile, verbose);
+    argv_1[argc_1++] = strdup("--lane");
+    argv_1[argc_1++] = strdup("2");
+    icheckEqual("Multiple lane option test", 1, main_i2b(argc_1-1, argv_1+1));
+    free_args(argv_1);
+
+    //
+    // Convert two lanes at once, and compare each output with a single lane run
+    //
+
+    if (verbose) fprintf(stderr,"\n===> Multiple lane test\n");
+    {
+        char command[1024];
+        char intensity_dir[512];
+        char expected[512];
+
+        // Make a second lane from a copy of the first
+        snprintf(intensity_dir, sizeof(intensity_dir), "%s/lanes/160916_miseq_0966_FC/Data/Intensities", TMPDIR);
+        snprintf(command, sizeof(command),
+                 "mkdir %s/lanes && cp -r %s %s/lanes/ && cd %s && cp -r L001 L002 && cp -r BaseCalls/L001 BaseCalls/L002 && "
+                 "for f in L002/* BaseCalls/L002/s_1_* BaseCalls/L002/*/s_1_*; do mv $f $(dirname $f)/$(basename $f | sed s/^s_1_/s_2_/); done",
+                 TMPDIR, MKNAME(DATA_DIR,"/160916_miseq_0966_FC"), TMPDIR, intensity_dir);
+        if (system(command)) { fprintf(stderr,"Can't set up two lane runfolder\n"); failure++; }
+
+        snprintf(outputfile, filename_len, "%s/i2b_lanes_%%d.bam", TMPDIR);
+        setup_lanes_test(&argc_1, &argv_1, outputfile, intensity_dir, "1,2", verbose);
+        icheckEqual("Multiple lane test: i2b", 0, main_i2b(argc_1-1, argv_1+1));
+        free_args(argv_1);
+
+        for (int lane = 1; lane <= 2; lane++) {
+            char lane_str[8];
+            snprintf(lane_str, sizeof(lane_str), "%d", lane);
+            snprintf(expected, sizeof(expected), "%s/i2b_lane_%d.bam", TMPDIR, lane);
+            setup_lanes_test(&argc_1, &argv_1, expected, intensity_dir, lane_str, verbose);
+            icheckEqual("Multiple lane test: single lane i2b", 0, main_i2b(argc_1-1, argv_1+1));
+            free_args(argv_1);
+            snprintf(outputfile, filename_len, "%s/i2b_lanes_%d.bam", TMPDIR, lane);
+            checkFiles("Multiple lane test", outputfile, expected);
+        }
+    }
+
     //
     // Test with non-standard read group ID
     //